@@ -0,0 +1,130 @@
+#include <functional>
+#include <iostream> // std::cout
+
+#include "json.hpp" // nlohmann::json
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado AncestroComunLote
+ */
+class AncestroComunLote : public Plugin
+{
+private:
+    void atender(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                 Tiempos *tiempos, const restbed::Bytes& body);
+public:
+    void handler(const std::shared_ptr< restbed::Session > session);
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaAncestroComunLote : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Handler del web service Ancestro Comun Lote
+ */
+void AncestroComunLote::handler(const std::shared_ptr<restbed::Session> session)
+{ /* Web Service 3 : POST (ancestros comunes en lote) */
+
+    const auto inicio = reloj::now();
+    const auto tiempos = this->getControl()->timingInterface(inicio);
+    const auto request = session->get_request();
+
+    // Se obtiene la longitud del contenido de la solicitud en content_length
+    int content_length;
+    request->get_header("Content-Length", content_length, 0);
+
+    // Procesa el contenido del POST
+    session->fetch(content_length,
+                   [this, inicio, tiempos](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+                       {
+                           if (tiempos)
+                               tiempos->sumar("cuerpo", reloj::now()-inicio);
+
+                           // Se aplica el mismo límite de 1 MiB que en crear-arbol
+                           if (body.size()>(1024*1024)) {
+                               auto msg = std::string("Se admiten hasta 1 MiB de datos");
+                               this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                                       {"Content-Length", std::to_string(msg.length())}
+                                   }, tiempos.get());
+                           }
+                           else {
+                               // Se copia el cuerpo, que solo es válido durante el callback
+                               this->calcular(session, inicio, tiempos, [this, session, inicio, tiempos, body] () {
+                                       atender(session, inicio, tiempos.get(), body);
+                                   });
+                           }
+                       });
+}
+
+/**
+ * Resuelve las consultas y responde (en el pool de cálculo)
+ */
+void AncestroComunLote::atender(const std::shared_ptr<restbed::Session> session, const reloj::time_point inicio,
+                                Tiempos *tiempos, const restbed::Bytes& body)
+{
+    try {
+        auto t0 = reloj::now();
+        auto request = json::parse(body.begin(), body.end());
+        auto t = reloj::now()-t0;
+        this->getControl()->getMetricas()->parseo(Metricas::PEDIDO, t);
+        if (tiempos)
+            tiempos->sumar("parse", t);
+        auto resultados = this->getControl()->lowestCommonAncestorBatchInterface(request, tiempos);
+        std::string response_string;
+        {
+            Tiempos::Fase fase(tiempos, "respuesta");
+            json response;
+            response["results"] = std::move(*resultados);
+            response_string = response.dump();
+        }
+        this->responder(session, inicio, restbed::OK, response_string, {
+                {"Content-Length", std::to_string(response_string.length())}
+            }, tiempos);
+    }
+    catch (std::exception& e){
+        auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+        msg.append(e.what());
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
+    }
+    catch (...) {
+        auto msg = std::string("Ocurrió un error al procesar la solicitud.");
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
+    }
+}
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaAncestroComunLote::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< AncestroComunLote > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::ANCESTRO_COMUN_LOTE );
+    r->set_path( "/ancestro-comun-lote" );
+
+    auto f = std::bind(&AncestroComunLote::handler, r, std::placeholders::_1);
+    r->set_method_handler( "POST",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaAncestroComunLote pluginFactory;
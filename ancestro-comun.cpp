@@ -1,4 +1,5 @@
 #include "plugin.hpp"
+#include "lector.hpp" // ConsultaAncestro
 #include <iostream> // std::cout
 
 // 'using namespace' is bad, usually, but this source
@@ -11,6 +12,9 @@ using namespace d;
  */
 class AncestroComun : public Plugin
 {
+private:
+    void atender(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                 Tiempos *tiempos, const std::string& qValue);
 public:
     void handler(const std::shared_ptr< restbed::Session > session);
 };
@@ -30,49 +34,104 @@ public:
 void AncestroComun::handler(const std::shared_ptr<restbed::Session> session)
 {
     /* Web Service 2 : GET */
+    const auto inicio = reloj::now();
+    const auto tiempos = this->getControl()->timingInterface(inicio);
     const auto request = session->get_request( );
 
-    auto content_length = 0;
-    request->get_header( "Content-Length", content_length);
-    std::string qValue = request->get_query_parameter("q", "");
+    std::string qValue;
+    {
+        Tiempos::Fase fase(tiempos.get(), "q");
+        qValue = request->get_query_parameter("q", "");
+    }
 
     if (qValue == "") {
         auto msg = std::string("Campo de solicitud vacío (q)");
-        session->close(restbed::BAD_REQUEST, msg, {
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
                 {"Content-Length", std::to_string(msg.length())}
-            });
+            }, tiempos.get());
     }
     else {
+        this->calcular(session, inicio, tiempos, [this, session, inicio, tiempos, qValue] () {
+                atender(session, inicio, tiempos.get(), qValue);
+            });
+    }
+}
+
+/**
+ * Resuelve la consulta y responde (en el pool de cálculo)
+ */
+void AncestroComun::atender(const std::shared_ptr<restbed::Session> session, const reloj::time_point inicio,
+                            Tiempos *tiempos, const std::string& qValue)
+{
+    try {
+        // La consulta casi siempre es {"id":N,"node_a":X,"node_b":Y} con valores
+        // simples: se separa en una pasada, sin armar el JSON completo. Si no
+        // tiene esa forma, la interpreta el parser general.
+        auto t0 = reloj::now();
+        ConsultaAncestro consulta;
+        json q;
+        bool simple = consulta.decodificar(qValue);
+        if (! simple)
+            q = json::parse(qValue);
+        auto t = reloj::now()-t0;
+        this->getControl()->getMetricas()->parseo(Metricas::PEDIDO, t);
+        if (tiempos)
+            tiempos->sumar("parse", t);
 
-        try {
-            std::shared_ptr<json> LCA = this->getControl()->lowestCommonAncestorInterface(json::parse(qValue));
+        // Con dos nodos enteros o dos cadenas, en un árbol de ese tipo la
+        // búsqueda y la respuesta no pasan por JSON (ver ArbolCompilado::Tipo)
+        auto control = this->getControl();
+        std::variant< int64_t, std::string, std::shared_ptr<json> > LCA;
+        if (simple && consulta.enteros())
+            std::visit([&LCA] (auto&& r) { LCA = std::move(r); },
+                       control->lowestCommonAncestorInterface(consulta.id, consulta.node_a.get<int64_t>(),
+                                                              consulta.node_b.get<int64_t>(), tiempos));
+        else if (simple && consulta.node_a.is_string() && consulta.node_b.is_string())
+            std::visit([&LCA] (auto&& r) { LCA = std::move(r); },
+                       control->lowestCommonAncestorInterface(consulta.id, consulta.node_a.get_ref<const std::string&>(),
+                                                              consulta.node_b.get_ref<const std::string&>(), tiempos));
+        else if (simple)
+            LCA = control->lowestCommonAncestorInterface(consulta.id, consulta.node_a, consulta.node_b, tiempos);
+        else
+            LCA = control->lowestCommonAncestorInterface(q, tiempos);
+
+        std::string response_string;
+        {
+            Tiempos::Fase fase(tiempos, "respuesta");
             json response;
-            if (LCA->is_string()) {
-                response["node"] = LCA->get<std::string>();
+            if (auto entero = std::get_if<int64_t>(&LCA)) {
+                response["node"] = *entero;
+            }
+            else if (auto cadena = std::get_if<std::string>(&LCA)) {
+                response["node"] = std::move(*cadena);
+            }
+            else if (auto& valor = *std::get<std::shared_ptr<json>>(LCA); valor.is_string()) {
+                response["node"] = valor.get<std::string>();
             }
-            else if (LCA->is_number()) {
-                response["node"] = LCA->get<int>();
+            else if (valor.is_number()) {
+                response["node"] = valor.get<int64_t>();
             }
             else {
-                response["node"] = LCA->dump();
+                response["node"] = valor.dump();
             }
-            session->close (restbed::OK, response.dump(), {
-                    {"Content-Length", std::to_string(response.dump().length())}
-                });
-        }
-        catch (std::exception& e){
-            auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
-            msg.append(e.what());
-            session->close(restbed::BAD_REQUEST, msg, {
-                    {"Content-Length", std::to_string(msg.length())}
-                });
-        }
-        catch (...) {
-            auto msg = std::string("Ocurrió un error al procesar la solicitud.");
-            session->close(restbed::BAD_REQUEST, msg, {
-                    {"Content-Length", std::to_string(msg.length())}
-                });
+            response_string = response.dump();
         }
+        this->responder(session, inicio, restbed::OK, response_string, {
+                {"Content-Length", std::to_string(response_string.length())}
+            }, tiempos);
+    }
+    catch (std::exception& e){
+        auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+        msg.append(e.what());
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
+    }
+    catch (...) {
+        auto msg = std::string("Ocurrió un error al procesar la solicitud.");
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
     }
 }
 
@@ -84,6 +143,7 @@ std::shared_ptr< restbed::Resource > FactoriaAncestroComun::get( std::shared_ptr
     auto r=std::make_shared< AncestroComun > ();
 
     r->setControl( c );
+    r->setRuta( Metricas::ANCESTRO_COMUN );
     r->set_path( "/ancestro-comun" );
 
     auto f = std::bind(&AncestroComun::handler, r, std::placeholders::_1);
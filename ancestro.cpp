@@ -0,0 +1,50 @@
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado Ancestro: k-ésimo ancestro de un nodo, {"id":<id>,"node":<node>,"k":<k>}
+ */
+class Ancestro : public PluginConsulta
+{
+public:
+    Ancestro() : PluginConsulta("node") {}
+    std::shared_ptr< json > consultar(const json& busqueda, Tiempos *tiempos)
+        {
+            return this->getControl()->kthAncestorInterface(busqueda, tiempos);
+        }
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaAncestro : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaAncestro::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< Ancestro > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::ANCESTRO );
+    r->set_path( "/ancestro" );
+
+    auto f = std::bind(&Ancestro::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaAncestro pluginFactory;
@@ -0,0 +1,1425 @@
+#include <algorithm> // std::min, std::reverse, std::sort, std::swap
+#include <charconv>  // std::to_chars
+#include <cerrno>    // errno
+#include <cstdio>    // fopen, fwrite, rename
+#include <cstring>   // memcpy, strerror
+#include <string_view> // std::hash<std::string_view>
+#include <thread>    // std::this_thread
+#include <fcntl.h>   // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>  // close
+#include "arbol.hpp"
+#include "hash.hpp"  // hash128
+
+
+
+/** ***************************************************************************
+ * Estimación de la memoria que ocupa un valor JSON ya interpretado. No es
+ * exacta (depende del asignador), pero es suficiente para el presupuesto de
+ * la caché.
+ * @param v Valor a estimar
+ * @return Cantidad aproximada de bytes
+ ** ***************************************************************************/
+static size_t estimarBytes(const json& v)
+{
+    size_t total = sizeof(json);
+
+    if (v.is_string())
+        total += v.get_ref<const std::string&>().capacity();
+    else if (v.is_object())
+        for (auto& el : v.items())
+            total += el.key().capacity() + 4*sizeof(void*) + estimarBytes(el.value());
+    else if (v.is_array())
+        for (auto& el : v)
+            total += estimarBytes(el);
+
+    return total;
+}
+
+/** ***************************************************************************
+ * Destructor. Devuelve todos los bloques al sistema.
+ ** ***************************************************************************/
+Arena::~Arena()
+{
+    for (auto& [b, largo] : bloques)
+        ::operator delete(b, largo);
+}
+
+/** ***************************************************************************
+ * Entrega memoria del bloque en uso, pasando al siguiente bloque retenido o
+ * pidiendo uno nuevo (del doble de tamaño) cuando no alcanza.
+ * @param largo Bytes pedidos
+ * @param alineacion Alineación requerida
+ * @return Puntero a la memoria
+ ** ***************************************************************************/
+void* Arena::do_allocate(size_t largo, size_t alineacion)
+{
+    while (actual < bloques.size())
+    {
+        auto [b, tamanio] = bloques[actual];
+        size_t inicio = (usado + alineacion-1) & ~(alineacion-1);
+        if (inicio+largo <= tamanio) {
+            usado = inicio+largo;
+            return b+inicio;
+        }
+        actual++;
+        usado = 0;
+    }
+
+    size_t tamanio = bloques.empty() ? BLOQUE_INICIAL : 2*bloques.back().second;
+    while (tamanio < largo+alineacion)
+        tamanio *= 2;
+
+    bloques.push_back({static_cast<std::byte*>(::operator new(tamanio)), tamanio});
+    actual = bloques.size()-1;
+    usado = largo;
+    return bloques.back().first;
+}
+
+/** ***************************************************************************
+ * Libera toda la memoria entregada. Si quedaron varios bloques se reemplazan
+ * por uno solo del tamaño total, para que el próximo uso de igual tamaño
+ * quepa en un bloque; por encima de MAXIMO_RETENIDO se devuelve todo al
+ * sistema, para no retener la memoria de un árbol excepcionalmente grande.
+ ** ***************************************************************************/
+void Arena::reiniciar(void)
+{
+    size_t total = capacidad();
+
+    if (bloques.size()>1 || total>MAXIMO_RETENIDO) {
+        for (auto& [b, largo] : bloques)
+            ::operator delete(b, largo);
+        bloques.clear();
+        if (total<=MAXIMO_RETENIDO)
+            bloques.push_back({static_cast<std::byte*>(::operator new(total)), total});
+    }
+
+    actual = 0;
+    usado = 0;
+}
+
+/** ***************************************************************************
+ * @return Bytes retenidos por la arena
+ ** ***************************************************************************/
+size_t Arena::capacidad(void) const
+{
+    size_t total = 0;
+    for (auto& b : bloques)
+        total += b.second;
+    return total;
+}
+
+/** ***************************************************************************
+ * @return La arena del hilo actual
+ ** ***************************************************************************/
+Arena& Arena::delHilo(void)
+{
+    thread_local Arena arena;
+    return arena;
+}
+
+/** ***************************************************************************
+ * Agrega al texto el valor JSON serializado, igual que json::dump(). Los
+ * enteros, que son el caso habitual, se escriben sin cadenas intermedias.
+ * @param texto Texto de salida
+ * @param v Valor a serializar
+ ** ***************************************************************************/
+static void serializarValor(std::string& texto, const json& v)
+{
+    char numero[24];
+
+    if (v.is_number_integer() || v.is_number_unsigned()) {
+        auto r = v.is_number_unsigned() ?
+            std::to_chars(numero, numero+sizeof(numero), v.get<uint64_t>()) :
+            std::to_chars(numero, numero+sizeof(numero), v.get<int64_t>());
+        texto.append(numero, r.ptr);
+    }
+    else
+        texto += v.dump();
+}
+
+/** ***************************************************************************
+ * Serialización canónica del árbol: el mismo texto que json::dump() sobre el
+ * árbol completo (sin espacios y con las claves de cada objeto en orden), sin
+ * armarlo. Así un mismo árbol se guarda igual, llegue por donde llegue.
+ * @return Texto JSON del árbol
+ ** ***************************************************************************/
+std::string ArbolPlano::serializar(void) const
+{
+    struct Paso {
+        int32_t nodo; // nodo en serialización
+        size_t  paso; // miembros del nodo ya escritos
+    };
+    Arena::Uso uso;
+    std::pmr::vector<Paso> pila(uso.recurso());
+    std::string texto;
+
+    // El texto canónico no suele superar al original, que no tiene por qué ser compacto
+    texto.reserve(largo);
+
+    if (! nodos.empty())
+        pila.push_back({0, 0});
+
+    while (! pila.empty())
+    {
+        auto [i, paso] = pila.back();
+        int32_t hijo = -1;
+
+        if (auto e = extras.find(i); e!=extras.end()) {
+            // Caso general: los miembros del nodo se ordenan junto a los otros campos
+            std::vector< std::pair<std::string, const json*> > miembros;
+            for (auto& el : e->second.items())
+                miembros.push_back({el.key(), &el.value()});
+            miembros.push_back({"node", &nodos[i]});
+            if (izquierdo[i]>=0) miembros.push_back({"left", nullptr});
+            if (derecho[i]>=0)   miembros.push_back({"right", nullptr});
+            std::sort(miembros.begin(), miembros.end(),
+                      [] (auto& a, auto& b) { return a.first<b.first; });
+
+            for (; paso<miembros.size() && hijo<0; paso++) {
+                texto += paso==0 ? '{' : ',';
+                texto += json(miembros[paso].first).dump();
+                texto += ':';
+                if (miembros[paso].second)
+                    serializarValor(texto, *miembros[paso].second);
+                else
+                    hijo = miembros[paso].first=="left" ? izquierdo[i] : derecho[i];
+            }
+            if (hijo<0)
+                texto += '}';
+        }
+        else {
+            // Caso habitual: {"left":...,"node":...,"right":...}
+            switch (paso) {
+            case 0:
+                texto += '{';
+                paso = 1;
+                if (izquierdo[i]>=0) {
+                    texto += "\"left\":";
+                    hijo = izquierdo[i];
+                    break;
+                }
+                [[fallthrough]];
+            case 1:
+                if (izquierdo[i]>=0)
+                    texto += ',';
+                texto += "\"node\":";
+                serializarValor(texto, nodos[i]);
+                paso = 2;
+                if (derecho[i]>=0) {
+                    texto += ",\"right\":";
+                    hijo = derecho[i];
+                    break;
+                }
+                [[fallthrough]];
+            default:
+                texto += '}';
+            }
+        }
+
+        if (hijo>=0) {
+            pila.back().paso = paso;
+            pila.push_back({hijo, 0});
+        }
+        else
+            pila.pop_back();
+    }
+
+    return texto;
+}
+
+/** ***************************************************************************
+ * Constructor del índice. Calcula las máscaras de cada ventana de 32
+ * posiciones y la tabla dispersa sobre los mínimos de cada bloque.
+ * @param v Arreglo a indexar
+ ** ***************************************************************************/
+IndiceRMQ::IndiceRMQ(std::vector<int32_t> v)
+    : bloques(0)
+{
+    const int n = v.size();
+    std::vector<uint32_t> m(n);
+    std::vector<int32_t> t;
+
+    // La máscara de i tiene el bit k encendido si la posición i-k es mínima
+    // en algún rango [x, i] con x > i-32. Es una pila monótona en 32 bits.
+    uint32_t actual = 0;
+    for (int i = 0; i < n; i++) {
+        actual <<= 1;
+        while (actual && v[i] <= v[i-__builtin_ctz(actual)])
+            actual &= actual-1;
+        actual |= 1;
+        m[i] = actual;
+    }
+
+    valores = std::move(v);
+    mascara = std::move(m);
+    bloques = (n+BLOQUE-1)/BLOQUE;
+
+    for (size_t b = 0; b < bloques; b++) {
+        int fin = std::min<int>(n, (b+1)*BLOQUE)-1;
+        t.push_back(minimoCorto(fin, fin-b*BLOQUE+1));
+    }
+
+    for (size_t nivel = 1; (1u<<nivel) <= bloques; nivel++) {
+        size_t anterior = (nivel-1)*bloques, salto = 1u<<(nivel-1);
+        for (size_t b = 0; b < bloques; b++)
+            t.push_back(b+salto < bloques ?
+                        menor(t[anterior+b], t[anterior+b+salto]) :
+                        t[anterior+b]);
+    }
+
+    tabla = std::move(t);
+}
+
+/** ***************************************************************************
+ * Mínimo en un rango de hasta 32 posiciones, usando solo la máscara.
+ * @param r Última posición del rango
+ * @param largo Largo del rango (1 a 32)
+ * @return Posición del mínimo en [r-largo+1, r]
+ ** ***************************************************************************/
+int IndiceRMQ::minimoCorto(int r, int largo) const
+{
+    uint32_t m = mascara[r] & (largo==BLOQUE ? ~0u : (1u<<largo)-1);
+    return r - (31-__builtin_clz(m));
+}
+
+/** ***************************************************************************
+ * Mínimo en un rango arbitrario, en tiempo constante.
+ * @param l Primera posición del rango
+ * @param r Última posición del rango (l <= r)
+ * @return Posición del mínimo en [l, r]
+ ** ***************************************************************************/
+int IndiceRMQ::minimo(int l, int r) const
+{
+    if (r-l+1 <= BLOQUE)
+        return minimoCorto(r, r-l+1);
+
+    // Los extremos se cubren con dos ventanas completas, y los bloques
+    // intermedios con dos consultas solapadas a la tabla dispersa.
+    int m = menor(minimoCorto(l+BLOQUE-1, BLOQUE), minimoCorto(r, BLOQUE));
+    int bl = l/BLOQUE+1, br = r/BLOQUE-1;
+
+    if (bl <= br) {
+        int nivel = 31-__builtin_clz(br-bl+1);
+        size_t base = nivel*bloques;
+        m = menor(m, menor(tabla[base+bl], tabla[base+br-(1<<nivel)+1]));
+    }
+
+    return m;
+}
+
+/** ***************************************************************************
+ * @return Memoria ocupada por el índice, en bytes
+ ** ***************************************************************************/
+size_t IndiceRMQ::memoria(void) const
+{
+    return valores.memoria() + mascara.memoria() + tabla.memoria();
+}
+
+/** ***************************************************************************
+ * Constructor. Aplana el árbol recorriéndolo una única vez con el mismo DFS
+ * que usaba la búsqueda original, validando que todos los nodos tengan el
+ * campo "node", y luego arma el índice de ancestros.
+ * @param arbol Objeto nlohmann::json con el árbol
+ ** ***************************************************************************/
+ArbolCompilado::ArbolCompilado(const json& arbol)
+    : tipo(GENERAL), bytes(0)
+{
+    struct Pendiente {
+        int32_t     padre;   // índice del padre ya aplanado
+        const json *o;       // subárbol a aplanar
+        bool        derecho; // rama del padre en la que cuelga
+    };
+    // Las estructuras de trabajo se toman de la arena del hilo
+    Arena::Uso uso;
+    std::pmr::vector<Pendiente> working(uso.recurso());
+    std::pmr::vector<int32_t> izquierdo(uso.recurso()), derecho(uso.recurso());
+    std::vector<int32_t> padre, profundidad;
+
+    // Se comienza por el nodo raíz, sin padre
+    working.push_back({-1, &arbol, false});
+
+    while (! working.empty())
+    {
+        auto [p, o, d] = working.back();
+        working.pop_back();
+
+        if (! o->is_object() || o->find("node")==o->end())
+            throw std::logic_error ( R"(Árbol mal formado, todos los nodos deben tener un campo "node")" );
+
+        int32_t i = nodos.size();
+        nodos.push_back((*o)["node"]);
+        padre.push_back(p);
+        profundidad.push_back(p<0 ? 0 : profundidad[p]+1);
+        izquierdo.push_back(-1);
+        derecho.push_back(-1);
+        if (p>=0)
+            (d ? derecho : izquierdo)[p] = i;
+
+        // continúa el DFS
+        if (o->find("left")!=o->end())
+            working.push_back({i, &(*o)["left"], false});
+        if (o->find("right")!=o->end())
+            working.push_back({i, &(*o)["right"], true});
+    }
+
+    this->padre = std::move(padre);
+    this->profundidad = std::move(profundidad);
+    indexar(izquierdo, derecho);
+    especializar();
+    indexarValores();
+    medir();
+}
+
+/** ***************************************************************************
+ * Constructor a partir de un árbol aplanado, ya validado. Renumera los nodos
+ * en el mismo orden DFS que el constructor a partir de JSON, de modo que
+ * ambos producen el mismo árbol compilado. Los valores de los nodos se
+ * mueven, no se copian.
+ * @param plano Árbol aplanado (queda vacío)
+ ** ***************************************************************************/
+ArbolCompilado::ArbolCompilado(ArbolPlano&& plano)
+    : tipo(GENERAL), bytes(0)
+{
+    if (plano.nodos.empty())
+        throw std::logic_error ( "Todos los árboles deben tener al menos un nodo!" );
+
+    struct Pendiente {
+        int32_t padre;   // índice del padre ya renumerado
+        int32_t o;       // índice del nodo en el árbol aplanado
+        bool    derecho; // rama del padre en la que cuelga
+    };
+    Arena::Uso uso;
+    std::pmr::vector<Pendiente> working(uso.recurso());
+    std::pmr::vector<int32_t> izquierdo(uso.recurso()), derecho(uso.recurso());
+    std::vector<int32_t> padre, profundidad;
+    const size_t n = plano.nodos.size();
+
+    nodos.reserve(n);
+    padre.reserve(n);
+    profundidad.reserve(n);
+    izquierdo.reserve(n);
+    derecho.reserve(n);
+
+    working.push_back({-1, 0, false});
+
+    while (! working.empty())
+    {
+        auto [p, o, d] = working.back();
+        working.pop_back();
+
+        int32_t i = nodos.size();
+        nodos.push_back(std::move(plano.nodos[o]));
+        padre.push_back(p);
+        profundidad.push_back(p<0 ? 0 : profundidad[p]+1);
+        izquierdo.push_back(-1);
+        derecho.push_back(-1);
+        if (p>=0)
+            (d ? derecho : izquierdo)[p] = i;
+
+        if (plano.izquierdo[o]>=0)
+            working.push_back({i, plano.izquierdo[o], false});
+        if (plano.derecho[o]>=0)
+            working.push_back({i, plano.derecho[o], true});
+    }
+
+    this->padre = std::move(padre);
+    this->profundidad = std::move(profundidad);
+    indexar(izquierdo, derecho);
+    especializar();
+    indexarValores();
+    medir();
+
+    plano = ArbolPlano();
+}
+
+/** ***************************************************************************
+ * Elección del tipo de los valores (ver Tipo): si todos los nodos son
+ * enteros que entran en 64 bits con signo, o todos son cadenas, sus valores
+ * pasan de nodos a un arreglo denso o a un bloque de texto.
+ ** ***************************************************************************/
+void ArbolCompilado::especializar(void)
+{
+    bool todosEnteros = true, todasCadenas = true;
+    size_t largo = 0;
+
+    for (auto& v : nodos) {
+        todosEnteros = todosEnteros && v.is_number_integer()
+            && (! v.is_number_unsigned() || v.get<uint64_t>() <= uint64_t(INT64_MAX));
+        todasCadenas = todasCadenas && v.is_string();
+        if (todasCadenas)
+            largo += v.get_ref<const std::string&>().size();
+        else if (! todosEnteros)
+            return;
+    }
+
+    if (todosEnteros) {
+        std::vector<int64_t> enteros;
+        enteros.reserve(nodos.size());
+        for (auto& v : nodos)
+            enteros.push_back(v.get<int64_t>());
+        this->enteros = std::move(enteros);
+        tipo = ENTEROS;
+    }
+    else {
+        std::vector<char> textos;
+        std::vector<uint64_t> desplazamientos;
+        textos.reserve(largo);
+        desplazamientos.reserve(nodos.size()+1);
+        for (auto& v : nodos) {
+            auto& cadena = v.get_ref<const std::string&>();
+            desplazamientos.push_back(textos.size());
+            textos.insert(textos.end(), cadena.begin(), cadena.end());
+        }
+        desplazamientos.push_back(textos.size());
+        this->textos = std::move(textos);
+        this->desplazamientos = std::move(desplazamientos);
+        tipo = CADENAS;
+    }
+
+    nodos = std::vector<json>();
+}
+
+/** ***************************************************************************
+ * Estimación de la memoria que ocupa el árbol compilado (ver memoria()).
+ ** ***************************************************************************/
+void ArbolCompilado::medir(void)
+{
+    bytes = sizeof(ArbolCompilado)
+        + (nodos.capacity()-nodos.size())*sizeof(json)
+        + padre.memoria()
+        + profundidad.memoria()
+        + salto.memoria()
+        + euler.memoria()
+        + primera.memoria()
+        + rmq.memoria()
+        + valores.memoria()
+        + enteros.memoria()
+        + desplazamientos.memoria()
+        + textos.memoria();
+
+    for (auto& v : nodos)
+        bytes += estimarBytes(v);
+}
+
+/** ***************************************************************************
+ * Armado del recorrido de Euler y del índice RMQ sobre las profundidades del
+ * recorrido. El ancestro común de dos nodos es el nodo menos profundo entre
+ * sus primeras apariciones en el recorrido. Se arman también los punteros
+ * de salto de cada nodo (ver ancestro()).
+ * @param izquierdo Índice del hijo izquierdo de cada nodo (-1 si no tiene)
+ * @param derecho Índice del hijo derecho de cada nodo (-1 si no tiene)
+ ** ***************************************************************************/
+void ArbolCompilado::indexar(const std::pmr::vector<int32_t>& izquierdo, const std::pmr::vector<int32_t>& derecho)
+{
+    // Cada entrada de la pila es un nodo y cuántos de sus hijos ya se visitaron
+    Arena::Uso uso;
+    std::pmr::vector< std::pair<int32_t,int> > pila(uso.recurso());
+    const size_t n = nodos.size();
+    std::vector<int32_t> euler, primera(n, -1), salto(n);
+
+    euler.reserve(2*n-1);
+
+    primera[0] = 0;
+    euler.push_back(0);
+    pila.push_back({0, 0});
+
+    while (! pila.empty())
+    {
+        auto& [v, visitados] = pila.back();
+        int32_t h = -1;
+
+        while (h<0 && visitados<2)
+            h = (visitados++==0) ? izquierdo[v] : derecho[v];
+
+        if (h>=0) {
+            primera[h] = euler.size();
+            euler.push_back(h);
+            pila.push_back({h, 0});
+        }
+        else {
+            pila.pop_back();
+            if (! pila.empty())
+                euler.push_back(pila.back().first);
+        }
+    }
+
+    std::vector<int32_t> prof(euler.size());
+    for (size_t i = 0; i < euler.size(); i++)
+        prof[i] = profundidad[euler[i]];
+
+    rmq = IndiceRMQ(std::move(prof));
+
+    // Los nodos están en preorden: el padre (y su salto) siempre es anterior
+    salto[0] = 0;
+    for (size_t v = 1; v < n; v++) {
+        int32_t p = padre[v], j = salto[p];
+        if (profundidad[p]-profundidad[j] == profundidad[j]-profundidad[salto[j]])
+            salto[v] = salto[j];
+        else
+            salto[v] = p;
+    }
+
+    this->euler = std::move(euler);
+    this->primera = std::move(primera);
+    this->salto = std::move(salto);
+}
+
+/** ***************************************************************************
+ * Mezcla de splitmix64, para combinar un hash con un valor.
+ ** ***************************************************************************/
+static uint64_t mezclar(uint64_t h, uint64_t x)
+{
+    x += h + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x>>30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x>>27)) * 0x94d049bb133111ebULL;
+    return x ^ (x>>31);
+}
+
+/** ***************************************************************************
+ * Hash de un número: todos se toman como double, como en la igualdad de
+ * nlohmann::json entre enteros y números con decimales.
+ ** ***************************************************************************/
+static uint64_t hashNumero(double d)
+{
+    if (d==0)
+        d = 0; // -0.0 == 0.0
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return mezclar(2, bits);
+}
+
+/** ***************************************************************************
+ * Hash de un valor JSON, coherente con la igualdad de nlohmann::json: dos
+ * valores iguales tienen el mismo hash. Por eso los números se toman todos
+ * como double (1, 1u y 1.0 son iguales) y los objetos se recorren en el
+ * orden de sus claves, que nlohmann::json mantiene ordenadas.
+ * @param v Valor
+ * @return Hash de 64 bits
+ ** ***************************************************************************/
+uint64_t ArbolCompilado::hashValor(const json& v)
+{
+    auto cadena = [] (const std::string& s) {
+        return std::hash<std::string_view>()(s);
+    };
+
+    switch (v.type())
+    {
+    case json::value_t::null:
+        return mezclar(0, 0);
+    case json::value_t::boolean:
+        return mezclar(1, v.get<bool>());
+    case json::value_t::number_integer:
+    case json::value_t::number_unsigned:
+    case json::value_t::number_float:
+        return hashNumero(v.get<double>());
+    case json::value_t::string:
+        return hashCadena(v.get_ref<const std::string&>());
+    case json::value_t::array: {
+        uint64_t h = mezclar(4, v.size());
+        for (auto& el : v)
+            h = mezclar(h, hashValor(el));
+        return h;
+    }
+    case json::value_t::object: {
+        uint64_t h = mezclar(5, v.size());
+        for (auto& el : v.items())
+            h = mezclar(mezclar(h, cadena(el.key())), hashValor(el.value()));
+        return h;
+    }
+    default:
+        return mezclar(6, 0);
+    }
+}
+
+/** ***************************************************************************
+ * Hash de un entero, igual al de hashValor() para el mismo valor en JSON.
+ * @param v Valor
+ * @return Hash de 64 bits
+ ** ***************************************************************************/
+uint64_t ArbolCompilado::hashEntero(int64_t v)
+{
+    return hashNumero(double(v));
+}
+
+/** ***************************************************************************
+ * Hash de una cadena, igual al de hashValor() para el mismo valor en JSON.
+ * @param v Valor
+ * @return Hash de 64 bits
+ ** ***************************************************************************/
+uint64_t ArbolCompilado::hashCadena(std::string_view v)
+{
+    return mezclar(3, std::hash<std::string_view>()(v));
+}
+
+/*
+ * Valor de un nodo según el tipo de los valores del árbol: el JSON (GENERAL,
+ * ya compilado), el entero (ENTEROS) o la cadena (CADENAS). Con ellos se
+ * arma el índice de valores de cada tipo, que compara sin JSON en los dos
+ * últimos.
+ */
+template<> const json& ArbolCompilado::clave<const json&>(int i) const { return nodos[i]; }
+template<> int64_t ArbolCompilado::clave<int64_t>(int i) const { return enteros[i]; }
+template<> std::string_view ArbolCompilado::clave<std::string_view>(int i) const { return cadena(i); }
+
+static uint64_t hashClave(const json& v) { return ArbolCompilado::hashValor(v); }
+static uint64_t hashClave(int64_t v) { return ArbolCompilado::hashEntero(v); }
+static uint64_t hashClave(std::string_view v) { return ArbolCompilado::hashCadena(v); }
+
+/** ***************************************************************************
+ * Agrega un nodo al índice hash de los valores. Si el valor ya está, el
+ * índice se queda con la aparición de mayor índice (la última en el orden
+ * del recorrido).
+ * @param valores Índice (capacidad potencia de dos, con ranuras libres)
+ * @param j Nodo a agregar
+ ** ***************************************************************************/
+template<class Clave>
+void ArbolCompilado::agregarValor(std::vector<Ranura>& valores, int32_t j) const
+{
+    const size_t mascara = valores.size()-1;
+    decltype(auto) v = clave<Clave>(j);
+    uint64_t h = hashClave(v);
+    uint32_t firma = h>>32;
+    size_t r = h & mascara;
+
+    while (valores[r].nodo>=0 &&
+           (valores[r].firma!=firma || clave<Clave>(valores[r].nodo)!=v))
+        r = (r+1) & mascara;
+
+    valores[r] = {firma, std::max(valores[r].nodo, j)};
+}
+
+/** ***************************************************************************
+ * Armado del índice hash de los valores de los nodos. Se recorren los nodos
+ * en orden y, si un valor se repite, el índice se queda con la última
+ * aparición, igual que la búsqueda lineal original.
+ ** ***************************************************************************/
+template<class Clave>
+void ArbolCompilado::indexarValores(void)
+{
+    // Tabla de al menos el doble de los nodos, potencia de dos
+    size_t capacidad = 2;
+    while (capacidad < 2*tamanio())
+        capacidad *= 2;
+
+    std::vector<Ranura> valores(capacidad, {0, -1});
+
+    for (int32_t i = 0; i < int32_t(tamanio()); i++)
+        agregarValor<Clave>(valores, i);
+
+    this->valores = std::move(valores);
+}
+
+void ArbolCompilado::indexarValores(void)
+{
+    switch (tipo)
+    {
+    case ENTEROS:
+        indexarValores<int64_t>();
+        break;
+    case CADENAS:
+        indexarValores<std::string_view>();
+        break;
+    default:
+        indexarValores<const json&>();
+    }
+}
+
+/** ***************************************************************************
+ * Recorrido del índice hash de los valores desde la ranura de un hash.
+ * @param h Hash del valor buscado
+ * @param igual Si el valor de un nodo es el buscado
+ * @return Índice del nodo, o -1 si no existe
+ ** ***************************************************************************/
+template<class Igual>
+int ArbolCompilado::sondear(uint64_t h, Igual igual) const
+{
+    const size_t mascara = valores.size()-1;
+    uint32_t firma = h>>32;
+
+    for (size_t r = h & mascara; valores[r].nodo>=0; r = (r+1) & mascara)
+        if (valores[r].firma==firma && igual(valores[r].nodo))
+            return valores[r].nodo;
+
+    return -1;
+}
+
+/** ***************************************************************************
+ * Búsqueda de un nodo por su valor, con el índice hash: en promedio se
+ * compara a lo sumo un valor completo. Semántica (la de la búsqueda lineal
+ * original):
+ *  - la igualdad es la de nlohmann::json (1 y 1.0 son iguales, y en los
+ *    objetos no importa el orden de las claves);
+ *  - si el valor se repite, se devuelve la última aparición en el orden del
+ *    recorrido (preorden, la rama derecha antes que la izquierda);
+ *  - si el valor no está, se devuelve -1.
+ * En los árboles de enteros o de cadenas se compara como lo haría
+ * nlohmann::json, pero sin armar el valor de cada nodo.
+ * @param valor Valor del campo "node" a buscar
+ * @return Índice del nodo, o -1 si no existe
+ ** ***************************************************************************/
+int ArbolCompilado::buscar(const json& valor) const
+{
+    switch (tipo)
+    {
+    case ENTEROS:
+        switch (valor.type())
+        {
+        case json::value_t::number_integer:
+            return buscarEntero(valor.get<int64_t>());
+        case json::value_t::number_unsigned: {
+            // nlohmann::json compara un entero con uno sin signo convirtiendo este último
+            int64_t v = int64_t(valor.get<uint64_t>());
+            return sondear(hashValor(valor), [this, v] (int n) { return enteros[n]==v; });
+        }
+        case json::value_t::number_float: {
+            double v = valor.get<double>();
+            return sondear(hashValor(valor), [this, v] (int n) { return double(enteros[n])==v; });
+        }
+        default:
+            return -1;
+        }
+    case CADENAS:
+        return valor.is_string() ? buscarCadena(valor.get_ref<const std::string&>()) : -1;
+    default:
+        if (nodos.empty())
+            return sondear(hashValor(valor), [this, &valor] (int n) { return nodo(n)==valor; });
+        return sondear(hashValor(valor), [this, &valor] (int n) { return nodos[n]==valor; });
+    }
+}
+
+/** ***************************************************************************
+ * Búsqueda de un nodo por un valor entero, igual que buscar(); en un árbol
+ * de enteros no se usa JSON.
+ * @param valor Valor del campo "node" a buscar
+ * @return Índice del nodo, o -1 si no existe
+ ** ***************************************************************************/
+int ArbolCompilado::buscarEntero(int64_t valor) const
+{
+    if (tipo!=ENTEROS)
+        return buscar(json(valor));
+    return sondear(hashEntero(valor), [this, valor] (int n) { return enteros[n]==valor; });
+}
+
+/** ***************************************************************************
+ * Búsqueda de un nodo por un valor de texto, igual que buscar(); en un árbol
+ * de cadenas no se usa JSON.
+ * @param valor Valor del campo "node" a buscar
+ * @return Índice del nodo, o -1 si no existe
+ ** ***************************************************************************/
+int ArbolCompilado::buscarCadena(std::string_view valor) const
+{
+    if (tipo!=CADENAS)
+        return buscar(json(std::string(valor)));
+    return sondear(hashCadena(valor), [this, valor] (int n) { return cadena(n)==valor; });
+}
+
+/** ***************************************************************************
+ * Ancestro común más cercano entre dos nodos, por índice, en tiempo
+ * constante: es el nodo de menor profundidad en el recorrido de Euler entre
+ * las primeras apariciones de ambos.
+ * @param a Índice del primer nodo
+ * @param b Índice del segundo nodo
+ * @return Índice del ancestro común
+ ** ***************************************************************************/
+int ArbolCompilado::ancestroComun(int a, int b) const
+{
+    int l = primera[a], r = primera[b];
+    if (l>r)
+        std::swap(l, r);
+    return euler[rmq.minimo(l, r)];
+}
+
+/** ***************************************************************************
+ * k-ésimo ancestro de un nodo (el padre es el primero), en tiempo
+ * O(log n). En lugar de una tabla de binary lifting (log n ancestros por
+ * nodo, demasiado para árboles de millones de nodos), cada nodo guarda un
+ * único puntero de salto con distancias en binario sesgado (Myers, 1983):
+ * desde cualquier nodo, saltando cuando el salto no se pasa de la
+ * profundidad buscada y subiendo al padre si no, se llega en O(log n) pasos.
+ * @param i Índice del nodo
+ * @param k Cantidad de niveles a subir (k>=0)
+ * @return Índice del ancestro, o -1 si el nodo tiene menos de k ancestros
+ ** ***************************************************************************/
+int ArbolCompilado::ancestro(int i, int k) const
+{
+    if (k<0 || k>profundidad[i])
+        return -1;
+
+    int32_t objetivo = profundidad[i]-k;
+
+    while (profundidad[i] > objetivo)
+        i = profundidad[salto[i]] >= objetivo ? salto[i] : padre[i];
+
+    return i;
+}
+
+/** ***************************************************************************
+ * Distancia (cantidad de aristas) entre dos nodos, en tiempo constante.
+ * @param a Índice del primer nodo
+ * @param b Índice del segundo nodo
+ * @return Distancia entre los nodos
+ ** ***************************************************************************/
+int ArbolCompilado::distancia(int a, int b) const
+{
+    return profundidad[a]+profundidad[b]-2*profundidad[ancestroComun(a, b)];
+}
+
+/** ***************************************************************************
+ * Camino entre dos nodos: de a hasta el ancestro común y de allí hasta b,
+ * ambos incluidos. Es lineal en el largo del camino.
+ * @param a Índice del primer nodo
+ * @param b Índice del segundo nodo
+ * @return Índices de los nodos del camino, en orden
+ ** ***************************************************************************/
+std::vector<int32_t> ArbolCompilado::camino(int a, int b) const
+{
+    int lca = ancestroComun(a, b);
+    std::vector<int32_t> resultado;
+    resultado.reserve(profundidad[a]+profundidad[b]-2*profundidad[lca]+1);
+
+    for (int v = a; v != lca; v = padre[v])
+        resultado.push_back(v);
+    resultado.push_back(lca);
+
+    auto medio = resultado.size();
+    for (int v = b; v != lca; v = padre[v])
+        resultado.push_back(v);
+    std::reverse(resultado.begin()+medio, resultado.end());
+
+    return resultado;
+}
+
+/** ***************************************************************************
+ * Valor de un nodo. En una instantánea de un árbol GENERAL se interpreta su
+ * texto JSON.
+ * @param i Índice del nodo
+ * @return Valor del campo "node" del nodo
+ ** ***************************************************************************/
+json ArbolCompilado::nodo(int i) const
+{
+    switch (tipo)
+    {
+    case ENTEROS:
+        return enteros[i];
+    case CADENAS:
+        return std::string(cadena(i));
+    default:
+        if (nodos.empty())
+            return json::parse(textos.data()+desplazamientos[i], textos.data()+desplazamientos[i+1]);
+        return nodos[i];
+    }
+}
+
+/** ***************************************************************************
+ * Valor de un nodo de un árbol de cadenas, sin copiarlo.
+ * @param i Índice del nodo
+ * @return Bytes de la cadena (válidos mientras viva el árbol)
+ ** ***************************************************************************/
+std::string_view ArbolCompilado::cadena(int i) const
+{
+    return std::string_view(textos.data()+desplazamientos[i], desplazamientos[i+1]-desplazamientos[i]);
+}
+
+/** ***************************************************************************
+ * Nueva versión de un árbol con un subárbol reemplazado: el hijo de un nodo
+ * en una de sus ramas (si lo tiene) se quita con todo su subárbol, y en su
+ * lugar se cuelga otro árbol (si se indica). Los índices de la versión
+ * anterior se reutilizan: en el preorden de los nodos y en el recorrido de
+ * Euler cada subárbol ocupa un tramo contiguo, así que los nodos que no
+ * cambian solo se desplazan, y los índices que dependen de ellos (padres,
+ * saltos, primeras apariciones) se corrigen con el desplazamiento en lugar
+ * de recalcularse. Solo el RMQ se arma de nuevo sobre el recorrido (lineal,
+ * sin recorrer el árbol) y, si se quitaron nodos, el índice de valores,
+ * porque otro nodo con el mismo valor puede volver a ser su última
+ * aparición. El resultado es igual al de compilar el árbol modificado.
+ * @param base Versión anterior del árbol
+ * @param padre Nodo del que cuelga el subárbol
+ * @param derecho Si el subárbol cuelga en la rama derecha
+ * @param hijo Hijo actual del padre en esa rama (-1 si no tiene)
+ * @param hermano Hijo del padre en la otra rama (-1 si no tiene)
+ * @param rama Árbol a colgar (nullptr: la rama queda vacía)
+ * @return La nueva versión del árbol
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> ArbolCompilado::injertar(const ArbolCompilado& base, int32_t padre, bool derecho,
+                                                               int32_t hijo, int32_t hermano, const ArbolCompilado *rama)
+{
+    const int32_t n = base.tamanio();
+
+    // En preorden, el subárbol de v son los nodos siguientes más profundos que v
+    auto tamanio = [&base, n] (int32_t v) {
+        if (v<0)
+            return 0;
+        int32_t w = v+1;
+        while (w<n && base.profundidad[w]>base.profundidad[v])
+            w++;
+        return w-v;
+    };
+
+    // Tramos a reemplazar: en el preorden la rama derecha va antes que la
+    // izquierda, y en el recorrido de Euler, después (seguida del padre)
+    const int32_t viejos = tamanio(hijo), nuevos = rama ? rama->tamanio() : 0;
+    int32_t desde, e0;
+    if (hijo>=0) {
+        desde = hijo;
+        e0 = base.primera[hijo];
+    }
+    else if (derecho) {
+        desde = padre+1;
+        e0 = hermano>=0 ? base.primera[hermano]+2*tamanio(hermano) : base.primera[padre]+1;
+    }
+    else {
+        desde = hermano>=0 ? hermano+tamanio(hermano) : padre+1;
+        e0 = base.primera[padre]+1;
+    }
+    const int32_t hasta = desde+viejos, delta = nuevos-viejos;
+    const int32_t e_hasta = e0+2*viejos, e_delta = 2*delta;
+    auto mover = [desde, delta] (int32_t i) { return i<desde ? i : i+delta; };
+
+    std::shared_ptr<ArbolCompilado> arbol( new ArbolCompilado() );
+    const int32_t total = n+delta;
+    std::vector<int32_t> padres(total), profundidades(total), saltos(total), primeras(total);
+    std::vector<int32_t> euler;
+    euler.reserve(2*total-1);
+
+    auto copiar = [&] (int32_t i) {
+        int32_t j = mover(i);
+        padres[j] = base.padre[i]<0 ? -1 : mover(base.padre[i]);
+        profundidades[j] = base.profundidad[i];
+        saltos[j] = mover(base.salto[i]);
+        primeras[j] = base.primera[i]<e0 ? base.primera[i] : base.primera[i]+e_delta;
+    };
+
+    for (int32_t i = 0; i < desde; i++)
+        copiar(i);
+    for (int32_t k = 0; k < nuevos; k++) {
+        int32_t j = desde+k;
+        padres[j] = k==0 ? padre : rama->padre[k]+desde;
+        profundidades[j] = rama->profundidad[k]+base.profundidad[padre]+1;
+        primeras[j] = rama->primera[k]+e0;
+        // Los ancestros del nodo son anteriores en el preorden (ver indexar())
+        int32_t p = padres[j], s = saltos[p];
+        saltos[j] = profundidades[p]-profundidades[s] == profundidades[s]-profundidades[saltos[s]] ? saltos[s] : p;
+    }
+    for (int32_t i = hasta; i < n; i++)
+        copiar(i);
+
+    for (int32_t e = 0; e < e0; e++)
+        euler.push_back(mover(base.euler[e]));
+    if (rama) {
+        for (size_t e = 0; e < rama->euler.size(); e++)
+            euler.push_back(rama->euler[e]+desde);
+        euler.push_back(padre);
+    }
+    for (size_t e = e_hasta; e < base.euler.size(); e++)
+        euler.push_back(mover(base.euler[e]));
+
+    std::vector<int32_t> prof(euler.size());
+    for (size_t i = 0; i < euler.size(); i++)
+        prof[i] = profundidades[euler[i]];
+
+    arbol->padre = std::move(padres);
+    arbol->profundidad = std::move(profundidades);
+    arbol->salto = std::move(saltos);
+    arbol->euler = std::move(euler);
+    arbol->primera = std::move(primeras);
+    arbol->rmq = IndiceRMQ(std::move(prof));
+
+    // Valores: si la rama es del mismo tipo que el árbol, se copian por
+    // tramos; si no, se arman como JSON y se elige su tipo como al compilar
+    arbol->tipo = ! rama || rama->tipo==base.tipo ? base.tipo : GENERAL;
+    if (arbol->tipo==ENTEROS) {
+        std::vector<int64_t> enteros;
+        enteros.reserve(total);
+        enteros.insert(enteros.end(), base.enteros.data(), base.enteros.data()+desde);
+        if (rama)
+            enteros.insert(enteros.end(), rama->enteros.data(), rama->enteros.data()+nuevos);
+        enteros.insert(enteros.end(), base.enteros.data()+hasta, base.enteros.data()+n);
+        arbol->enteros = std::move(enteros);
+    }
+    else if (arbol->tipo==CADENAS) {
+        std::vector<char> textos;
+        std::vector<uint64_t> desplazamientos;
+        textos.reserve(base.textos.size() - (base.desplazamientos[hasta]-base.desplazamientos[desde])
+                       + (rama ? rama->textos.size() : 0));
+        desplazamientos.reserve(total+1);
+        auto tramo = [&textos, &desplazamientos] (const ArbolCompilado& a, int32_t i, int32_t j) {
+            const uint64_t origen = a.desplazamientos[i], destino = textos.size();
+            for (int32_t k = i; k < j; k++)
+                desplazamientos.push_back(a.desplazamientos[k]-origen+destino);
+            textos.insert(textos.end(), a.textos.data()+origen, a.textos.data()+a.desplazamientos[j]);
+        };
+        tramo(base, 0, desde);
+        if (rama)
+            tramo(*rama, 0, nuevos);
+        tramo(base, hasta, n);
+        desplazamientos.push_back(textos.size());
+        arbol->textos = std::move(textos);
+        arbol->desplazamientos = std::move(desplazamientos);
+    }
+    else {
+        arbol->nodos.reserve(total);
+        for (int32_t i = 0; i < desde; i++)
+            arbol->nodos.push_back(base.nodo(i));
+        for (int32_t k = 0; k < nuevos; k++)
+            arbol->nodos.push_back(rama->nodo(k));
+        for (int32_t i = hasta; i < n; i++)
+            arbol->nodos.push_back(base.nodo(i));
+        arbol->especializar();
+    }
+
+    // Índice de valores: sin nodos quitados y con lugar, se desplazan los
+    // nodos de las ranuras y se agregan los nuevos (la última aparición en
+    // el preorden es la de mayor índice)
+    const size_t capacidad = base.valores.size();
+    if (viejos==0 && capacidad >= 2*size_t(total)) {
+        std::vector<Ranura> valores(base.valores.data(), base.valores.data()+capacidad);
+        for (auto& r : valores)
+            if (r.nodo>=0)
+                r.nodo = mover(r.nodo);
+
+        for (int32_t j = desde; j < desde+nuevos; j++)
+            switch (arbol->tipo)
+            {
+            case ENTEROS:
+                arbol->agregarValor<int64_t>(valores, j);
+                break;
+            case CADENAS:
+                arbol->agregarValor<std::string_view>(valores, j);
+                break;
+            default:
+                arbol->agregarValor<const json&>(valores, j);
+            }
+        arbol->valores = std::move(valores);
+    }
+    else
+        arbol->indexarValores();
+
+    arbol->medir();
+    return arbol;
+}
+
+/**
+ * Cabecera de una instantánea. La siguen, en este orden y cada uno alineado
+ * a 8 bytes: padre, profundidad, salto, euler, primera, los tres arreglos de
+ * IndiceRMQ (valores, mascara, tabla), el índice de valores y los valores
+ * de los nodos, en dos secciones según su tipo: en ENTEROS, los enteros (n)
+ * y un texto vacío; si no, los desplazamientos del texto de cada nodo (n+1)
+ * y el texto (los bytes de las cadenas en CADENAS, el JSON de cada valor en
+ * GENERAL).
+ */
+struct CabeceraInstantanea {
+  char     magia[8];    //< "ARBOLIDX"
+  uint32_t version;     //< VERSION_INSTANTANEA
+  uint32_t orden;       //< 0x01020304 escrito en el orden de bytes de la máquina
+  char     fuente[16];  //< Hash128 del JSON del árbol en la BBDD
+  uint64_t suma;        //< Suma de verificación de todo lo que sigue a la cabecera
+  uint64_t nodos;       //< Cantidad de nodos
+  uint64_t tabla;       //< Largo de la tabla dispersa del RMQ
+  uint64_t bloques;     //< Bloques del RMQ
+  uint64_t ranuras;     //< Ranuras del índice de valores
+  uint64_t texto;       //< Bytes del texto de los nodos
+  uint64_t tipo;        //< Tipo de los valores de los nodos (ArbolCompilado::Tipo)
+};
+
+static const uint32_t VERSION_INSTANTANEA = 2;
+
+/** ***************************************************************************
+ * Secciones de una instantánea (ver CabeceraInstantanea): su posición y su
+ * largo quedan determinados por la cabecera, y la suma de verificación
+ * encadena el hash de cada sección.
+ ** ***************************************************************************/
+struct SeccionInstantanea {
+  const void *datos;
+  size_t      largo;
+};
+
+static size_t alinear(size_t n)
+{
+    return (n+7) & ~size_t(7);
+}
+
+static uint64_t sumarSecciones(const std::vector<SeccionInstantanea>& secciones)
+{
+    uint64_t suma = VERSION_INSTANTANEA;
+    for (auto& s : secciones)
+        suma = hash128(s.datos, s.largo, suma).h1;
+    return suma;
+}
+
+/** ***************************************************************************
+ * Guarda el árbol en una instantánea. Se escribe en un archivo temporal que
+ * luego se renombra, de modo que quien abre el archivo nunca ve una
+ * instantánea a medio escribir.
+ * @param archivo Nombre del archivo
+ * @param fuente Hash128 (16 bytes) del JSON del árbol guardado en la BBDD,
+ *        para descartar la instantánea si no corresponde a la BBDD
+ ** ***************************************************************************/
+void ArbolCompilado::guardar(const std::string& archivo, const std::string& fuente) const
+{
+    const size_t n = tamanio();
+
+    // Valores de los nodos: los enteros o las cadenas tal como están en
+    // memoria, o el texto de cada nodo, tal como lo escribe json::dump()
+    std::string texto;
+    std::vector<uint64_t> desp;
+    SeccionInstantanea claves = {enteros.data(), n*sizeof(int64_t)}, cadenas = {texto.data(), 0};
+    if (tipo==CADENAS) {
+        claves = {desplazamientos.data(), (n+1)*sizeof(uint64_t)};
+        cadenas = {textos.data(), textos.size()};
+    }
+    else if (tipo==GENERAL) {
+        desp.reserve(n+1);
+        for (size_t i = 0; i < n; i++) {
+            desp.push_back(texto.size());
+            if (nodos.empty())
+                texto.append(textos.data()+desplazamientos[i], desplazamientos[i+1]-desplazamientos[i]);
+            else
+                serializarValor(texto, nodos[i]);
+        }
+        desp.push_back(texto.size());
+        claves = {desp.data(), desp.size()*sizeof(uint64_t)};
+        cadenas = {texto.data(), texto.size()};
+    }
+
+    std::vector<SeccionInstantanea> secciones = {
+        {padre.data(),        n*sizeof(int32_t)},
+        {profundidad.data(),  n*sizeof(int32_t)},
+        {salto.data(),        n*sizeof(int32_t)},
+        {euler.data(),        euler.size()*sizeof(int32_t)},
+        {primera.data(),      n*sizeof(int32_t)},
+        {rmq.valores.data(),  rmq.valores.size()*sizeof(int32_t)},
+        {rmq.mascara.data(),  rmq.mascara.size()*sizeof(uint32_t)},
+        {rmq.tabla.data(),    rmq.tabla.size()*sizeof(int32_t)},
+        {valores.data(),      valores.size()*sizeof(Ranura)},
+        claves,
+        cadenas,
+    };
+
+    CabeceraInstantanea c = {};
+    memcpy(c.magia, "ARBOLIDX", 8);
+    c.version = VERSION_INSTANTANEA;
+    c.orden = 0x01020304;
+    memcpy(c.fuente, fuente.data(), std::min<size_t>(fuente.size(), 16));
+    c.suma = sumarSecciones(secciones);
+    c.nodos = n;
+    c.tabla = rmq.tabla.size();
+    c.bloques = rmq.bloques;
+    c.ranuras = valores.size();
+    c.texto = cadenas.largo;
+    c.tipo = tipo;
+
+    auto temporal = archivo + ".tmp" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FILE *f = fopen(temporal.c_str(), "wb");
+    if (! f)
+        throw std::runtime_error ( "No se pudo crear la instantánea " + temporal + ": " + strerror(errno) );
+
+    static const char relleno[8] = {};
+    bool ok = fwrite(&c, sizeof(c), 1, f)==1;
+    for (auto& s : secciones)
+        ok = ok && fwrite(s.datos, 1, s.largo, f)==s.largo
+                && fwrite(relleno, 1, alinear(s.largo)-s.largo, f)==alinear(s.largo)-s.largo;
+    ok = (fclose(f)==0) && ok;
+
+    if (! ok || rename(temporal.c_str(), archivo.c_str())!=0) {
+        std::string msg = "No se pudo escribir la instantánea " + archivo + ": " + strerror(errno);
+        remove(temporal.c_str());
+        throw std::runtime_error ( msg );
+    }
+}
+
+/** ***************************************************************************
+ * Abre una instantánea con mmap. Los índices quedan en las páginas mapeadas
+ * y se consultan en el lugar. Se descarta (devolviendo nullptr) si no
+ * existe, si su formato o su versión no son los esperados, si los largos
+ * de la cabecera no son los que corresponden a sus nodos, si no
+ * corresponde al JSON guardado en la BBDD o si su suma de verificación no
+ * coincide (por ejemplo, un archivo truncado).
+ * @param archivo Nombre del archivo
+ * @param fuente Hash128 (16 bytes) del JSON del árbol guardado en la BBDD
+ * @return El árbol, o nullptr si no hay una instantánea válida
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> ArbolCompilado::abrir(const std::string& archivo, const std::string& fuente)
+{
+    int fd = open(archivo.c_str(), O_RDONLY);
+    if (fd<0)
+        return nullptr;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st)==0 && size_t(st.st_size) >= sizeof(CabeceraInstantanea))
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p==MAP_FAILED)
+        return nullptr;
+
+    const size_t largo = st.st_size;
+    std::shared_ptr<const void> mapa(p, [largo] (const void *q) { munmap(const_cast<void*>(q), largo); });
+
+    auto base = static_cast<const char*>(p);
+    CabeceraInstantanea c;
+    memcpy(&c, base, sizeof(c));
+
+    if (memcmp(c.magia, "ARBOLIDX", 8)!=0 || c.version!=VERSION_INSTANTANEA || c.orden!=0x01020304
+        || fuente.size()<16 || memcmp(c.fuente, fuente.data(), 16)!=0
+        || c.nodos==0 || c.nodos>=INT32_MAX || c.tipo>CADENAS)
+        return nullptr;
+
+    // Los largos que no salen de los nodos deben ser los que arma el
+    // constructor: una cabecera alterada no puede llevar a leer fuera de las
+    // secciones (sondear recorre las ranuras con una máscara) ni desbordar
+    // el cálculo de los largos
+    const size_t n = c.nodos;
+    const uint64_t bloques = (2*n-1 + IndiceRMQ::BLOQUE-1) / IndiceRMQ::BLOQUE;
+    uint64_t niveles = 1;
+    while ((uint64_t(1)<<niveles) <= bloques)
+        niveles++;
+    if (c.bloques!=bloques || c.tabla!=bloques*niveles
+        || c.ranuras<n+1 || (c.ranuras & (c.ranuras-1))!=0 || c.ranuras>largo/sizeof(Ranura))
+        return nullptr;
+
+    const size_t largos[] = {
+        n*sizeof(int32_t), n*sizeof(int32_t), n*sizeof(int32_t), (2*n-1)*sizeof(int32_t), n*sizeof(int32_t),
+        (2*n-1)*sizeof(int32_t), (2*n-1)*sizeof(uint32_t), c.tabla*sizeof(int32_t),
+        c.ranuras*sizeof(Ranura), c.tipo==ENTEROS ? n*sizeof(int64_t) : (n+1)*sizeof(uint64_t), c.texto
+    };
+
+    std::vector<SeccionInstantanea> secciones;
+    size_t posicion = sizeof(c);
+    for (auto l : largos) {
+        if (l > largo || posicion > largo-l)
+            return nullptr;
+        secciones.push_back({base+posicion, l});
+        posicion += alinear(l);
+    }
+
+    if (posicion!=largo || sumarSecciones(secciones)!=c.suma)
+        return nullptr;
+
+    auto seccion = [&secciones] (int i) { return secciones[i].datos; };
+
+    std::shared_ptr<ArbolCompilado> arbol(new ArbolCompilado());
+    arbol->padre = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(0)), n);
+    arbol->profundidad = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(1)), n);
+    arbol->salto = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(2)), n);
+    arbol->euler = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(3)), 2*n-1);
+    arbol->primera = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(4)), n);
+    arbol->rmq.valores = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(5)), 2*n-1);
+    arbol->rmq.mascara = Arreglo<uint32_t>(static_cast<const uint32_t*>(seccion(6)), 2*n-1);
+    arbol->rmq.tabla = Arreglo<int32_t>(static_cast<const int32_t*>(seccion(7)), c.tabla);
+    arbol->rmq.bloques = c.bloques;
+    arbol->valores = Arreglo<Ranura>(static_cast<const Ranura*>(seccion(8)), c.ranuras);
+    arbol->tipo = Tipo(c.tipo);
+    if (arbol->tipo==ENTEROS)
+        arbol->enteros = Arreglo<int64_t>(static_cast<const int64_t*>(seccion(9)), n);
+    else {
+        arbol->desplazamientos = Arreglo<uint64_t>(static_cast<const uint64_t*>(seccion(9)), n+1);
+        arbol->textos = Arreglo<char>(static_cast<const char*>(seccion(10)), c.texto);
+    }
+    arbol->mapa = std::move(mapa);
+    arbol->bytes = sizeof(ArbolCompilado) + largo;
+
+    return arbol;
+}
+
+/** ***************************************************************************
+ * Constructor.
+ * @param bytes Presupuesto de memoria de la caché. Con 0 no se guarda nada.
+ ** ***************************************************************************/
+CacheArboles::CacheArboles(size_t bytes)
+    : presupuesto(bytes), ocupado(0)
+{
+}
+
+/** ***************************************************************************
+ * Obtiene un árbol de la caché y lo marca como el más recientemente usado.
+ * @param id ID del árbol
+ * @return El árbol compilado, o nullptr si no está en la caché
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> CacheArboles::obtener(int id)
+{
+    const std::lock_guard<std::mutex> lock( this->cache_mutex );
+
+    auto it = indice.find(id);
+    if (it==indice.end())
+        return nullptr;
+
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+}
+
+/** ***************************************************************************
+ * Guarda un árbol en la caché, desalojando los menos recientemente usados
+ * hasta respetar el presupuesto. Los árboles que por sí solos superan el
+ * presupuesto no se guardan.
+ * @param id ID del árbol
+ * @param arbol Árbol compilado
+ ** ***************************************************************************/
+void CacheArboles::guardar(int id, std::shared_ptr<const ArbolCompilado> arbol)
+{
+    if (! arbol || arbol->memoria()>presupuesto)
+        return;
+
+    const std::lock_guard<std::mutex> lock( this->cache_mutex );
+
+    if (auto it = indice.find(id); it!=indice.end()) {
+        ocupado -= it->second->second->memoria();
+        lru.erase(it->second);
+        indice.erase(it);
+    }
+
+    lru.push_front({id, arbol});
+    indice[id] = lru.begin();
+    ocupado += arbol->memoria();
+
+    while (ocupado>presupuesto) {
+        ocupado -= lru.back().second->memoria();
+        indice.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+/** ***************************************************************************
+ * Agrega un árbol a la caché como el menos recientemente usado, solo si cabe
+ * sin desalojar a ningún otro y si no estaba ya. Sirve para precargar la
+ * caché en orden de preferencia sin que los últimos árboles desplacen a los
+ * primeros.
+ * @param id ID del árbol
+ * @param arbol Árbol compilado
+ * @return Si se agregó (false si no había lugar o ya estaba)
+ ** ***************************************************************************/
+bool CacheArboles::agregar(int id, std::shared_ptr<const ArbolCompilado> arbol)
+{
+    if (! arbol)
+        return false;
+
+    const std::lock_guard<std::mutex> lock( this->cache_mutex );
+
+    if (ocupado+arbol->memoria()>presupuesto || indice.count(id))
+        return false;
+
+    lru.push_back({id, arbol});
+    indice[id] = std::prev(lru.end());
+    ocupado += arbol->memoria();
+    return true;
+}
+
+/** ***************************************************************************
+ * @return Bytes retenidos actualmente por la caché
+ ** ***************************************************************************/
+size_t CacheArboles::memoria(void)
+{
+    const std::lock_guard<std::mutex> lock( this->cache_mutex );
+    return ocupado;
+}
+
+/** ***************************************************************************
+ * @return Cantidad de árboles en la caché
+ ** ***************************************************************************/
+size_t CacheArboles::cantidad(void)
+{
+    const std::lock_guard<std::mutex> lock( this->cache_mutex );
+    return lru.size();
+}
@@ -0,0 +1,247 @@
+#ifndef _ARBOL_HPP_
+#define _ARBOL_HPP_
+
+#include <cstdint>   // int32_t
+#include <cstddef>   // std::byte
+#include <list>      // std::list
+#include <memory>    // shared_ptr
+#include <memory_resource> // std::pmr
+#include <mutex>     // mutex
+#include <string>    // std::string
+#include <string_view> // std::string_view
+#include <unordered_map> // std::unordered_map
+#include <vector>    // std::vector
+#include "json.hpp"  // soporte para JSON (nlohmann)
+using json=nlohmann::json;
+
+
+/**
+ * Arena de memoria para estructuras de trabajo temporales (pilas, arreglos
+ * auxiliares). Entrega memoria en forma lineal y la libera toda junta al
+ * reiniciarse, conservando sus bloques para el próximo uso, de modo que en
+ * régimen no pide memoria al sistema. Se usa una por hilo (ver delHilo()) y
+ * se reinicia al terminar cada uso (ver Arena::Uso).
+ */
+class Arena : public std::pmr::memory_resource {
+private:
+  static const size_t BLOQUE_INICIAL = 64*1024;     //< Tamaño del primer bloque
+  static const size_t MAXIMO_RETENIDO = 16*1024*1024; //< Más que esto se devuelve al reiniciar
+  std::vector< std::pair<std::byte*, size_t> > bloques; //< Bloques pedidos al sistema
+  size_t actual;                                    //< Bloque en uso
+  size_t usado;                                     //< Bytes usados del bloque en uso
+  int    usos;                                      //< Usos anidados en curso
+  void* do_allocate(size_t, size_t) override;
+  void  do_deallocate(void*, size_t, size_t) override {}
+  bool  do_is_equal(const std::pmr::memory_resource& o) const noexcept override { return this==&o; }
+public:
+  Arena() : actual(0), usado(0), usos(0) {}
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  void reiniciar(void);
+  size_t capacidad(void) const;
+  static Arena& delHilo(void);
+
+  /**
+   * Uso de la arena del hilo. Al terminar el uso más externo, la arena se reinicia.
+   */
+  class Uso {
+    Arena& arena;
+  public:
+    Uso() : arena(Arena::delHilo()) { arena.usos++; }
+    ~Uso() { if (--arena.usos == 0) arena.reiniciar(); }
+    std::pmr::memory_resource* recurso() { return &arena; }
+  };
+};
+
+
+/**
+ * Arreglo de solo lectura de los índices de un árbol compilado. Es dueño de
+ * sus datos (un std::vector, al compilar) o los ve en memoria ajena (una
+ * instantánea mapeada con mmap, ver ArbolCompilado::abrir()); las consultas
+ * lo usan igual en ambos casos.
+ */
+template<class T>
+class Arreglo {
+private:
+  std::vector<T> propio; //< Datos propios (vacío si son ajenos)
+  const T       *datos;  //< Primer elemento
+  size_t         largo;  //< Cantidad de elementos
+public:
+  Arreglo() : datos(nullptr), largo(0) {}
+  Arreglo(std::vector<T>&& v) : propio(std::move(v)), datos(propio.data()), largo(propio.size()) {}
+  Arreglo(const T *d, size_t n) : datos(d), largo(n) {}
+  // Mover un std::vector conserva su memoria, así que datos sigue siendo válido
+  Arreglo(Arreglo&&) = default;
+  Arreglo& operator=(Arreglo&&) = default;
+  Arreglo(const Arreglo&) = delete;
+  Arreglo& operator=(const Arreglo&) = delete;
+  const T& operator[](size_t i) const { return datos[i]; }
+  const T* data(void) const { return datos; }
+  size_t size(void) const { return largo; }
+  size_t memoria(void) const { return propio.capacity()*sizeof(T); } //< Bytes propios
+};
+
+
+/**
+ * Índice de mínimo en rango (RMQ) sobre un arreglo fijo, con consultas en
+ * tiempo constante y memoria lineal. El arreglo se divide en bloques de 32
+ * posiciones: dentro de cada ventana de 32 se usa una máscara de bits con los
+ * candidatos a mínimo, y entre bloques una tabla dispersa (sparse table)
+ * sobre el mínimo de cada bloque.
+ */
+class IndiceRMQ {
+private:
+  static const int BLOQUE = 32;
+  Arreglo<int32_t>  valores;   //< Arreglo indexado
+  Arreglo<uint32_t> mascara;   //< Candidatos a mínimo en la ventana que termina en cada posición
+  Arreglo<int32_t>  tabla;     //< Sparse table sobre los bloques, un nivel detrás de otro
+  size_t            bloques;   //< Cantidad de bloques (ancho de cada nivel de la tabla)
+  int menor(int i, int j) const { return valores[j]<valores[i] ? j : i; }
+  int minimoCorto(int, int) const;
+  friend class ArbolCompilado; //< Para guardarlo y abrirlo en instantáneas
+public:
+  IndiceRMQ() : bloques(0) {}
+  explicit IndiceRMQ(std::vector<int32_t>);
+  int minimo(int, int) const;
+  size_t memoria(void) const;
+};
+
+
+/**
+ * Árbol aplanado tal como llega en una solicitud: los nodos en el orden del
+ * documento, con el índice de sus hijos. Lo arma LectorArbol sin construir
+ * el JSON completo, y de él se obtienen tanto el texto a guardar como el
+ * árbol compilado.
+ */
+struct ArbolPlano {
+  std::vector<json>    nodos;     //< Valor del campo "node" de cada nodo (la raíz es el 0)
+  std::vector<int32_t> izquierdo; //< Índice del hijo izquierdo de cada nodo (-1 si no tiene)
+  std::vector<int32_t> derecho;   //< Índice del hijo derecho de cada nodo (-1 si no tiene)
+  std::unordered_map<int32_t, json> extras; //< Otros campos, solo de los nodos que los tienen
+  size_t               largo = 0; //< Bytes del documento original, si se conocen
+  std::string serializar(void) const;
+};
+
+
+/**
+ * Árbol ya interpretado y aplanado, listo para consultas.
+ * Los nodos se guardan en una tabla en el orden del recorrido DFS original
+ * (preorden, visitando la rama derecha antes que la izquierda), junto con
+ * el índice del padre y la profundidad de cada uno. Al construirlo se arma
+ * también el recorrido de Euler con un índice RMQ, de modo que cada consulta
+ * de ancestro común es de tiempo constante, y un índice hash de los valores
+ * de los nodos, de modo que buscar un nodo por su valor también lo es (en
+ * promedio). Una vez construido es inmutable, por lo que puede compartirse
+ * entre hilos sin sincronización: todas las consultas sobre un árbol en la
+ * caché usan los mismos índices.
+ *
+ * Los valores de los nodos se guardan según su tipo (ver Tipo): si al
+ * compilarlo todos son enteros o todos son cadenas, que es lo más común, se
+ * guardan en un arreglo denso de int64_t o seguidos en un único bloque de
+ * texto, y se buscan comparando enteros o bytes, sin JSON; si no, se
+ * guardan como JSON. Las respuestas son las mismas con cualquier tipo.
+ *
+ * Una versión modificada de un árbol (un subárbol agregado o quitado, ver
+ * injertar()) se arma a partir de los índices de la versión anterior, sin
+ * recorrer ni volver a indexar los nodos que no cambian.
+ *
+ * El árbol puede guardarse en una instantánea binaria (ver guardar()) y
+ * abrirse luego con mmap (ver abrir()): los índices se consultan en el lugar,
+ * sin copiarlos ni interpretarlos, y los valores de los nodos (si no son
+ * todos enteros o todos cadenas) se guardan como texto JSON que solo se
+ * interpreta al consultarlos.
+ */
+class ArbolCompilado {
+public:
+  /**
+   * Tipo de los valores de los nodos de un árbol.
+   */
+  enum Tipo : uint32_t {
+    GENERAL,  //< Cualquier JSON (en nodos, o como texto JSON en una instantánea)
+    ENTEROS,  //< Todos enteros de 64 bits con signo (en enteros)
+    CADENAS   //< Todos cadenas (sus bytes seguidos en textos)
+  };
+private:
+  struct Ranura {
+    uint32_t firma;                 //< Parte alta del hash del valor, para descartar sin comparar
+    int32_t  nodo;                  //< Nodo con ese valor (-1 si la ranura está libre)
+  };
+  Tipo                 tipo;        //< Tipo de los valores de los nodos
+  std::vector<json>    nodos;       //< Valor del campo "node" de cada nodo (GENERAL, vacío si es una instantánea)
+  Arreglo<int64_t>     enteros;     //< Valor de cada nodo (ENTEROS)
+  Arreglo<int32_t>     padre;       //< Índice del padre de cada nodo (-1 en la raíz)
+  Arreglo<int32_t>     profundidad; //< Profundidad de cada nodo (0 en la raíz)
+  Arreglo<int32_t>     salto;       //< Ancestro lejano de cada nodo (punteros de salto, ver ancestro())
+  Arreglo<int32_t>     euler;       //< Recorrido de Euler (2n-1 índices de nodo)
+  Arreglo<int32_t>     primera;     //< Primera aparición de cada nodo en euler
+  IndiceRMQ            rmq;         //< Mínimo de profundidad en rangos de euler
+  Arreglo<Ranura>      valores;     //< Índice hash (direccionamiento abierto) de valor a nodo
+  Arreglo<uint64_t>    desplazamientos; //< Inicio del texto de cada nodo en textos (CADENAS o instantánea)
+  Arreglo<char>        textos;      //< Bytes de las cadenas (CADENAS) o valores como texto JSON (instantánea)
+  std::shared_ptr<const void> mapa; //< Instantánea mapeada (se desmapea al destruir el árbol)
+  size_t               bytes;       //< Memoria estimada que ocupa el árbol compilado
+  ArbolCompilado() : tipo(GENERAL), bytes(0) {}
+  void indexar(const std::pmr::vector<int32_t>&, const std::pmr::vector<int32_t>&);
+  void especializar(void);
+  void medir(void);
+  template<class Clave> Clave clave(int) const;
+  template<class Clave> void agregarValor(std::vector<Ranura>&, int32_t) const;
+  template<class Clave> void indexarValores(void);
+  void indexarValores(void);
+  template<class Igual> int sondear(uint64_t, Igual) const;
+public:
+  explicit ArbolCompilado(const json&);
+  explicit ArbolCompilado(ArbolPlano&&);
+  static std::shared_ptr<const ArbolCompilado> injertar(const ArbolCompilado&, int32_t, bool, int32_t, int32_t,
+                                                        const ArbolCompilado*);
+  void guardar(const std::string&, const std::string&) const;
+  static std::shared_ptr<const ArbolCompilado> abrir(const std::string&, const std::string&);
+  static uint64_t hashValor(const json&);
+  static uint64_t hashEntero(int64_t);
+  static uint64_t hashCadena(std::string_view);
+  int buscar(const json&) const;
+  int buscarEntero(int64_t) const;
+  int buscarCadena(std::string_view) const;
+  int ancestroComun(int, int) const;
+  int ancestro(int, int) const;
+  int distancia(int, int) const;
+  std::vector<int32_t> camino(int, int) const;
+  int nivel(int i) const { return profundidad[i]; }   //< Profundidad del nodo i (0 en la raíz)
+  json nodo(int) const;
+  Tipo tipoValores(void) const { return tipo; }       //< Tipo de los valores de los nodos
+  int64_t entero(int i) const { return enteros[i]; }  //< Valor del nodo i (solo ENTEROS)
+  std::string_view cadena(int) const;
+  size_t tamanio(void) const { return padre.size(); } //< Cantidad de nodos
+  size_t memoria(void) const { return bytes; }        //< Memoria estimada en bytes
+};
+
+
+/**
+ * Caché de árboles compilados, indexada por ID de árbol.
+ * Está acotada por un presupuesto de bytes (según ArbolCompilado::memoria())
+ * y descarta los árboles usados menos recientemente (LRU). Es segura para
+ * uso desde varios hilos: los árboles se entregan como shared_ptr, así que
+ * un desalojo nunca invalida una consulta en curso.
+ */
+class CacheArboles {
+private:
+  typedef std::pair< int, std::shared_ptr<const ArbolCompilado> > Entrada;
+  std::list<Entrada> lru;                                         //< Entradas, la más reciente al frente
+  std::unordered_map< int, std::list<Entrada>::iterator > indice; //< ID -> posición en lru
+  size_t     presupuesto;                                         //< Máximo de bytes a retener
+  size_t     ocupado;                                             //< Bytes retenidos actualmente
+  std::mutex cache_mutex;                                         //< Protege lru, indice y ocupado
+public:
+  explicit CacheArboles(size_t);
+  std::shared_ptr<const ArbolCompilado> obtener(int);
+  void guardar(int, std::shared_ptr<const ArbolCompilado>);
+  bool agregar(int, std::shared_ptr<const ArbolCompilado>);
+  size_t memoria(void);
+  size_t capacidad(void) const { return presupuesto; } //< Presupuesto de bytes
+  size_t cantidad(void);
+};
+
+
+
+#endif
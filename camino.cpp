@@ -0,0 +1,50 @@
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado Camino: camino entre dos nodos, {"id":<id>,"node_a":<node>,"node_b":<node>}
+ */
+class Camino : public PluginConsulta
+{
+public:
+    Camino() : PluginConsulta("path") {}
+    std::shared_ptr< json > consultar(const json& busqueda, Tiempos *tiempos)
+        {
+            return this->getControl()->pathInterface(busqueda, tiempos);
+        }
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaCamino : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaCamino::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< Camino > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::CAMINO );
+    r->set_path( "/camino" );
+
+    auto f = std::bind(&Camino::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaCamino pluginFactory;
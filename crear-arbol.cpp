@@ -1,7 +1,9 @@
+#include <algorithm> // std::min
 #include <functional>
 #include <iostream> // std::cout
 
 #include "json.hpp" // nlohmann::json
+#include "lector.hpp"
 #include "plugin.hpp"
 
 // 'using namespace' is bad, usually, but this source
@@ -9,12 +11,47 @@
 
 using namespace d;
 
+/**
+ * Estado de una solicitud en curso: el lector del árbol, cuándo llegó,
+ * cuánto tiempo se lleva interpretando el cuerpo y sus tiempos por fase.
+ */
+struct Pedido
+{
+    LectorArbol        lector;
+    reloj::time_point  inicio = reloj::now();
+    reloj::duration    parseo = reloj::duration::zero();
+    std::shared_ptr< Tiempos > tiempos;
+    void leer(const void *datos, size_t largo)
+        {
+            auto t0 = reloj::now();
+            lector.leer(datos, largo);
+            parseo += reloj::now()-t0;
+        }
+};
+
 /**
  * Plugin especializado CrearArbol
  */
 class CrearArbol : public Plugin
 {
+private:
+    static const size_t PARTE = 64*1024; //< Bytes que se leen por vez
+    size_t maximo;                       //< Tamaño máximo de un árbol, en bytes
+    void leerParte(const std::shared_ptr< restbed::Session > session,
+                   std::shared_ptr< Pedido > pedido, size_t restantes);
+    void leerChunked(const std::shared_ptr< restbed::Session > session,
+                     std::shared_ptr< Pedido > pedido,
+                     std::shared_ptr< DecodificadorChunked > decodificador);
+    void crear(const std::shared_ptr< restbed::Session > session,
+               std::shared_ptr< Pedido > pedido);
+    void guardar(const std::shared_ptr< restbed::Session > session,
+                 std::shared_ptr< Pedido > pedido);
+    void responderError(const std::shared_ptr< restbed::Session > session,
+                        const Pedido& pedido,
+                        const std::string& msg, bool cuerpo_leido);
+    std::string msgMaximo(void) const;
 public:
+    explicit CrearArbol(size_t m) : maximo(m) {}
     void handler(const std::shared_ptr< restbed::Session > session);
 };
 
@@ -33,63 +70,196 @@ public:
 void CrearArbol::handler(const std::shared_ptr<restbed::Session> session)
 { /* Web Service 1 : POST (Crear tree) */
 
+    auto pedido = std::make_shared< Pedido >();
+    pedido->tiempos = this->getControl()->timingInterface(pedido->inicio);
     const auto request = session->get_request();
 
+    // El cuerpo se procesa por partes a medida que llega, sin guardarlo: con
+    // "Transfer-Encoding: chunked" se decodifica chunk a chunk, y si no, se
+    // leen los bytes indicados por Content-Length.
+    auto transfer_encoding = request->get_header("Transfer-Encoding", std::string());
+    if (transfer_encoding.find("chunked")!=std::string::npos) {
+        leerChunked(session, pedido, std::make_shared< DecodificadorChunked >(maximo));
+        return;
+    }
+
+    if (! request->has_header("Content-Length")) {
+        auto msg = std::string("Se requiere Content-Length o Transfer-Encoding: chunked");
+        this->cerrar(session, pedido->inicio, restbed::LENGTH_REQUIRED, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, pedido->tiempos.get());
+        return;
+    }
+
     // Se obtiene la longitud del contenido de la solicitud en content_length
-    int content_length;
-    request->get_header("Content-Length", content_length, 0);
+    size_t content_length;
+    try {
+        content_length = std::stoull(request->get_header("Content-Length", std::string()));
+    }
+    catch (...) {
+        responderError(session, *pedido, "Content-Length inválido", false);
+        return;
+    }
+
+    // Para impedir que el webservice permita crear árboles excesivamente
+    // grandes, se limita el tamaño máximo del pedido (RESTFUL_MAX_TREE_MB).
+    // Se rechaza antes de leer el cuerpo.
+    if (content_length>maximo) {
+        responderError(session, *pedido, msgMaximo(), false);
+        return;
+    }
+
+    leerParte(session, pedido, content_length);
+}
+
+/**
+ * Lee la siguiente parte del cuerpo y se la pasa al lector. Al terminar el
+ * cuerpo, crea el árbol.
+ */
+void CrearArbol::leerParte(const std::shared_ptr<restbed::Session> session,
+                           std::shared_ptr<Pedido> pedido, size_t restantes)
+{
+    if (restantes==0) {
+        crear(session, pedido);
+        return;
+    }
 
-    // Procesa el contenido del POST
-    session->fetch(content_length,
-                   [&](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+    size_t parte = std::min(restantes, PARTE);
+
+    session->fetch(parte,
+                   [this, pedido, restantes, parte](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
                        {
-                           // RestBed devuelve un contenedor (vector<uint8_t>)
-                           // Para impedir que el webservice permita crear árboles excesivamente
-                           // grandes, se limita el tamaño máximo del pedido a 1 MiB, que debería
-                           // ser suficiente para representar árboles binarios.
-                           if (body.size()>(1024*1024)) {
-                               auto msg = std::string("Se admiten hasta 1 MiB de datos");
-                               session->close(restbed::BAD_REQUEST, msg.c_str(), {
-                                       {"Content-Length", std::to_string(msg.length())}
-                                   });
+                           try {
+                               pedido->leer(body.data(), body.size());
                            }
-                           else {
-                               auto req_string = std::string((char*)body.data(), body.size());
-                               auto request = json::parse(req_string);
-
-                               try {
-                                   json response;
-                                   auto id = this->getControl()->newTreeInterface(request);
-                                   response["id"]=id;
-                                   session->close( restbed::OK, response.dump(), {
-                                           {"Content-Length", std::to_string(response.dump().length())}
-                                       });
-                               }
-                               catch (std::exception& e){
-                                   auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
-                                   msg.append(e.what());
-                                   session->close(restbed::BAD_REQUEST, msg, {
-                                           {"Content-Length", std::to_string(msg.length())}
-                                       });
-                               }
-                               catch (...) {
-                                   auto msg = std::string("Ocurrió un error al procesar la solicitud.");
-                                   session->close(restbed::BAD_REQUEST, msg, {
-                                           {"Content-Length", std::to_string(msg.length())}
-                                       });                                    
-                               }
+                           catch (std::exception& e){
+                               auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+                               msg.append(e.what());
+                               responderError(session, *pedido, msg, restantes==parte);
+                               return;
                            }
+                           leerParte(session, pedido, restantes-parte);
                        });
 }
 
+/**
+ * Lee la siguiente parte de un cuerpo chunked: una línea de tamaño o de
+ * trailer, o los datos de un chunk. Al terminar el cuerpo, crea el árbol.
+ */
+void CrearArbol::leerChunked(const std::shared_ptr<restbed::Session> session,
+                             std::shared_ptr<Pedido> pedido,
+                             std::shared_ptr<DecodificadorChunked> decodificador)
+{
+    if (decodificador->terminado()) {
+        crear(session, pedido);
+        return;
+    }
+
+    auto callback = [this, pedido, decodificador](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+        {
+            try {
+                decodificador->leer(body.data(), body.size(), [&pedido] (const char *datos, size_t largo) {
+                        pedido->leer(datos, largo);
+                    });
+            }
+            catch (std::length_error&) {
+                responderError(session, *pedido, msgMaximo(), false);
+                return;
+            }
+            catch (std::exception& e){
+                auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+                msg.append(e.what());
+                responderError(session, *pedido, msg, false);
+                return;
+            }
+            leerChunked(session, pedido, decodificador);
+        };
+
+    if (auto n = decodificador->siguiente(); n>0)
+        session->fetch(std::min(n, PARTE), callback);
+    else
+        session->fetch("\r\n", callback);
+}
+
+/**
+ * Termina la lectura, crea el árbol y responde con su ID. Como incluye
+ * guardarlo y compilarlo, se hace en el pool de cálculo; el cuerpo ya se
+ * leyó, así que si se rechaza por cola llena la conexión sigue disponible.
+ */
+void CrearArbol::crear(const std::shared_ptr<restbed::Session> session,
+                       std::shared_ptr<Pedido> pedido)
+{
+    if (auto tiempos = pedido->tiempos.get(); tiempos) {
+        tiempos->sumar("cuerpo", reloj::now()-pedido->inicio-pedido->parseo);
+        tiempos->sumar("carga", pedido->parseo);
+    }
+
+    this->calcular(session, pedido->inicio, pedido->tiempos, [this, session, pedido] () {
+            guardar(session, pedido);
+        });
+}
+
+/**
+ * Crea el árbol y responde con su ID (en el pool de cálculo).
+ */
+void CrearArbol::guardar(const std::shared_ptr<restbed::Session> session,
+                         std::shared_ptr<Pedido> pedido)
+{
+    try {
+        json response;
+        auto arbol = pedido->lector.terminar();
+        this->getControl()->getMetricas()->parseo(Metricas::CARGA, pedido->parseo);
+        response["id"] = this->getControl()->newTreeInterface(std::move(arbol), pedido->tiempos.get());
+        auto response_string = response.dump();
+        this->responder(session, pedido->inicio, restbed::OK, response_string, {
+                {"Content-Length", std::to_string(response_string.length())}
+            }, pedido->tiempos.get());
+    }
+    catch (std::exception& e){
+        responderError(session, *pedido, std::string("Ocurrió un error al procesar la solicitud: ").append(e.what()), true);
+    }
+    catch (...) {
+        responderError(session, *pedido, "Ocurrió un error al procesar la solicitud.", true);
+    }
+}
+
+/**
+ * Responde BAD REQUEST. Si quedó parte del cuerpo sin leer, la conexión no
+ * puede usarse para otra solicitud y se cierra.
+ */
+void CrearArbol::responderError(const std::shared_ptr<restbed::Session> session,
+                                const Pedido& pedido,
+                                const std::string& msg, bool cuerpo_leido)
+{
+    if (cuerpo_leido)
+        this->responder(session, pedido.inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, pedido.tiempos.get());
+    else
+        this->cerrar(session, pedido.inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, pedido.tiempos.get());
+}
+
+/**
+ * Mensaje para los árboles que superan el tamaño máximo.
+ */
+std::string CrearArbol::msgMaximo(void) const
+{
+    return std::string("Se admiten hasta ").append(std::to_string(maximo/(1024*1024))).append(" MiB de datos");
+}
+
 /**
  * Getter principal del Plugin
  */
 std::shared_ptr< restbed::Resource > FactoriaCrearArbol::get( std::shared_ptr< Control > c )
 {
-    auto r=std::make_shared< CrearArbol > ();
+    auto r=std::make_shared< CrearArbol > (c->getMaxTreeBytes());
 
     r->setControl( c );
+    r->setRuta( Metricas::CREAR_ARBOL );
     r->set_path( "/crear-arbol" );
 
     auto f = std::bind(&CrearArbol::handler, r, std::placeholders::_1);
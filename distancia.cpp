@@ -0,0 +1,50 @@
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado Distancia: distancia entre dos nodos, {"id":<id>,"node_a":<node>,"node_b":<node>}
+ */
+class Distancia : public PluginConsulta
+{
+public:
+    Distancia() : PluginConsulta("distance") {}
+    std::shared_ptr< json > consultar(const json& busqueda, Tiempos *tiempos)
+        {
+            return this->getControl()->distanceInterface(busqueda, tiempos);
+        }
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaDistancia : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaDistancia::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< Distancia > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::DISTANCIA );
+    r->set_path( "/distancia" );
+
+    auto f = std::bind(&Distancia::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaDistancia pluginFactory;
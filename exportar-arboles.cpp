@@ -0,0 +1,228 @@
+#include <climits>   // INT_MAX
+#include <cstdio>    // snprintf
+#include <functional>
+#include <iostream> // std::cerr
+
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Estado de una exportación en curso: el exportador, cuándo llegó la
+ * solicitud y si la conexión se mantiene al terminar.
+ */
+struct Exportacion
+{
+    std::unique_ptr< Exportador > exportador;
+    reloj::time_point  inicio = reloj::now();
+    bool               mantener = false;
+};
+
+/**
+ * Plugin especializado ExportarArboles
+ */
+class ExportarArboles : public Plugin
+{
+private:
+    static const size_t ANCHO = 16; //< Dígitos hexadecimales del largo de cada chunk
+    size_t tramo;                  //< Bytes de árboles por chunk
+    void enviar(const std::shared_ptr< restbed::Session > session,
+                std::shared_ptr< Exportacion > exportacion, bool primero);
+    static int parametro(const std::shared_ptr< const restbed::Request >& request,
+                         const std::string& nombre, int omision);
+public:
+    explicit ExportarArboles(size_t t) : tramo(t) {}
+    void handler(const std::shared_ptr< restbed::Session > session);
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaExportarArboles : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Handler del web service Exportar Arboles
+ */
+void ExportarArboles::handler(const std::shared_ptr<restbed::Session> session)
+{ /* Web Service : GET (Exportar trees, NDJSON o binario) */
+
+    auto exportacion = std::make_shared< Exportacion >();
+    const auto request = session->get_request();
+
+    Exportador::Formato formato;
+    int desde, hasta;
+    try {
+        formato = Exportador::formatoDe(request->get_query_parameter("formato", ""));
+        desde = parametro(request, "desde", 1);
+        hasta = parametro(request, "hasta", INT_MAX);
+    }
+    catch (std::exception& e) {
+        auto msg = std::string("Ocurrió un error al procesar la solicitud: ").append(e.what());
+        this->responder(session, exportacion->inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            });
+        return;
+    }
+
+    exportacion->exportador = this->getControl()->exportInterface(formato, desde, hasta);
+
+    // El primer chunk va con las cabeceras: si el pool está lleno todavía
+    // puede responderse 503 (ver calcular)
+    this->calcular(session, exportacion->inicio, nullptr, [this, session, exportacion] () {
+            enviar(session, exportacion, true);
+        });
+}
+
+/**
+ * Exporta el siguiente tramo y lo envía como un chunk (en el pool de
+ * cálculo). Recién cuando el chunk se terminó de enviar se pasa el
+ * siguiente tramo al pool: a lo sumo hay un tramo en memoria por
+ * exportación, y el cliente que lee despacio frena la exportación en lugar
+ * de acumularla. El último chunk lleva también el chunk vacío final.
+ *
+ * Ya enviadas las cabeceras, un error (o el pool lleno) solo puede
+ * informarse cerrando la conexión sin el chunk final: el cliente recibe los
+ * árboles completos hasta el corte, y puede reanudar desde el último ID
+ * recibido + 1.
+ */
+void ExportarArboles::enviar(const std::shared_ptr<restbed::Session> session,
+                             std::shared_ptr<Exportacion> exportacion, bool primero)
+{
+    // Se reserva el lugar del largo del chunk, que se completa al final con
+    // ceros a la izquierda, para no copiar los árboles detrás de él
+    std::string chunk(ANCHO + 2, ' ');
+    chunk.reserve(ANCHO + 2 + tramo);
+
+    try {
+        exportacion->exportador->siguiente([&chunk] (const char *datos, size_t largo) {
+                chunk.append(datos, largo);
+            }, tramo);
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en la exportación: " << e.what() << std::endl;
+        if (primero) {
+            auto msg = std::string("Ocurrió un error al procesar la solicitud: ").append(e.what());
+            this->responder(session, exportacion->inicio, restbed::INTERNAL_SERVER_ERROR, msg, {
+                    {"Content-Length", std::to_string(msg.length())}
+                });
+        }
+        else {
+            this->registrar(exportacion->inicio, restbed::INTERNAL_SERVER_ERROR);
+            session->close();
+        }
+        return;
+    }
+
+    size_t largo = chunk.size() - (ANCHO + 2);
+    char cabecera[ANCHO + 3];
+    snprintf(cabecera, sizeof(cabecera), "%0*zx\r\n", int(ANCHO), largo);
+    chunk.replace(0, ANCHO + 2, cabecera, ANCHO + 2);
+    if (largo==0)
+        chunk.clear();
+    else
+        chunk.append("\r\n");
+
+    bool terminado = exportacion->exportador->terminado();
+    if (terminado)
+        chunk.append("0\r\n\r\n");
+
+    auto seguir = [this, exportacion] (const std::shared_ptr<restbed::Session> session) {
+        auto tarea = [this, session, exportacion] () {
+            enviar(session, exportacion, false);
+        };
+        if (! this->getControl()->computeInterface( std::move(tarea) )) {
+            std::cerr << "Exportación cortada en el ID " << exportacion->exportador->ultimo()
+                      << ": servidor ocupado" << std::endl;
+            this->registrar(exportacion->inicio, restbed::SERVICE_UNAVAILABLE);
+            session->close();
+        }
+    };
+
+    if (primero) {
+        std::multimap< std::string, std::string > cabeceras = {
+            {"Content-Type", Exportador::tipo(exportacion->exportador->getFormato())},
+            {"Transfer-Encoding", "chunked"}
+        };
+        exportacion->mantener = this->getControl()->keepAliveInterface(session, cabeceras);
+
+        if (terminado && exportacion->mantener) {
+            // Sin callback, restbed espera la siguiente solicitud
+            this->registrar(exportacion->inicio, restbed::OK);
+            session->yield(restbed::OK, chunk, cabeceras);
+        }
+        else if (terminado) {
+            this->registrar(exportacion->inicio, restbed::OK);
+            session->close(restbed::OK, chunk, cabeceras);
+        }
+        else
+            session->yield(restbed::OK, chunk, cabeceras, seguir);
+        return;
+    }
+
+    if (! terminado)
+        session->yield(chunk, seguir);
+    else {
+        this->registrar(exportacion->inicio, restbed::OK);
+        if (exportacion->mantener)
+            session->yield(chunk);
+        else
+            session->close(chunk);
+    }
+}
+
+/**
+ * @return Valor de un parámetro entero positivo, o el valor por omisión si
+ *         no está
+ */
+int ExportarArboles::parametro(const std::shared_ptr<const restbed::Request>& request,
+                               const std::string& nombre, int omision)
+{
+    auto texto = request->get_query_parameter(nombre, "");
+    if (texto.empty())
+        return omision;
+
+    size_t fin = 0;
+    long valor = 0;
+    try {
+        valor = std::stol(texto, &fin);
+    }
+    catch (...) {
+    }
+    if (fin!=texto.size() || valor<1 || valor>INT_MAX)
+        throw std::logic_error ( "Parámetro " + nombre + " inválido (ID de 1 a " + std::to_string(INT_MAX) + "): " + texto );
+    return valor;
+}
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaExportarArboles::get( std::shared_ptr< Control > c )
+{
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    auto export_chunk_kb = enteroDeEntorno( "RESTFUL_EXPORT_CHUNK_KB", "256" );
+    if (export_chunk_kb==0 || size_t(export_chunk_kb) > SIZE_MAX/1024)
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_EXPORT_CHUNK_KB: ").append(std::to_string(export_chunk_kb)) );
+
+    auto r=std::make_shared< ExportarArboles > (size_t(export_chunk_kb) * 1024);
+
+    r->setControl( c );
+    r->setRuta( Metricas::EXPORTAR_ARBOLES );
+    r->set_path( "/exportar-arboles" );
+
+    auto f = std::bind(&ExportarArboles::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaExportarArboles pluginFactory;
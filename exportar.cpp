@@ -0,0 +1,100 @@
+#include <algorithm> // std::max, std::copy_n
+#include <cstdint>   // uint64_t
+#include <charconv>  // std::to_chars
+#include <stdexcept> // std::logic_error
+#include "exportar.hpp"
+
+
+
+/** ***************************************************************************
+ * Constructor.
+ * @param r Función que recorre los árboles de un rango de ID, en orden
+ * @param f Formato de la exportación
+ * @param d Primer ID a exportar
+ * @param h Último ID a exportar
+ ** ***************************************************************************/
+Exportador::Exportador(Recorrer r, Formato f, int d, int h)
+    : recorrer(std::move(r)), formato(f), proximo(std::max(d, 1)), hasta(h),
+      fin(proximo > hasta), ultimo_id(0), total(0), escritos(0)
+{
+}
+
+/** ***************************************************************************
+ * Exportación del siguiente tramo: los árboles siguientes, hasta escribir
+ * al menos los bytes pedidos (siempre árboles completos: un árbol más
+ * grande que el tramo se escribe entero).
+ * @param escribir Función que recibe los bytes exportados; los JSON se
+ *                 entregan desde la persistencia y solo son válidos
+ *                 durante la llamada
+ * @param maximo Bytes a partir de los que termina el tramo
+ * @return Si quedan árboles por exportar
+ ** ***************************************************************************/
+bool Exportador::siguiente(const Escribir& escribir, size_t maximo)
+{
+    if (fin)
+        return false;
+
+    size_t tramo = 0;
+    bool cortado = false;
+
+    recorrer(proximo, hasta, [&] (int id, const char *texto, size_t largo) {
+            if (formato == NDJSON) {
+                char cabecera[32] = "{\"id\":";
+                auto p = std::to_chars(cabecera+6, cabecera+sizeof(cabecera), id).ptr;
+                size_t n = std::copy_n(",\"tree\":", 8, p) - cabecera;
+                escribir(cabecera, n);
+                escribir(texto, largo);
+                escribir("}\n", 2);
+                tramo += n + largo + 2;
+            }
+            else {
+                unsigned char cabecera[16];
+                for (int i = 0; i < 8; i++) {
+                    cabecera[i] = uint64_t(id) >> (8*i);
+                    cabecera[8+i] = uint64_t(largo) >> (8*i);
+                }
+                escribir(reinterpret_cast<const char*>(cabecera), sizeof(cabecera));
+                escribir(texto, largo);
+                tramo += sizeof(cabecera) + largo;
+            }
+
+            ultimo_id = id;
+            total++;
+            if (tramo < maximo)
+                return true;
+            cortado = true;
+            return false;
+        });
+
+    escritos += tramo;
+
+    // Sin corte, el recorrido llegó al final del rango (o de los árboles)
+    if (! cortado || ultimo_id >= hasta)
+        fin = true;
+    else
+        proximo = ultimo_id + 1;
+
+    return ! fin;
+}
+
+/** ***************************************************************************
+ * @param nombre Nombre del formato ("ndjson" o "binario"; "" es NDJSON)
+ * @return Formato de la exportación
+ ** ***************************************************************************/
+Exportador::Formato Exportador::formatoDe(const std::string& nombre)
+{
+    if (nombre.empty() || nombre == "ndjson")
+        return NDJSON;
+    if (nombre == "binario")
+        return BINARIO;
+    throw std::logic_error ( "Formato de exportación inválido (ndjson o binario): " + nombre );
+}
+
+/** ***************************************************************************
+ * @param f Formato de la exportación
+ * @return Tipo de contenido (Content-Type) del formato
+ ** ***************************************************************************/
+const char* Exportador::tipo(Formato f)
+{
+    return f == NDJSON ? "application/x-ndjson" : "application/octet-stream";
+}
@@ -0,0 +1,55 @@
+#ifndef _EXPORTAR_HPP_
+#define _EXPORTAR_HPP_
+
+#include <climits>   // INT_MAX
+#include <cstddef>   // size_t
+#include <functional> // std::function
+#include <string>    // std::string
+
+
+/**
+ * Exportación masiva de árboles, en orden de ID, de un rango de ID. Se
+ * exporta por tramos (ver siguiente()): cada tramo es un recorrido corto de
+ * la persistencia (ver Persist::recorrer) que termina al juntar los bytes
+ * pedidos, de modo que la memoria usada no depende del tamaño de la
+ * exportación y ninguna lectura queda abierta entre tramos. Cada JSON se
+ * entrega directamente desde la persistencia, sin copiarlo.
+ *
+ * Formatos:
+ *  - NDJSON: una línea {"id":N,"tree":<JSON guardado>} por árbol.
+ *  - BINARIO: por árbol, el ID y el largo del JSON (enteros de 64 bits,
+ *    little endian) seguidos del JSON guardado.
+ * En ambos, la exportación de rangos consecutivos concatenada es igual a la
+ * del rango completo: una exportación grande puede partirse por rangos de ID
+ * y hacerse en paralelo, o reanudarse desde ultimo()+1.
+ */
+class Exportador {
+public:
+  enum Formato { NDJSON, BINARIO };
+  typedef std::function<void(int, int, const std::function<bool(int, const char*, size_t)>&)> Recorrer; //< Recorre un rango de ID
+  typedef std::function<void(const char*, size_t)> Escribir; //< Recibe los bytes exportados
+  static const size_t BYTES_TRAMO = 256*1024; //< Bytes por tramo, por omisión
+
+private:
+  Recorrer    recorrer;
+  Formato     formato;
+  int         proximo;     //< Siguiente ID a exportar
+  int         hasta;       //< Último ID del rango
+  bool        fin;         //< Ya no quedan árboles en el rango
+  int         ultimo_id;   //< Último ID exportado (0: ninguno)
+  size_t      total;       //< Árboles exportados
+  size_t      escritos;    //< Bytes exportados
+public:
+  Exportador(Recorrer, Formato, int = 1, int = INT_MAX);
+  bool siguiente(const Escribir&, size_t = BYTES_TRAMO);
+  Formato getFormato(void) const { return formato; }   //< Formato de la exportación
+  bool terminado(void) const { return fin; }           //< No quedan árboles por exportar
+  int ultimo(void) const { return ultimo_id; }         //< Último ID exportado (0: ninguno)
+  size_t exportados(void) const { return total; }      //< Árboles exportados
+  size_t bytes(void) const { return escritos; }        //< Bytes exportados
+  static Formato formatoDe(const std::string&);
+  static const char* tipo(Formato);
+};
+
+
+#endif
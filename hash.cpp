@@ -0,0 +1,85 @@
+#include <algorithm> // std::min
+#include <cstring>   // memcpy
+#include "hash.hpp"
+
+
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/** ***************************************************************************
+ * MurmurHash3 x64_128, de Austin Appleby (dominio público).
+ * @param datos Datos a procesar
+ * @param largo Largo de los datos en bytes
+ * @param semilla Semilla del hash
+ * @return Hash de 128 bits
+ ** ***************************************************************************/
+Hash128 hash128(const void *datos, size_t largo, uint64_t semilla)
+{
+    const uint8_t *data = (const uint8_t*)datos;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = semilla, h2 = semilla;
+
+    for (size_t i = 0; i < largo/16; i++)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i*16, 8);
+        memcpy(&k2, data + i*16 + 8, 8);
+
+        k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+
+        k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+    }
+
+    // Últimos 0 a 15 bytes
+    const uint8_t *tail = data + (largo/16)*16;
+    size_t resto = largo & 15;
+    uint64_t k1 = 0, k2 = 0;
+
+    for (size_t i = resto; i > 8; i--)
+        k2 ^= (uint64_t)tail[i-1] << (8*(i-9));
+    if (resto > 8) {
+        k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+    }
+
+    for (size_t i = std::min<size_t>(resto, 8); i > 0; i--)
+        k1 ^= (uint64_t)tail[i-1] << (8*(i-1));
+    if (resto > 0) {
+        k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= largo; h2 ^= largo;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    return {h1, h2};
+}
+
+/** ***************************************************************************
+ * @return Los 16 bytes del hash (little endian), aptos para guardar como BLOB
+ ** ***************************************************************************/
+std::string Hash128::bytes(void) const
+{
+    std::string b(16, '\0');
+    for (int i = 0; i < 8; i++) {
+        b[i]   = (char)(h1 >> (8*i));
+        b[i+8] = (char)(h2 >> (8*i));
+    }
+    return b;
+}
@@ -0,0 +1,27 @@
+#ifndef _HASH_HPP_
+#define _HASH_HPP_
+
+#include <cstddef>   // size_t
+#include <cstdint>   // uint64_t
+#include <string>    // std::string
+
+
+/**
+ * Hash de 128 bits (MurmurHash3 x64_128). No es criptográfico: sirve para
+ * indexar contenido, y quien lo usa para deduplicar debe comparar el
+ * contenido completo cuando dos hashes coinciden.
+ */
+struct Hash128 {
+  uint64_t h1; //< Primera mitad
+  uint64_t h2; //< Segunda mitad
+  bool operator==(const Hash128& o) const { return h1==o.h1 and h2==o.h2; }
+  bool operator!=(const Hash128& o) const { return ! (*this==o); }
+  std::string bytes(void) const;
+};
+
+Hash128 hash128(const void*, size_t, uint64_t semilla=0);
+inline Hash128 hash128(const std::string& s) { return hash128(s.data(), s.size()); }
+
+
+
+#endif
@@ -0,0 +1,263 @@
+#include <algorithm> // std::min
+#include <cstdint>   // SIZE_MAX
+#include <functional>
+#include <iostream> // std::cout
+
+#include "json.hpp" // nlohmann::json
+#include "lector.hpp"
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Estado de una importación en curso: el importador, cuándo llegó, sus
+ * tiempos por fase y los resultados de las líneas ya procesadas.
+ */
+struct Importacion
+{
+    std::unique_ptr< Importador > importador;
+    reloj::time_point  inicio = reloj::now();
+    std::shared_ptr< Tiempos > tiempos;
+    std::string        salida;
+};
+
+/**
+ * Plugin especializado ImportarArboles
+ */
+class ImportarArboles : public Plugin
+{
+private:
+    static const size_t PARTE = 64*1024; //< Bytes que se leen por vez
+    size_t maximo;                       //< Tamaño máximo de un árbol, en bytes
+    void leerParte(const std::shared_ptr< restbed::Session > session,
+                   std::shared_ptr< Importacion > importacion, size_t restantes);
+    void leerChunked(const std::shared_ptr< restbed::Session > session,
+                     std::shared_ptr< Importacion > importacion,
+                     std::shared_ptr< DecodificadorChunked > decodificador);
+    void seguir(const std::shared_ptr< restbed::Session > session,
+                std::shared_ptr< Importacion > importacion,
+                std::function< void(void) > siguiente);
+    void terminar(const std::shared_ptr< restbed::Session > session,
+                  std::shared_ptr< Importacion > importacion);
+    void responderError(const std::shared_ptr< restbed::Session > session,
+                        const Importacion& importacion,
+                        const std::string& msg, bool cuerpo_leido);
+public:
+    explicit ImportarArboles(size_t m) : maximo(m) {}
+    void handler(const std::shared_ptr< restbed::Session > session);
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaImportarArboles : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Handler del web service Importar Arboles
+ */
+void ImportarArboles::handler(const std::shared_ptr<restbed::Session> session)
+{ /* Web Service : POST (Importar trees, NDJSON) */
+
+    auto importacion = std::make_shared< Importacion >();
+    importacion->tiempos = this->getControl()->timingInterface(importacion->inicio);
+    importacion->importador = this->getControl()->importInterface(maximo);
+    const auto request = session->get_request();
+
+    // Como en crear-arbol, el cuerpo se procesa por partes a medida que
+    // llega; aquí no hay un máximo para el cuerpo, sino para cada línea.
+    auto transfer_encoding = request->get_header("Transfer-Encoding", std::string());
+    if (transfer_encoding.find("chunked")!=std::string::npos) {
+        leerChunked(session, importacion, std::make_shared< DecodificadorChunked >(SIZE_MAX));
+        return;
+    }
+
+    if (! request->has_header("Content-Length")) {
+        auto msg = std::string("Se requiere Content-Length o Transfer-Encoding: chunked");
+        this->cerrar(session, importacion->inicio, restbed::LENGTH_REQUIRED, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, importacion->tiempos.get());
+        return;
+    }
+
+    size_t content_length;
+    try {
+        content_length = std::stoull(request->get_header("Content-Length", std::string()));
+    }
+    catch (...) {
+        responderError(session, *importacion, "Content-Length inválido", false);
+        return;
+    }
+
+    leerParte(session, importacion, content_length);
+}
+
+/**
+ * Lee la siguiente parte del cuerpo y se la pasa al importador. Al terminar
+ * el cuerpo, importa las últimas líneas y responde.
+ */
+void ImportarArboles::leerParte(const std::shared_ptr<restbed::Session> session,
+                                std::shared_ptr<Importacion> importacion, size_t restantes)
+{
+    if (restantes==0) {
+        terminar(session, importacion);
+        return;
+    }
+
+    size_t parte = std::min(restantes, PARTE);
+
+    session->fetch(parte,
+                   [this, importacion, restantes, parte](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+                       {
+                           importacion->importador->leer(body.data(), body.size());
+                           seguir(session, importacion, [this, session, importacion, restantes, parte] () {
+                                   leerParte(session, importacion, restantes-parte);
+                               });
+                       });
+}
+
+/**
+ * Lee la siguiente parte de un cuerpo chunked (ver crear-arbol). Al terminar
+ * el cuerpo, importa las últimas líneas y responde.
+ */
+void ImportarArboles::leerChunked(const std::shared_ptr<restbed::Session> session,
+                                  std::shared_ptr<Importacion> importacion,
+                                  std::shared_ptr<DecodificadorChunked> decodificador)
+{
+    if (decodificador->terminado()) {
+        terminar(session, importacion);
+        return;
+    }
+
+    auto callback = [this, importacion, decodificador](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+        {
+            try {
+                decodificador->leer(body.data(), body.size(), [&importacion] (const char *datos, size_t largo) {
+                        importacion->importador->leer(datos, largo);
+                    });
+            }
+            catch (std::exception& e){
+                auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+                msg.append(e.what());
+                responderError(session, *importacion, msg, false);
+                return;
+            }
+            seguir(session, importacion, [this, session, importacion, decodificador] () {
+                    leerChunked(session, importacion, decodificador);
+                });
+        };
+
+    if (auto n = decodificador->siguiente(); n>0)
+        session->fetch(std::min(n, PARTE), callback);
+    else
+        session->fetch("\r\n", callback);
+}
+
+/**
+ * Sigue leyendo el cuerpo. Si el importador juntó un lote, primero lo
+ * procesa en el pool de cálculo, y recién entonces sigue leyendo: así el
+ * cliente no envía más rápido de lo que se importa. Si el pool está lleno
+ * se responde 503 y, como queda cuerpo sin leer, se cierra la conexión.
+ */
+void ImportarArboles::seguir(const std::shared_ptr<restbed::Session> session,
+                             std::shared_ptr<Importacion> importacion,
+                             std::function<void(void)> siguiente)
+{
+    if (! importacion->importador->lleno()) {
+        siguiente();
+        return;
+    }
+
+    auto tarea = [this, session, importacion, siguiente] () {
+        try {
+            importacion->importador->procesar(importacion->salida);
+        }
+        catch (std::exception& e) {
+            responderError(session, *importacion, std::string("Ocurrió un error al procesar la solicitud: ").append(e.what()), false);
+            return;
+        }
+        siguiente();
+    };
+
+    if (! this->getControl()->computeInterface( std::move(tarea) )) {
+        auto msg = std::string("Servidor ocupado, reintente más tarde");
+        this->cerrar(session, importacion->inicio, restbed::SERVICE_UNAVAILABLE, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Retry-After", std::to_string(this->getControl()->getRetryAfter())},
+                {"Connection", "close"}
+            }, importacion->tiempos.get());
+    }
+}
+
+/**
+ * Importa las últimas líneas y responde con un resultado por línea (en el
+ * pool de cálculo).
+ */
+void ImportarArboles::terminar(const std::shared_ptr<restbed::Session> session,
+                               std::shared_ptr<Importacion> importacion)
+{
+    this->calcular(session, importacion->inicio, importacion->tiempos, [this, session, importacion] () {
+            try {
+                importacion->importador->terminar(importacion->salida);
+            }
+            catch (std::exception& e) {
+                responderError(session, *importacion, std::string("Ocurrió un error al procesar la solicitud: ").append(e.what()), true);
+                return;
+            }
+            this->responder(session, importacion->inicio, restbed::OK, importacion->salida, {
+                    {"Content-Type", "application/x-ndjson"},
+                    {"Content-Length", std::to_string(importacion->salida.length())}
+                }, importacion->tiempos.get());
+        });
+}
+
+/**
+ * Responde BAD REQUEST, indicando cuántas líneas ya se importaron. Si quedó
+ * parte del cuerpo sin leer, la conexión no puede usarse para otra solicitud
+ * y se cierra.
+ */
+void ImportarArboles::responderError(const std::shared_ptr<restbed::Session> session,
+                                     const Importacion& importacion,
+                                     const std::string& error, bool cuerpo_leido)
+{
+    auto msg = error + " (líneas ya importadas: " + std::to_string(importacion.importador->procesadas()) + ")";
+
+    if (cuerpo_leido)
+        this->responder(session, importacion.inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, importacion.tiempos.get());
+    else
+        this->cerrar(session, importacion.inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, importacion.tiempos.get());
+}
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaImportarArboles::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< ImportarArboles > (c->getMaxTreeBytes());
+
+    r->setControl( c );
+    r->setRuta( Metricas::IMPORTAR_ARBOLES );
+    r->set_path( "/importar-arboles" );
+
+    auto f = std::bind(&ImportarArboles::handler, r, std::placeholders::_1);
+    r->set_method_handler( "POST",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaImportarArboles pluginFactory;
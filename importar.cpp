@@ -0,0 +1,160 @@
+#include <algorithm> // std::min
+#include <cstring>   // memchr
+#include <string_view> // std::string_view
+#include <unordered_map> // std::unordered_map
+#include "importar.hpp"
+#include "lector.hpp"
+
+
+
+/** ***************************************************************************
+ * Constructor.
+ * @param g Función que guarda los JSON de un lote y devuelve sus ID
+ * @param m Métricas del servicio (o nullptr)
+ * @param p Pool de cálculo donde repartir cada lote (nullptr: en el hilo que llama)
+ * @param max Bytes máximos de una línea
+ * @param l Líneas por lote
+ ** ***************************************************************************/
+Importador::Importador(Guardar g, std::shared_ptr<Metricas> m, std::shared_ptr<PoolCalculo> p, size_t max, size_t l)
+    : guardar(std::move(g)), metricas(m), pool(std::move(p)), maximo(max),
+      lote(std::max<size_t>(1, l)), actual{std::string(), false}, pendientes(0), total(0),
+      distintos(0), errores(0)
+{
+}
+
+/** ***************************************************************************
+ * Lectura de una parte de la entrada. Solo la divide en líneas; el trabajo
+ * se hace en procesar(), cuando el lote está lleno (ver lleno()).
+ * @param datos Datos recibidos
+ * @param largo Cantidad de bytes
+ ** ***************************************************************************/
+void Importador::leer(const void *datos, size_t largo)
+{
+    auto c = static_cast<const char*>(datos), fin = c+largo;
+
+    while (c<fin)
+    {
+        auto nl = static_cast<const char*>(memchr(c, '\n', fin-c));
+        auto hasta = nl ? nl : fin;
+
+        if (! actual.excedida) {
+            if (actual.texto.size() + (hasta-c) > maximo) {
+                actual.excedida = true;
+                actual.texto = std::string();
+            }
+            else
+                actual.texto.append(c, hasta);
+        }
+
+        if (! nl)
+            break;
+
+        cerrarLinea();
+        c = nl+1;
+    }
+}
+
+/** ***************************************************************************
+ * Pasa la línea en curso a las pendientes.
+ ** ***************************************************************************/
+void Importador::cerrarLinea(void)
+{
+    if (! actual.texto.empty() && actual.texto.back()=='\r')
+        actual.texto.pop_back();
+
+    pendientes += actual.texto.size();
+    lineas.push_back(std::move(actual));
+    actual = {std::string(), false};
+}
+
+/** ***************************************************************************
+ * Procesamiento de las líneas pendientes: se interpretan en paralelo, se
+ * deduplican y se guardan juntas. Agrega a la salida una línea de resultado
+ * por cada una.
+ * @param salida Texto al que se agregan los resultados
+ ** ***************************************************************************/
+void Importador::procesar(std::string& salida)
+{
+    const size_t n = lineas.size();
+    if (n==0)
+        return;
+
+    std::vector<std::string> textos(n), fallas(n);
+    std::vector<size_t> nodos(n, 0);
+    auto trabajar = [&] (size_t i) {
+        auto t0 = std::chrono::steady_clock::now();
+        try {
+            if (lineas[i].excedida)
+                throw std::length_error ( "Se admiten hasta " + std::to_string(maximo/(1024*1024)) + " MiB por árbol" );
+
+            LectorArbol lector;
+            lector.leer(lineas[i].texto.data(), lineas[i].texto.size());
+            auto arbol = lector.terminar();
+            if (arbol.nodos.empty())
+                throw std::logic_error( "Todos los árboles deben tener al menos un nodo!" );
+            nodos[i] = arbol.nodos.size();
+            textos[i] = arbol.serializar();
+        }
+        catch (std::exception& e) {
+            fallas[i] = e.what();
+        }
+        std::string().swap(lineas[i].texto);
+        if (metricas)
+            metricas->parseo(Metricas::CARGA, std::chrono::steady_clock::now()-t0);
+    };
+
+    if (pool)
+        pool->repartir(n, trabajar);
+    else
+        for (size_t i = 0; i < n; i++)
+            trabajar(i);
+
+    // Árboles repetidos dentro del lote: se guarda solo el primero
+    std::unordered_map<std::string_view, size_t> unicos;
+    std::vector<size_t> indice(n), primeros;
+    for (size_t i = 0; i < n; i++) {
+        if (! fallas[i].empty())
+            continue;
+        auto [it, nuevo] = unicos.emplace(textos[i], primeros.size());
+        if (nuevo)
+            primeros.push_back(i);
+        indice[i] = it->second;
+    }
+    unicos.clear();
+
+    std::vector<std::string> guardar_textos;
+    guardar_textos.reserve(primeros.size());
+    for (auto i : primeros)
+        guardar_textos.push_back(std::move(textos[i]));
+
+    auto ids = guardar_textos.empty() ? std::vector<int>() : guardar(guardar_textos);
+
+    for (size_t i = 0; i < n; i++) {
+        if (! fallas[i].empty()) {
+            salida.append(json({{"error", fallas[i]}}).dump(-1, ' ', false, json::error_handler_t::replace)).push_back('\n');
+            errores++;
+        }
+        else {
+            salida.append("{\"id\":").append(std::to_string(ids[indice[i]])).append("}\n");
+            if (metricas)
+                metricas->arbol(nodos[i]);
+        }
+    }
+
+    total += n;
+    distintos += primeros.size();
+    lineas.clear();
+    pendientes = 0;
+}
+
+/** ***************************************************************************
+ * Fin de la entrada: una última línea sin fin de línea también se importa.
+ * Procesa todas las líneas pendientes.
+ * @param salida Texto al que se agregan los resultados
+ ** ***************************************************************************/
+void Importador::terminar(std::string& salida)
+{
+    if (! actual.texto.empty() || actual.excedida)
+        cerrarLinea();
+    procesar(salida);
+}
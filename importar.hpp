@@ -0,0 +1,59 @@
+#ifndef _IMPORTAR_HPP_
+#define _IMPORTAR_HPP_
+
+#include <cstddef>   // size_t
+#include <functional> // std::function
+#include <memory>    // shared_ptr
+#include <string>    // std::string
+#include <vector>    // std::vector
+#include "metricas.hpp" // Metricas
+#include "pool.hpp"    // PoolCalculo
+
+
+/**
+ * Importación masiva de árboles en NDJSON (un árbol JSON por línea). Recibe
+ * el texto por partes, a medida que llega, y lo divide en líneas; cada lote
+ * de líneas se interpreta y valida en paralelo, repartido en el pool de
+ * cálculo (ver LectorArbol y PoolCalculo::repartir), se
+ * deduplica dentro del lote por su serialización canónica y se guarda con
+ * una única llamada (ver Persist::insertLote). Por cada línea de la entrada
+ * se emite, en el mismo orden, una línea con {"id":N} o {"error":"..."}: un
+ * árbol mal formado no detiene la importación. Un error al guardar, en
+ * cambio, se informa con la excepción y detiene la importación (los lotes
+ * anteriores ya quedaron guardados).
+ */
+class Importador {
+public:
+  typedef std::function<std::vector<int>(const std::vector<std::string>&)> Guardar; //< Guarda los JSON y devuelve sus ID
+  static const size_t BYTES_LOTE = 64*1024*1024; //< Bytes de líneas a partir de los que el lote está lleno
+
+private:
+  struct Linea {
+    std::string texto;     //< Texto de la línea, sin el fin de línea
+    bool        excedida;  //< Superó el máximo y se descartó su texto
+  };
+  Guardar     guardar;
+  std::shared_ptr<Metricas> metricas;
+  std::shared_ptr<PoolCalculo> pool; //< Pool donde se reparte cada lote (o nullptr)
+  size_t      maximo;      //< Bytes máximos de una línea
+  size_t      lote;        //< Líneas por lote
+  std::vector<Linea> lineas; //< Líneas completas pendientes
+  Linea       actual;      //< Línea en curso
+  size_t      pendientes;  //< Bytes de las líneas pendientes
+  size_t      total;       //< Líneas procesadas
+  size_t      distintos;   //< Árboles distintos guardados (deduplicados en cada lote)
+  size_t      errores;     //< Líneas con errores
+  void cerrarLinea(void);
+public:
+  Importador(Guardar, std::shared_ptr<Metricas>, std::shared_ptr<PoolCalculo>, size_t, size_t);
+  void leer(const void*, size_t);
+  bool lleno(void) const { return lineas.size()>=lote || pendientes>=BYTES_LOTE; } //< Hay un lote para procesar
+  void procesar(std::string&);
+  void terminar(std::string&);
+  size_t procesadas(void) const { return total; }     //< Líneas procesadas
+  size_t guardados(void) const { return distintos; }  //< Árboles distintos guardados
+  size_t fallidas(void) const { return errores; }     //< Líneas con errores
+};
+
+
+#endif
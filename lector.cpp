@@ -0,0 +1,694 @@
+#include <cctype>    // isalnum
+#include <charconv>  // std::from_chars
+#include "lector.hpp"
+
+
+
+/** ***************************************************************************
+ * Constructor. El lector espera un árbol (un objeto) como documento.
+ ** ***************************************************************************/
+LectorArbol::LectorArbol()
+    : espera(VALOR_ARBOL), lexico(ESTRUCTURA), miembro(OTRO), profundidad(0),
+      en_cadena(false), escape(false), escalar(false), leidos(0)
+{
+}
+
+/** ***************************************************************************
+ * Error de formato, con la posición en el documento.
+ * @param descripcion Descripción del error
+ ** ***************************************************************************/
+void LectorArbol::error(const char *descripcion) const
+{
+    throw std::logic_error ( std::string("Árbol mal formado, ").append(descripcion)
+                             .append(" (byte ").append(std::to_string(leidos)).append(")") );
+}
+
+/** ***************************************************************************
+ * Lectura de una parte del documento. Las partes pueden cortar el documento
+ * en cualquier lugar, incluso en medio de un token.
+ * @param datos Datos a leer
+ * @param largo Cantidad de bytes
+ ** ***************************************************************************/
+void LectorArbol::leer(const void *datos, size_t largo)
+{
+    auto c = static_cast<const char*>(datos), fin = c+largo;
+
+    for (; c<fin; c++, leidos++)
+    {
+        if (lexico==CAPTURA)
+        {
+            if (en_cadena) {
+                // Se copia de una vez hasta la próxima comilla o barra
+                auto corte = c;
+                while (corte<fin && *corte!='"' && *corte!='\\')
+                    corte++;
+                if (! escape) {
+                    captura.append(c, corte);
+                    leidos += corte-c;
+                    c = corte;
+                    if (c==fin)
+                        break;
+                }
+                captura += *c;
+                if (escape)
+                    escape = false;
+                else if (*c=='\\')
+                    escape = true;
+                else if (*c=='"') {
+                    en_cadena = false;
+                    if (profundidad==0)
+                        finValor();
+                }
+                continue;
+            }
+
+            if (escalar) {
+                if (isalnum(static_cast<unsigned char>(*c)) || *c=='+' || *c=='-' || *c=='.') {
+                    captura += *c;
+                    continue;
+                }
+                // El carácter que termina un escalar pertenece a la estructura
+                finValor();
+            }
+            else {
+                captura += *c;
+                if (*c=='"')
+                    en_cadena = true;
+                else if (*c=='{' || *c=='[')
+                    profundidad++;
+                else if ((*c=='}' || *c==']') && --profundidad==0)
+                    finValor();
+                continue;
+            }
+        }
+        else if (lexico==CADENA_CLAVE)
+        {
+            clave += *c;
+            if (escape)
+                escape = false;
+            else if (*c=='\\')
+                escape = true;
+            else if (*c=='"')
+                finClave();
+            continue;
+        }
+
+        if (*c==' ' || *c=='\t' || *c=='\n' || *c=='\r')
+            continue;
+
+        switch (espera)
+        {
+        case VALOR_ARBOL:
+            if (*c!='{')
+                error(abiertos.empty() ? "el árbol debe ser un objeto" :
+                      "los campos left y right deben ser árboles");
+            abrirArbol();
+            break;
+
+        case CLAVE_O_FIN:
+            if (*c=='}') {
+                cerrarArbol();
+                break;
+            }
+            [[fallthrough]];
+        case CLAVE:
+            if (*c!='"')
+                error("se esperaba una clave");
+            clave.assign(1, '"');
+            lexico = CADENA_CLAVE;
+            break;
+
+        case DOS_PUNTOS:
+            if (*c!=':')
+                error("se esperaba ':'");
+            espera = (miembro==LEFT || miembro==RIGHT) ? VALOR_ARBOL : VALOR;
+            break;
+
+        case VALOR:
+            if (*c==',' || *c==':' || *c=='}' || *c==']')
+                error("se esperaba un valor");
+            captura.assign(1, *c);
+            lexico = CAPTURA;
+            en_cadena = *c=='"';
+            escalar = !en_cadena && *c!='{' && *c!='[';
+            profundidad = (*c=='{' || *c=='[') ? 1 : 0;
+            break;
+
+        case COMA_O_FIN:
+            if (*c==',')
+                espera = CLAVE;
+            else if (*c=='}')
+                cerrarArbol();
+            else
+                error("se esperaba ',' o '}'");
+            break;
+
+        case FIN:
+            error("hay datos después del árbol");
+        }
+    }
+}
+
+/** ***************************************************************************
+ * Apertura de un nuevo nodo, que cuelga del miembro en curso del nodo
+ * abierto más interno (o es la raíz).
+ ** ***************************************************************************/
+void LectorArbol::abrirArbol(void)
+{
+    int32_t i = arbol.nodos.size();
+
+    arbol.nodos.emplace_back();
+    arbol.izquierdo.push_back(-1);
+    arbol.derecho.push_back(-1);
+
+    if (! abiertos.empty())
+        (miembro==RIGHT ? arbol.derecho : arbol.izquierdo)[abiertos.back().nodo] = i;
+
+    abiertos.push_back({i, 0});
+    espera = CLAVE_O_FIN;
+}
+
+/** ***************************************************************************
+ * Cierre del nodo abierto más interno, que debe tener su campo "node".
+ ** ***************************************************************************/
+void LectorArbol::cerrarArbol(void)
+{
+    if (! (abiertos.back().vistos & NODE))
+        error(R"(todos los nodos deben tener un campo "node")");
+
+    abiertos.pop_back();
+    espera = abiertos.empty() ? FIN : COMA_O_FIN;
+}
+
+/** ***************************************************************************
+ * Fin de una clave: se identifica el miembro y se descartan los repetidos.
+ ** ***************************************************************************/
+void LectorArbol::finClave(void)
+{
+    lexico = ESTRUCTURA;
+    espera = DOS_PUNTOS;
+
+    // Solo las claves con secuencias de escape necesitan interpretarse
+    if (clave.find('\\')!=std::string::npos)
+        try {
+            clave = json::parse(clave).get<std::string>();
+        }
+        catch (json::exception&) {
+            error("clave inválida");
+        }
+    else
+        clave = clave.substr(1, clave.size()-2);
+
+    miembro = clave=="node" ? NODE : clave=="left" ? LEFT : clave=="right" ? RIGHT : OTRO;
+
+    auto& abierto = abiertos.back();
+    if (miembro!=OTRO) {
+        if (abierto.vistos & miembro)
+            error("hay campos repetidos");
+        abierto.vistos |= miembro;
+    }
+    else if (auto e = arbol.extras.find(abierto.nodo); e!=arbol.extras.end() && e->second.contains(clave))
+        error("hay campos repetidos");
+}
+
+/** ***************************************************************************
+ * Conversión directa de un entero JSON (sin ceros a la izquierda, ni signo +,
+ * ni fracción o exponente).
+ * @param texto Texto del valor
+ * @param valor Resultado, si es un entero de 64 bits
+ * @return Si el texto es un entero de 64 bits
+ ** ***************************************************************************/
+static bool enteroJSON(std::string_view texto, json& valor)
+{
+    auto c = texto.data(), fin = c+texto.size();
+    bool negativo = c<fin && *c=='-';
+    auto digitos = c+negativo;
+
+    if (digitos==fin || (*digitos=='0' && fin-digitos>1))
+        return false;
+
+    if (negativo) {
+        int64_t n;
+        auto [p, e] = std::from_chars(c, fin, n);
+        if (e!=std::errc() || p!=fin)
+            return false;
+        valor = n;
+    }
+    else {
+        uint64_t n;
+        auto [p, e] = std::from_chars(c, fin, n);
+        if (e!=std::errc() || p!=fin)
+            return false;
+        valor = n;
+    }
+    return true;
+}
+
+/** ***************************************************************************
+ * Fin del valor de "node" o de otro campo: se interpreta solo ese valor.
+ ** ***************************************************************************/
+void LectorArbol::finValor(void)
+{
+    lexico = ESTRUCTURA;
+    espera = COMA_O_FIN;
+
+    // Los enteros, el caso más común, se convierten sin el parser de
+    // nlohmann, con el mismo tipo que él les daría (sin signo si no son
+    // negativos). Los que no entran en 64 bits siguen el camino general.
+    json valor;
+    if (! enteroJSON(captura, valor))
+        try {
+            valor = json::parse(captura);
+        }
+        catch (json::parse_error&) {
+            error("valor inválido");
+        }
+
+    auto nodo = abiertos.back().nodo;
+    if (miembro==NODE)
+        arbol.nodos[nodo] = std::move(valor);
+    else
+        arbol.extras[nodo][clave] = std::move(valor);
+
+    captura.clear();
+}
+
+/** ***************************************************************************
+ * Fin del documento.
+ * @return El árbol aplanado (el lector queda vacío)
+ ** ***************************************************************************/
+ArbolPlano LectorArbol::terminar(void)
+{
+    if (espera!=FIN || lexico!=ESTRUCTURA)
+        error("el árbol está incompleto");
+
+    arbol.largo = leidos;
+    return std::move(arbol);
+}
+
+/** ***************************************************************************
+ * Decodificación de la consulta. Se admite exactamente un objeto con los
+ * campos id, node_a y node_b, una vez cada uno y en cualquier orden, con
+ * valores enteros de 64 bits o cadenas ASCII sin secuencias de escape (y
+ * espacios entre los elementos). Los valores son los mismos, y del mismo
+ * tipo, que daría json::parse.
+ * @param q Texto de la consulta
+ * @return Si la consulta tiene esa forma; si no, debe usarse json::parse
+ ** ***************************************************************************/
+bool ConsultaAncestro::decodificar(std::string_view q)
+{
+    const size_t n = q.size();
+    size_t i = 0;
+    unsigned vistos = 0;
+
+    auto espacios = [&q, &i, n] () {
+        while (i<n && (q[i]==' ' || q[i]=='\t' || q[i]=='\n' || q[i]=='\r'))
+            i++;
+    };
+    // Cadena ASCII sin escapes; i queda tras las comillas finales
+    auto cadena = [&q, &i, n] (std::string_view& texto) {
+        size_t k = ++i;
+        while (i<n && q[i]!='"' && q[i]!='\\' && q[i]>=0x20 && static_cast<unsigned char>(q[i])<0x80)
+            i++;
+        if (i>=n || q[i]!='"')
+            return false;
+        texto = q.substr(k, i++ - k);
+        return true;
+    };
+
+    espacios();
+    if (i>=n || q[i++]!='{')
+        return false;
+
+    while (true)
+    {
+        std::string_view clave;
+        espacios();
+        if (i>=n || q[i]!='"' || ! cadena(clave))
+            return false;
+
+        int campo = clave=="id" ? 0 : clave=="node_a" ? 1 : clave=="node_b" ? 2 : -1;
+        if (campo<0 || (vistos & (1u<<campo)))
+            return false;
+        vistos |= 1u<<campo;
+
+        espacios();
+        if (i>=n || q[i++]!=':')
+            return false;
+        espacios();
+
+        json& valor = campo==0 ? id : campo==1 ? node_a : node_b;
+        if (i<n && q[i]=='"') {
+            std::string_view texto;
+            if (! cadena(texto))
+                return false;
+            valor = std::string(texto);
+        }
+        else {
+            size_t k = i;
+            while (i<n && ((q[i]>='0' && q[i]<='9') || q[i]=='-'))
+                i++;
+            if (! enteroJSON(q.substr(k, i-k), valor))
+                return false;
+        }
+
+        espacios();
+        if (i<n && q[i]==',') {
+            i++;
+            continue;
+        }
+        if (i<n && q[i]=='}') {
+            i++;
+            break;
+        }
+        return false;
+    }
+
+    espacios();
+    return i==n && vistos==7;
+}
+
+/** ***************************************************************************
+ * @return Si los dos nodos son enteros de 64 bits con signo
+ ** ***************************************************************************/
+bool ConsultaAncestro::enteros(void) const
+{
+    auto entero = [] (const json& v) {
+        return v.is_number_integer() && (! v.is_number_unsigned() || v.get<uint64_t>() <= uint64_t(INT64_MAX));
+    };
+    return entero(node_a) && entero(node_b);
+}
+
+/** ***************************************************************************
+ * Constructor. Recorre el texto una vez, siguiendo solo la estructura: de
+ * los valores que no son ramas ("node" y otros campos) se busca el final.
+ * @param t Texto canónico del árbol
+ * @param largo Bytes del texto
+ * @param nodos Cantidad de nodos esperada, si se conoce
+ ** ***************************************************************************/
+MapaArbol::MapaArbol(const char *t, size_t largo, size_t nodos)
+    : texto(t, largo)
+{
+    std::vector<int32_t> abiertos;
+    // El texto puede no terminar en '\0' (ver Persist::select)
+    auto c = [t, largo] (size_t i) { return i<largo ? t[i] : '\0'; };
+
+    inicio.reserve(nodos);
+    fin.reserve(nodos);
+    izquierdo.reserve(nodos);
+    derecho.reserve(nodos);
+    tamanio.reserve(nodos);
+
+    auto abrir = [this, &abiertos] (size_t i) {
+        int32_t h = inicio.size();
+        inicio.push_back(i);
+        fin.push_back(0);
+        izquierdo.push_back(-1);
+        derecho.push_back(-1);
+        tamanio.push_back(1);
+        abiertos.push_back(h);
+        return h;
+    };
+
+    if (c(0)!='{')
+        error(0);
+    abrir(0);
+    size_t i = 1;
+
+    while (true)
+    {
+        int32_t n = abiertos.back();
+
+        if (c(i)=='}') {
+            fin[n] = ++i;
+            for (int32_t h : {izquierdo[n], derecho[n]})
+                if (h>=0)
+                    tamanio[n] += tamanio[h];
+            abiertos.pop_back();
+            if (abiertos.empty())
+                break;
+        }
+        else {
+            size_t k = i;
+            i = saltarCadena(i);
+            if (c(i++)!=':')
+                error(i-1);
+
+            // El texto es canónico: las claves "left" y "right" no tienen escapes
+            bool izq = i-k==7 && texto.compare(k, 7, "\"left\":")==0;
+            bool der = i-k==8 && texto.compare(k, 8, "\"right\":")==0;
+            if (izq || der) {
+                if (c(i)!='{')
+                    error(i);
+                (der ? derecho : izquierdo)[n] = abrir(i++);
+                continue;
+            }
+            i = saltarValor(i);
+        }
+
+        if (c(i)==',')
+            i++;
+        else if (c(i)!='}')
+            error(i);
+    }
+
+    if (i!=largo)
+        error(i);
+}
+
+/** ***************************************************************************
+ * Error de formato del texto, con la posición.
+ * @param i Posición del error
+ ** ***************************************************************************/
+void MapaArbol::error(size_t i) const
+{
+    throw std::logic_error ( std::string("Árbol guardado mal formado (byte ").append(std::to_string(i)).append(")") );
+}
+
+/** ***************************************************************************
+ * @param i Posición de las comillas iniciales de una cadena
+ * @return Posición siguiente a las comillas finales
+ ** ***************************************************************************/
+size_t MapaArbol::saltarCadena(size_t i) const
+{
+    const char *c = texto.data();
+    const size_t n = texto.size();
+
+    if (i>=n || c[i]!='"')
+        error(i);
+    for (i++; i<n && c[i]!='"'; i++)
+        if (c[i]=='\\')
+            i++;
+    if (i>=n)
+        error(n);
+    return i+1;
+}
+
+/** ***************************************************************************
+ * @param i Posición del inicio de un valor JSON
+ * @return Posición siguiente al final del valor
+ ** ***************************************************************************/
+size_t MapaArbol::saltarValor(size_t i) const
+{
+    const char *c = texto.data();
+    const size_t n = texto.size();
+
+    if (i<n && c[i]=='"')
+        return saltarCadena(i);
+
+    if (i>=n || (c[i]!='{' && c[i]!='[')) {
+        while (i<n && c[i]!=',' && c[i]!='}' && c[i]!=']')
+            i++;
+        return i;
+    }
+
+    int profundidad = 0;
+    do {
+        if (c[i]=='"') {
+            i = saltarCadena(i);
+            continue;
+        }
+        if (c[i]=='{' || c[i]=='[')
+            profundidad++;
+        else if (c[i]=='}' || c[i]==']')
+            profundidad--;
+        i++;
+    } while (profundidad>0 && i<n);
+
+    if (profundidad>0)
+        error(n);
+    return i;
+}
+
+/** ***************************************************************************
+ * Ubicación de un nodo por su índice en el árbol compilado (preorden,
+ * visitando la rama derecha antes que la izquierda, ver ArbolCompilado): se
+ * baja desde la raíz eligiendo la rama según el tamaño de los subárboles.
+ * @param compilado Índice del nodo en el árbol compilado
+ * @param padre Resultado: el padre del nodo en el mapa (-1 en la raíz)
+ * @param rama Resultado: si el nodo cuelga de la rama derecha del padre
+ * @return El nodo en el mapa
+ ** ***************************************************************************/
+int32_t MapaArbol::nodo(int32_t compilado, int32_t& padre, bool& rama) const
+{
+    int32_t n = 0, i = 0;
+    padre = -1;
+    rama = false;
+
+    while (i<compilado) {
+        int32_t d = derecho[n];
+        padre = n;
+        rama = d>=0 && compilado<i+1+tamanio[d];
+        n = rama ? d : izquierdo[n];
+        i += rama || d<0 ? 1 : 1+tamanio[d];
+        if (n<0)
+            throw std::logic_error ( "El nodo no está en el árbol guardado" );
+    }
+    return n;
+}
+
+/** ***************************************************************************
+ * @param n Nodo en el mapa
+ * @param compilado Índice del nodo en el árbol compilado
+ * @param rama Si se busca el hijo derecho (o el izquierdo)
+ * @return Índice en el árbol compilado del hijo del nodo en esa rama (-1 si no tiene)
+ ** ***************************************************************************/
+int32_t MapaArbol::hijo(int32_t n, int32_t compilado, bool rama) const
+{
+    if (rama)
+        return derecho[n]<0 ? -1 : compilado+1;
+    return izquierdo[n]<0 ? -1 : compilado+1+(derecho[n]<0 ? 0 : tamanio[derecho[n]]);
+}
+
+/** ***************************************************************************
+ * Texto del árbol con un subárbol colgado de un nodo, en reemplazo del que
+ * tuviera en esa rama. Si la rama estaba vacía, el miembro se agrega en el
+ * lugar que le corresponde según el orden de las claves, de modo que el
+ * resultado sigue siendo canónico.
+ * @param n Nodo en el mapa
+ * @param rama Si el subárbol cuelga de la rama derecha (o de la izquierda)
+ * @param subarbol Texto canónico del subárbol
+ * @return Texto canónico del árbol modificado
+ ** ***************************************************************************/
+std::string MapaArbol::colgar(int32_t n, bool rama, const std::string& subarbol) const
+{
+    const char *c = texto.data();
+    const std::string clave = rama ? "right" : "left";
+    std::string resultado;
+
+    if (int32_t h = (rama ? derecho : izquierdo)[n]; h>=0) {
+        resultado.reserve(texto.size()-(fin[h]-inicio[h])+subarbol.size());
+        return resultado.append(texto, 0, inicio[h]).append(subarbol).append(texto, fin[h]);
+    }
+
+    resultado.reserve(texto.size()+clave.size()+subarbol.size()+4);
+
+    // Se busca el primer miembro del nodo con una clave posterior
+    size_t i = inicio[n]+1;
+    while (c[i]!='}')
+    {
+        size_t k = i;
+        i = saltarCadena(i);
+        std::string nombre(texto.substr(k+1, i-k-2));
+        if (nombre.find('\\')!=std::string::npos)
+            nombre = json::parse(texto.substr(k, i-k)).get<std::string>();
+
+        if (nombre>clave)
+            return resultado.append(texto, 0, k).append("\"").append(clave).append("\":")
+                .append(subarbol).append(",").append(texto, k);
+
+        i++;
+        if (nombre=="left" || nombre=="right")
+            i = fin[(nombre=="right" ? derecho : izquierdo)[n]];
+        else
+            i = saltarValor(i);
+        if (c[i]==',')
+            i++;
+    }
+
+    return resultado.append(texto, 0, i).append(",\"").append(clave).append("\":")
+        .append(subarbol).append(texto, i);
+}
+
+/** ***************************************************************************
+ * Texto del árbol sin el subárbol que cuelga de una rama de un nodo.
+ * @param n Nodo en el mapa
+ * @param rama Si se quita la rama derecha (o la izquierda)
+ * @return Texto canónico del árbol modificado
+ ** ***************************************************************************/
+std::string MapaArbol::quitar(int32_t n, bool rama) const
+{
+    int32_t h = (rama ? derecho : izquierdo)[n];
+    if (h<0)
+        throw std::logic_error ( "El nodo no tiene subárbol en esa rama" );
+
+    // El miembro va desde su clave, y se quita también una coma vecina (el
+    // nodo tiene al menos el miembro "node")
+    size_t desde = inicio[h]-(rama ? 8 : 7), hasta = fin[h];
+    if (texto[desde-1]==',')
+        desde--;
+    else
+        hasta++;
+
+    std::string resultado;
+    resultado.reserve(texto.size()-(hasta-desde));
+    return resultado.append(texto, 0, desde).append(texto, hasta);
+}
+
+/** ***************************************************************************
+ * Constructor.
+ * @param maximo Máximo de bytes de datos que se aceptan
+ ** ***************************************************************************/
+DecodificadorChunked::DecodificadorChunked(size_t maximo)
+    : estado(TAMANIO), restantes(0), total(0), maximo(maximo)
+{
+}
+
+/** ***************************************************************************
+ * Fin de una línea de tamaño ("<hex>[;extensiones]\r\n") o de trailer. El
+ * chunk de tamaño 0 es el último, y lo siguen los trailers hasta una línea
+ * vacía.
+ ** ***************************************************************************/
+void DecodificadorChunked::finLinea(void)
+{
+    if (estado==TRAILER) {
+        if (linea=="\r\n")
+            estado = TERMINADO;
+        linea.clear();
+        return;
+    }
+
+    size_t fin = 0;
+    unsigned long long tamanio = 0;
+    try {
+        tamanio = std::stoull(linea, &fin, 16);
+    }
+    catch (...) {
+        throw std::logic_error ( "Cuerpo chunked mal formado, tamaño de chunk inválido" );
+    }
+    if (linea[fin]!=';' && linea[fin]!='\r' && linea[fin]!=' ' && linea[fin]!='\t')
+        throw std::logic_error ( "Cuerpo chunked mal formado, tamaño de chunk inválido" );
+
+    if (tamanio>maximo-total)
+        throw std::length_error ( "El cuerpo supera el máximo admitido" );
+
+    total += tamanio;
+    restantes = tamanio;
+    estado = tamanio ? DATOS : TRAILER;
+    linea.clear();
+}
+
+/** ***************************************************************************
+ * @return Bytes que conviene pedir a continuación, sin pasar del final del
+ *         cuerpo: 0 si se espera una línea (pedir hasta "\r\n"), o la
+ *         cantidad de bytes que faltan del chunk en curso (con su CRLF).
+ ** ***************************************************************************/
+size_t DecodificadorChunked::siguiente(void) const
+{
+    switch (estado)
+    {
+    case DATOS:     return restantes+2;
+    case FIN_DATOS: return restantes;
+    default:        return 0;
+    }
+}
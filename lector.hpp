@@ -0,0 +1,180 @@
+#ifndef _LECTOR_HPP_
+#define _LECTOR_HPP_
+
+#include <algorithm> // std::min
+#include <cstddef>   // size_t
+#include <cstdint>   // int32_t
+#include <stdexcept> // std::logic_error, std::length_error
+#include <string>    // std::string
+#include <string_view> // std::string_view
+#include <vector>    // std::vector
+#include "arbol.hpp" // ArbolPlano
+
+
+/**
+ * Lector incremental de árboles en JSON. Recibe el documento por partes, a
+ * medida que llega (por ejemplo desde session->fetch), y en una única pasada
+ * valida la forma del árbol (objetos con "node" y, opcionalmente, "left" y
+ * "right" que a su vez son árboles) y arma el árbol aplanado, sin construir
+ * nunca el JSON completo. Solo se interpretan con nlohmann::json los valores
+ * de "node" (y de otros campos), de a uno.
+ * Los errores de formato se informan con std::logic_error.
+ */
+class LectorArbol {
+private:
+  enum Espera { VALOR_ARBOL, CLAVE_O_FIN, CLAVE, DOS_PUNTOS, VALOR, COMA_O_FIN, FIN };
+  enum Lexico { ESTRUCTURA, CADENA_CLAVE, CAPTURA };
+  enum Miembro { NODE=1, LEFT=2, RIGHT=4, OTRO=0 };
+  struct Abierto {
+    int32_t  nodo;    //< Nodo del objeto abierto
+    unsigned vistos;  //< Miembros (NODE, LEFT, RIGHT) ya leídos
+  };
+  ArbolPlano           arbol;       //< Árbol en construcción
+  std::vector<Abierto> abiertos;    //< Objetos de árbol abiertos, el más interno al final
+  Espera      espera;               //< Próximo elemento esperado en la estructura
+  Lexico      lexico;               //< Token en curso
+  Miembro     miembro;              //< Miembro cuyo valor se espera
+  std::string clave;                //< Clave en curso (texto crudo), o de un campo OTRO
+  std::string captura;              //< Texto crudo del valor en curso
+  int         profundidad;          //< Anidamiento del valor en curso
+  bool        en_cadena;            //< El valor en curso está dentro de una cadena
+  bool        escape;               //< El carácter anterior fue '\' dentro de una cadena
+  bool        escalar;              //< El valor en curso es un número o un literal
+  size_t      leidos;               //< Bytes leídos en total
+  void abrirArbol(void);
+  void cerrarArbol(void);
+  void finClave(void);
+  void finValor(void);
+  [[noreturn]] void error(const char*) const;
+public:
+  LectorArbol();
+  void leer(const void*, size_t);
+  ArbolPlano terminar(void);
+  size_t bytes(void) const { return leidos; } //< Bytes leídos en total
+};
+
+
+/**
+ * Consulta de ancestro común {"id":<id>,"node_a":<node>,"node_b":<node>}
+ * decodificada en una sola pasada, sin armar el JSON de la consulta: es la
+ * consulta más frecuente, y casi siempre con valores enteros o cadenas
+ * simples. Solo se decodifican esas formas (ver decodificar()); cualquier
+ * otra se deja al parser general, que la interpreta (o la rechaza) igual
+ * que siempre.
+ */
+struct ConsultaAncestro {
+  json id;     //< ID del árbol
+  json node_a; //< Valor del primer nodo
+  json node_b; //< Valor del segundo nodo
+  bool decodificar(std::string_view);
+  bool enteros(void) const;
+};
+
+
+/**
+ * Mapa de los nodos en el texto canónico de un árbol (ver
+ * ArbolPlano::serializar): dónde empieza y termina cada nodo y de qué rama
+ * cuelga, en una pasada que solo sigue la estructura, sin interpretar los
+ * valores. Con él se arma el texto de un árbol modificado (un subárbol
+ * agregado o quitado) copiando el texto original por tramos, sin volver a
+ * leerlo ni serializarlo completo. Los nodos se numeran en el orden del
+ * documento, y se ubican por su índice en el árbol compilado (ver nodo()).
+ * El texto no se copia: debe seguir vivo mientras se use el mapa.
+ */
+class MapaArbol {
+private:
+  std::string_view     texto;       //< Texto canónico del árbol
+  std::vector<size_t>  inicio;      //< Posición del '{' de cada nodo
+  std::vector<size_t>  fin;         //< Posición siguiente al '}' de cada nodo
+  std::vector<int32_t> izquierdo;   //< Hijo izquierdo de cada nodo (-1 si no tiene)
+  std::vector<int32_t> derecho;     //< Hijo derecho de cada nodo (-1 si no tiene)
+  std::vector<int32_t> tamanio;     //< Nodos del subárbol de cada nodo
+  size_t saltarCadena(size_t) const;
+  size_t saltarValor(size_t) const;
+  [[noreturn]] void error(size_t) const;
+public:
+  MapaArbol(const char*, size_t, size_t = 0);
+  int32_t nodo(int32_t, int32_t&, bool&) const;
+  int32_t hijo(int32_t, int32_t, bool) const;
+  std::string colgar(int32_t, bool, const std::string&) const;
+  std::string quitar(int32_t, bool) const;
+  size_t cantidad(void) const { return inicio.size(); } //< Cantidad de nodos
+};
+
+
+/**
+ * Decodificador incremental de cuerpos HTTP con "Transfer-Encoding: chunked".
+ * Recibe el cuerpo crudo por partes y entrega solo los datos, también por
+ * partes. Indica cuántos bytes pedir a continuación, para no leer nunca más
+ * allá del final del cuerpo (en una conexión persistente, lo que sigue es la
+ * próxima solicitud). Si los datos superan el máximo se lanza
+ * std::length_error; los errores de formato, std::logic_error.
+ */
+class DecodificadorChunked {
+private:
+  enum Estado { TAMANIO, DATOS, FIN_DATOS, TRAILER, TERMINADO };
+  Estado      estado;    //< Parte del cuerpo que se espera
+  std::string linea;     //< Línea en curso (tamaño o trailer)
+  size_t      restantes; //< Bytes del chunk en curso (o de su CRLF final) por leer
+  size_t      total;     //< Bytes de datos entregados
+  size_t      maximo;    //< Máximo de bytes de datos
+  void finLinea(void);
+public:
+  explicit DecodificadorChunked(size_t);
+  template<class Datos> void leer(const void*, size_t, Datos&&);
+  size_t siguiente(void) const;
+  bool terminado(void) const { return estado==TERMINADO; } //< Se leyó el cuerpo completo
+  size_t bytes(void) const { return total; }               //< Bytes de datos entregados
+};
+
+/** ***************************************************************************
+ * Lectura de una parte del cuerpo crudo.
+ * @param crudo Datos recibidos
+ * @param largo Cantidad de bytes
+ * @param datos Función que recibe los datos decodificados (puntero y largo)
+ ** ***************************************************************************/
+template<class Datos>
+void DecodificadorChunked::leer(const void *crudo, size_t largo, Datos&& datos)
+{
+    auto c = static_cast<const char*>(crudo), fin = c+largo;
+
+    while (c<fin)
+    {
+        switch (estado)
+        {
+        case TAMANIO:
+        case TRAILER:
+            linea += *c++;
+            if (linea.size()>4096)
+                throw std::logic_error ( "Cuerpo chunked mal formado, línea demasiado larga" );
+            if (linea.size()>=2 && linea.compare(linea.size()-2, 2, "\r\n")==0)
+                finLinea();
+            break;
+
+        case DATOS: {
+            size_t n = std::min<size_t>(restantes, fin-c);
+            datos(c, n);
+            c += n;
+            restantes -= n;
+            if (restantes==0) {
+                estado = FIN_DATOS;
+                restantes = 2;
+            }
+            break;
+        }
+
+        case FIN_DATOS:
+            if (*c++ != "\r\n"[2-restantes])
+                throw std::logic_error ( "Cuerpo chunked mal formado, falta CRLF tras los datos" );
+            if (--restantes==0)
+                estado = TAMANIO;
+            break;
+
+        case TERMINADO:
+            throw std::logic_error ( "Cuerpo chunked mal formado, hay datos tras el final" );
+        }
+    }
+}
+
+
+#endif
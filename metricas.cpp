@@ -0,0 +1,351 @@
+#include <cstdio>     // snprintf
+#include <cstring>    // strcmp
+#include <iostream>   // std::cerr
+#include "metricas.hpp"
+
+namespace {
+    const char * const NOMBRES_RUTAS[]     = { "/crear-arbol", "/ancestro-comun", "/ancestro-comun-lote", "/profundidad",
+                                               "/distancia", "/ancestro", "/camino", "/importar-arboles", "/exportar-arboles",
+                                               "/modificar-arbol", "/metrics" };
+    const char * const NOMBRES_ESPERAS[]   = { "pool", "escritura", "grupo" };
+    const char * const NOMBRES_CONSULTAS[] = { "insert", "select" };
+    const char * const NOMBRES_PARSEOS[]   = { "solicitud", "carga", "guardado" };
+    const int          CODIGOS_ESTADOS[]   = { 200, 400, 411, 413, 500, 503 };
+
+    // Límites de las cubetas: tiempos de 100 µs a 10 s (en ns), y nodos de 1 a 10^7
+    const uint64_t LIMITES_TIEMPO[] = {
+        100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+        50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000
+    };
+    const uint64_t LIMITES_NODOS[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+    const int CUBETAS_TIEMPO = sizeof(LIMITES_TIEMPO)/sizeof(LIMITES_TIEMPO[0]);
+    const int CUBETAS_NODOS = sizeof(LIMITES_NODOS)/sizeof(LIMITES_NODOS[0]);
+
+    std::string numero(double v)
+    {
+        char texto[32];
+        snprintf(texto, sizeof(texto), "%.9g", v);
+        return texto;
+    }
+}
+
+/** ***************************************************************************
+ * Constructor. Todos los contadores empiezan en cero.
+ ** ***************************************************************************/
+Metricas::Metricas()
+    : fragmentos(new Fragmento[FRAGMENTOS]())
+{
+}
+
+/** ***************************************************************************
+ * Fragmento de contadores del hilo. A cada hilo se le asigna uno la primera
+ * vez, en orden, de modo que hasta FRAGMENTOS hilos no comparten contadores
+ * (y si los comparten, los atomics mantienen las cuentas correctas).
+ * @return Fragmento del hilo
+ ** ***************************************************************************/
+Metricas::Fragmento& Metricas::propio(void)
+{
+    static std::atomic<unsigned> siguiente{0};
+    thread_local unsigned indice = siguiente++ % FRAGMENTOS;
+
+    return fragmentos[indice];
+}
+
+/** ***************************************************************************
+ * Registro de un valor en un histograma.
+ * @param limites Límites superiores de las cubetas, en orden
+ * @param n Cantidad de límites
+ * @param valor Valor a registrar
+ ** ***************************************************************************/
+void Metricas::Histograma::registrar(const uint64_t *limites, int n, uint64_t valor)
+{
+    int i = 0;
+    while (i<n && valor>limites[i])
+        i++;
+
+    cubetas[i].fetch_add(1, std::memory_order_relaxed);
+    suma.fetch_add(valor, std::memory_order_relaxed);
+}
+
+/** ***************************************************************************
+ * Registro de una solicitud atendida.
+ * @param ruta Web service que la atendió
+ * @param estado Código de estado HTTP de la respuesta
+ * @param duracion Tiempo desde que llegó hasta la respuesta
+ ** ***************************************************************************/
+void Metricas::solicitud(Ruta ruta, int estado, std::chrono::nanoseconds duracion)
+{
+    auto& f = propio();
+
+    int i = 0;
+    while (i<ESTADOS-1 && CODIGOS_ESTADOS[i]!=estado)
+        i++;
+
+    f.solicitudes[ruta][i].fetch_add(1, std::memory_order_relaxed);
+    f.latencia[ruta].registrar(LIMITES_TIEMPO, CUBETAS_TIEMPO, duracion.count());
+}
+
+/** ***************************************************************************
+ * Registro de una espera en Persist (por una conexión, por el mutex de
+ * escritura o por la confirmación de un lote).
+ ** ***************************************************************************/
+void Metricas::espera(Espera tipo, std::chrono::nanoseconds duracion)
+{
+    propio().espera[tipo].registrar(LIMITES_TIEMPO, CUBETAS_TIEMPO, duracion.count());
+}
+
+/** ***************************************************************************
+ * Registro del tiempo de ejecución de una consulta de SQLite.
+ ** ***************************************************************************/
+void Metricas::consulta(Consulta tipo, std::chrono::nanoseconds duracion)
+{
+    propio().consulta[tipo].registrar(LIMITES_TIEMPO, CUBETAS_TIEMPO, duracion.count());
+}
+
+/** ***************************************************************************
+ * Registro del tiempo de interpretación de un JSON.
+ ** ***************************************************************************/
+void Metricas::parseo(Parseo tipo, std::chrono::nanoseconds duracion)
+{
+    propio().parseo[tipo].registrar(LIMITES_TIEMPO, CUBETAS_TIEMPO, duracion.count());
+}
+
+/** ***************************************************************************
+ * Registro del tamaño de un árbol creado.
+ * @param nodos Cantidad de nodos
+ ** ***************************************************************************/
+void Metricas::arbol(size_t nodos)
+{
+    propio().nodos.registrar(LIMITES_NODOS, CUBETAS_NODOS, nodos);
+}
+
+/** ***************************************************************************
+ * Registro de la espera de una tarea en la cola del pool de cálculo.
+ ** ***************************************************************************/
+void Metricas::cola(std::chrono::nanoseconds duracion)
+{
+    propio().cola.registrar(LIMITES_TIEMPO, CUBETAS_TIEMPO, duracion.count());
+}
+
+/** ***************************************************************************
+ * Registro de una búsqueda en la caché de árboles.
+ * @param acierto Si el árbol estaba en la caché
+ ** ***************************************************************************/
+void Metricas::cache(bool acierto)
+{
+    propio().cache[acierto].fetch_add(1, std::memory_order_relaxed);
+}
+
+/** ***************************************************************************
+ * Escritura de un histograma (sumando todos los fragmentos) en el formato
+ * de Prometheus: cubetas acumuladas, suma y cantidad.
+ * @param texto Texto al que se agrega
+ * @param nombre Nombre de la métrica
+ * @param etiquetas Etiquetas de la serie ("" si no tiene)
+ * @param limites Límites de las cubetas
+ * @param n Cantidad de límites
+ * @param escala Factor de los valores registrados a la unidad de la métrica
+ * @param histograma Histograma de cada fragmento
+ ** ***************************************************************************/
+void Metricas::escribir(std::string& texto, const char *nombre, const std::string& etiquetas,
+                        const uint64_t *limites, int n, double escala,
+                        const std::function<const Histograma&(const Fragmento&)>& histograma) const
+{
+    uint64_t cubetas[CUBETAS+1] = {}, suma = 0;
+
+    for (int f = 0; f < FRAGMENTOS; f++) {
+        auto& h = histograma(fragmentos[f]);
+        for (int i = 0; i <= n; i++)
+            cubetas[i] += h.cubetas[i].load(std::memory_order_relaxed);
+        suma += h.suma.load(std::memory_order_relaxed);
+    }
+
+    auto separador = etiquetas.empty() ? "" : ",";
+    uint64_t acumulado = 0;
+    for (int i = 0; i <= n; i++) {
+        acumulado += cubetas[i];
+        texto.append(nombre).append("_bucket{").append(etiquetas).append(separador)
+            .append("le=\"").append(i<n ? numero(limites[i]*escala) : "+Inf").append("\"} ")
+            .append(std::to_string(acumulado)).append("\n");
+    }
+
+    auto llaves = etiquetas.empty() ? std::string() : "{"+etiquetas+"}";
+    texto.append(nombre).append("_sum").append(llaves).append(" ").append(numero(suma*escala)).append("\n");
+    texto.append(nombre).append("_count").append(llaves).append(" ").append(std::to_string(acumulado)).append("\n");
+}
+
+/** ***************************************************************************
+ * Escritura de una medida (gauge) en el formato de Prometheus.
+ * @param texto Texto al que se agrega
+ * @param nombre Nombre de la métrica
+ * @param ayuda Descripción de la métrica
+ * @param valor Valor actual
+ ** ***************************************************************************/
+void Metricas::medida(std::string& texto, const char *nombre, const char *ayuda, double valor)
+{
+    texto.append("# HELP ").append(nombre).append(" ").append(ayuda).append("\n")
+        .append("# TYPE ").append(nombre).append(" gauge\n")
+        .append(nombre).append(" ").append(numero(valor)).append("\n");
+}
+
+/** ***************************************************************************
+ * Nombre de una ruta, tal como se publica.
+ * @param ruta Ruta
+ * @return Nombre de la ruta
+ ** ***************************************************************************/
+const char* Metricas::nombre(Ruta ruta)
+{
+    return ruta<RUTAS ? NOMBRES_RUTAS[ruta] : "";
+}
+
+/** ***************************************************************************
+ * Exportación de todas las métricas en el formato de texto de Prometheus.
+ * Los contadores se leen sin detener a los hilos que registran, así que
+ * cada serie es consistente consigo misma pero no necesariamente con las
+ * demás.
+ * @return Texto de las métricas
+ ** ***************************************************************************/
+std::string Metricas::exportar(void) const
+{
+    std::string texto;
+
+    texto.append("# HELP restful_http_requests_total Solicitudes atendidas, por ruta y código de estado.\n"
+                 "# TYPE restful_http_requests_total counter\n");
+    for (int r = 0; r < RUTAS; r++)
+        for (int e = 0; e < ESTADOS; e++) {
+            uint64_t total = 0;
+            for (int f = 0; f < FRAGMENTOS; f++)
+                total += fragmentos[f].solicitudes[r][e].load(std::memory_order_relaxed);
+            if (total)
+                texto.append("restful_http_requests_total{route=\"").append(NOMBRES_RUTAS[r])
+                    .append("\",status=\"").append(e<ESTADOS-1 ? std::to_string(CODIGOS_ESTADOS[e]) : "otro")
+                    .append("\"} ").append(std::to_string(total)).append("\n");
+        }
+
+    texto.append("# HELP restful_http_request_duration_seconds Tiempo desde la llegada de cada solicitud hasta su respuesta.\n"
+                 "# TYPE restful_http_request_duration_seconds histogram\n");
+    for (int r = 0; r < RUTAS; r++)
+        escribir(texto, "restful_http_request_duration_seconds", std::string("route=\"").append(NOMBRES_RUTAS[r]).append("\""),
+                 LIMITES_TIEMPO, CUBETAS_TIEMPO, 1e-9, [r] (const Fragmento& f) -> const Histograma& { return f.latencia[r]; });
+
+    texto.append("# HELP restful_db_wait_seconds Esperas en la persistencia: conexión del pool, mutex de escritura y confirmación del lote (group commit).\n"
+                 "# TYPE restful_db_wait_seconds histogram\n");
+    for (int e = 0; e < ESPERAS; e++)
+        escribir(texto, "restful_db_wait_seconds", std::string("lock=\"").append(NOMBRES_ESPERAS[e]).append("\""),
+                 LIMITES_TIEMPO, CUBETAS_TIEMPO, 1e-9, [e] (const Fragmento& f) -> const Histograma& { return f.espera[e]; });
+
+    texto.append("# HELP restful_db_step_seconds Tiempo de ejecución de las consultas de SQLite (sqlite3_step).\n"
+                 "# TYPE restful_db_step_seconds histogram\n");
+    for (int c = 0; c < CONSULTAS; c++)
+        escribir(texto, "restful_db_step_seconds", std::string("statement=\"").append(NOMBRES_CONSULTAS[c]).append("\""),
+                 LIMITES_TIEMPO, CUBETAS_TIEMPO, 1e-9, [c] (const Fragmento& f) -> const Histograma& { return f.consulta[c]; });
+
+    texto.append("# HELP restful_json_parse_seconds Tiempo de interpretación de JSON: solicitudes, árboles recibidos y árboles leídos de la BBDD.\n"
+                 "# TYPE restful_json_parse_seconds histogram\n");
+    for (int p = 0; p < PARSEOS; p++)
+        escribir(texto, "restful_json_parse_seconds", std::string("source=\"").append(NOMBRES_PARSEOS[p]).append("\""),
+                 LIMITES_TIEMPO, CUBETAS_TIEMPO, 1e-9, [p] (const Fragmento& f) -> const Histograma& { return f.parseo[p]; });
+
+    texto.append("# HELP restful_compute_queue_wait_seconds Espera de las tareas en la cola del pool de cálculo.\n"
+                 "# TYPE restful_compute_queue_wait_seconds histogram\n");
+    escribir(texto, "restful_compute_queue_wait_seconds", "", LIMITES_TIEMPO, CUBETAS_TIEMPO, 1e-9,
+             [] (const Fragmento& f) -> const Histograma& { return f.cola; });
+
+    texto.append("# HELP restful_tree_nodes Cantidad de nodos de los árboles creados.\n"
+                 "# TYPE restful_tree_nodes histogram\n");
+    escribir(texto, "restful_tree_nodes", "", LIMITES_NODOS, CUBETAS_NODOS, 1,
+             [] (const Fragmento& f) -> const Histograma& { return f.nodos; });
+
+    texto.append("# HELP restful_tree_cache_requests_total Búsquedas en la caché de árboles compilados, por resultado.\n"
+                 "# TYPE restful_tree_cache_requests_total counter\n");
+    for (int acierto = 1; acierto >= 0; acierto--) {
+        uint64_t total = 0;
+        for (int f = 0; f < FRAGMENTOS; f++)
+            total += fragmentos[f].cache[acierto].load(std::memory_order_relaxed);
+        texto.append("restful_tree_cache_requests_total{result=\"").append(acierto ? "hit" : "miss")
+            .append("\"} ").append(std::to_string(total)).append("\n");
+    }
+
+    return texto;
+}
+
+/** ***************************************************************************
+ * Constructor.
+ * @param i Llegada de la solicitud
+ * @param c Si se envía la cabecera Server-Timing
+ * @param u Duración a partir de la cual se registra la solicitud (0: nunca)
+ ** ***************************************************************************/
+Tiempos::Tiempos(reloj::time_point i, bool c, std::chrono::nanoseconds u)
+    : cantidad(0), inicio(i), cabecera(c), umbral(u), arbol_nodos(0)
+{
+}
+
+/** ***************************************************************************
+ * Suma una duración a una fase.
+ * @param nombre Nombre de la fase (un literal: se guarda el puntero)
+ * @param duracion Duración a sumar
+ ** ***************************************************************************/
+void Tiempos::sumar(const char *nombre, std::chrono::nanoseconds duracion)
+{
+    for (int i = 0; i < cantidad; i++)
+        if (strcmp(fases[i].nombre, nombre)==0) {
+            fases[i].duracion += duracion;
+            return;
+        }
+
+    if (cantidad < FASES)
+        fases[cantidad++] = {nombre, duracion};
+}
+
+/** ***************************************************************************
+ * Registra el árbol usado por la solicitud.
+ * @param id ID del árbol (JSON)
+ * @param nodos Cantidad de nodos
+ ** ***************************************************************************/
+void Tiempos::arbol(const std::string& id, size_t nodos)
+{
+    arbol_id = id;
+    arbol_nodos = nodos;
+}
+
+/** ***************************************************************************
+ * Valor de la cabecera Server-Timing: cada fase, en el orden en que se
+ * midió, y el total, con las duraciones en milisegundos.
+ * @param total Duración total de la solicitud
+ * @return Valor de la cabecera
+ ** ***************************************************************************/
+std::string Tiempos::servidor(std::chrono::nanoseconds total) const
+{
+    std::string texto;
+
+    for (int i = 0; i < cantidad; i++)
+        texto.append(fases[i].nombre).append(";dur=").append(numero(fases[i].duracion.count()/1e6)).append(", ");
+
+    return texto.append("total;dur=").append(numero(total.count()/1e6));
+}
+
+/** ***************************************************************************
+ * Fin de la solicitud: agrega la cabecera Server-Timing a la respuesta, si
+ * está activada, y si la solicitud superó el umbral la registra en la
+ * salida de errores, con sus fases y el árbol usado.
+ * @param ruta Web service que atendió la solicitud
+ * @param estado Código de estado HTTP de la respuesta
+ * @param cabeceras Cabeceras de la respuesta
+ ** ***************************************************************************/
+void Tiempos::terminar(Metricas::Ruta ruta, int estado, std::multimap<std::string, std::string>& cabeceras) const
+{
+    auto total = reloj::now()-inicio;
+    auto texto = servidor(total);
+
+    if (cabecera)
+        cabeceras.insert({"Server-Timing", texto});
+
+    if (umbral.count()>0 && total>=umbral) {
+        auto linea = std::string("Solicitud lenta: ").append(Metricas::nombre(ruta))
+            .append(" ").append(std::to_string(estado));
+        if (! arbol_id.empty())
+            linea.append(" árbol ").append(arbol_id).append(" (").append(std::to_string(arbol_nodos)).append(" nodos)");
+        linea.append(" [").append(texto).append("]\n");
+        std::cerr << linea << std::flush;
+    }
+}
@@ -0,0 +1,123 @@
+#ifndef _METRICAS_HPP_
+#define _METRICAS_HPP_
+
+#include <atomic>    // std::atomic
+#include <chrono>    // std::chrono
+#include <cstdint>   // uint64_t
+#include <functional> // std::function
+#include <map>       // std::multimap
+#include <memory>    // std::unique_ptr
+#include <string>    // std::string
+
+
+/**
+ * Métricas del servicio, exportadas en el formato de texto de Prometheus
+ * (ver el web service /metrics): solicitudes por ruta y estado, latencias
+ * por ruta, esperas y tiempo de SQLite en Persist, tiempo de interpretación
+ * de JSON, tamaño de los árboles creados y aciertos de la caché de árboles.
+ * Registrar no usa mutex: cada hilo suma con atomics (relaxed) en su propio
+ * fragmento de contadores, alineado a línea de caché, y exportar suma los
+ * fragmentos. Así la instrumentación no agrega contención entre hilos.
+ */
+class Metricas {
+public:
+  enum Ruta     { CREAR_ARBOL, ANCESTRO_COMUN, ANCESTRO_COMUN_LOTE, PROFUNDIDAD, DISTANCIA, ANCESTRO, CAMINO,
+                  IMPORTAR_ARBOLES, EXPORTAR_ARBOLES, MODIFICAR_ARBOL, METRICS, RUTAS };
+  enum Espera   { POOL, ESCRITURA, GRUPO, ESPERAS };   //< Conexión del pool, mutex de escritura, lote del group commit
+  enum Consulta { INSERT, SELECT, CONSULTAS };         //< Consultas de SQLite (sqlite3_step)
+  enum Parseo   { PEDIDO, CARGA, GUARDADO, PARSEOS };  //< JSON de la solicitud, árbol recibido, árbol leído de la BBDD
+
+private:
+  static const int FRAGMENTOS = 16; //< Fragmentos de contadores
+  static const int ESTADOS = 7;     //< Códigos de estado con contador propio (el último cuenta el resto)
+  static const int CUBETAS = 16;    //< Máximo de límites de un histograma (más la cubeta +Inf)
+
+  struct Histograma {
+    std::atomic<uint64_t> cubetas[CUBETAS+1]; //< Cuentas por cubeta, sin acumular
+    std::atomic<uint64_t> suma;               //< Suma de los valores registrados
+    void registrar(const uint64_t*, int, uint64_t);
+  };
+
+  struct alignas(64) Fragmento {
+    std::atomic<uint64_t> solicitudes[RUTAS][ESTADOS];
+    Histograma            latencia[RUTAS];
+    Histograma            espera[ESPERAS];
+    Histograma            consulta[CONSULTAS];
+    Histograma            parseo[PARSEOS];
+    Histograma            nodos;
+    Histograma            cola;               //< Espera en la cola del pool de cálculo
+    std::atomic<uint64_t> cache[2];           //< Fallos y aciertos de la caché de árboles
+  };
+
+  std::unique_ptr<Fragmento[]> fragmentos;
+  Fragmento& propio(void);
+  void escribir(std::string&, const char*, const std::string&, const uint64_t*, int, double,
+                const std::function<const Histograma&(const Fragmento&)>&) const;
+
+public:
+  Metricas();
+  void solicitud(Ruta, int, std::chrono::nanoseconds);
+  void espera(Espera, std::chrono::nanoseconds);
+  void consulta(Consulta, std::chrono::nanoseconds);
+  void parseo(Parseo, std::chrono::nanoseconds);
+  void arbol(size_t);
+  void cola(std::chrono::nanoseconds);
+  void cache(bool);
+  std::string exportar(void) const;
+  static void medida(std::string&, const char*, const char*, double);
+  static const char* nombre(Ruta);
+};
+
+
+/**
+ * Tiempos de las fases de una solicitud (decodificación, interpretación,
+ * BBDD, compilación, búsqueda, respuesta...), para la cabecera Server-Timing
+ * y el registro de solicitudes lentas. Lo crea el controlador solo si alguna
+ * de las dos cosas está activada: con un puntero nulo, Fase no lee el reloj
+ * y no agrega costo. Una solicitud se atiende en un hilo por vez, así que no
+ * requiere sincronización.
+ */
+class Tiempos {
+public:
+  typedef std::chrono::steady_clock reloj;
+
+  /**
+   * Medición de una fase durante su alcance (scope). Las mediciones con el
+   * mismo nombre se suman.
+   */
+  class Fase {
+  private:
+    Tiempos          *tiempos;
+    const char       *nombre;
+    reloj::time_point inicio;
+  public:
+    Fase(Tiempos *t, const char *n) : tiempos(t), nombre(n) { if (t) inicio = reloj::now(); }
+    ~Fase() { if (tiempos) tiempos->sumar(nombre, reloj::now()-inicio); }
+    Fase(const Fase&) = delete;
+    Fase& operator=(const Fase&) = delete;
+  };
+
+private:
+  static const int FASES = 12;  //< Máximo de fases distintas (las demás se descartan)
+  struct Medida {
+    const char              *nombre;
+    std::chrono::nanoseconds duracion;
+  };
+  Medida            fases[FASES];
+  int               cantidad;
+  reloj::time_point inicio;     //< Llegada de la solicitud
+  bool              cabecera;   //< Si se envía Server-Timing
+  std::chrono::nanoseconds umbral; //< Duración a partir de la cual se registra la solicitud (0: nunca)
+  std::string       arbol_id;   //< ID del árbol usado, si lo hay
+  size_t            arbol_nodos;
+public:
+  Tiempos(reloj::time_point, bool, std::chrono::nanoseconds);
+  void sumar(const char*, std::chrono::nanoseconds);
+  void arbol(const std::string&, size_t);
+  std::string servidor(std::chrono::nanoseconds) const;
+  bool conCabecera(void) const { return cabecera; }             //< Si se envía Server-Timing
+  void terminar(Metricas::Ruta, int, std::multimap<std::string, std::string>&) const;
+};
+
+
+#endif
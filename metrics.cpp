@@ -0,0 +1,62 @@
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado Metrics
+ */
+class Metrics : public Plugin
+{
+public:
+    void handler(const std::shared_ptr< restbed::Session > session);
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaMetrics : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Handler del web service Metrics: las métricas del servicio en el formato
+ * de texto de Prometheus.
+ */
+void Metrics::handler(const std::shared_ptr<restbed::Session> session)
+{ /* Web Service 4 : GET */
+
+    const auto inicio = reloj::now();
+    auto texto = this->getControl()->metricsInterface();
+
+    this->responder(session, inicio, restbed::OK, texto, {
+            {"Content-Type", "text/plain; version=0.0.4; charset=utf-8"},
+            {"Content-Length", std::to_string(texto.length())}
+        });
+}
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaMetrics::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< Metrics > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::METRICS );
+    r->set_path( "/metrics" );
+
+    auto f = std::bind(&Metrics::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaMetrics pluginFactory;
@@ -0,0 +1,149 @@
+#include <functional>
+#include <iostream> // std::cout
+
+#include "json.hpp" // nlohmann::json
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado ModificarArbol
+ */
+class ModificarArbol : public Plugin
+{
+private:
+    size_t maximo;                       //< Tamaño máximo de una modificación, en bytes
+    void atender(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                 Tiempos *tiempos, const restbed::Bytes& body);
+public:
+    explicit ModificarArbol(size_t m) : maximo(m) {}
+    void handler(const std::shared_ptr< restbed::Session > session);
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaModificarArbol : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Handler del web service Modificar Arbol
+ */
+void ModificarArbol::handler(const std::shared_ptr<restbed::Session> session)
+{ /* Web Service : POST (Modificar tree, nueva versión) */
+
+    const auto inicio = reloj::now();
+    const auto tiempos = this->getControl()->timingInterface(inicio);
+    const auto request = session->get_request();
+
+    if (! request->has_header("Content-Length")) {
+        auto msg = std::string("Se requiere Content-Length");
+        this->cerrar(session, inicio, restbed::LENGTH_REQUIRED, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, tiempos.get());
+        return;
+    }
+
+    // Se obtiene la longitud del contenido de la solicitud en content_length
+    size_t content_length;
+    try {
+        content_length = std::stoull(request->get_header("Content-Length", std::string()));
+    }
+    catch (...) {
+        auto msg = std::string("Content-Length inválido");
+        this->cerrar(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, tiempos.get());
+        return;
+    }
+
+    // Un subárbol a colgar tiene el mismo límite que un árbol nuevo
+    // (RESTFUL_MAX_TREE_MB). Se rechaza antes de leer el cuerpo.
+    if (content_length>maximo) {
+        auto msg = std::string("Se admiten hasta ").append(std::to_string(maximo/(1024*1024))).append(" MiB de datos");
+        this->cerrar(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())},
+                {"Connection", "close"}
+            }, tiempos.get());
+        return;
+    }
+
+    // Procesa el contenido del POST
+    session->fetch(content_length,
+                   [this, inicio, tiempos](const std::shared_ptr<restbed::Session> session, const restbed::Bytes &body)
+                       {
+                           if (tiempos)
+                               tiempos->sumar("cuerpo", reloj::now()-inicio);
+
+                           // Se copia el cuerpo, que solo es válido durante el callback
+                           this->calcular(session, inicio, tiempos, [this, session, inicio, tiempos, body] () {
+                                   atender(session, inicio, tiempos.get(), body);
+                               });
+                       });
+}
+
+/**
+ * Aplica la modificación y responde con el ID del árbol nuevo (en el pool de cálculo)
+ */
+void ModificarArbol::atender(const std::shared_ptr<restbed::Session> session, const reloj::time_point inicio,
+                             Tiempos *tiempos, const restbed::Bytes& body)
+{
+    try {
+        auto t0 = reloj::now();
+        auto request = json::parse(body.begin(), body.end());
+        auto t = reloj::now()-t0;
+        this->getControl()->getMetricas()->parseo(Metricas::PEDIDO, t);
+        if (tiempos)
+            tiempos->sumar("parse", t);
+        int id = this->getControl()->patchTreeInterface(request, tiempos);
+        json response;
+        response["id"] = id;
+        auto response_string = response.dump();
+        this->responder(session, inicio, restbed::OK, response_string, {
+                {"Content-Length", std::to_string(response_string.length())}
+            }, tiempos);
+    }
+    catch (std::exception& e){
+        auto msg = std::string("Ocurrió un error al procesar la solicitud: ");
+        msg.append(e.what());
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
+    }
+    catch (...) {
+        auto msg = std::string("Ocurrió un error al procesar la solicitud.");
+        this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                {"Content-Length", std::to_string(msg.length())}
+            }, tiempos);
+    }
+}
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaModificarArbol::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< ModificarArbol > (c->getMaxTreeBytes());
+
+    r->setControl( c );
+    r->setRuta( Metricas::MODIFICAR_ARBOL );
+    r->set_path( "/modificar-arbol" );
+
+    auto f = std::bind(&ModificarArbol::handler, r, std::placeholders::_1);
+    r->set_method_handler( "POST",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaModificarArbol pluginFactory;
@@ -0,0 +1,602 @@
+#include <iostream>
+#include <algorithm> // std::max, std::all_of
+#include <cerrno>    // errno
+#include <cstring>   // memcpy, memcmp, strerror
+#include <fcntl.h>   // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>  // pwrite, fdatasync, ftruncate, close
+#include "persistencia.hpp"
+#include "hash.hpp"
+
+
+
+/** ***************************************************************************
+ * ID de árbol a partir de su texto, como lo recibe Persist (ver
+ * Modelo::compilarArbol). Solo hay árboles con ID enteros positivos.
+ * @param id std::string con el ID
+ * @return ID, o 0 si el texto no es un ID válido
+ ** ***************************************************************************/
+static int idDe(const std::string& id)
+{
+    size_t fin = 0;
+    long n = 0;
+    try {
+        n = std::stol( id, &fin );
+    }
+    catch (...) {
+        return 0;
+    }
+
+    return (fin==id.size() && n>0 && n<=INT32_MAX) ? n : 0;
+}
+
+/** ***************************************************************************
+ * Constructor.
+ * @param m Métricas del servicio (si no se indican, se usan unas propias)
+ ** ***************************************************************************/
+PersistMemoria::PersistMemoria(std::shared_ptr<Metricas> m)
+    : metricas(m ? m : std::make_shared<Metricas>())
+{
+}
+
+/** ***************************************************************************
+ * Árbol de un ID. Quien la llama debe tener el mutex.
+ * @param id std::string con el ID
+ * @return El árbol, o nullptr si no existe
+ ** ***************************************************************************/
+const PersistMemoria::Arbol* PersistMemoria::buscar(const std::string& id)
+{
+    auto i = idDe(id);
+    return (i>0 && size_t(i)<=arboles.size()) ? &arboles[i-1] : nullptr;
+}
+
+/** ***************************************************************************
+ * Inserción de un JSON, deduplicado por su hash de 128 bits como en
+ * PersistSQLite (con la clave extendida por un contador si hay colisiones).
+ * @param json_to_save std::string con JSON del árbol a guardar
+ * @return ID del árbol guardado (o ya existente)
+ ** ***************************************************************************/
+int PersistMemoria::insert(const std::string& json_to_save)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    auto clave = hash128(json_to_save).bytes();
+    auto json = std::make_shared<const std::string>(json_to_save);
+
+    const std::lock_guard<std::mutex> lock( this->arboles_mutex );
+
+    for (int colisiones = 0; colisiones < 256; colisiones++)
+    {
+        if (colisiones)
+            clave.resize(16), clave.push_back((char)colisiones);
+
+        auto it = claves.find(clave);
+        if (it==claves.end()) {
+            arboles.push_back({std::move(json), clave});
+            claves[clave] = arboles.size();
+            metricas->consulta( Metricas::INSERT, std::chrono::steady_clock::now()-t0 );
+            return arboles.size();
+        }
+
+        if (*arboles[it->second-1].json == json_to_save) {
+            metricas->consulta( Metricas::INSERT, std::chrono::steady_clock::now()-t0 );
+            return it->second;
+        }
+    }
+
+    throw std::runtime_error ( "Error insertando el árbol: demasiadas colisiones de hash" );
+}
+
+/** ***************************************************************************
+ * Obtención del JSON de un árbol. Se entrega fuera del mutex.
+ * @param id std::string con ID del árbol a buscar
+ * @param lector Función que recibe el JSON del árbol (texto y largo)
+ ** ***************************************************************************/
+void PersistMemoria::select(const std::string id, const std::function<void(const char*, size_t)>& lector)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    std::shared_ptr<const std::string> json;
+    {
+        const std::lock_guard<std::mutex> lock( this->arboles_mutex );
+        if (auto arbol = buscar(id); arbol)
+            json = arbol->json;
+    }
+    metricas->consulta( Metricas::SELECT, std::chrono::steady_clock::now()-t0 );
+
+    if (! json)
+        throw std::runtime_error ( "No existe el árbol ID: " + id );
+
+    lector(json->data(), json->size());
+}
+
+/** ***************************************************************************
+ * @param id std::string con ID del árbol a buscar
+ * @return Clave (hash del JSON) del árbol
+ ** ***************************************************************************/
+std::string PersistMemoria::clave(const std::string id)
+{
+    const std::lock_guard<std::mutex> lock( this->arboles_mutex );
+    auto arbol = buscar(id);
+    if (! arbol)
+        throw std::runtime_error ( "No existe el árbol ID: " + id );
+    return arbol->clave;
+}
+
+/** ***************************************************************************
+ * @param limite Máximo de ID a obtener
+ * @return ID de los árboles, del más reciente al más antiguo
+ ** ***************************************************************************/
+std::vector<int> PersistMemoria::recientes(size_t limite)
+{
+    const std::lock_guard<std::mutex> lock( this->arboles_mutex );
+    std::vector<int> ids;
+    for (int id = arboles.size(); id > 0 && ids.size() < limite; id--)
+        ids.push_back(id);
+    return ids;
+}
+
+/** ***************************************************************************
+ * Recorrido de los árboles de un rango de ID, en orden. Cada JSON se entrega
+ * fuera del mutex.
+ * @param desde Primer ID a recorrer
+ * @param hasta Último ID a recorrer
+ * @param lector Función que recibe el ID y el JSON de cada árbol; si
+ *               devuelve false, el recorrido se detiene
+ ** ***************************************************************************/
+void PersistMemoria::recorrer(int desde, int hasta, const std::function<bool(int, const char*, size_t)>& lector)
+{
+    for (int id = std::max(desde, 1); id <= hasta; id++) {
+        std::shared_ptr<const std::string> json;
+        {
+            const std::lock_guard<std::mutex> lock( this->arboles_mutex );
+            if (size_t(id) > arboles.size())
+                return;
+            json = arboles[id-1].json;
+        }
+        if (! lector(id, json->data(), json->size()))
+            return;
+    }
+}
+
+
+/**
+ * Cabecera del archivo del registro.
+ */
+struct CabeceraLog {
+  char     magia[8];     //< "ARBOLLOG"
+  uint32_t version;      //< VERSION_LOG
+  uint32_t orden;        //< 0x01020304 escrito en el orden de bytes de la máquina
+};
+
+/**
+ * Cabecera de cada registro. La sigue el JSON, con relleno hasta múltiplo de 8.
+ */
+struct CabeceraRegistro {
+  uint32_t largo;        //< Bytes del JSON
+  uint32_t suma;         //< Suma de verificación de la clave y el JSON
+  uint8_t  largo_clave;  //< Bytes de la clave (16, o 17 si hubo colisiones)
+  char     clave[17];    //< Clave de deduplicación
+  char     relleno[6];
+};
+
+static const uint32_t VERSION_LOG = 1;
+
+static uint64_t alinear(uint64_t n)
+{
+    return (n+7) & ~uint64_t(7);
+}
+
+static uint32_t sumaRegistro(const std::string& clave, const char *json, size_t largo)
+{
+    return hash128(json, largo, hash128(clave.data(), clave.size()).h1).h1;
+}
+
+/** ***************************************************************************
+ * Escritura completa de un buffer en una posición del archivo.
+ * @param fd Descriptor del archivo
+ * @param datos Datos a escribir
+ * @param largo Bytes a escribir
+ * @param posicion Posición en el archivo
+ ** ***************************************************************************/
+static void escribirTodo(int fd, const void *datos, size_t largo, uint64_t posicion)
+{
+    auto p = static_cast<const char*>(datos);
+    while (largo > 0) {
+        auto n = pwrite(fd, p, largo, posicion);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error ( std::string("Error escribiendo el registro: ").append(strerror(errno)) );
+        p += n;
+        largo -= n;
+        posicion += n;
+    }
+}
+
+/** ***************************************************************************
+ * Mapeo del archivo, de solo lectura. Puede ser más largo que el archivo:
+ * solo se leen las posiciones ya escritas.
+ * @param fd Descriptor del archivo
+ * @param largo Bytes a mapear
+ ** ***************************************************************************/
+PersistLog::Mapa::Mapa(int fd, size_t l)
+    : largo(l)
+{
+    void *p = mmap(NULL, largo, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        throw std::runtime_error ( std::string("Error mapeando el registro: ").append(strerror(errno)) );
+    datos = static_cast<const char*>(p);
+}
+
+PersistLog::Mapa::~Mapa()
+{
+    munmap(const_cast<char*>(datos), largo);
+}
+
+/** ***************************************************************************
+ * Constructor. Abre (o crea) el archivo del registro y arma el índice.
+ * Configuración (variables de entorno):
+ *  - RESTFUL_DB: archivo del registro
+ *  - RESTFUL_DB_SYNCHRONOUS: con OFF no se hace fdatasync tras cada escritura
+ * @param m Métricas del servicio (si no se indican, se usan unas propias)
+ ** ***************************************************************************/
+PersistLog::PersistLog(std::shared_ptr<Metricas> m)
+    : metricas(m ? m : std::make_shared<Metricas>()), fd(-1), fin(0)
+{
+    char const *name = getenv("RESTFUL_DB");
+    if ( ! name )
+        name = "restful.db";
+    db_name = name;
+
+    char const *synchronous = getenv("RESTFUL_DB_SYNCHRONOUS");
+    if ( ! synchronous )
+        synchronous = "FULL";
+
+    // Estas excepciones deben llegar a MAIN, no capturar antes.
+    auto sync = std::string(synchronous);
+    if (sync!="OFF" && sync!="NORMAL" && sync!="FULL" && sync!="EXTRA")
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_DB_SYNCHRONOUS: ").append(sync) );
+    sincronizar = sync!="OFF";
+
+    fd = open(db_name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error ( "Error abriendo el registro " + db_name + ": " + strerror(errno) );
+
+    try {
+        abrir();
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+/** ***************************************************************************
+ * Validación de un registro del archivo: cabecera, largo y suma de
+ * verificación.
+ * @param datos Contenido del archivo
+ * @param posicion Posición de la cabecera del registro
+ * @param largo Bytes del archivo
+ * @param r Cabecera leída
+ * @return Si el registro está completo y es válido
+ ** ***************************************************************************/
+static bool registroValido(const char *datos, uint64_t posicion, uint64_t largo, CabeceraRegistro& r)
+{
+    if (posicion + sizeof(r) > largo)
+        return false;
+    memcpy(&r, datos+posicion, sizeof(r));
+    auto json = posicion + sizeof(r);
+    if ((r.largo_clave!=16 && r.largo_clave!=17) || alinear(r.largo) > largo-json)
+        return false;
+    return sumaRegistro(std::string(r.clave, r.largo_clave), datos+json, r.largo) == r.suma;
+}
+
+/** ***************************************************************************
+ * Lectura del registro al abrirlo: valida la cabecera (o la escribe, si el
+ * archivo es nuevo) y recorre los registros armando el índice. Un registro
+ * dañado (incompleto, con la cabecera o el largo erróneos, o con la suma de
+ * verificación errónea) es una escritura interrumpida solo si no le sigue
+ * ningún registro válido: entonces se descarta junto con lo que le sigue.
+ * Si hay registros válidos después, el archivo está dañado: no se abre, en
+ * vez de truncarlo y perderlos.
+ ** ***************************************************************************/
+void PersistLog::abrir(void)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error ( "Error leyendo el registro " + db_name + ": " + strerror(errno) );
+
+    uint64_t largo = st.st_size;
+
+    if (largo == 0) {
+        CabeceraLog c = {};
+        memcpy(c.magia, "ARBOLLOG", 8);
+        c.version = VERSION_LOG;
+        c.orden = 0x01020304;
+        escribirTodo(fd, &c, sizeof(c), 0);
+        largo = sizeof(c);
+    }
+
+    mapear(largo);
+
+    CabeceraLog c;
+    if (largo < sizeof(c) || (memcpy(&c, mapa->datos, sizeof(c)), memcmp(c.magia, "ARBOLLOG", 8)!=0)
+        || c.version!=VERSION_LOG || c.orden!=0x01020304)
+        throw std::runtime_error ( "El archivo " + db_name + " no es un registro de árboles (RESTFUL_BACKEND=log)" );
+
+    uint64_t posicion = sizeof(c);
+    CabeceraRegistro r;
+
+    for (; posicion < largo; posicion += sizeof(r) + alinear(r.largo))
+    {
+        if (registroValido(mapa->datos, posicion, largo, r)) {
+            std::string clave(r.clave, r.largo_clave);
+            registros.push_back({posicion + sizeof(r), r.largo, clave});
+            claves[clave] = registros.size();
+            continue;
+        }
+
+        // Los registros se escriben uno tras otro: si alguno válido sigue a
+        // este, no es una escritura interrumpida (el largo no es confiable,
+        // así que se busca en todas las posiciones alineadas)
+        CabeceraRegistro siguiente;
+        for (auto p = posicion+8; p + sizeof(siguiente) <= largo; p += 8)
+            if (registroValido(mapa->datos, p, largo, siguiente))
+                throw std::runtime_error ( "El registro " + db_name + " está dañado en el byte " + std::to_string(posicion) );
+        break;
+    }
+
+    if (posicion < largo) {
+        std::cerr << "Registro " << db_name << ": se descartan " << largo-posicion
+                  << " bytes de una escritura incompleta al final" << std::endl;
+        if (ftruncate(fd, posicion) != 0)
+            throw std::runtime_error ( "Error truncando el registro " + db_name + ": " + strerror(errno) );
+    }
+
+    fin = posicion;
+}
+
+/** ***************************************************************************
+ * Mapea de nuevo el archivo si el mapeo actual no llega hasta la posición
+ * dada. El mapeo se agranda al menos al doble, para no rehacerlo en cada
+ * escritura. Quien la llama debe tener el mutex del índice.
+ * @param hasta Posición que debe quedar mapeada
+ ** ***************************************************************************/
+void PersistLog::mapear(uint64_t hasta)
+{
+    if (mapa && mapa->largo >= hasta)
+        return;
+
+    const uint64_t pagina = sysconf(_SC_PAGESIZE);
+    uint64_t largo = std::max<uint64_t>(hasta, mapa ? 2*mapa->largo : 1024*1024);
+    largo = (largo + pagina-1) / pagina * pagina;
+
+    mapa = std::make_shared<Mapa>(fd, largo);
+}
+
+/** ***************************************************************************
+ * Registro de un ID, con el mapeo que lo contiene.
+ * @param id ID del árbol
+ * @param m Mapeo a usar para leer el JSON
+ * @param r Registro del árbol
+ * @return Si el árbol existe
+ ** ***************************************************************************/
+bool PersistLog::leer(int id, std::shared_ptr<Mapa>& m, Registro& r)
+{
+    const std::lock_guard<std::mutex> lock( this->indice_mutex );
+    if (id<=0 || size_t(id)>registros.size())
+        return false;
+    m = mapa;
+    r = registros[id-1];
+    return true;
+}
+
+/** ***************************************************************************
+ * Inserción de un JSON al final del registro, deduplicado por su hash de 128
+ * bits como en PersistSQLite. El ID se entrega recién con el registro
+ * escrito (y, salvo con RESTFUL_DB_SYNCHRONOUS=OFF, confirmado en disco).
+ * @param json_to_save std::string con JSON del árbol a guardar
+ * @return ID del árbol guardado (o ya existente)
+ ** ***************************************************************************/
+int PersistLog::insert(const std::string& json_to_save)
+{
+    return agregar(1, [&json_to_save] (size_t) -> const std::string& { return json_to_save; })[0];
+}
+
+/** ***************************************************************************
+ * Inserción de varios JSON con un único fdatasync al final.
+ * @param jsons JSON de los árboles a guardar
+ * @return ID de cada árbol, en el mismo orden
+ ** ***************************************************************************/
+std::vector<int> PersistLog::insertLote(const std::vector<std::string>& jsons)
+{
+    return agregar(jsons.size(), [&jsons] (size_t i) -> const std::string& { return jsons[i]; });
+}
+
+/** ***************************************************************************
+ * Escritura de varios JSON al final del registro. Los registros nuevos se
+ * agregan al índice (y sus ID se entregan) recién después de confirmarlos
+ * todos en disco. Si algo falla no se agregan, y el archivo se trunca donde
+ * terminaba: una escritura posterior más corta no debe dejar detrás restos
+ * de esta, que al abrirlo se tomarían por registros dañados o válidos.
+ * @param n Cantidad de JSON
+ * @param texto Función que devuelve el JSON i-ésimo
+ * @return ID de cada JSON, en el mismo orden
+ ** ***************************************************************************/
+std::vector<int> PersistLog::agregar(size_t n, const std::function<const std::string&(size_t)>& texto)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    const std::lock_guard<std::mutex> escritura( this->escritura_mutex );
+    auto t1 = std::chrono::steady_clock::now();
+    metricas->espera( Metricas::ESCRITURA, t1-t0 );
+
+    std::vector<int> ids;
+    std::vector<Registro> nuevos;
+    std::unordered_map<std::string, size_t> claves_nuevas; //< Clave -> posición en la entrada, de los registros nuevos
+    uint64_t posicion = fin;
+    int siguiente;
+    {
+        const std::lock_guard<std::mutex> lock( this->indice_mutex );
+        siguiente = registros.size()+1;
+    }
+
+    try {
+        for (size_t i = 0; i < n; i++)
+        {
+            auto& json_to_save = texto(i);
+            if (json_to_save.size() > UINT32_MAX)
+                throw std::runtime_error ( "Error insertando el árbol: el JSON es demasiado largo para el registro" );
+
+            auto t2 = std::chrono::steady_clock::now();
+            auto clave = hash128(json_to_save).bytes();
+
+            // Solo este hilo agrega registros, así que lo leído del índice no cambia
+            int id = 0;
+            bool libre = false;
+            for (int colisiones = 0; colisiones < 256 && ! libre && ! id; colisiones++)
+            {
+                if (colisiones)
+                    clave.resize(16), clave.push_back((char)colisiones);
+
+                if (auto it = claves_nuevas.find(clave); it!=claves_nuevas.end()) {
+                    if (texto(it->second) == json_to_save)
+                        id = ids[it->second];
+                    continue;
+                }
+
+                const std::lock_guard<std::mutex> lock( this->indice_mutex );
+                auto it = claves.find(clave);
+                if (it==claves.end())
+                    libre = true;
+                else {
+                    auto& r = registros[it->second-1];
+                    if (r.largo==json_to_save.size() && ! memcmp(mapa->datos+r.posicion, json_to_save.data(), r.largo))
+                        id = it->second;
+                }
+            }
+
+            if (! id && ! libre)
+                throw std::runtime_error ( "Error insertando el árbol: demasiadas colisiones de hash" );
+
+            if (! id) {
+                CabeceraRegistro c = {};
+                c.largo = json_to_save.size();
+                c.suma = sumaRegistro(clave, json_to_save.data(), json_to_save.size());
+                c.largo_clave = clave.size();
+                memcpy(c.clave, clave.data(), clave.size());
+
+                static const char relleno[8] = {};
+                auto datos = posicion + sizeof(c);
+                escribirTodo(fd, &c, sizeof(c), posicion);
+                escribirTodo(fd, json_to_save.data(), json_to_save.size(), datos);
+                escribirTodo(fd, relleno, alinear(c.largo)-c.largo, datos+c.largo);
+
+                id = siguiente + nuevos.size();
+                nuevos.push_back({datos, c.largo, clave});
+                claves_nuevas[clave] = i;
+                posicion = datos + alinear(c.largo);
+            }
+
+            ids.push_back(id);
+            metricas->consulta( Metricas::INSERT, std::chrono::steady_clock::now()-t2 );
+        }
+
+        if (! nuevos.empty() && sincronizar && fdatasync(fd) != 0)
+            throw std::runtime_error ( std::string("Error confirmando el registro: ").append(strerror(errno)) );
+    }
+    catch (...) {
+        // Una escritura puede haber quedado a medias, aunque posicion no haya avanzado
+        if (ftruncate(fd, fin) != 0)
+            std::cerr << "Registro " << db_name << ": no se pudo descartar una escritura fallida: "
+                      << strerror(errno) << std::endl;
+        throw;
+    }
+
+    if (nuevos.empty())
+        return ids;
+
+    {
+        const std::lock_guard<std::mutex> lock( this->indice_mutex );
+        mapear(posicion);
+        for (auto& r : nuevos) {
+            registros.push_back(std::move(r));
+            claves[registros.back().clave] = registros.size();
+        }
+    }
+    fin = posicion;
+
+    return ids;
+}
+
+/** ***************************************************************************
+ * Obtención del JSON de un árbol directamente del archivo mapeado, sin
+ * copiarlo ni tomar ningún mutex durante la lectura.
+ * @param id std::string con ID del árbol a buscar
+ * @param lector Función que recibe el JSON del árbol (texto y largo)
+ ** ***************************************************************************/
+void PersistLog::select(const std::string id, const std::function<void(const char*, size_t)>& lector)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    std::shared_ptr<Mapa> m;
+    Registro r;
+    bool existe = leer(idDe(id), m, r);
+    metricas->consulta( Metricas::SELECT, std::chrono::steady_clock::now()-t0 );
+
+    if (! existe)
+        throw std::runtime_error ( "No existe el árbol ID: " + id );
+
+    lector(m->datos + r.posicion, r.largo);
+}
+
+/** ***************************************************************************
+ * @param id std::string con ID del árbol a buscar
+ * @return Clave (hash del JSON) del árbol
+ ** ***************************************************************************/
+std::string PersistLog::clave(const std::string id)
+{
+    std::shared_ptr<Mapa> m;
+    Registro r;
+    if (! leer(idDe(id), m, r))
+        throw std::runtime_error ( "No existe el árbol ID: " + id );
+    return r.clave;
+}
+
+/** ***************************************************************************
+ * @param limite Máximo de ID a obtener
+ * @return ID de los árboles, del más reciente al más antiguo
+ ** ***************************************************************************/
+std::vector<int> PersistLog::recientes(size_t limite)
+{
+    const std::lock_guard<std::mutex> lock( this->indice_mutex );
+    std::vector<int> ids;
+    for (int id = registros.size(); id > 0 && ids.size() < limite; id--)
+        ids.push_back(id);
+    return ids;
+}
+
+/** ***************************************************************************
+ * Recorrido de los árboles de un rango de ID, en orden, directamente del
+ * archivo mapeado (ver select()).
+ * @param desde Primer ID a recorrer
+ * @param hasta Último ID a recorrer
+ * @param lector Función que recibe el ID y el JSON de cada árbol; si
+ *               devuelve false, el recorrido se detiene
+ ** ***************************************************************************/
+void PersistLog::recorrer(int desde, int hasta, const std::function<bool(int, const char*, size_t)>& lector)
+{
+    std::shared_ptr<Mapa> m;
+    Registro r;
+    for (int id = std::max(desde, 1); id <= hasta && leer(id, m, r); id++)
+        if (! lector(id, m->datos + r.posicion, r.largo))
+            return;
+}
+
+/** ***************************************************************************
+ * Destructor. Libera el mapeo (cuando termine la última lectura) y cierra el
+ * archivo.
+ ** ***************************************************************************/
+PersistLog::~PersistLog()
+{
+    mapa.reset();
+    close(fd);
+}
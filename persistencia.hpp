@@ -0,0 +1,100 @@
+#ifndef _PERSISTENCIA_HPP_
+#define _PERSISTENCIA_HPP_
+
+#include <cstdint>   // uint64_t
+#include <functional> // std::function
+#include <memory>    // shared_ptr
+#include <mutex>     // mutex
+#include <string>    // std::string
+#include <unordered_map> // std::unordered_map
+#include <vector>    // std::vector
+#include "restful.hpp" // Persist
+#include "metricas.hpp" // Metricas
+
+
+/**
+ * Backend de persistencia en memoria: un mapa de hash a ID y los JSON por
+ * ID. No hay durabilidad (todo se pierde al terminar), por lo que sirve
+ * para benchmarks y despliegues efímeros. Los JSON se guardan en
+ * shared_ptr, de modo que select() los entrega fuera del mutex.
+ */
+class PersistMemoria : public Persist {
+private:
+  struct Arbol {
+    std::shared_ptr<const std::string> json;  //< JSON guardado
+    std::string                        clave; //< Clave de deduplicación
+  };
+  std::shared_ptr<Metricas> metricas;            //< Tiempos de las operaciones
+  std::vector<Arbol> arboles;                    //< Árboles, el ID i en la posición i-1
+  std::unordered_map<std::string, int> claves;   //< Clave -> ID
+  std::mutex arboles_mutex;                      //< Protege arboles y claves
+  const Arbol* buscar(const std::string&);
+public:
+  explicit PersistMemoria(std::shared_ptr<Metricas> = nullptr);
+  using Persist::select;
+  int insert (const std::string&) override;
+  void select (const std::string, const std::function<void(const char*, size_t)>&) override;
+  std::string clave (const std::string) override;
+  std::vector<int> recientes (size_t) override;
+  void recorrer (int, int, const std::function<bool(int, const char*, size_t)>&) override;
+  std::string archivo(void) const override { return ""; } //< Sin archivo
+};
+
+
+/**
+ * Backend de persistencia en un registro (log) de solo agregado. Cada árbol
+ * es un registro con su clave, su largo, una suma de verificación y el JSON;
+ * su ID es su número de registro. En memoria se mantiene solo un índice (ID
+ * -> posición, clave -> ID), y el archivo se lee mapeado con mmap, sin
+ * copiar los JSON. Las escrituras se serializan y, salvo con
+ * RESTFUL_DB_SYNCHRONOUS=OFF, cada una (o cada lote, ver insertLote) se
+ * confirma con fdatasync antes de devolver los ID. Al abrir, un registro incompleto al final del archivo (una
+ * escritura interrumpida) se descarta; un registro dañado con otros válidos
+ * después impide abrirlo.
+ */
+class PersistLog : public Persist {
+private:
+  /**
+   * Archivo mapeado. Al crecer el archivo se mapea de nuevo, y el mapeo
+   * anterior se libera cuando termina la última lectura que lo usa.
+   */
+  struct Mapa {
+    const char *datos;
+    size_t      largo;
+    Mapa(int, size_t);
+    ~Mapa();
+  };
+  struct Registro {
+    uint64_t posicion; //< Posición del JSON en el archivo
+    uint32_t largo;    //< Bytes del JSON
+    std::string clave; //< Clave de deduplicación
+  };
+  std::shared_ptr<Metricas> metricas;           //< Tiempos de las operaciones
+  std::string db_name;                          //< Archivo del registro
+  int         fd;                               //< Descriptor del archivo
+  bool        sincronizar;                      //< Si se hace fdatasync tras cada escritura
+  uint64_t    fin;                              //< Fin de los datos válidos del archivo
+  std::shared_ptr<Mapa> mapa;                   //< Archivo mapeado
+  std::vector<Registro> registros;              //< Registros, el ID i en la posición i-1
+  std::unordered_map<std::string, int> claves;  //< Clave -> ID
+  std::mutex indice_mutex;                      //< Protege mapa, registros y claves
+  std::mutex escritura_mutex;                   //< Serializa las escrituras
+  void abrir(void);
+  void mapear(uint64_t);
+  bool leer(int, std::shared_ptr<Mapa>&, Registro&);
+  std::vector<int> agregar(size_t, const std::function<const std::string&(size_t)>&);
+public:
+  explicit PersistLog(std::shared_ptr<Metricas> = nullptr);
+  ~PersistLog();
+  using Persist::select;
+  int insert (const std::string&) override;
+  std::vector<int> insertLote (const std::vector<std::string>&) override;
+  void select (const std::string, const std::function<void(const char*, size_t)>&) override;
+  std::string clave (const std::string) override;
+  std::vector<int> recientes (size_t) override;
+  void recorrer (int, int, const std::function<bool(int, const char*, size_t)>&) override;
+  std::string archivo(void) const override { return db_name; } //< Archivo del registro
+};
+
+
+#endif
@@ -5,6 +5,8 @@
 
 namespace d
 {
+    typedef std::chrono::steady_clock reloj; //< Reloj para medir las solicitudes
+
     /**
      * Clase para implementar plugins que sirvan como recursos de restbed.
      * La principal diferencia es el acceso al control, necesario en el
@@ -14,6 +16,7 @@ namespace d
     {
     private:
         std::shared_ptr< Control > control;
+        Metricas::Ruta ruta = Metricas::RUTAS; //< Ruta en las métricas (RUTAS: sin métricas)
     public:
         virtual void handler(const std::shared_ptr< restbed::Session> session)=0;
         void setControl (std::shared_ptr< Control > c)
@@ -24,6 +27,159 @@ namespace d
             {
                 return this->control;
             }
+        void setRuta (Metricas::Ruta r)
+            {
+                this->ruta = r;
+            }
+        /**
+         * Registra la solicitud en las métricas.
+         */
+        void registrar(const reloj::time_point inicio, const int estado)
+            {
+                if (this->ruta != Metricas::RUTAS)
+                    this->control->getMetricas()->solicitud( this->ruta, estado, reloj::now()-inicio );
+            }
+        /**
+         * Envía la respuesta y mantiene o cierra la conexión según la
+         * política de conexiones persistentes (keep-alive). Con tiempos por
+         * fase, agrega Server-Timing y registra la solicitud si fue lenta.
+         */
+        void responder(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                       const int estado, const std::string& cuerpo,
+                       const std::multimap< std::string, std::string >& cabeceras,
+                       const Tiempos *tiempos = nullptr)
+            {
+                registrar( inicio, estado );
+                if (tiempos) {
+                    auto con_tiempos = cabeceras;
+                    tiempos->terminar( this->ruta, estado, con_tiempos );
+                    this->control->replyInterface( session, estado, cuerpo, con_tiempos );
+                }
+                else
+                    this->control->replyInterface( session, estado, cuerpo, cabeceras );
+            }
+        /**
+         * Pasa el trabajo de la solicitud (que incluye enviar la respuesta)
+         * al pool de cálculo. Si la cola está llena, responde enseguida
+         * 503 con Retry-After.
+         */
+        void calcular(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                      const std::shared_ptr< Tiempos >& tiempos, std::function< void(void) > calculo)
+            {
+                auto tarea = [tiempos, calculo = std::move(calculo), encolada = reloj::now()] ()
+                    {
+                        if (tiempos)
+                            tiempos->sumar("cola", reloj::now()-encolada);
+                        calculo();
+                    };
+
+                if (! this->control->computeInterface( std::move(tarea) )) {
+                    auto msg = std::string("Servidor ocupado, reintente más tarde");
+                    this->responder( session, inicio, restbed::SERVICE_UNAVAILABLE, msg, {
+                            {"Content-Length", std::to_string(msg.length())},
+                            {"Retry-After", std::to_string(this->control->getRetryAfter())}
+                        }, tiempos.get() );
+                }
+            }
+        /**
+         * Envía la respuesta y cierra la conexión (cuando no se puede seguir
+         * leyendo de ella, por ejemplo tras un cuerpo rechazado).
+         */
+        void cerrar(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                    const int estado, const std::string& cuerpo,
+                    const std::multimap< std::string, std::string >& cabeceras,
+                    const Tiempos *tiempos = nullptr)
+            {
+                registrar( inicio, estado );
+                if (tiempos) {
+                    auto con_tiempos = cabeceras;
+                    tiempos->terminar( this->ruta, estado, con_tiempos );
+                    session->close( estado, cuerpo, con_tiempos );
+                }
+                else
+                    session->close( estado, cuerpo, cabeceras );
+            }
+    };
+
+    /**
+     * Plugin para las consultas sobre un árbol por GET, con la búsqueda en
+     * JSON en el parámetro q (como ancestro-comun). Cada consulta implementa
+     * consultar(), que recibe la búsqueda y devuelve el resultado; la
+     * respuesta es {"<campo>":<resultado>}, y ante cualquier error se
+     * responde BAD REQUEST.
+     */
+    class PluginConsulta : public Plugin
+    {
+    private:
+        std::string campo; //< Campo de la respuesta con el resultado
+    public:
+        explicit PluginConsulta(const std::string& c) : campo(c) {}
+        virtual std::shared_ptr< json > consultar(const json& busqueda, Tiempos *tiempos)=0;
+        void handler(const std::shared_ptr< restbed::Session > session)
+            {
+                const auto inicio = reloj::now();
+                const auto tiempos = this->getControl()->timingInterface(inicio);
+                const auto request = session->get_request();
+
+                std::string qValue;
+                {
+                    Tiempos::Fase fase(tiempos.get(), "q");
+                    qValue = request->get_query_parameter("q", "");
+                }
+
+                if (qValue == "") {
+                    auto msg = std::string("Campo de solicitud vacío (q)");
+                    this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                            {"Content-Length", std::to_string(msg.length())}
+                        }, tiempos.get());
+                    return;
+                }
+
+                this->calcular(session, inicio, tiempos, [this, session, inicio, tiempos, qValue] () {
+                        atender(session, inicio, tiempos.get(), qValue);
+                    });
+            }
+        /**
+         * Resuelve la consulta y responde (en el pool de cálculo).
+         */
+        void atender(const std::shared_ptr< restbed::Session > session, const reloj::time_point inicio,
+                     Tiempos *tiempos, const std::string& qValue)
+            {
+                std::string msg;
+                try {
+                    auto t0 = reloj::now();
+                    auto q = json::parse(qValue);
+                    auto t = reloj::now()-t0;
+                    this->getControl()->getMetricas()->parseo(Metricas::PEDIDO, t);
+                    if (tiempos)
+                        tiempos->sumar("parse", t);
+
+                    auto resultado = consultar(q, tiempos);
+
+                    std::string response_string;
+                    {
+                        Tiempos::Fase fase(tiempos, "respuesta");
+                        json response;
+                        response[campo] = std::move(*resultado);
+                        response_string = response.dump();
+                    }
+                    this->responder(session, inicio, restbed::OK, response_string, {
+                            {"Content-Type", "application/json"},
+                            {"Content-Length", std::to_string(response_string.length())}
+                        }, tiempos);
+                    return;
+                }
+                catch (std::exception& e) {
+                    msg = std::string("Ocurrió un error al procesar la solicitud: ").append(e.what());
+                }
+                catch (...) {
+                    msg = "Ocurrió un error al procesar la solicitud.";
+                }
+
+                this->responder(session, inicio, restbed::BAD_REQUEST, msg, {
+                        {"Content-Length", std::to_string(msg.length())}
+                    }, tiempos);
+            }
     };
 
     /**
@@ -0,0 +1,167 @@
+#include <algorithm> // std::min
+#include <iostream>  // std::cerr
+#include "pool.hpp"
+
+
+
+/** ***************************************************************************
+ * Constructor. Inicia los hilos.
+ * @param n Cantidad de hilos (0: las tareas se ejecutan al enviarlas)
+ * @param c Capacidad de la cola: máximo de tareas esperando
+ * @param m Métricas donde registrar la espera de las tareas
+ ** ***************************************************************************/
+PoolCalculo::PoolCalculo(size_t n, size_t c, std::shared_ptr<Metricas> m)
+    : metricas(m ? m : std::make_shared<Metricas>()), capacidad(c), pendientes(0), turno(0), terminar(false)
+{
+    for (size_t i = 0; i < n; i++)
+        colas.push_back(std::make_unique<Cola>());
+
+    for (size_t i = 0; i < n; i++)
+        hilos.emplace_back(&PoolCalculo::trabajar, this, i);
+}
+
+/** ***************************************************************************
+ * Destructor. Los hilos ejecutan las tareas que queden antes de terminar.
+ ** ***************************************************************************/
+PoolCalculo::~PoolCalculo()
+{
+    {
+        const std::lock_guard<std::mutex> lock( this->espera_mutex );
+        terminar = true;
+    }
+    espera_cv.notify_all();
+
+    for (auto& h : hilos)
+        h.join();
+}
+
+/** ***************************************************************************
+ * Envía una tarea al pool.
+ * @param tarea Tarea a ejecutar
+ * @return false si la cola está llena y la tarea se descartó
+ ** ***************************************************************************/
+bool PoolCalculo::enviar(Tarea tarea)
+{
+    if (hilos.empty()) {
+        tarea();
+        return true;
+    }
+
+    // Se reserva el lugar antes de encolar, para no pasarse de la capacidad
+    if (pendientes.fetch_add(1) >= capacidad) {
+        pendientes--;
+        return false;
+    }
+
+    auto& cola = *colas[turno++ % colas.size()];
+    {
+        const std::lock_guard<std::mutex> lock( cola.mutex );
+        cola.tareas.push_back({std::move(tarea), reloj::now()});
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock( this->espera_mutex );
+    }
+    espera_cv.notify_one();
+
+    return true;
+}
+
+/** ***************************************************************************
+ * Ejecuta f(0), ..., f(n-1) repartidas entre el hilo que llama y los hilos
+ * del pool que estén libres, y vuelve cuando terminaron todas. Puede
+ * llamarse desde una tarea del pool: el que llama toma partes igual que los
+ * ayudantes y solo espera a las que ya empezó otro hilo, así que no se
+ * bloquea aunque los ayudantes sigan en la cola (o no entren, si está
+ * llena); los que empiezan tarde no encuentran nada que hacer.
+ * @param n Cantidad de partes
+ * @param f Función que ejecuta una parte (no debe lanzar excepciones)
+ ** ***************************************************************************/
+void PoolCalculo::repartir(size_t n, const std::function<void(size_t)>& f)
+{
+    struct Reparto {
+      size_t                  n;
+      const std::function<void(size_t)>* f; //< Solo se usa mientras quedan partes
+      std::atomic<size_t>     siguiente{0};
+      size_t                  hechas = 0;
+      std::mutex              mutex;
+      std::condition_variable cv;
+    };
+    auto reparto = std::make_shared<Reparto>();
+    reparto->n = n;
+    reparto->f = &f;
+
+    auto trabajar = [reparto] () {
+        for (size_t i; (i = reparto->siguiente++) < reparto->n; ) {
+            (*reparto->f)(i);
+            const std::lock_guard<std::mutex> lock( reparto->mutex );
+            if (++reparto->hechas == reparto->n)
+                reparto->cv.notify_all();
+        }
+    };
+
+    for (size_t h = 1; h < std::min(hilos.size(), n); h++)
+        if (! enviar(trabajar))
+            break;
+    trabajar();
+
+    std::unique_lock<std::mutex> lock( reparto->mutex );
+    reparto->cv.wait(lock, [&reparto] { return reparto->hechas == reparto->n; });
+}
+
+/** ***************************************************************************
+ * Toma la próxima tarea para un hilo: la más antigua de su cola o, si está
+ * vacía, la más antigua de la primera otra cola que tenga.
+ * @param propia Cola del hilo
+ * @param encolada Tarea tomada
+ * @return false si no había tareas
+ ** ***************************************************************************/
+bool PoolCalculo::tomar(size_t propia, Encolada& encolada)
+{
+    for (size_t i = 0; i < colas.size(); i++)
+    {
+        auto& cola = *colas[(propia+i) % colas.size()];
+        const std::lock_guard<std::mutex> lock( cola.mutex );
+        if (! cola.tareas.empty()) {
+            encolada = std::move(cola.tareas.front());
+            cola.tareas.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/** ***************************************************************************
+ * Ciclo de cada hilo: ejecuta tareas mientras haya, y si no, espera.
+ * @param propia Cola del hilo
+ ** ***************************************************************************/
+void PoolCalculo::trabajar(size_t propia)
+{
+    Encolada encolada;
+
+    while (true)
+    {
+        if (tomar(propia, encolada)) {
+            pendientes--;
+            metricas->cola(reloj::now()-encolada.llegada);
+            try {
+                encolada.tarea();
+            }
+            catch (std::exception& e) {
+                std::cerr << "Error en una tarea del pool de cálculo: " << e.what() << std::endl;
+            }
+            catch (...) {
+                std::cerr << "Error inesperado en una tarea del pool de cálculo" << std::endl;
+            }
+            encolada.tarea = nullptr;
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock( this->espera_mutex );
+        if (terminar && pendientes==0)
+            return;
+        // Una tarea reservada puede no estar encolada todavía: se vuelve a buscar
+        espera_cv.wait(lock, [this] { return terminar || pendientes>0; });
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef _POOL_HPP_
+#define _POOL_HPP_
+
+#include <atomic>    // std::atomic
+#include <chrono>    // std::chrono::steady_clock
+#include <condition_variable> // std::condition_variable
+#include <deque>     // std::deque
+#include <functional> // std::function
+#include <memory>    // std::unique_ptr
+#include <mutex>     // std::mutex
+#include <thread>    // std::thread
+#include <vector>    // std::vector
+#include "metricas.hpp" // Metricas
+
+
+/**
+ * Pool de hilos de cálculo, separado de los hilos de restbed (que atienden
+ * la E/S de las conexiones), con una cola acotada. Cada hilo tiene su propia
+ * cola: las tareas nuevas se reparten entre ellas por turno, cada hilo toma
+ * de la suya en orden de llegada y, si está vacía, roba la tarea más antigua
+ * de otra (work stealing), de modo que una tarea larga no demora a las que
+ * quedaron detrás en la misma cola. Si ya hay tantas tareas esperando como
+ * la capacidad, enviar() las rechaza en lugar de encolarlas, para que quien
+ * la llama responda enseguida (503) en vez de acumular trabajo sin límite.
+ * Con 0 hilos no hay pool y las tareas se ejecutan en el hilo que las envía.
+ */
+class PoolCalculo {
+public:
+  typedef std::function<void()> Tarea;
+
+private:
+  typedef std::chrono::steady_clock reloj;
+  struct Encolada {
+    Tarea             tarea;
+    reloj::time_point llegada; //< Para medir la espera en la cola
+  };
+  struct Cola {
+    std::mutex            mutex;
+    std::deque<Encolada>  tareas;
+  };
+
+  std::shared_ptr<Metricas>           metricas;   //< Espera en la cola
+  std::vector< std::unique_ptr<Cola> > colas;     //< Una cola por hilo
+  std::vector<std::thread>            hilos;
+  size_t                              capacidad;  //< Máximo de tareas esperando
+  std::atomic<size_t>                 pendientes; //< Tareas esperando (reservadas o en alguna cola)
+  std::atomic<size_t>                 turno;      //< Próxima cola para una tarea nueva
+  std::mutex                          espera_mutex; //< Protege terminar, junto con espera_cv
+  std::condition_variable             espera_cv;  //< Despierta a los hilos sin tareas
+  bool                                terminar;   //< Pide a los hilos que vacíen las colas y terminen
+  bool tomar(size_t, Encolada&);
+  void trabajar(size_t);
+
+public:
+  PoolCalculo(size_t, size_t, std::shared_ptr<Metricas> = nullptr);
+  ~PoolCalculo();
+  bool enviar(Tarea);
+  void repartir(size_t, const std::function<void(size_t)>&);
+  size_t cantidad(void) const { return pendientes.load(std::memory_order_relaxed); } //< Tareas esperando
+  size_t tamanio(void) const { return hilos.size(); }                                //< Cantidad de hilos
+};
+
+
+#endif
@@ -0,0 +1,50 @@
+#include "plugin.hpp"
+
+// 'using namespace' is bad, usually, but this source
+// is tiny and not to be used by any other sources.
+
+using namespace d;
+
+/**
+ * Plugin especializado Profundidad: profundidad de un nodo, {"id":<id>,"node":<node>}
+ */
+class Profundidad : public PluginConsulta
+{
+public:
+    Profundidad() : PluginConsulta("depth") {}
+    std::shared_ptr< json > consultar(const json& busqueda, Tiempos *tiempos)
+        {
+            return this->getControl()->depthInterface(busqueda, tiempos);
+        }
+};
+
+/**
+ * Factoría especializada para el plugin
+ */
+class FactoriaProfundidad : public PluginFactory
+{
+public:
+    std::shared_ptr< restbed::Resource > get( std::shared_ptr< Control > c );
+};
+
+/**
+ * Getter principal del Plugin
+ */
+std::shared_ptr< restbed::Resource > FactoriaProfundidad::get( std::shared_ptr< Control > c )
+{
+    auto r=std::make_shared< Profundidad > ();
+
+    r->setControl( c );
+    r->setRuta( Metricas::PROFUNDIDAD );
+    r->set_path( "/profundidad" );
+
+    auto f = std::bind(&Profundidad::handler, r, std::placeholders::_1);
+    r->set_method_handler( "GET",  f);
+
+    return r;
+}
+
+/**
+ * Objeto Global para Acceder a la biblioteca
+ */
+FactoriaProfundidad pluginFactory;
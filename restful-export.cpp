@@ -0,0 +1,115 @@
+#include <chrono>
+#include <climits>   // INT_MAX
+#include <cstdio>    // fopen, fwrite
+#include <cstring>   // strncmp, strerror
+#include <cerrno>    // errno
+#include <iostream>
+#include "restful.hpp"
+
+
+
+/*
+ * Exportación masiva de árboles sin el servidor: escribe los árboles
+ * guardados en la base de datos configurada como para el servidor
+ * (RESTFUL_DB, RESTFUL_BACKEND...), en orden de ID, en el archivo indicado
+ * o en la salida estándar (sin archivo, o con "-"). Opciones:
+ *   --desde=N     Primer ID a exportar (por omisión, 1)
+ *   --hasta=N     Último ID a exportar (por omisión, todos)
+ *   --formato=F   ndjson (por omisión) o binario (ver Exportador)
+ * Los JSON se escriben directamente desde la base de datos, sin copiarlos,
+ * de a tramos. Al terminar, o ante un error, informa por la salida de
+ * errores el último ID exportado: con --desde=<último ID + 1> se reanuda la
+ * exportación, y agregando la salida se obtiene la exportación completa.
+ * Termina con 1 si hubo un error.
+ */
+
+/**
+ * @return Valor de una opción --nombre=valor entera positiva
+ */
+static int opcion(const char *arg, const char *nombre)
+{
+    auto texto = std::string(arg + strlen(nombre));
+    size_t fin = 0;
+    long valor = 0;
+    try {
+        valor = std::stol(texto, &fin);
+    }
+    catch (...) {
+    }
+    if (fin!=texto.size() || valor<1 || valor>INT_MAX)
+        throw std::runtime_error ( std::string("Valor inválido en ").append(arg) );
+    return valor;
+}
+
+int main (const int argc, const char **argv)
+{
+    std::unique_ptr<Exportador> exportador;
+    auto inicio = std::chrono::steady_clock::now();
+    int desde = 1, hasta = INT_MAX;
+
+    try {
+        auto formato = Exportador::NDJSON;
+        const char *nombre = "-";
+
+        for (int i = 1; i < argc; i++) {
+            if (! strncmp(argv[i], "--desde=", 8))
+                desde = opcion(argv[i], "--desde=");
+            else if (! strncmp(argv[i], "--hasta=", 8))
+                hasta = opcion(argv[i], "--hasta=");
+            else if (! strncmp(argv[i], "--formato=", 10))
+                formato = Exportador::formatoDe(argv[i] + 10);
+            else if (argv[i][0]=='-' && argv[i][1]=='-')
+                throw std::runtime_error ( std::string("Opción desconocida: ").append(argv[i]) );
+            else
+                nombre = argv[i];
+        }
+
+        FILE *salida = strcmp(nombre, "-") ? fopen(nombre, "wb") : stdout;
+        if (! salida)
+            throw std::runtime_error ( std::string("No se puede abrir ").append(nombre).append(": ").append(strerror(errno)) );
+
+        auto control = std::make_shared<Control>();
+        exportador = control->exportInterface(formato, desde, hasta);
+
+        auto escribir = [salida] (const char *datos, size_t largo) {
+            fwrite(datos, 1, largo, salida);
+        };
+
+        try {
+            while (exportador->siguiente(escribir) && ! ferror(salida))
+                ;
+        }
+        catch (...) {
+            if (salida!=stdout)
+                fclose(salida);
+            throw;
+        }
+
+        // Con la salida incompleta no se sabe desde dónde reanudar
+        bool error = fflush(salida)!=0 || ferror(salida);
+        if (salida!=stdout)
+            error = fclose(salida)!=0 || error;
+        if (error) {
+            exportador.reset();
+            throw std::runtime_error ( std::string("Error escribiendo la salida: ").append(strerror(errno)) );
+        }
+
+        std::chrono::duration<double> duracion = std::chrono::steady_clock::now()-inicio;
+        std::cerr << "Exportación: " << exportador->exportados() << " árboles, "
+                  << exportador->bytes() << " bytes, último ID " << exportador->ultimo() << ", en "
+                  << duracion.count() << " s ("
+                  << exportador->exportados()/std::max(duracion.count(), 1e-9) << " árboles/s)" << std::endl;
+
+        return 0;
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en la exportación: " << e.what() << std::endl;
+    }
+    catch (...) {
+        std::cerr << "Error en la exportación. Abortado." << std::endl;
+    }
+    if (exportador)
+        std::cerr << "Último ID exportado: " << exportador->ultimo() << " (reanudar con --desde="
+                  << (exportador->ultimo() ? exportador->ultimo()+1 : desde) << ")" << std::endl;
+    return 1;
+}
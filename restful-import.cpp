@@ -0,0 +1,97 @@
+#include <chrono>
+#include <cstdio>    // fopen, fread, fwrite
+#include <cstring>   // strcmp, strerror
+#include <cerrno>    // errno
+#include <iostream>
+#include "restful.hpp"
+
+
+
+/*
+ * Importación masiva de árboles sin el servidor: lee árboles en NDJSON (un
+ * árbol por línea) de los archivos indicados, o de la entrada estándar si no
+ * se indica ninguno (o con "-"), y los guarda en la base de datos
+ * configurada como para el servidor (RESTFUL_DB, RESTFUL_BACKEND...). Por la
+ * salida estándar emite, por cada línea y en el mismo orden, {"id":N} o
+ * {"error":"..."}, como POST /importar-arboles. Al terminar informa el
+ * resumen por la salida de errores. Termina con 1 si hubo líneas con
+ * errores o un error al guardar.
+ */
+
+static const size_t PARTE = 1024*1024; //< Bytes que se leen por vez
+
+/**
+ * Importa un archivo abierto, escribiendo los resultados de cada lote a
+ * medida que se procesan.
+ */
+static void importar(FILE *entrada, Importador& importador)
+{
+    std::vector<char> buffer(PARTE);
+    std::string salida;
+
+    while (size_t n = fread(buffer.data(), 1, buffer.size(), entrada)) {
+        importador.leer(buffer.data(), n);
+        if (importador.lleno()) {
+            importador.procesar(salida);
+            fwrite(salida.data(), 1, salida.size(), stdout);
+            salida.clear();
+        }
+    }
+
+    if (ferror(entrada))
+        throw std::runtime_error ( std::string("Error leyendo la entrada: ").append(strerror(errno)) );
+}
+
+int main (const int argc, const char **argv)
+{
+    try {
+        auto control = std::make_shared<Control>();
+        auto inicio = std::chrono::steady_clock::now();
+
+        // Cada archivo se importa por separado: una última línea sin fin de
+        // línea no se une con la primera del archivo siguiente.
+        size_t lineas = 0, guardados = 0, errores = 0;
+        std::string salida;
+        for (int i = 1; i < std::max(argc, 2); i++) {
+            auto nombre = i < argc ? argv[i] : "-";
+            auto importador = control->importInterface(control->getMaxTreeBytes());
+            FILE *entrada = strcmp(nombre, "-") ? fopen(nombre, "rb") : stdin;
+            if (! entrada)
+                throw std::runtime_error ( std::string("No se puede abrir ").append(nombre).append(": ").append(strerror(errno)) );
+
+            try {
+                importar(entrada, *importador);
+            }
+            catch (...) {
+                if (entrada!=stdin)
+                    fclose(entrada);
+                throw;
+            }
+            if (entrada!=stdin)
+                fclose(entrada);
+
+            importador->terminar(salida);
+            fwrite(salida.data(), 1, salida.size(), stdout);
+            salida.clear();
+
+            lineas += importador->procesadas();
+            guardados += importador->guardados();
+            errores += importador->fallidas();
+        }
+        fflush(stdout);
+
+        std::chrono::duration<double> duracion = std::chrono::steady_clock::now()-inicio;
+        std::cerr << "Importación: " << lineas << " líneas, " << guardados << " árboles distintos, "
+                  << errores << " con errores, en " << duracion.count() << " s ("
+                  << lineas/std::max(duracion.count(), 1e-9) << " líneas/s)" << std::endl;
+
+        return errores ? 1 : 0;
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en la importación: " << e.what() << std::endl;
+    }
+    catch (...) {
+        std::cerr << "Error en la importación. Abortado." << std::endl;
+    }
+    return 1;
+}
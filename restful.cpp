@@ -1,18 +1,65 @@
 #include <iostream>
+#include <cstring>   // memcmp, strlen
+#include <strings.h> // strcasecmp
+#include <algorithm> // std::max
 #include <memory>    // make_shared<>() ... etc
-#include <stack>     // std::stack<>
+#include <cerrno>    // errno
+#include <sys/resource.h> // getrusage
+#include <sys/stat.h> // mkdir
+#include <unistd.h>  // access
 #include "restful.hpp"
+#include "persistencia.hpp"
 #include "plugin.hpp"
+#include "hash.hpp"
+#include "lector.hpp"
 
 
 
 /** ***************************************************************************
- * Constructor. Instancia el Endpoint y el Modelo como miembros.
+ * Constructor. Instancia el Endpoint y el Modelo como miembros. Lee la
+ * configuración de los tiempos por fase (variables de entorno):
+ *  - RESTFUL_SERVER_TIMING: 1 para enviar la cabecera Server-Timing
+ *  - RESTFUL_SLOW_MS: registrar las solicitudes que tarden al menos estos
+ *    milisegundos; 0 lo desactiva
+ * y del pool de cálculo:
+ *  - RESTFUL_COMPUTE_THREADS: hilos de cálculo (0: se calcula en los hilos
+ *    de restbed); por omisión, uno por núcleo
+ *  - RESTFUL_COMPUTE_QUEUE: máximo de solicitudes esperando un hilo de cálculo
+ *  - RESTFUL_RETRY_AFTER_S: Retry-After de las solicitudes rechazadas
+ * y de la precarga:
+ *  - RESTFUL_WARMUP_TREES: árboles a precargar al iniciar (0: ninguno)
+ * y de la importación masiva:
+ *  - RESTFUL_IMPORT_BATCH: líneas por lote (y por transacción)
+ * y del tamaño de los árboles que reciben los web services:
+ *  - RESTFUL_MAX_TREE_MB: MiB máximos del JSON de un árbol
  ** ***************************************************************************/
 Control::Control()
 {
+    // Estas excepciones deben llegar a MAIN, no capturar antes.
+    auto timing = enteroDeEntorno( "RESTFUL_SERVER_TIMING", "0" );
+    if (timing>1)
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_SERVER_TIMING: ").append(std::to_string(timing)) );
+    server_timing = timing==1;
+    umbral_lento = std::chrono::milliseconds( enteroDeEntorno( "RESTFUL_SLOW_MS", "0" ) );
+
+    auto nucleos = std::to_string( std::max( 1u, std::thread::hardware_concurrency() ) );
+    auto hilos = enteroDeEntorno( "RESTFUL_COMPUTE_THREADS", nucleos.c_str() );
+    auto capacidad = enteroDeEntorno( "RESTFUL_COMPUTE_QUEUE", "256" );
+    reintento = enteroDeEntorno( "RESTFUL_RETRY_AFTER_S", "1" );
+    precarga = enteroDeEntorno( "RESTFUL_WARMUP_TREES", "0" );
+    lote_importacion = enteroDeEntorno( "RESTFUL_IMPORT_BATCH", "10000" );
+    if (lote_importacion==0)
+        throw std::runtime_error ( "Valor inválido en RESTFUL_IMPORT_BATCH: 0" );
+
+    auto max_tree_mb = enteroDeEntorno( "RESTFUL_MAX_TREE_MB", "256" );
+    if (size_t(max_tree_mb) > SIZE_MAX/(1024*1024))
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_MAX_TREE_MB: ").append(std::to_string(max_tree_mb)) );
+    maximo_arbol = size_t(max_tree_mb) * 1024 * 1024;
+
+    metricas = std::make_shared<Metricas>();
+    poolCalculo = std::make_shared<PoolCalculo>(hilos, capacidad, metricas);
     webServices = std::make_shared<Endpoint>();
-    modeloArbol = std::make_shared<Modelo>();
+    modeloArbol = std::make_shared<Modelo>(metricas);
 }
 
 /** ***************************************************************************
@@ -23,60 +70,390 @@ Control::~Control()
 }
 
 /** ***************************************************************************
- * Procedimiento principal del control. Ejecuta los Web Services.
+ * Procedimiento principal del control. Precarga los árboles y luego ejecuta
+ * los Web Services: el puerto recién se abre con la caché ya cargada.
  * @return Estado de error de salida.
  ** ***************************************************************************/
 int Control::run(void)
 {
+    warmUpInterface();
     return webServices->runWS (shared_from_this());
 }
 
+/** ***************************************************************************
+ * Interfaz de importación masiva del controlador: un importador que
+ * reparte la interpretación de cada lote en el pool de cálculo y lo guarda
+ * con Modelo::createNewTrees.
+ * @see Importador
+ * @param maximo Bytes máximos de cada árbol
+ * @return El importador, para una entrada
+ ** ***************************************************************************/
+std::unique_ptr<Importador> Control::importInterface(size_t maximo)
+{
+    auto modelo = modeloArbol;
+    return std::make_unique<Importador>([modelo] (const std::vector<std::string>& textos) {
+            return modelo->createNewTrees(textos);
+        }, metricas, poolCalculo, maximo, lote_importacion);
+}
+
+/** ***************************************************************************
+ * Interfaz de exportación masiva del controlador: un exportador del rango de
+ * ID indicado que recorre los árboles con Modelo::exportTrees.
+ * @see Exportador
+ * @param formato Formato de la exportación
+ * @param desde Primer ID a exportar
+ * @param hasta Último ID a exportar
+ * @return El exportador, para una salida
+ ** ***************************************************************************/
+std::unique_ptr<Exportador> Control::exportInterface(Exportador::Formato formato, int desde, int hasta)
+{
+    auto modelo = modeloArbol;
+    return std::make_unique<Exportador>([modelo] (int d, int h, const std::function<bool(int, const char*, size_t)>& lector) {
+            modelo->exportTrees(d, h, lector);
+        }, formato, desde, hasta);
+}
+
+/** ***************************************************************************
+ * Interfaz de modificación de árboles del controlador.
+ * @see Modelo::patchTree(const json&)
+ * @param obj Objeto nlohmann::json con la modificación (id, node y left,
+ *            right o remove)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return ID de la nueva versión del árbol
+ ** ***************************************************************************/
+int Control::patchTreeInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->patchTree(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de precarga del controlador: compila en la caché los
+ * RESTFUL_WARMUP_TREES árboles más recientes, repartidos en el pool de
+ * cálculo.
+ * @see Modelo::precargar(size_t, PoolCalculo&)
+ * @return Cantidad de árboles precargados
+ ** ***************************************************************************/
+size_t Control::warmUpInterface(void)
+{
+    if (precarga==0)
+        return 0;
+
+    return modeloArbol->precargar(precarga, *poolCalculo);
+}
+
 /** ***************************************************************************
  * Interfaz de creación de árboles del controlador.
- * @see Modelo::createNewTree(const json)
+ * @see Modelo::createNewTree(const json&)
  * @param obj Objeto nlohmann::json con el árbol a guardar
  * @return ID del árbol creado (o ya existente)
  ** ***************************************************************************/
-int Control::newTreeInterface(const json obj)
+int Control::newTreeInterface(const json& obj)
 {
     return modeloArbol->createNewTree(obj);
 }
 
+/** ***************************************************************************
+ * Interfaz de creación de árboles del controlador, para árboles ya leídos
+ * y validados por LectorArbol.
+ * @see Modelo::createNewTree(ArbolPlano&&)
+ * @param arbol Árbol aplanado a guardar
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return ID del árbol creado (o ya existente)
+ ** ***************************************************************************/
+int Control::newTreeInterface(ArbolPlano&& arbol, Tiempos *tiempos)
+{
+    return modeloArbol->createNewTree(std::move(arbol), tiempos);
+}
+
 /** ***************************************************************************
  * Interfaz de búsqueda de ancestro común del controlador.
- * @see Modelo::lowestCommonAncestor(const json)
+ * @see Modelo::lowestCommonAncestor(const json&)
  * @param obj Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON conteniendo el ancestro común
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::lowestCommonAncestorInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->lowestCommonAncestor(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de búsqueda de ancestro común del controlador, con los campos de
+ * la consulta ya separados (ver ConsultaAncestro).
+ * @see Modelo::lowestCommonAncestor(const json&, const json&, const json&)
+ * @param id ID del árbol
+ * @param valor_a Valor del primer nodo
+ * @param valor_b Valor del segundo nodo
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
  * @return JSON conteniendo el ancestro común
  ** ***************************************************************************/
-std::shared_ptr<json> Control::lowestCommonAncestorInterface(const json obj)
+std::shared_ptr<json> Control::lowestCommonAncestorInterface(const json& id, const json& valor_a, const json& valor_b,
+                                                             Tiempos *tiempos)
+{
+    return modeloArbol->lowestCommonAncestor(id, valor_a, valor_b, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de búsqueda de ancestro común del controlador, con valores de un
+ * tipo (int64_t o std::string).
+ * @see Modelo::lowestCommonAncestor(const json&, const Clave&, const Clave&)
+ * @param id ID del árbol
+ * @param valor_a Valor del primer nodo
+ * @param valor_b Valor del segundo nodo
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return Valor del ancestro común, o JSON conteniéndolo
+ ** ***************************************************************************/
+template<class Clave>
+std::variant< Clave, std::shared_ptr<json> > Control::lowestCommonAncestorInterface(const json& id, const Clave& valor_a,
+                                                                                    const Clave& valor_b,
+                                                                                    Tiempos *tiempos)
+{
+    return modeloArbol->lowestCommonAncestor(id, valor_a, valor_b, tiempos);
+}
+
+template std::variant< int64_t, std::shared_ptr<json> >
+Control::lowestCommonAncestorInterface(const json&, const int64_t&, const int64_t&, Tiempos*);
+template std::variant< std::string, std::shared_ptr<json> >
+Control::lowestCommonAncestorInterface(const json&, const std::string&, const std::string&, Tiempos*);
+
+/** ***************************************************************************
+ * Interfaz de búsqueda de ancestros comunes en lote del controlador.
+ * @see Modelo::lowestCommonAncestorBatch(const json&)
+ * @param obj Objeto nlohmann::json con la búsqueda (id, pairs)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON con un resultado por cada par, en el mismo orden
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::lowestCommonAncestorBatchInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->lowestCommonAncestorBatch(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de profundidad de un nodo del controlador.
+ * @see Modelo::nodeDepth(const json&)
+ * @param obj Objeto nlohmann::json con la búsqueda (id, node)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON con la profundidad del nodo
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::depthInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->nodeDepth(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de distancia entre dos nodos del controlador.
+ * @see Modelo::nodeDistance(const json&)
+ * @param obj Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON con la distancia entre los nodos
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::distanceInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->nodeDistance(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de k-ésimo ancestro del controlador.
+ * @see Modelo::kthAncestor(const json&)
+ * @param obj Objeto nlohmann::json con la búsqueda (id, node, k)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON conteniendo el ancestro
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::kthAncestorInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->kthAncestor(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de camino entre dos nodos del controlador.
+ * @see Modelo::nodePath(const json&)
+ * @param obj Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON (arreglo) con los nodos del camino
+ ** ***************************************************************************/
+std::shared_ptr<json> Control::pathInterface(const json& obj, Tiempos *tiempos)
+{
+    return modeloArbol->nodePath(obj, tiempos);
+}
+
+/** ***************************************************************************
+ * Interfaz de respuesta de los web services del controlador. Envía la
+ * respuesta y deja la conexión abierta o la cierra según la política de
+ * conexiones persistentes.
+ * @see Conexiones::responder()
+ * @param session Sesión de restbed de la solicitud
+ * @param estado Código de estado HTTP
+ * @param cuerpo Cuerpo de la respuesta
+ * @param cabeceras Cabeceras de la respuesta
+ ** ***************************************************************************/
+void Control::replyInterface(const std::shared_ptr<restbed::Session>& session, int estado,
+                             const std::string& cuerpo,
+                             const std::multimap<std::string, std::string>& cabeceras)
+{
+    webServices->getConexiones()->responder(session, estado, cuerpo, cabeceras);
+}
+
+/** ***************************************************************************
+ * Interfaz de conexiones persistentes del controlador, para las respuestas
+ * que se envían por partes (ver exportar-arboles): decide al empezar si la
+ * conexión se mantiene al terminar.
+ * @see Conexiones::persistente
+ * @param session Sesión de restbed de la solicitud
+ * @param cabeceras Cabeceras de la respuesta (se agrega "Connection")
+ * @return Si la conexión se mantiene
+ ** ***************************************************************************/
+bool Control::keepAliveInterface(const std::shared_ptr<restbed::Session>& session,
+                                 std::multimap<std::string, std::string>& cabeceras)
+{
+    return webServices->getConexiones()->persistente(session, cabeceras);
+}
+
+/** ***************************************************************************
+ * Interfaz de métricas del controlador: las métricas registradas por todas
+ * las capas y el estado actual de la caché y de las conexiones.
+ * @return Texto de las métricas en el formato de Prometheus
+ ** ***************************************************************************/
+std::string Control::metricsInterface(void)
+{
+    auto texto = metricas->exportar();
+
+    modeloArbol->medidas(texto);
+    Metricas::medida(texto, "restful_keepalive_connections", "Conexiones persistentes abiertas.",
+                     webServices->getConexiones()->cantidad());
+    Metricas::medida(texto, "restful_compute_queue_depth", "Solicitudes esperando un hilo de cálculo.",
+                     poolCalculo->cantidad());
+    Metricas::medida(texto, "restful_compute_threads", "Hilos de cálculo.", poolCalculo->tamanio());
+
+    return texto;
+}
+
+/** ***************************************************************************
+ * Interfaz de tiempos por fase del controlador. Solo se miden si se envía
+ * la cabecera Server-Timing o se registran las solicitudes lentas.
+ * @param inicio Llegada de la solicitud
+ * @return Tiempos de la solicitud, o nullptr si no se miden
+ ** ***************************************************************************/
+std::shared_ptr<Tiempos> Control::timingInterface(Tiempos::reloj::time_point inicio)
+{
+    if (! server_timing && umbral_lento.count()==0)
+        return nullptr;
+
+    return std::make_shared<Tiempos>(inicio, server_timing, umbral_lento);
+}
+
+/** ***************************************************************************
+ * Interfaz del pool de cálculo del controlador. Los web services le pasan
+ * el trabajo de cada solicitud (BBDD, interpretación, consultas), para no
+ * ocupar los hilos de restbed.
+ * @param tarea Trabajo de la solicitud, que también envía la respuesta
+ * @return false si la cola está llena y la tarea se descartó
+ ** ***************************************************************************/
+bool Control::computeInterface(PoolCalculo::Tarea tarea)
+{
+    return poolCalculo->enviar(std::move(tarea));
+}
+
+/** ***************************************************************************
+ * Constructor. Instancia el servicio de persistencia en BD (ver
+ * Persist::crear). Lee la configuración (variables de entorno):
+ *  - RESTFUL_CACHE_MB: presupuesto de la caché de árboles compilados
+ *  - RESTFUL_SNAPSHOT: 1 para guardar instantáneas de los árboles
+ *    compilados, en el directorio <RESTFUL_DB>.arboles
+ * @param m Métricas del servicio (si no se indican, se usan unas propias)
+ ** ***************************************************************************/
+Modelo::Modelo(std::shared_ptr<Metricas> m)
+    : metricas(m ? m : std::make_shared<Metricas>())
+{
+    persistService = Persist::crear(metricas);
+
+    char const *cache_mb = getenv( "RESTFUL_CACHE_MB" );
+    if ( ! cache_mb )
+        cache_mb = "64";
+
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    size_t bytes;
+    try {
+        bytes = std::stoul( cache_mb ) * 1024 * 1024;
+    }
+    catch (...) {
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_CACHE_MB: ").append(cache_mb) );
+    }
+
+    cacheArboles = std::make_shared<CacheArboles>(bytes);
+
+    // Estas excepciones deben llegar a MAIN, no capturar antes.
+    auto snapshot = enteroDeEntorno( "RESTFUL_SNAPSHOT", "0" );
+    if (snapshot>1)
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_SNAPSHOT: ").append(std::to_string(snapshot)) );
+
+    if (snapshot==1) {
+        if (persistService->archivo().empty())
+            throw std::runtime_error ( "RESTFUL_SNAPSHOT=1 requiere un backend con archivo (RESTFUL_BACKEND)" );
+        instantaneas = persistService->archivo() + ".arboles";
+        if (mkdir(instantaneas.c_str(), 0755)!=0 && errno!=EEXIST)
+            throw std::runtime_error ( "Error creando el directorio de instantáneas " + instantaneas + ": " + strerror(errno) );
+    }
+}
+
+/** ***************************************************************************
+ * ID entero de un árbol, para la caché y las instantáneas. La persistencia
+ * asigna ID de 1 a INT32_MAX: otro entero no corresponde a ningún árbol, y
+ * convertirlo a int lo confundiría con otro ID.
+ * @param id Objeto nlohmann::json con el ID (entero)
+ * @return El ID
+ ** ***************************************************************************/
+static int idArbol(const json& id)
+{
+    bool valido = id.is_number_unsigned()
+        ? id.get<uint64_t>()>=1 && id.get<uint64_t>()<=uint64_t(INT32_MAX)
+        : id.get<int64_t>()>=1 && id.get<int64_t>()<=int64_t(INT32_MAX);
+    if (! valido)
+        throw std::logic_error ( "No se encontró ningún árbol (campo id erróneo)" );
+    return id.get<int>();
+}
+
+/** ***************************************************************************
+ * @param id ID del árbol
+ * @return Archivo de la instantánea del árbol
+ ** ***************************************************************************/
+std::string Modelo::archivoInstantanea(int id) const
 {
-    return modeloArbol->lowestCommonAncestor(obj);
+    return instantaneas + "/" + std::to_string(id) + ".arbol";
 }
 
 /** ***************************************************************************
- * Constructor. Instancia el servicio de persistencia en BD.
+ * Guarda la instantánea de un árbol compilado. Los errores se registran
+ * pero no se informan: sin instantánea, el árbol se compila desde la BBDD.
+ * @param id ID del árbol
+ * @param arbol Árbol compilado
+ * @param fuente Clave del JSON del árbol en la BBDD (ver PersistSQLite::clave)
  ** ***************************************************************************/
-Modelo::Modelo()
+void Modelo::guardarInstantanea(int id, const ArbolCompilado& arbol, const std::string& fuente)
 {
-    persistService = std::make_shared<Persist>();
+    try {
+        arbol.guardar(archivoInstantanea(id), fuente);
+    }
+    catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+    }
 }
 
 /** ***************************************************************************
- * Destructor. Llama a los destructores miembro.
+ * Destructor. Los miembros se liberan con sus shared_ptr (llamar aquí a
+ * ~Persist() los destruiría dos veces).
  ** ***************************************************************************/
 Modelo::~Modelo()
 {
-    persistService->~Persist();
 }
 
 /** ***************************************************************************
  * Creación de árbol a partir de JSON. Persiste el JSON en BD para que sea
  * accesible mediante consultas. Usa el servicio insert.
- * @see Persist::insert(std::string)
+ * @see PersistSQLite::insert(std::string)
  * @param Objeto nlohmann::json con el árbol a guardar
  * @return ID del árbol creado (o ya existente)
  ** ***************************************************************************/
-int Modelo::createNewTree(const json o)
+int Modelo::createNewTree(const json& o)
 {
     if (o.find("node")==o.end())
         throw std::logic_error( "Todos los árboles deben tener al menos un nodo!" );
@@ -98,243 +475,1618 @@ int Modelo::createNewTree(const json o)
 }
 
 /** ***************************************************************************
- * Búsqueda de ancestro común más cercano. Se debe proporcionar una búsqueda del
- * formato {"id":<id>,"node_a":<node>, "node_b":<node>} donde el ID corresponde
- * al de un árbol creado mediante el servicio de creación de árboles.
- * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
- * @return JSON conteniendo el ancestro común
+ * Creación de varios árboles ya validados y serializados (ver Importador),
+ * guardados juntos (ver Persist::insertLote). No se compilan: se compilan
+ * en la primera consulta, o en la precarga.
+ * @param textos Serialización canónica de cada árbol
+ * @return ID de cada árbol creado (o ya existente), en el mismo orden
  ** ***************************************************************************/
-std::shared_ptr<json> Modelo::lowestCommonAncestor(const json objBusqueda)
+std::vector<int> Modelo::createNewTrees(const std::vector<std::string>& textos)
 {
-    std::shared_ptr<json> LCA = std::make_shared<json>();
-    std::stack<json> camino, nodo_a, nodo_b;
-    std::stack< std::pair<json,json> > working;
-    json arbol;
+    // Los errores en INSERT no se informan detalladamente al cliente, pero se loguean
+    try {
 
-    auto contieneNodo = [] (json o, std::string nodo) {
-        return o.find(nodo)!=o.end();
-    };
+        return persistService->insertLote(textos);
 
-    if (! contieneNodo (objBusqueda, "id"))
-        throw std::logic_error ( "ID del árbol requerido (falta campo id)" );
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en INSERT: " << e.what() << std::endl;
+        throw std::runtime_error ( "Error interno. No se pueden crear los árboles." );
+    }
+    catch (...) {
+        std::cerr << "Error inesperado en INSERT" << std::endl;
+        throw std::runtime_error ( "Error interno. No se pueden crear los árboles." );
+    }
+}
 
-    if (! contieneNodo (objBusqueda, "node_a") ||
-        ! contieneNodo (objBusqueda, "node_b") )
-        throw std::logic_error ( "Nodos de búsqueda requeridos (falta campo node_a o node_b)" );
+/** ***************************************************************************
+ * Recorrido de los árboles guardados de un rango de ID, en orden, para la
+ * exportación (ver Persist::recorrer). No se compilan ni pasan por la caché.
+ * @param desde Primer ID a recorrer
+ * @param hasta Último ID a recorrer
+ * @param lector Función que recibe el ID y el JSON de cada árbol; si
+ *               devuelve false, el recorrido se detiene
+ ** ***************************************************************************/
+void Modelo::exportTrees(int desde, int hasta, const std::function<bool(int, const char*, size_t)>& lector)
+{
+    // Los errores en SELECT no se informan detalladamente al cliente, pero se loguean
+    try {
+
+        persistService->recorrer(desde, hasta, lector);
+
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en SELECT: " << e.what() << std::endl;
+        throw std::runtime_error ( "Error interno. No se pueden leer los árboles." );
+    }
+}
+
+/** ***************************************************************************
+ * Creación de un árbol ya aplanado y validado (ver LectorArbol). Se guarda
+ * su serialización canónica, que es el mismo texto que guardaría
+ * createNewTree(const json&) para el mismo árbol, y como el árbol ya está
+ * aplanado se compila sin volver a interpretarlo y queda en la caché para
+ * las primeras consultas.
+ * @param arbol Árbol aplanado a guardar (queda vacío)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return ID del árbol creado (o ya existente)
+ ** ***************************************************************************/
+int Modelo::createNewTree(ArbolPlano&& arbol, Tiempos *tiempos)
+{
+    if (arbol.nodos.empty())
+        throw std::logic_error( "Todos los árboles deben tener al menos un nodo!" );
+
+    int id;
+    std::string fuente; // Clave del JSON, para la instantánea
+
+    // Los errores en INSERT no se informan detalladamente al cliente, pero se loguean
+    try {
+        std::string texto;
+        {
+            Tiempos::Fase fase(tiempos, "serializar");
+            texto = arbol.serializar();
+        }
+        Tiempos::Fase fase(tiempos, "db");
+        id = persistService->insert(texto);
+        if (! instantaneas.empty())
+            fuente = hash128(texto).bytes();
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en INSERT: " << e.what() << std::endl;
+        throw std::runtime_error ( "Error interno. No se puede crear el árbol." );
+    }
+    catch (...) {
+        std::cerr << "Error inesperado en INSERT" << std::endl;
+        throw std::runtime_error ( "Error interno. No se puede crear el árbol." );
+    }
+
+    metricas->arbol(arbol.nodos.size());
+    if (tiempos)
+        tiempos->arbol(std::to_string(id), arbol.nodos.size());
+
+    std::shared_ptr<const ArbolCompilado> compilado;
+    {
+        Tiempos::Fase fase(tiempos, "compilar");
+        compilado = std::make_shared<const ArbolCompilado>(std::move(arbol));
+    }
+
+    // Si el árbol ya existía, su instantánea también
+    if (! instantaneas.empty() && access(archivoInstantanea(id).c_str(), F_OK)!=0) {
+        Tiempos::Fase fase(tiempos, "instantanea");
+        guardarInstantanea(id, *compilado, fuente);
+    }
+
+    cacheArboles->guardar(id, compilado);
+    return id;
+}
+
+/** ***************************************************************************
+ * Modificación de un árbol: se cuelga un subárbol de uno de sus nodos o se
+ * quita el subárbol de un nodo, y se guarda el resultado como un árbol nuevo
+ * (el árbol original no cambia). Se debe proporcionar una modificación de
+ * alguno de los formatos
+ *   {"id":<id>,"node":<node>,"left":<subárbol>}
+ *   {"id":<id>,"node":<node>,"right":<subárbol>}
+ *   {"id":<id>,"node":<node>,"remove":true}
+ * Con left o right el subárbol reemplaza al que tuviera el nodo en esa rama;
+ * con remove se quita el nodo con todo su subárbol (no puede ser la raíz).
+ * El nodo se busca igual que en las consultas (ver ArbolCompilado::buscar).
+ * El árbol modificado se guarda completo, pero no se vuelve a leer ni a
+ * compilar: su texto se arma con tramos del texto original (ver MapaArbol)
+ * y su versión compilada a partir de la del árbol original (ver
+ * ArbolCompilado::injertar), y queda en la caché.
+ * @param cambio Objeto nlohmann::json con la modificación
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return ID del árbol modificado (o ya existente)
+ ** ***************************************************************************/
+int Modelo::patchTree(const json& cambio, Tiempos *tiempos)
+{
+    auto base = arbolDeBusqueda(cambio, {"node"}, tiempos);
+
+    if (cambio.count("left") + cambio.count("right") + cambio.count("remove") != 1)
+        throw std::logic_error ( "Se debe indicar una única modificación (campo left, right o remove)" );
+    const bool quitar = cambio.contains("remove");
+    if (quitar && cambio["remove"]!=true)
+        throw std::logic_error ( "El campo remove solo admite el valor true" );
+
+    const int32_t v = nodoDeBusqueda(*base, cambio["node"], tiempos);
+    if (quitar && v==0)
+        throw std::logic_error ( "No se puede quitar la raíz del árbol" );
+
+    int32_t padre, hijo, hermano;
+    bool derecho = cambio.contains("right");
+    std::unique_ptr<const ArbolCompilado> rama;
+    std::string subarbol;
+
+    if (! quitar) {
+        // El subárbol se valida y aplana como los árboles nuevos
+        Tiempos::Fase fase(tiempos, "compilar");
+        LectorArbol lector;
+        auto recibido = cambio[derecho ? "right" : "left"].dump();
+        lector.leer(recibido.data(), recibido.size());
+        ArbolPlano plano = lector.terminar();
+        subarbol = plano.serializar();
+        rama = std::make_unique<const ArbolCompilado>(std::move(plano));
+    }
+
+    // El árbol compilado no guarda de qué rama cuelga cada nodo: se toma del
+    // texto guardado, y el texto modificado se arma por tramos de este,
+    // directamente desde el buffer de la persistencia
+    std::string texto;
+    std::chrono::nanoseconds armado{0};
+    auto inicio = std::chrono::steady_clock::now();
 
     try {
-        std::string arbol_string = this->persistService->select(objBusqueda["id"].dump());
-        arbol = json::parse(arbol_string);
+        this->persistService->select(cambio["id"].dump(), [&] (const char *original, size_t largo) {
+            auto t0 = std::chrono::steady_clock::now();
+            MapaArbol mapa(original, largo, base->tamanio());
+            if (mapa.cantidad()!=base->tamanio())
+                throw std::runtime_error ( "El árbol guardado no corresponde al compilado" );
+
+            int32_t p;
+            bool lado;
+            int32_t n = mapa.nodo(v, p, lado);
+
+            if (quitar) {
+                padre = base->ancestro(v, 1);
+                derecho = lado;
+                hijo = v;
+                hermano = mapa.hijo(p, padre, ! derecho);
+                texto = mapa.quitar(p, derecho);
+            }
+            else {
+                padre = v;
+                hijo = mapa.hijo(n, v, derecho);
+                hermano = mapa.hijo(n, v, ! derecho);
+                texto = mapa.colgar(n, derecho, subarbol);
+            }
+            armado += std::chrono::steady_clock::now()-t0;
+        });
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en SELECT: " << e.what() << std::endl;
+        throw std::runtime_error ( "Error interno. No se puede leer el árbol." );
+    }
+
+    if (tiempos) {
+        tiempos->sumar("db", std::chrono::steady_clock::now()-inicio-armado);
+        tiempos->sumar("serializar", armado);
+    }
+
+    int id;
+    std::string fuente; // Clave del JSON, para la instantánea
+
+    // Los errores en INSERT no se informan detalladamente al cliente, pero se loguean
+    try {
+        Tiempos::Fase fase(tiempos, "db");
+        id = persistService->insert(texto);
+        if (! instantaneas.empty())
+            fuente = hash128(texto).bytes();
+    }
+    catch (std::exception& e) {
+        std::cerr << "Error en INSERT: " << e.what() << std::endl;
+        throw std::runtime_error ( "Error interno. No se puede crear el árbol." );
+    }
+    catch (...) {
+        std::cerr << "Error inesperado en INSERT" << std::endl;
+        throw std::runtime_error ( "Error interno. No se puede crear el árbol." );
+    }
+
+    // Si el árbol ya existía y está en la caché, no hace falta armarlo
+    auto modificado = cacheArboles->obtener(id);
+    bool nuevo = ! modificado;
+    if (nuevo) {
+        Tiempos::Fase fase(tiempos, "compilar");
+        modificado = ArbolCompilado::injertar(*base, padre, derecho, hijo, hermano, rama.get());
+    }
+
+    metricas->arbol(modificado->tamanio());
+    if (tiempos)
+        tiempos->arbol(std::to_string(id), modificado->tamanio());
+
+    if (nuevo && ! instantaneas.empty() && access(archivoInstantanea(id).c_str(), F_OK)!=0) {
+        Tiempos::Fase fase(tiempos, "instantanea");
+        guardarInstantanea(id, *modificado, fuente);
+    }
+
+    if (nuevo)
+        cacheArboles->guardar(id, modificado);
+    return id;
+}
+
+/** ***************************************************************************
+ * Obtención del árbol compilado a partir de su ID. Los árboles se buscan
+ * primero en la caché; si no están, se compilan (ver compilarArbol) y se
+ * guardan en la caché para las próximas consultas. Si varias consultas
+ * piden a la vez un árbol que no está en la caché, se compila una sola vez
+ * y todas esperan ese resultado: con árboles grandes, compilarlo varias
+ * veces en paralelo multiplicaría la memoria y el tiempo.
+ * @param id Objeto nlohmann::json con el ID del árbol
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return El árbol compilado
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> Modelo::obtenerArbol(const json& id, Tiempos *tiempos)
+{
+    // Solo se cachean los ID enteros, que son los que asigna SQLite
+    if (! id.is_number_integer()) {
+        metricas->cache(false);
+        return compilarArbol(id, tiempos);
+    }
+
+    int clave = idArbol(id);
+
+    {
+        Tiempos::Fase fase(tiempos, "cache");
+        if (auto arbol = cacheArboles->obtener(clave); arbol) {
+            metricas->cache(true);
+            return arbol;
+        }
+    }
+
+    metricas->cache(false);
+
+    std::promise< std::shared_ptr<const ArbolCompilado> > promesa;
+    std::shared_future< std::shared_ptr<const ArbolCompilado> > futuro;
+    bool compilar = false;
+
+    {
+        const std::lock_guard<std::mutex> lock( this->compilando_mutex );
+
+        if (auto it = compilando.find(clave); it!=compilando.end())
+            futuro = it->second;
+        else if (auto arbol = cacheArboles->obtener(clave); arbol)
+            return arbol;
+        else {
+            futuro = promesa.get_future().share();
+            compilando[clave] = futuro;
+            compilar = true;
+        }
+    }
+
+    if (compilar) {
+        try {
+            auto compilado = compilarArbol(id, tiempos);
+            cacheArboles->guardar(clave, compilado);
+            promesa.set_value(compilado);
+        }
+        catch (...) {
+            promesa.set_exception(std::current_exception());
+        }
+
+        const std::lock_guard<std::mutex> lock( this->compilando_mutex );
+        compilando.erase(clave);
+    }
+
+    // Si lo compila otra solicitud, esta espera
+    Tiempos::Fase fase(compilar ? nullptr : tiempos, "espera");
+    return futuro.get();
+}
+
+/** ***************************************************************************
+ * Compilación de un árbol desde BBDD. El JSON se lee directamente del buffer
+ * de SQLite con LectorArbol, sin copiarlo ni armar el JSON completo. Con las
+ * instantáneas activadas, si hay una que corresponde al JSON guardado se usa
+ * mapeada en lugar de compilar; si no, se guarda una tras compilar.
+ * @see Persist::select(std::string, std::function)
+ * @param id Objeto nlohmann::json con el ID del árbol
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr). La lectura
+ *        se cuenta como "compilar" y no como parte de "db"
+ * @return El árbol compilado
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> Modelo::compilarArbol(const json& id, Tiempos *tiempos)
+{
+    // Con una instantánea válida no hace falta leer ni compilar el JSON
+    std::string fuente;
+    if (! instantaneas.empty() && id.is_number_integer()) {
+        Tiempos::Fase fase(tiempos, "instantanea");
+        try {
+            fuente = persistService->clave(id.dump());
+        }
+        catch (std::exception&) {
+            // Sin la clave, el árbol no existe: lo informa la lectura del JSON
+        }
+        if (! fuente.empty())
+            if (auto arbol = ArbolCompilado::abrir(archivoInstantanea(idArbol(id)), fuente); arbol)
+                return arbol;
+    }
+
+    LectorArbol lector;
+    std::chrono::nanoseconds lectura{0};
+    auto inicio = std::chrono::steady_clock::now();
+
+    try {
+        this->persistService->select(id.dump(), [this, &lector, &lectura] (const char *texto, size_t largo) {
+            auto t0 = std::chrono::steady_clock::now();
+            lector.leer(texto, largo);
+            auto t = std::chrono::steady_clock::now()-t0;
+            metricas->parseo(Metricas::GUARDADO, t);
+            lectura += t;
+        });
+    }
+    catch (std::logic_error&) {
+        // Árbol guardado sin validar (ver createNewTree(const json&)), mal formado
+        throw;
     }
     catch (std::exception& e) {
-        std::cerr << "No se encontró el árbol ID: ["<< objBusqueda["id"] << "]" << std::endl;
+        std::cerr << "No se encontró el árbol ID: ["<< id << "]" << std::endl;
         std::cerr << "Descripción: " << e.what() << std::endl;
         throw std::logic_error ( "No se encontró ningún árbol (campo id erróneo)" );
     }
     catch (...) {
-        std::cerr << "No se encontró el árbol ID: ["<< objBusqueda["id"] << "]" << std::endl;
+        std::cerr << "No se encontró el árbol ID: ["<< id << "]" << std::endl;
         throw std::logic_error ( "No se encontró ningún árbol (campo id erróneo)" );
     }
 
-    // Se comienza por el nodo raíz, sin último padre
-    working.push({0, arbol});
+    if (tiempos)
+        tiempos->sumar("db", std::chrono::steady_clock::now()-inicio-lectura);
+
+    std::shared_ptr<const ArbolCompilado> arbol;
+    {
+        Tiempos::Fase fase(tiempos, "compilar");
+        if (tiempos)
+            tiempos->sumar("compilar", lectura);
+        arbol = std::make_shared<const ArbolCompilado>(lector.terminar());
+    }
+
+    if (! fuente.empty()) {
+        Tiempos::Fase fase(tiempos, "instantanea");
+        guardarInstantanea(idArbol(id), *arbol, fuente);
+    }
+
+    return arbol;
+}
+
+/** ***************************************************************************
+ * Búsqueda de ancestro común más cercano. Se debe proporcionar una búsqueda del
+ * formato {"id":<id>,"node_a":<node>, "node_b":<node>} donde el ID corresponde
+ * al de un árbol creado mediante el servicio de creación de árboles.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON conteniendo el ancestro común
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::lowestCommonAncestor(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto contieneNodo = [] (const json& o, const char *nodo) {
+        return o.find(nodo)!=o.end();
+    };
+
+    if (! contieneNodo (objBusqueda, "id"))
+        throw std::logic_error ( "ID del árbol requerido (falta campo id)" );
+
+    if (! contieneNodo (objBusqueda, "node_a") ||
+        ! contieneNodo (objBusqueda, "node_b") )
+        throw std::logic_error ( "Nodos de búsqueda requeridos (falta campo node_a o node_b)" );
+
+    return lowestCommonAncestor(objBusqueda["id"], objBusqueda["node_a"], objBusqueda["node_b"], tiempos);
+}
+
+/** ***************************************************************************
+ * Búsqueda de ancestro común más cercano, con los campos de la búsqueda ya
+ * separados (ver ConsultaAncestro).
+ * @param id ID del árbol
+ * @param valor_a Valor del primer nodo
+ * @param valor_b Valor del segundo nodo
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON conteniendo el ancestro común
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::lowestCommonAncestor(const json& id, const json& valor_a, const json& valor_b,
+                                                   Tiempos *tiempos)
+{
+    auto arbol = obtenerArbol(id, tiempos);
+    if (tiempos)
+        tiempos->arbol(id.dump(), arbol->tamanio());
+
+    int nodo_a, nodo_b;
+    {
+        Tiempos::Fase fase(tiempos, "buscar");
+        nodo_a = arbol->buscar(valor_a);
+        nodo_b = arbol->buscar(valor_b);
+    }
+
+    if (nodo_a>=0 and nodo_b>=0) {
+        Tiempos::Fase fase(tiempos, "lca");
+        return std::make_shared<json>(arbol->nodo(arbol->ancestroComun(nodo_a, nodo_b)));
+    }
+
+    throw std::logic_error ( "Error encontrando el ancestro. Verifique que el objeto no contenga más de un árbol." );
+}
+
+/** ***************************************************************************
+ * Búsqueda de ancestro común más cercano con valores de un tipo (int64_t o
+ * std::string). Si los valores del árbol son de ese mismo tipo (ver
+ * ArbolCompilado::Tipo), la búsqueda y el resultado no pasan por JSON; si
+ * no, los nodos se buscan como JSON y el resultado es JSON, igual que en la
+ * búsqueda general.
+ * @param id ID del árbol
+ * @param valor_a Valor del primer nodo
+ * @param valor_b Valor del segundo nodo
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return Valor del ancestro común, o JSON conteniéndolo
+ ** ***************************************************************************/
+template<class Clave>
+std::variant< Clave, std::shared_ptr<json> > Modelo::lowestCommonAncestor(const json& id, const Clave& valor_a,
+                                                                          const Clave& valor_b, Tiempos *tiempos)
+{
+    constexpr bool entero = std::is_same_v<Clave, int64_t>;
+
+    auto arbol = obtenerArbol(id, tiempos);
+    if (tiempos)
+        tiempos->arbol(id.dump(), arbol->tamanio());
+
+    int nodo_a, nodo_b;
+    {
+        Tiempos::Fase fase(tiempos, "buscar");
+        if constexpr (entero) {
+            nodo_a = arbol->buscarEntero(valor_a);
+            nodo_b = arbol->buscarEntero(valor_b);
+        }
+        else {
+            nodo_a = arbol->buscarCadena(valor_a);
+            nodo_b = arbol->buscarCadena(valor_b);
+        }
+    }
+
+    if (nodo_a>=0 and nodo_b>=0) {
+        Tiempos::Fase fase(tiempos, "lca");
+        int ancestro = arbol->ancestroComun(nodo_a, nodo_b);
+        if constexpr (entero) {
+            if (arbol->tipoValores()==ArbolCompilado::ENTEROS)
+                return arbol->entero(ancestro);
+        }
+        else {
+            if (arbol->tipoValores()==ArbolCompilado::CADENAS)
+                return Clave(arbol->cadena(ancestro));
+        }
+        return std::make_shared<json>(arbol->nodo(ancestro));
+    }
+
+    throw std::logic_error ( "Error encontrando el ancestro. Verifique que el objeto no contenga más de un árbol." );
+}
+
+template std::variant< int64_t, std::shared_ptr<json> >
+Modelo::lowestCommonAncestor(const json&, const int64_t&, const int64_t&, Tiempos*);
+template std::variant< std::string, std::shared_ptr<json> >
+Modelo::lowestCommonAncestor(const json&, const std::string&, const std::string&, Tiempos*);
+
+/** ***************************************************************************
+ * Búsqueda de ancestros comunes en lote sobre un mismo árbol. Se debe
+ * proporcionar una búsqueda del formato
+ * {"id":<id>,"pairs":[{"node_a":<node>,"node_b":<node>}, ...]}. El árbol se
+ * obtiene una única vez y cada par se resuelve con su índice, en tiempo
+ * constante. Los errores de un par no afectan al resto: cada resultado es
+ * {"node":<ancestro>} o bien {"error":<descripción>}.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, pairs)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON (arreglo) con un resultado por par, en el mismo orden
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::lowestCommonAncestorBatch(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto contieneNodo = [] (const json& o, const char *nodo) {
+        return o.is_object() and o.find(nodo)!=o.end();
+    };
+
+    if (! contieneNodo (objBusqueda, "id"))
+        throw std::logic_error ( "ID del árbol requerido (falta campo id)" );
+
+    if (! contieneNodo (objBusqueda, "pairs") || ! objBusqueda["pairs"].is_array())
+        throw std::logic_error ( "Pares de búsqueda requeridos (falta el arreglo pairs)" );
+
+    auto arbol = obtenerArbol(objBusqueda["id"], tiempos);
+    if (tiempos)
+        tiempos->arbol(objBusqueda["id"].dump(), arbol->tamanio());
+
+    auto resultados = std::make_shared<json>(json::array());
+    Tiempos::Fase fase(tiempos, "pares");
+
+    for (auto& par : objBusqueda["pairs"])
+    {
+        json resultado;
+
+        if (! contieneNodo (par, "node_a") || ! contieneNodo (par, "node_b")) {
+            resultado["error"] = "Nodos de búsqueda requeridos (falta campo node_a o node_b)";
+        }
+        else {
+            auto nodo_a = arbol->buscar(par["node_a"]);
+            auto nodo_b = arbol->buscar(par["node_b"]);
+
+            if (nodo_a>=0 and nodo_b>=0)
+                resultado["node"] = arbol->nodo(arbol->ancestroComun(nodo_a, nodo_b));
+            else
+                resultado["error"] = "Error encontrando el ancestro. Alguno de los nodos no está en el árbol.";
+        }
+
+        resultados->push_back(std::move(resultado));
+    }
+
+    return resultados;
+}
+
+/** ***************************************************************************
+ * Obtención del árbol de una búsqueda, verificando que esta tenga el ID y
+ * los campos requeridos.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda
+ * @param campos Campos requeridos además del id
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return El árbol compilado
+ ** ***************************************************************************/
+std::shared_ptr<const ArbolCompilado> Modelo::arbolDeBusqueda(const json& objBusqueda,
+                                                              std::initializer_list<const char*> campos,
+                                                              Tiempos *tiempos)
+{
+    if (! objBusqueda.is_object() || objBusqueda.find("id")==objBusqueda.end())
+        throw std::logic_error ( "ID del árbol requerido (falta campo id)" );
+
+    for (auto campo : campos)
+        if (objBusqueda.find(campo)==objBusqueda.end())
+            throw std::logic_error ( std::string("Campo de búsqueda requerido (falta campo ").append(campo).append(")") );
+
+    auto arbol = obtenerArbol(objBusqueda["id"], tiempos);
+    if (tiempos)
+        tiempos->arbol(objBusqueda["id"].dump(), arbol->tamanio());
+
+    return arbol;
+}
+
+/** ***************************************************************************
+ * Búsqueda de un nodo del árbol por su valor (ver ArbolCompilado::buscar).
+ * @param arbol Árbol compilado
+ * @param valor Valor del nodo
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return Índice del nodo
+ ** ***************************************************************************/
+int Modelo::nodoDeBusqueda(const ArbolCompilado& arbol, const json& valor, Tiempos *tiempos)
+{
+    Tiempos::Fase fase(tiempos, "buscar");
+
+    int nodo = arbol.buscar(valor);
+    if (nodo<0)
+        throw std::logic_error ( "Error encontrando el nodo. Verifique que esté en el árbol." );
+
+    return nodo;
+}
+
+/** ***************************************************************************
+ * Profundidad de un nodo (la raíz tiene profundidad 0). Se debe proporcionar
+ * una búsqueda del formato {"id":<id>,"node":<node>}.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON con la profundidad
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::nodeDepth(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto arbol = arbolDeBusqueda(objBusqueda, {"node"}, tiempos);
+
+    return std::make_shared<json>(arbol->nivel(nodoDeBusqueda(*arbol, objBusqueda["node"], tiempos)));
+}
+
+/** ***************************************************************************
+ * Distancia (cantidad de aristas) entre dos nodos. Se debe proporcionar una
+ * búsqueda del formato {"id":<id>,"node_a":<node>,"node_b":<node>}.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON con la distancia
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::nodeDistance(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto arbol = arbolDeBusqueda(objBusqueda, {"node_a", "node_b"}, tiempos);
+    auto a = nodoDeBusqueda(*arbol, objBusqueda["node_a"], tiempos);
+    auto b = nodoDeBusqueda(*arbol, objBusqueda["node_b"], tiempos);
+
+    Tiempos::Fase fase(tiempos, "lca");
+    return std::make_shared<json>(arbol->distancia(a, b));
+}
+
+/** ***************************************************************************
+ * k-ésimo ancestro de un nodo: con k=0 el nodo mismo, con k=1 su padre, y
+ * así. Se debe proporcionar una búsqueda del formato
+ * {"id":<id>,"node":<node>,"k":<entero>}.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node, k)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON conteniendo el ancestro
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::kthAncestor(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto arbol = arbolDeBusqueda(objBusqueda, {"node", "k"}, tiempos);
+
+    auto& k = objBusqueda["k"];
+    if (! k.is_number_integer() || k.get<int64_t>()<0)
+        throw std::logic_error ( "El campo k debe ser un entero no negativo" );
+
+    auto nodo = nodoDeBusqueda(*arbol, objBusqueda["node"], tiempos);
+    if (k.get<int64_t>()>arbol->nivel(nodo))
+        throw std::logic_error ( "El nodo tiene menos de k ancestros" );
+
+    Tiempos::Fase fase(tiempos, "ancestro");
+    return std::make_shared<json>(arbol->nodo(arbol->ancestro(nodo, k.get<int>())));
+}
+
+/** ***************************************************************************
+ * Camino entre dos nodos: los valores de los nodos desde node_a, subiendo
+ * hasta el ancestro común, y bajando hasta node_b, ambos incluidos. Se debe
+ * proporcionar una búsqueda del formato
+ * {"id":<id>,"node_a":<node>,"node_b":<node>}.
+ * @param objBusqueda Objeto nlohmann::json con la búsqueda (id, node_a, node_b)
+ * @param tiempos Tiempos por fase de la solicitud (o nullptr)
+ * @return JSON (arreglo) con los valores de los nodos del camino
+ ** ***************************************************************************/
+std::shared_ptr<json> Modelo::nodePath(const json& objBusqueda, Tiempos *tiempos)
+{
+    auto arbol = arbolDeBusqueda(objBusqueda, {"node_a", "node_b"}, tiempos);
+    auto a = nodoDeBusqueda(*arbol, objBusqueda["node_a"], tiempos);
+    auto b = nodoDeBusqueda(*arbol, objBusqueda["node_b"], tiempos);
+
+    Tiempos::Fase fase(tiempos, "camino");
+    auto resultado = std::make_shared<json>(json::array());
+    for (auto i : arbol->camino(a, b))
+        resultado->push_back(arbol->nodo(i));
+
+    return resultado;
+}
+
+/** ***************************************************************************
+ * Precarga de la caché de árboles, para que tras un reinicio las primeras
+ * consultas no paguen la lectura y compilación de cada árbol. Se toman los
+ * árboles más recientes (de mayor ID) y se compilan en paralelo, repartidos
+ * en el pool de cálculo (ver PoolCalculo::repartir); la carga
+ * termina al llegar al límite o cuando el siguiente árbol ya no cabe en la
+ * caché sin desalojar a los anteriores. Los árboles que no se pueden leer
+ * se saltean (se registra el primer error y la cantidad). Al terminar se
+ * registra el tiempo y la memoria usados.
+ * @param limite Máximo de árboles a precargar
+ * @param pool Pool de cálculo donde se compilan
+ * @return Cantidad de árboles precargados
+ ** ***************************************************************************/
+size_t Modelo::precargar(size_t limite, PoolCalculo& pool)
+{
+    if (cacheArboles->capacidad()==0) {
+        std::cerr << "Precarga: la caché de árboles está desactivada (RESTFUL_CACHE_MB=0)" << std::endl;
+        return 0;
+    }
+
+    auto inicio = std::chrono::steady_clock::now();
+    auto ids = persistService->recientes(limite);
+
+    std::atomic<size_t> cargados{0}, nodos{0}, errores{0};
+    std::atomic<bool> lleno{false};
+
+    pool.repartir(ids.size(), [&] (size_t i) {
+        if (lleno)
+            return;
+        try {
+            auto arbol = compilarArbol(ids[i], nullptr);
+            if (! cacheArboles->agregar(ids[i], arbol)) {
+                lleno = true;
+                return;
+            }
+            cargados++;
+            nodos += arbol->tamanio();
+        }
+        catch (std::exception& e) {
+            if (errores++ == 0)
+                std::cerr << "Precarga: no se pudo compilar el árbol ID " << ids[i] << ": " << e.what() << std::endl;
+        }
+    });
+
+    std::chrono::duration<double> duracion = std::chrono::steady_clock::now()-inicio;
+    struct rusage uso;
+    getrusage(RUSAGE_SELF, &uso);
+    std::cerr << "Precarga: " << cargados << " de " << ids.size() << " árboles (" << nodos << " nodos, "
+              << cacheArboles->memoria()/(1024.0*1024) << " MiB estimados en la caché"
+              << (lleno ? ", caché llena" : "") << ", " << errores << " con errores) en " << duracion.count() << " s con "
+              << std::max<size_t>(1, std::min(pool.tamanio(), ids.size())) << " hilos; memoria máxima del proceso: "
+              << uso.ru_maxrss/1024 << " MiB" << std::endl;
+
+    return cargados;
+}
+
+/** ***************************************************************************
+ * Medidas del modelo (estado de la caché de árboles), en el formato de
+ * Prometheus.
+ * @param texto Texto al que se agregan
+ ** ***************************************************************************/
+void Modelo::medidas(std::string& texto)
+{
+    Metricas::medida(texto, "restful_tree_cache_bytes", "Memoria estimada de los árboles en la caché.",
+                     cacheArboles->memoria());
+    Metricas::medida(texto, "restful_tree_cache_trees", "Árboles en la caché.", cacheArboles->cantidad());
+}
+
+/** ***************************************************************************
+ * Contructor
+ ** ***************************************************************************/
+Endpoint::Endpoint()
+{
+    this->service = std::make_shared< restbed::Service >();
+    this->conexiones = std::make_shared< Conexiones >();
+}
+
+/** ***************************************************************************
+ * Destructor
+ ** ***************************************************************************/
+Endpoint::~Endpoint()
+{
+    service->stop();
+}
+
+/** ***************************************************************************
+ * Lanzador principal de los Web Services. Estos se ejecutan en hilos distintos
+ * dependiendo de la configuración de RestBed.
+ * @param control Controlador principal, para uso de sus interfaces.
+ * @return Estado final cuando los Web Services se finalizan.
+ ** ***************************************************************************/
+int Endpoint::runWS(std::shared_ptr<Control> control)
+{
+    auto res1 = d::plugin("./libcrear-arbol.so", control);
+    auto res2 = d::plugin("./libancestro-comun.so", control);
+    auto res3 = d::plugin("./libancestro-comun-lote.so", control);
+    auto res4 = d::plugin("./libmetrics.so", control);
+    auto res5 = d::plugin("./libprofundidad.so", control);
+    auto res6 = d::plugin("./libdistancia.so", control);
+    auto res7 = d::plugin("./libancestro.so", control);
+    auto res8 = d::plugin("./libcamino.so", control);
+    auto res9 = d::plugin("./libimportar-arboles.so", control);
+    auto res10 = d::plugin("./libexportar-arboles.so", control);
+    auto res11 = d::plugin("./libmodificar-arbol.so", control);
+
+    char const *max_threads = getenv( "RESTFUL_MAX_THREADS" );
+    if ( ! max_threads )
+        max_threads = "4";
+
+    char const *port_no = getenv ( "RESTFUL_PORT" );
+    if ( ! port_no )
+        port_no = "80";
+
+    auto settings = std::make_shared< restbed::Settings >();
+
+    try {
+        settings->set_worker_limit( std::stoi( max_threads ) );
+        settings->set_port( std::stoi( port_no ) );
+        conexiones->configurar( *settings );
+    }
+    catch (...) {
+        std::cerr << "Error fatal estableciendo la configuración del servidor. "
+            "Es posible que esto se deba a establecer mal las variables de entorno." << std::endl;
+        return 1;
+    }
+
+    try {
+        service->publish( res1 );
+        service->publish( res2 );
+        service->publish( res3 );
+        service->publish( res4 );
+        service->publish( res5 );
+        service->publish( res6 );
+        service->publish( res7 );
+        service->publish( res8 );
+        service->publish( res9 );
+        service->publish( res10 );
+        service->publish( res11 );
+        service->start( settings );
+    }
+    catch (...) {
+        std::cerr << "Error fatal: No se pudieron exponer los webservices! "
+                     "Asegurese de tener permiso y que el puerto no esté en uso!" << std::endl;
+        return 1;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/** ***************************************************************************
+ * Lectura de un entero no negativo de una variable de entorno. El valor
+ * debe ser solo el número: "-1", "256MB" o "0x10" se rechazan.
+ * @param nombre Nombre de la variable
+ * @param omision Valor si la variable no está definida
+ * @return Valor leído
+ ** ***************************************************************************/
+long enteroDeEntorno(const char *nombre, const char *omision)
+{
+    char const *valor = getenv( nombre );
+    if ( ! valor )
+        valor = omision;
+
+    size_t fin = 0;
+    long n = -1;
+    try {
+        n = std::stol( valor, &fin );
+    }
+    catch (...) {
+    }
+
+    if (n<0 || valor[fin]!='\0')
+        throw std::runtime_error ( std::string("Valor inválido en ").append(nombre).append(": ").append(valor) );
+
+    return n;
+}
+
+/** ***************************************************************************
+ * Constructor. Lee la configuración de las conexiones persistentes
+ * (variables de entorno):
+ *  - RESTFUL_KEEP_ALIVE_TIMEOUT_MS: inactividad máxima de una conexión
+ *    persistente, en ms; 0 desactiva el keep-alive
+ *  - RESTFUL_KEEP_ALIVE_MAX_REQUESTS: solicitudes por conexión
+ *  - RESTFUL_MAX_CONNECTIONS: conexiones persistentes simultáneas
+ ** ***************************************************************************/
+Conexiones::Conexiones()
+{
+    // Estas excepciones deben llegar a MAIN, no capturar antes.
+    inactividad = std::chrono::milliseconds( enteroDeEntorno( "RESTFUL_KEEP_ALIVE_TIMEOUT_MS", "5000" ) );
+    maximo_solicitudes = enteroDeEntorno( "RESTFUL_KEEP_ALIVE_MAX_REQUESTS", "100" );
+    maximo_conexiones = enteroDeEntorno( "RESTFUL_MAX_CONNECTIONS", "256" );
+}
+
+/** ***************************************************************************
+ * Aplica la política a la configuración de restbed. Sin keep-alive todas las
+ * respuestas llevan "Connection: close", como antes; con keep-alive el
+ * tiempo de inactividad se usa como timeout de la conexión.
+ * @param settings Configuración del servicio
+ ** ***************************************************************************/
+void Conexiones::configurar(restbed::Settings& settings) const
+{
+    if (! activo())
+        settings.set_default_header( "Connection", "close" );
+    else
+        settings.set_connection_timeout( inactividad );
+}
+
+/** ***************************************************************************
+ * Registra una solicitud atendida en la conexión de la sesión y decide si
+ * la conexión debe quedar abierta.
+ * @param session Sesión de restbed de la solicitud
+ * @param cierre_pedido Si el cliente pidió cerrar la conexión
+ * @return true si la conexión queda abierta para otra solicitud
+ ** ***************************************************************************/
+bool Conexiones::mantener(const std::shared_ptr<const restbed::Session>& session, bool cierre_pedido)
+{
+    if (! activo())
+        return false;
+
+    const std::lock_guard<std::mutex> lock( this->conexiones_mutex );
+
+    auto it = abiertas.find(session.get());
+    if (it!=abiertas.end() && it->second.session.expired()) {
+        abiertas.erase(it);
+        it = abiertas.end();
+    }
+
+    if (it==abiertas.end()) {
+        // Conexión nueva: antes de admitirla se descartan las ya cerradas
+        if (abiertas.size()>=maximo_conexiones)
+            for (auto i = abiertas.begin(); i!=abiertas.end(); )
+                i = i->second.session.expired() ? abiertas.erase(i) : std::next(i);
+
+        if (cierre_pedido || abiertas.size()>=maximo_conexiones)
+            return false;
+
+        it = abiertas.emplace(session.get(), Conexion{session, 0}).first;
+    }
+
+    if (cierre_pedido || ++it->second.solicitudes>=maximo_solicitudes) {
+        abiertas.erase(it);
+        return false;
+    }
+
+    return true;
+}
+
+/** ***************************************************************************
+ * Decide si la conexión de una solicitud se mantiene tras responderla, y
+ * agrega la cabecera "Connection" que corresponde. En HTTP/1.1 la conexión
+ * es persistente salvo que el cliente pida cerrarla; en HTTP/1.0, solo si
+ * el cliente lo pide expresamente. Cuenta la solicitud como atendida (ver
+ * mantener()), por lo que se llama una vez por solicitud.
+ * @param session Sesión de restbed de la solicitud
+ * @param cabeceras Cabeceras de la respuesta
+ * @return Si la conexión se mantiene
+ ** ***************************************************************************/
+bool Conexiones::persistente(const std::shared_ptr<restbed::Session>& session,
+                             std::multimap<std::string, std::string>& cabeceras)
+{
+    const auto request = session->get_request();
+    auto pedido = request->get_header("Connection", std::string());
+    bool cierre_pedido = request->get_version()<1.1 ?
+        strcasecmp(pedido.c_str(), "keep-alive")!=0 :
+        strcasecmp(pedido.c_str(), "close")==0;
+
+    if (mantener(session, cierre_pedido)) {
+        cabeceras.emplace("Connection", "keep-alive");
+        return true;
+    }
+
+    // Sin keep-alive, "Connection: close" ya es cabecera por omisión
+    if (activo())
+        cabeceras.emplace("Connection", "close");
+    return false;
+}
+
+/** ***************************************************************************
+ * Envía la respuesta de una solicitud. Si la conexión se mantiene, se
+ * responde con yield (restbed espera la siguiente solicitud en la misma
+ * conexión); si no, con close.
+ * @param session Sesión de restbed de la solicitud
+ * @param estado Código de estado HTTP
+ * @param cuerpo Cuerpo de la respuesta
+ * @param cabeceras Cabeceras de la respuesta (se agrega "Connection")
+ ** ***************************************************************************/
+void Conexiones::responder(const std::shared_ptr<restbed::Session>& session, int estado,
+                           const std::string& cuerpo, std::multimap<std::string, std::string> cabeceras)
+{
+    if (persistente(session, cabeceras))
+        session->yield(estado, cuerpo, cabeceras);
+    else
+        session->close(estado, cuerpo, cabeceras);
+}
+
+/** ***************************************************************************
+ * @return Cantidad de conexiones persistentes abiertas
+ ** ***************************************************************************/
+size_t Conexiones::cantidad(void)
+{
+    const std::lock_guard<std::mutex> lock( this->conexiones_mutex );
+
+    for (auto i = abiertas.begin(); i!=abiertas.end(); )
+        i = i->second.session.expired() ? abiertas.erase(i) : std::next(i);
+
+    return abiertas.size();
+}
+
+/** ***************************************************************************
+ * Función SQL HASH128(texto), usada para migrar bases de datos anteriores al
+ * índice por hash. Devuelve el mismo BLOB que se guarda al insertar.
+ ** ***************************************************************************/
+static void sqlHash128(sqlite3_context *ctx, int, sqlite3_value **argv)
+{
+    auto texto = sqlite3_value_text( argv[0] );
+    auto largo = sqlite3_value_bytes( argv[0] );
+    auto clave = hash128( texto, largo ).bytes();
+
+    sqlite3_result_blob( ctx, clave.data(), clave.size(), SQLITE_TRANSIENT );
+}
+
+/** ***************************************************************************
+ * Constructor. Lee la configuración de la BBDD y abre la primera conexión,
+ * que crea el archivo de Base de Datos si no existe, la tabla, y migra el
+ * esquema si hace falta. El resto de las conexiones se abren a demanda.
+ * Ajustes (variables de entorno, se aplican a cada conexión):
+ *  - RESTFUL_DB_MMAP_SIZE: bytes de la BBDD accesibles por mmap (PRAGMA mmap_size)
+ *  - RESTFUL_DB_CACHE_SIZE: caché de páginas de cada conexión (PRAGMA cache_size)
+ *  - RESTFUL_DB_SYNCHRONOUS: OFF, NORMAL, FULL o EXTRA (PRAGMA synchronous)
+ * Group commit (variables de entorno):
+ *  - RESTFUL_DB_GROUP_COMMIT_US: ventana de cada lote en µs; 0 lo desactiva
+ *  - RESTFUL_DB_GROUP_COMMIT_MAX: máximo de inserciones por lote
+ * @param m Métricas del servicio (si no se indican, se usan unas propias)
+ ** ***************************************************************************/
+PersistSQLite::PersistSQLite(std::shared_ptr<Metricas> m)
+    : metricas(m ? m : std::make_shared<Metricas>()), terminar(false)
+{
+    char const *name = getenv("RESTFUL_DB");
+    if ( ! name )
+        name = "restful.db";
+    db_name = name;
+
+    char const *mmap_size = getenv("RESTFUL_DB_MMAP_SIZE");
+    if ( ! mmap_size )
+        mmap_size = "0";
+
+    char const *cache_size = getenv("RESTFUL_DB_CACHE_SIZE");
+    if ( ! cache_size )
+        cache_size = "-2000";
+
+    char const *synchronous = getenv("RESTFUL_DB_SYNCHRONOUS");
+    if ( ! synchronous )
+        synchronous = "FULL";
+
+    // Los valores se validan antes de armar el SQL con ellos.
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    try {
+        pragmas = std::string("PRAGMA mmap_size = ").append(std::to_string(std::stoll(mmap_size))).append(";")
+            .append("PRAGMA cache_size = ").append(std::to_string(std::stoll(cache_size))).append(";");
+    }
+    catch (...) {
+        throw std::runtime_error ( "Valor inválido en RESTFUL_DB_MMAP_SIZE o RESTFUL_DB_CACHE_SIZE" );
+    }
+
+    auto sync = std::string(synchronous);
+    if (sync!="OFF" && sync!="NORMAL" && sync!="FULL" && sync!="EXTRA")
+        throw std::runtime_error ( std::string("Valor inválido en RESTFUL_DB_SYNCHRONOUS: ").append(sync) );
+    pragmas.append("PRAGMA synchronous = ").append(sync).append(";");
+
+    conexiones.push_back(std::make_unique<Conexion>(db_name, pragmas, true));
+    libres.push_back(conexiones.back().get());
+
+    char const *grupo_us = getenv("RESTFUL_DB_GROUP_COMMIT_US");
+    if ( ! grupo_us )
+        grupo_us = "0";
+
+    char const *grupo_max = getenv("RESTFUL_DB_GROUP_COMMIT_MAX");
+    if ( ! grupo_max )
+        grupo_max = "256";
+
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    try {
+        grupo_ventana = std::chrono::microseconds(std::stol(grupo_us));
+        grupo_maximo = std::stoul(grupo_max);
+    }
+    catch (...) {
+        throw std::runtime_error ( "Valor inválido en RESTFUL_DB_GROUP_COMMIT_US o RESTFUL_DB_GROUP_COMMIT_MAX" );
+    }
+
+    if (grupo_maximo < 1)
+        grupo_maximo = 1;
+
+    if (grupo_ventana.count() > 0)
+        escritor = std::thread(&PersistSQLite::escribirLotes, this);
+}
+
+/** ***************************************************************************
+ * Constructor de una conexión. Abre la BBDD en modo WAL, aplica los ajustes
+ * y compila las consultas a BBDD que serán usadas en la aplicación. La
+ * conexión inicial además crea la tabla y, si la base de datos tiene el
+ * esquema anterior (JSON TEXT UNIQUE), la migra.
+ * @param db_name Archivo de BBDD
+ * @param pragmas Ajustes a aplicar
+ * @param inicial Si es la primera conexión de Persist
+ ** ***************************************************************************/
+PersistSQLite::Conexion::Conexion(const std::string& db_name, const std::string& pragmas, bool inicial)
+    : db(NULL), insert_stmt(NULL), select_hash_stmt(NULL), select_json_stmt(NULL), select_clave_stmt(NULL),
+      select_rango_stmt(NULL), select_recientes_stmt(NULL)
+{
+    // Conexión a la BBDD. Cada conexión la usa un solo hilo a la vez, así que
+    // no necesita los mutex internos de SQLite.
+    auto exit = sqlite3_open_v2( db_name.c_str(), &(this->db),
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL );
+
+    // Las excepciones llegan a MAIN si es la conexión inicial, o a quien pidió
+    // prestada una conexión nueva (ver Prestamo), que la descarta.
+    if (exit) {
+        auto msg = std::string("Error abriendo la base de datos: ").append(sqlite3_errmsg(db));
+        sqlite3_close(db);
+        throw std::runtime_error ( msg );
+    }
+
+    try {
+        // Si otra conexión está escribiendo, se espera en lugar de fallar
+        sqlite3_busy_timeout ( db, 5000 );
+
+        exit = sqlite3_exec (db, std::string("PRAGMA journal_mode = WAL;").append(pragmas).c_str(), NULL, NULL, NULL);
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error configurando la base de datos: ").append(sqlite3_errmsg(db)) );
+
+        exit = sqlite3_create_function ( db, "HASH128", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                         NULL, sqlHash128, NULL, NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error registrando la función HASH128: ").append(sqlite3_errmsg(db)) );
+
+        // El contenido se deduplica por el hash de 128 bits del JSON, no por el
+        // texto completo: así SQLite no mantiene un índice con una copia de cada árbol.
+        auto sql =                                    \
+            "CREATE TABLE IF NOT EXISTS ARBOLES ( "   \
+            "  ID INTEGER PRIMARY KEY,"                  \
+            "  HASH BLOB UNIQUE NOT NULL,"               \
+            "  JSON TEXT NOT NULL"                       \
+            ");";
+
+        if (inicial) {
+            exit = sqlite3_exec (db, sql, NULL, NULL, NULL);
+
+            // Esta excepción debe llegar a MAIN, no capturar antes.
+            if (exit)
+                throw std::runtime_error ( std::string("Error creando la tabla: ").append(sqlite3_errmsg(db)) );
+
+            migrar();
+        }
+
+        // Si la clave ya existe no se inserta nada, y se compara el contenido
+        // con select_hash_stmt para distinguir un duplicado de una colisión.
+        sql =                                         \
+            "INSERT INTO ARBOLES (HASH, JSON) "       \
+            "VALUES (?, ?) "                          \
+            "ON CONFLICT (HASH) DO NOTHING;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->insert_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta INSERT: ").append(sqlite3_errmsg(db)) );
+
+        sql =                                       \
+            "SELECT JSON FROM ARBOLES WHERE ID = ?;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_json_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta SELECT JSON: ").append(sqlite3_errmsg(db)) );
+
+        sql =                                       \
+            "SELECT ID, JSON FROM ARBOLES WHERE HASH = ?;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_hash_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta SELECT HASH: ").append(sqlite3_errmsg(db)) );
+
+        sql =                                       \
+            "SELECT HASH FROM ARBOLES WHERE ID = ?;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_clave_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta SELECT CLAVE: ").append(sqlite3_errmsg(db)) );
+
+        sql =                                       \
+            "SELECT ID, JSON FROM ARBOLES WHERE ID BETWEEN ? AND ? ORDER BY ID;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_rango_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta SELECT RANGO: ").append(sqlite3_errmsg(db)) );
+
+        sql =                                       \
+            "SELECT ID FROM ARBOLES ORDER BY ID DESC LIMIT ?;";
+
+        exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_recientes_stmt), NULL );
+
+        if (exit)
+            throw std::runtime_error ( std::string("Error compilando la consulta SELECT RECIENTES: ").append(sqlite3_errmsg(db)) );
+    }
+    catch (...) {
+        // Si el constructor no termina no se llama al destructor: se libera aquí
+        for (auto stmt : {insert_stmt, select_hash_stmt, select_json_stmt, select_clave_stmt,
+                          select_rango_stmt, select_recientes_stmt})
+            sqlite3_finalize ( stmt );
+        sqlite3_close ( db );
+        throw;
+    }
+}
+
+/** ***************************************************************************
+ * Migración del esquema anterior, donde la tabla no tenía columna HASH y la
+ * columna JSON era UNIQUE. Se copia todo a una tabla nueva conservando los
+ * ID, calculando el hash en SQL, y luego se compacta el archivo. Es atómica:
+ * ante cualquier error se deshace y la base de datos queda como estaba.
+ ** ***************************************************************************/
+void PersistSQLite::Conexion::migrar(void)
+{
+    sqlite3_stmt *stmt;
+    auto sql = "SELECT COUNT(*) FROM pragma_table_info('ARBOLES') WHERE name = 'HASH';";
+
+    auto exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &stmt, NULL );
+
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    if (exit)
+        throw std::runtime_error ( std::string("Error verificando el esquema: ").append(sqlite3_errmsg(db)) );
+
+    exit = sqlite3_step ( stmt );
+    auto tiene_hash = (exit == SQLITE_ROW) && sqlite3_column_int ( stmt, 0 );
+    sqlite3_finalize ( stmt );
 
-    
-    while (! working.empty())
-    {
-        auto i = working.top().first;
-        auto o = working.top().second;
-        working.pop();
+    if (tiene_hash)
+        return;
 
-        if (! camino.empty())
-            while (i != camino.top()) {
-                camino.pop();
-            }
+    std::cout << "Migrando la base de datos al índice por hash" << std::endl;
 
-        if (! contieneNodo(o, "node"))
-            throw std::logic_error ( R"(Árbol mal formado, todos los nodos deben tener un campo "node")" );
+    sql =                                                                 \
+        "BEGIN IMMEDIATE;"                                                \
+        "CREATE TABLE ARBOLES_HASH ( "                                    \
+        "  ID INTEGER PRIMARY KEY,"                                       \
+        "  HASH BLOB UNIQUE NOT NULL,"                                    \
+        "  JSON TEXT NOT NULL"                                            \
+        ");"                                                              \
+        "INSERT INTO ARBOLES_HASH (ID, HASH, JSON) "                      \
+        "  SELECT ID, HASH128(JSON), JSON FROM ARBOLES;"                  \
+        "DROP TABLE ARBOLES;"                                             \
+        "ALTER TABLE ARBOLES_HASH RENAME TO ARBOLES;"                     \
+        "COMMIT;";
 
-        camino.push(o["node"]);
+    char *error = NULL;
+    exit = sqlite3_exec (db, sql, NULL, NULL, &error);
 
-        // guardado de la pila como dirección de los nodos
-        if (o["node"]==objBusqueda["node_a"])  nodo_a = camino;
-        if (o["node"]==objBusqueda["node_b"])  nodo_b = camino;
+    // Esta excepción debe llegar a MAIN, no capturar antes.
+    if (exit) {
+        auto msg = std::string("Error migrando la base de datos: ").append(error ? error : "");
+        sqlite3_free (error);
+        sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+        throw std::runtime_error ( msg );
+    }
 
-        // continúa el DFS
-        if (contieneNodo (o, "left")) {
-            working.push({o["node"],o["left"]});
-        }
-        if (contieneNodo (o, "right")) {
-            working.push({o["node"],o["right"]});
-        }
-    };
+    // Devuelve al sistema el espacio que ocupaba el índice sobre el texto
+    if (sqlite3_exec (db, "VACUUM;", NULL, NULL, NULL))
+        std::cerr << "No se pudo compactar la base de datos: " << sqlite3_errmsg(db) << std::endl;
+}
+
+/** ***************************************************************************
+ * Inserción en BBDD sobre esta conexión. Quien la llama debe tener el mutex
+ * de escritura. El JSON se identifica por su hash de 128 bits. Un árbol nuevo se guarda con
+ * una única consulta; si la clave ya existe se compara el texto completo y,
+ * si difiere (colisión de hash), se reintenta con la clave extendida con un
+ * contador.
+ * @param json_to_save std::string con JSON del árbol a guardar en BBDD
+ * @param metricas Métricas donde registrar el tiempo de las consultas
+ * @return ID del árbol guardado
+ ** ***************************************************************************/
+int PersistSQLite::Conexion::insertar( const std::string& json_to_save, Metricas& metricas )
+{
+    auto clave = hash128(json_to_save).bytes();
 
-    if (!nodo_a.empty() and !nodo_b.empty())
+    for (int colisiones = 0; colisiones < 256; colisiones++)
     {
-        // nodo_a y nodo_b contienen las rutas a cada nodo
-        // todos los elementos de dirección compartidos son ancestros en común
-        while (nodo_a.size()>nodo_b.size())
-            nodo_a.pop();
-        while (nodo_a.size()<nodo_b.size())
-            nodo_b.pop();
-        while (nodo_a.top()!=nodo_b.top()) {
-            nodo_a.pop();
-            nodo_b.pop();
-        }
-        LCA.reset(new json(nodo_a.top()));
-        return LCA;
+        if (colisiones)
+            clave.resize(16), clave.push_back((char)colisiones);
+
+        /*=================================== INSERT =======================================*/
+
+        auto exit = sqlite3_reset ( this->insert_stmt );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit)
+            throw std::runtime_error ( std::string("Error inesperado preparándose para la consulta INSERT (reset) [")
+                .append(std::to_string(exit))
+                .append("]: ")
+                .append(sqlite3_errmsg(db)) );
+
+        // INSERT INTO ARBOLES (HASH, JSON)
+        // VALUES (?, ?) ON CONFLICT (HASH) DO NOTHING;
+        exit = sqlite3_bind_blob (
+            this->insert_stmt,      // Statement compilado
+            1,                      // Enlazar al 1er valor de la consulta
+            clave.data(),           // Qué valor enlazar
+            clave.size(),           // Longitud del valor enlazado
+            NULL
+            );
+
+        if (! exit)
+            exit = sqlite3_bind_text (
+                this->insert_stmt,      // Statement compilado
+                2,                      // Enlazar al 2do valor de la consulta
+                json_to_save.c_str(),   // Qué valor enlazar
+                json_to_save.length(),  // Longitud del valor enlazado
+                NULL
+                );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit)
+            throw std::runtime_error (
+                std::string("Error alimentando a la consulta INSERT (bind): ")
+                .append(sqlite3_errmsg(db)) );
+
+        auto t0 = std::chrono::steady_clock::now();
+        exit = sqlite3_step ( this->insert_stmt );
+        metricas.consulta( Metricas::INSERT, std::chrono::steady_clock::now()-t0 );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit != SQLITE_DONE)
+            throw std::runtime_error(
+                std::string("Error ejecutando la consulta INSERT [")
+                .append(std::to_string(exit))
+                .append("]: ")
+                .append(sqlite3_errmsg(db)) );
+
+        if (sqlite3_changes ( this->db ) == 1)
+            return sqlite3_last_insert_rowid ( this->db );
+
+        /*================================= SELECT HASH ====================================*/
+
+        exit = sqlite3_reset ( this->select_hash_stmt );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit)
+            throw std::runtime_error(
+                std::string("Error inesperado preparándose para la consulta SELECT HASH (reset): ")
+                .append(sqlite3_errmsg(db)) );
+
+        // SELECT ID, JSON FROM ARBOLES
+        // WHERE HASH=?;
+        exit = sqlite3_bind_blob (
+            this->select_hash_stmt, // Statement compilado
+            1,                      // Enlazar al 1er valor de la consulta
+            clave.data(),           // Qué valor enlazar
+            clave.size(),           // Longitud del valor enlazado
+            NULL
+            );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit)
+            throw std::runtime_error (
+                std::string("Error alimentando a la consulta SELECT HASH (bind): ")
+                .append(sqlite3_errmsg(db)) );
+
+        exit = sqlite3_step ( this->select_hash_stmt );
+
+        // Esta excepción debe llegar al WS.
+        // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
+        if (exit != SQLITE_ROW)
+            throw std::runtime_error (
+                std::string("Error ejecutando la consulta SELECT HASH (sin resultados)[")
+                .append(std::to_string(exit))
+                .append("]: ")
+                .append(sqlite3_errmsg(db)) );
+
+        auto id = sqlite3_column_int ( this->select_hash_stmt, 0 );
+        auto texto = (const char*)sqlite3_column_text ( this->select_hash_stmt, 1 );
+        auto largo = (size_t)sqlite3_column_bytes ( this->select_hash_stmt, 1 );
+        auto iguales = largo == json_to_save.length() && ! memcmp ( texto, json_to_save.c_str(), largo );
+
+        sqlite3_reset ( this->select_hash_stmt );
+
+        if (iguales)
+            return id;
     }
 
-    throw std::logic_error ( "Error encontrando el ancestro. Verifique que el objeto no contenga más de un árbol." );
+    throw std::runtime_error ( "Error ejecutando la consulta INSERT: demasiadas colisiones de hash" );
 }
 
 /** ***************************************************************************
- * Contructor
+ * Servicio de inserción en BBDD con mutex para los hilos de RestBed.
+ * Sin group commit, cada inserción es su propia transacción. Con group
+ * commit, la inserción se encola y se espera a que el hilo escritor confirme
+ * el lote que la contiene.
+ * @see PersistSQLite::insertAsync(std::string)
+ * @param json_to_save std::string con JSON del árbol a guardar en BBDD
+ * @return ID del árbol guardado
  ** ***************************************************************************/
-Endpoint::Endpoint()
+int PersistSQLite::insert( const std::string& json_to_save )
 {
-    this->service = std::make_shared< restbed::Service >();
+    auto t0 = std::chrono::steady_clock::now();
+
+    if (grupo_ventana.count() > 0) {
+        auto futuro = insertAsync(json_to_save);
+        futuro.wait();
+        metricas->espera( Metricas::GRUPO, std::chrono::steady_clock::now()-t0 );
+        return futuro.get();
+    }
+
+    const std::lock_guard<std::mutex> lock( this->escritura_mutex );
+    metricas->espera( Metricas::ESCRITURA, std::chrono::steady_clock::now()-t0 );
+    Prestamo c( *this );
+
+    return c->insertar(json_to_save, *metricas);
 }
 
 /** ***************************************************************************
- * Destructor
+ * Inserción en BBDD que no bloquea al que la llama. Con group commit el JSON
+ * se encola para el hilo escritor; el futuro se resuelve con el ID recién
+ * cuando el lote que lo contiene se confirmó en disco (o con la excepción si
+ * el lote falló). Sin group commit se inserta en el momento.
+ * @param json_to_save std::string con JSON del árbol a guardar en BBDD
+ * @return Futuro con el ID del árbol guardado
  ** ***************************************************************************/
-Endpoint::~Endpoint()
+std::future<int> PersistSQLite::insertAsync( std::string json_to_save )
 {
-    service->stop();
+    std::promise<int> promesa;
+    auto futuro = promesa.get_future();
+
+    if (grupo_ventana.count() <= 0) {
+        try {
+            promesa.set_value(insert(json_to_save));
+        }
+        catch (...) {
+            promesa.set_exception(std::current_exception());
+        }
+        return futuro;
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock( this->cola_mutex );
+        cola.push_back({std::move(json_to_save), std::move(promesa)});
+    }
+    cola_cv.notify_one();
+
+    return futuro;
 }
 
 /** ***************************************************************************
- * Lanzador principal de los Web Services. Estos se ejecutan en hilos distintos
- * dependiendo de la configuración de RestBed.
- * @param control Controlador principal, para uso de sus interfaces.
- * @return Estado final cuando los Web Services se finalizan.
+ * Hilo escritor del group commit. Toma el primer pendiente de la cola, espera
+ * a que se cumpla la ventana de tiempo o a juntar el máximo de inserciones,
+ * y las confirma todas en una única transacción. Al destruir Persist vacía la
+ * cola antes de terminar.
  ** ***************************************************************************/
-int Endpoint::runWS(std::shared_ptr<Control> control)
+void PersistSQLite::escribirLotes(void)
 {
-    auto res1 = d::plugin("./libcrear-arbol.so", control);
-    auto res2 = d::plugin("./libancestro-comun.so", control);
+    std::unique_lock<std::mutex> lock( this->cola_mutex );
 
-    char const *max_threads = getenv( "RESTFUL_MAX_THREADS" );
-    if ( ! max_threads )
-        max_threads = "4";
+    while (true)
+    {
+        cola_cv.wait(lock, [this] { return terminar || ! cola.empty(); });
 
-    char const *port_no = getenv ( "RESTFUL_PORT" );
-    if ( ! port_no )
-        port_no = "80";
+        if (cola.empty())
+            return;
 
-    auto settings = std::make_shared< restbed::Settings >();
+        // La ventana cuenta desde que el lote tiene su primer pendiente
+        auto limite = std::chrono::steady_clock::now() + grupo_ventana;
+        cola_cv.wait_until(lock, limite, [this] { return terminar || cola.size() >= grupo_maximo; });
 
-    try {
-        settings->set_worker_limit( std::stoi( max_threads ) );
-        settings->set_port( std::stoi( port_no ) );
-        settings->set_default_header( "Connection", "close" );
-    }
-    catch (...) {
-        std::cerr << "Error fatal estableciendo la configuración del servidor. "
-            "Es posible que esto se deba a establecer mal las variables de entorno." << std::endl;
-        return 1;
+        std::vector<Pendiente> lote;
+        while (! cola.empty() && lote.size() < grupo_maximo) {
+            lote.push_back(std::move(cola.front()));
+            cola.pop_front();
+        }
+
+        lock.unlock();
+        escribirLote(lote);
+        lock.lock();
     }
+}
+
+/** ***************************************************************************
+ * Escritura de un lote en una transacción. Los ID se entregan solo después del
+ * COMMIT, así que la durabilidad es la misma que sin group commit. Si algo
+ * falla, se deshace el lote completo y todos sus pendientes reciben el error.
+ * @param lote Inserciones pendientes
+ ** ***************************************************************************/
+void PersistSQLite::escribirLote(std::vector<Pendiente>& lote)
+{
+    std::vector<int> ids;
 
     try {
-        service->publish( res1 );
-        service->publish( res2 );
-        service->start( settings );
+        ids = transaccion(lote.size(), [&lote] (size_t i) -> const std::string& { return lote[i].json; });
     }
     catch (...) {
-        std::cerr << "Error fatal: No se pudieron exponer los webservices! "
-                     "Asegurese de tener permiso y que el puerto no esté en uso!" << std::endl;
-        return 1;
+        for (auto& p : lote)
+            p.id.set_exception(std::current_exception());
+        return;
     }
 
-    return EXIT_SUCCESS;
+    for (size_t i = 0; i < lote.size(); i++)
+        lote[i].id.set_value(ids[i]);
 }
 
 /** ***************************************************************************
- * Constructor. Crea el archivo de Base de Datos si no existe, la tabla, y
- * compila las consultas a BBDD que serán usadas en la aplicación.
+ * Inserción de varios JSON en una única transacción (y un único fsync), por
+ * ejemplo para una importación masiva. Los ID se entregan después del
+ * COMMIT; si algo falla se deshace la transacción completa.
+ * @param jsons JSON de los árboles a guardar
+ * @return ID de cada árbol, en el mismo orden
  ** ***************************************************************************/
-Persist::Persist()
+std::vector<int> PersistSQLite::insertLote(const std::vector<std::string>& jsons)
 {
-    char const *db_name = getenv("RESTFUL_DB");
-    if ( ! db_name )
-        db_name = "restful.db";
+    return transaccion(jsons.size(), [&jsons] (size_t i) -> const std::string& { return jsons[i]; });
+}
 
-    // Conexión a la BBDD
-    auto exit = sqlite3_open( db_name, &(this->db) );
+/** ***************************************************************************
+ * Inserción de varios JSON en una transacción, con el mutex de escritura.
+ * @param n Cantidad de JSON
+ * @param texto Función que devuelve el JSON i-ésimo
+ * @return ID de cada JSON, en el mismo orden
+ ** ***************************************************************************/
+std::vector<int> PersistSQLite::transaccion(size_t n, const std::function<const std::string&(size_t)>& texto)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    const std::lock_guard<std::mutex> lock( this->escritura_mutex );
+    metricas->espera( Metricas::ESCRITURA, std::chrono::steady_clock::now()-t0 );
+    std::vector<int> ids;
+    ids.reserve(n);
 
-    // Esta excepción debe llegar a MAIN, no capturar antes.
-    if (exit)
-        throw std::runtime_error (std::string("Error abriendo la base de datos: ").append(sqlite3_errmsg(db)));
+    Prestamo c( *this );
 
-    auto sql =                                    \
-        "CREATE TABLE IF NOT EXISTS ARBOLES ( "   \
-        "  ID INTEGER PRIMARY KEY,"                  \
-        "  JSON TEXT UNIQUE NOT NULL"                    \
-        ");";
+    if (auto exit = sqlite3_exec (c->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL); exit)
+        throw std::runtime_error ( std::string("Error iniciando la transacción del lote: ").append(sqlite3_errmsg(c->db)) );
 
-    exit = sqlite3_exec (db, sql, NULL, NULL, NULL);
+    try {
+        for (size_t i = 0; i < n; i++)
+            ids.push_back(c->insertar(texto(i), *metricas));
 
-    // Esta excepción debe llegar a MAIN, no capturar antes.
-    if (exit)
-        throw std::runtime_error ( std::string("Error creando la tabla: ").append(sqlite3_errmsg(db)) );
+        if (auto exit = sqlite3_exec (c->db, "COMMIT;", NULL, NULL, NULL); exit)
+            throw std::runtime_error ( std::string("Error confirmando el lote: ").append(sqlite3_errmsg(c->db)) );
+    }
+    catch (...) {
+        sqlite3_exec (c->db, "ROLLBACK;", NULL, NULL, NULL);
+        throw;
+    }
 
-    sql =                               \
-        "INSERT INTO ARBOLES (JSON) "   \
-        "VALUES (?);";
+    return ids;
+}
 
-    exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->insert_stmt), NULL );
+/** ***************************************************************************
+ * Backend de persistencia según la configuración (variable de entorno):
+ *  - RESTFUL_BACKEND: sqlite (omisión, ver PersistSQLite), memoria (ver
+ *    PersistMemoria) o log (ver PersistLog)
+ * @param m Métricas del servicio (si no se indican, se usan unas propias)
+ * @return El backend
+ ** ***************************************************************************/
+std::shared_ptr<Persist> Persist::crear(std::shared_ptr<Metricas> m)
+{
+    char const *backend = getenv("RESTFUL_BACKEND");
+    if ( ! backend )
+        backend = "sqlite";
 
     // Esta excepción debe llegar a MAIN, no capturar antes.
-    if (exit)
-        throw std::runtime_error ( std::string("Error compilando la consulta INSERT: ").append(sqlite3_errmsg(db)) );
-
-    sql =                                       \
-        "SELECT JSON FROM ARBOLES WHERE ID = ?;";
-
-    exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_json_stmt), NULL );
+    auto nombre = std::string(backend);
+    if (nombre=="sqlite")
+        return std::make_shared<PersistSQLite>(m);
+    if (nombre=="memoria")
+        return std::make_shared<PersistMemoria>(m);
+    if (nombre=="log")
+        return std::make_shared<PersistLog>(m);
+
+    throw std::runtime_error ( "Valor inválido en RESTFUL_BACKEND: " + nombre );
+}
 
-    // Esta excepción debe llegar a MAIN, no capturar antes.
-    if (exit)
-        throw std::runtime_error ( std::string("Error compilando la consulta SELECT JSON: ").append(sqlite3_errmsg(db)) );
+/** ***************************************************************************
+ * Inserción de varios JSON. Por omisión se insertan de a uno; los backends
+ * con durabilidad la redefinen para confirmarlos juntos.
+ * @param jsons JSON de los árboles a guardar
+ * @return ID de cada árbol, en el mismo orden
+ ** ***************************************************************************/
+std::vector<int> Persist::insertLote(const std::vector<std::string>& jsons)
+{
+    std::vector<int> ids;
+    ids.reserve(jsons.size());
+    for (auto& j : jsons)
+        ids.push_back(insert(j));
+    return ids;
+}
 
-    sql =                                       \
-        "SELECT ID FROM ARBOLES WHERE JSON = ?;";
+/** ***************************************************************************
+ * Servicio de obtención del árbol a partir de su ID.
+ * @param id std::string con ID del árbol a buscar
+ * @return std::string con JSON del árbol
+ ** ***************************************************************************/
+std::string Persist::select(const std::string id)
+{
+    std::string result;
 
-    exit = sqlite3_prepare_v2 ( this->db, sql, strlen (sql), &(this->select_id_stmt), NULL );
+    select(id, [&result] (const char *texto, size_t largo) {
+        result.assign(texto, largo);
+    });
 
-    // Esta excepción debe llegar a MAIN, no capturar antes.
-    if (exit)
-        throw std::runtime_error ( std::string("Error compilando la consulta SELECT ID: ").append(sqlite3_errmsg(db)) );
+    return result;
 }
 
 /** ***************************************************************************
- * Servicio de inserción en BBDD con mutex para los hilos de RestBed.
- * @param json_to_save std::string con JSON del árbol a guardar en BBDD
- * @return ID del árbol guardado
+ * Servicio de obtención del árbol a partir de su ID, sin copiarlo: el JSON
+ * se entrega directamente desde el buffer de SQLite, que solo es válido
+ * durante la llamada. Sirve para leer árboles grandes sin duplicarlos.
+ * @param id std::string con ID del árbol a buscar
+ * @param lector Función que recibe el JSON del árbol (texto y largo)
  ** ***************************************************************************/
-int Persist::insert( const std::string json_to_save )
+void PersistSQLite::select(const std::string id, const std::function<void(const char*, size_t)>& lector)
 {
-    const std::lock_guard<std::mutex> lock( this->stmt_mutex );
-    /*=================================== INSERT =======================================*/
+    Prestamo c( *this );
 
-    auto exit = sqlite3_reset ( this->insert_stmt );
+    auto exit = sqlite3_reset ( c->select_json_stmt );
 
     // Esta excepción debe llegar al WS.
     // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit && exit != SQLITE_CONSTRAINT)
-        throw std::runtime_error ( std::string("Error inesperado preparándose para la consulta INSERT (reset) [")
+    if (exit)
+        throw std::runtime_error (
+            std::string("Error inesperado preparándose para la consulta SELECT JSON (reset) [")
             .append(std::to_string(exit))
             .append("]: ")
-            .append(sqlite3_errmsg(db)) );
+            .append(sqlite3_errmsg(c->db)) );
 
-    // INSERT INTO ARBOLES (JSON)
-    // VALUES (?);
+    // SELECT JSON FROM ARBOLES
+    // WHERE ID=?;
     exit = sqlite3_bind_text (
-        this->insert_stmt,      // Statement compilado
+        c->select_json_stmt, // Statement compilado
         1,                      // Enlazar al 1er valor de la consulta
-        json_to_save.c_str(),   // Qué valor enlazar
-        json_to_save.length(),  // Longitud del valor enlazado
+        id.c_str(),             // Qué valor enlazar
+        id.length(),            // Longitud del valor enlazado
         NULL
         );
 
@@ -342,130 +2094,230 @@ int Persist::insert( const std::string json_to_save )
     // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
     if (exit)
         throw std::runtime_error (
-            std::string("Error alimentando a la consulta INSERT (bind): ")
-            .append(sqlite3_errmsg(db)) );
+            std::string("Error alimentando a la consulta SELECT JSON (bind) [")
+            .append(std::to_string(exit))
+            .append("]: ")
+            .append(sqlite3_errmsg(c->db)) );
 
-    exit = sqlite3_step ( this->insert_stmt );
+    auto t0 = std::chrono::steady_clock::now();
+    exit = sqlite3_step ( c->select_json_stmt );
+    metricas->consulta( Metricas::SELECT, std::chrono::steady_clock::now()-t0 );
 
     // Esta excepción debe llegar al WS.
     // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit != SQLITE_DONE && exit != SQLITE_CONSTRAINT)
-        throw std::runtime_error(
-            std::string("Error ejecutando la consulta INSERT [")
+    if (exit != SQLITE_ROW) {
+        throw std::runtime_error (
+            std::string("Error ejecutando la consulta SELECT JSON (sin resultados)[")
             .append(std::to_string(exit))
             .append("]: ")
-            .append(sqlite3_errmsg(db)) );
-
-    /*==================================== SELECT ======================================*/
-
+            .append(sqlite3_errmsg(c->db)) );
+    }
 
-    exit = sqlite3_reset ( this->select_id_stmt );
+    try {
+        lector((const char*)sqlite3_column_text ( c->select_json_stmt, 0 ),
+               sqlite3_column_bytes ( c->select_json_stmt, 0 ));
+    }
+    catch (...) {
+        sqlite3_reset ( c->select_json_stmt );
+        throw;
+    }
 
-    // Esta excepción debe llegar al WS.
-    // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit)
-        throw std::runtime_error(
-            std::string("Error inesperado preparándose para la consulta SELECT ID (reset): ")
-            .append(sqlite3_errmsg(db)) );
+    // Libera la instantánea de lectura, que en modo WAL demora los checkpoints
+    sqlite3_reset ( c->select_json_stmt );
+}
 
-    // SELECT ID FROM ARBOLES
-    // WHERE JSON=?;
-    exit = sqlite3_bind_text (
-        this->select_id_stmt,   // Statement compilado
-        1,                      // Enlazar al 1er valor de la consulta
-        json_to_save.c_str(),   // Qué valor enlazar
-        json_to_save.length(),  // Longitud del valor enlazado
-        NULL
-        );
+/** ***************************************************************************
+ * Servicio de obtención de la clave (hash del JSON) de un árbol, sin leer el
+ * JSON. Sirve para comprobar que una instantánea corresponde a la BBDD.
+ * @param id std::string con ID del árbol a buscar
+ * @return Clave del árbol (16 bytes, o 17 si hubo una colisión de hash)
+ ** ***************************************************************************/
+std::string PersistSQLite::clave(const std::string id)
+{
+    Prestamo c( *this );
 
-    // Esta excepción debe llegar al WS.
-    // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit)
-        throw std::runtime_error (
-            std::string("Error alimentando a la consulta SELECT ID (bind): ")
-            .append(sqlite3_errmsg(db)) );
+    auto exit = sqlite3_reset ( c->select_clave_stmt );
 
-    exit = sqlite3_step ( this->select_id_stmt );
+    // SELECT HASH FROM ARBOLES
+    // WHERE ID=?;
+    if (! exit)
+        exit = sqlite3_bind_text (
+            c->select_clave_stmt,   // Statement compilado
+            1,                      // Enlazar al 1er valor de la consulta
+            id.c_str(),             // Qué valor enlazar
+            id.length(),            // Longitud del valor enlazado
+            NULL
+            );
+
+    if (! exit) {
+        auto t0 = std::chrono::steady_clock::now();
+        exit = sqlite3_step ( c->select_clave_stmt );
+        metricas->consulta( Metricas::SELECT, std::chrono::steady_clock::now()-t0 );
+    }
 
     // Esta excepción debe llegar al WS.
     // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit != SQLITE_ROW)
-        throw std::runtime_error (
-            std::string("Error ejecutando la consulta SELECT_ID (sin resultados)[")
+    if (exit != SQLITE_ROW) {
+        auto msg = std::string("Error ejecutando la consulta SELECT CLAVE [")
             .append(std::to_string(exit))
             .append("]: ")
-            .append(sqlite3_errmsg(db)) );
-
-    auto id = sqlite3_column_int ( this->select_id_stmt, 0 );
+            .append(sqlite3_errmsg(c->db));
+        sqlite3_reset ( c->select_clave_stmt );
+        throw std::runtime_error ( msg );
+    }
 
-    return id;
+    std::string resultado( (const char*)sqlite3_column_blob ( c->select_clave_stmt, 0 ),
+                           sqlite3_column_bytes ( c->select_clave_stmt, 0 ) );
+    sqlite3_reset ( c->select_clave_stmt );
+    return resultado;
 }
 
 /** ***************************************************************************
- * Servicio de obtención del árbol a partir de su ID.
- * @param id std::string con ID del árbol a buscar
- * @return std::string con JSON del árbol
+ * Servicio de obtención de los ID de los árboles más recientes (los de
+ * mayor ID), para la precarga.
+ * @param limite Máximo de ID a obtener
+ * @return ID de los árboles, del más reciente al más antiguo
  ** ***************************************************************************/
-std::string Persist::select(const std::string id)
+std::vector<int> PersistSQLite::recientes(size_t limite)
 {
-    const std::lock_guard<std::mutex> lock( this->stmt_mutex );
+    Prestamo c( *this );
+    std::vector<int> ids;
+    auto stmt = c->select_recientes_stmt;
 
-    auto exit = sqlite3_reset ( this->select_json_stmt );
+    // SELECT ID FROM ARBOLES
+    // ORDER BY ID DESC LIMIT ?;
+    auto exit = sqlite3_bind_int64 ( stmt, 1, std::min<size_t>(limite, INT64_MAX) );
 
-    // Esta excepción debe llegar al WS.
-    // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit)
-        throw std::runtime_error (
-            std::string("Error inesperado preparándose para la consulta SELECT JSON (reset) [")
-            .append(std::to_string(exit))
-            .append("]: ")
-            .append(sqlite3_errmsg(db)) );
+    while (! exit && (exit = sqlite3_step ( stmt )) == SQLITE_ROW) {
+        ids.push_back( sqlite3_column_int ( stmt, 0 ) );
+        exit = 0;
+    }
 
-    // SELECT JSON FROM ARBOLES
-    // WHERE ID=?;
-    exit = sqlite3_bind_text (
-        this->select_json_stmt, // Statement compilado
-        1,                      // Enlazar al 1er valor de la consulta
-        id.c_str(),             // Qué valor enlazar
-        id.length(),            // Longitud del valor enlazado
-        NULL
-        );
+    // La consulta se reinicia para la próxima llamada, sin dejar abierta la transacción de lectura
+    if (exit != SQLITE_DONE) {
+        auto msg = std::string("Error ejecutando la consulta SELECT RECIENTES: ").append(sqlite3_errmsg(c->db));
+        sqlite3_reset ( stmt );
+        throw std::runtime_error ( msg );
+    }
 
-    // Esta excepción debe llegar al WS.
-    // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit)
-        throw std::runtime_error (
-            std::string("Error alimentando a la consulta SELECT JSON (bind) [")
-            .append(std::to_string(exit))
-            .append("]: ")
-            .append(sqlite3_errmsg(db)) );
+    sqlite3_reset ( stmt );
+
+    return ids;
+}
 
-    exit = sqlite3_step ( this->select_json_stmt );
+/** ***************************************************************************
+ * Recorrido de los árboles de un rango de ID, en orden de ID, para la
+ * exportación. Cada JSON se entrega directamente desde el buffer de SQLite,
+ * que solo es válido durante la llamada, sin copiarlo. El recorrido es una
+ * única transacción de lectura: quien recorre mucho debe hacerlo en tramos
+ * (cortando con el lector), de modo que la instantánea en modo WAL no demore
+ * los checkpoints. Por eso, al terminar cada tramo la consulta se reinicia
+ * (aunque el lector la haya cortado), lo que cierra la transacción.
+ * @param desde Primer ID a recorrer
+ * @param hasta Último ID a recorrer
+ * @param lector Función que recibe el ID y el JSON de cada árbol (texto y
+ *               largo); si devuelve false, el recorrido se detiene
+ ** ***************************************************************************/
+void PersistSQLite::recorrer(int desde, int hasta, const std::function<bool(int, const char*, size_t)>& lector)
+{
+    Prestamo c( *this );
+    auto stmt = c->select_rango_stmt;
 
-    // Esta excepción debe llegar al WS.
-    // El WS no debe informar el error al cliente. Solo un BAD REQUEST o un SERVER ERROR. Puede loguear.
-    if (exit != SQLITE_ROW) {
-        throw std::runtime_error (
-            std::string("Error ejecutando la consulta SELECT JSON (sin resultados)[")
-            .append(std::to_string(exit))
-            .append("]: ")
-            .append(sqlite3_errmsg(db)) );
+    // SELECT ID, JSON FROM ARBOLES
+    // WHERE ID BETWEEN ? AND ? ORDER BY ID;
+    auto exit = sqlite3_bind_int ( stmt, 1, desde );
+    if (! exit)
+        exit = sqlite3_bind_int ( stmt, 2, hasta );
+
+    try {
+        while (! exit && (exit = sqlite3_step ( stmt )) == SQLITE_ROW) {
+            exit = 0;
+            if (! lector( sqlite3_column_int ( stmt, 0 ),
+                          (const char*)sqlite3_column_text ( stmt, 1 ),
+                          sqlite3_column_bytes ( stmt, 1 ) )) {
+                exit = SQLITE_DONE;
+                break;
+            }
+        }
+    }
+    catch (...) {
+        sqlite3_reset ( stmt );
+        throw;
     }
 
-    auto result = std::string((char*)sqlite3_column_text ( this->select_json_stmt, 0 ));
+    if (exit != SQLITE_DONE) {
+        auto msg = std::string("Error ejecutando la consulta SELECT RANGO: ").append(sqlite3_errmsg(c->db));
+        sqlite3_reset ( stmt );
+        throw std::runtime_error ( msg );
+    }
 
-    return result;
+    sqlite3_reset ( stmt );
+}
+
+/** ***************************************************************************
+ * Préstamo de una conexión: toma una libre del pool, o abre una nueva si
+ * todas están en uso. Hay a lo sumo tantas conexiones como hilos usando
+ * Persist a la vez.
+ * @param p Servicio de persistencia dueño del pool
+ ** ***************************************************************************/
+PersistSQLite::Prestamo::Prestamo(PersistSQLite& p)
+    : persist(p), conexion(NULL)
+{
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        const std::lock_guard<std::mutex> lock( persist.pool_mutex );
+        persist.metricas->espera( Metricas::POOL, std::chrono::steady_clock::now()-t0 );
+        if (! persist.libres.empty()) {
+            conexion = persist.libres.back();
+            persist.libres.pop_back();
+            return;
+        }
+    }
+
+    // Se abre fuera del mutex para no bloquear a los otros hilos
+    auto nueva = std::make_unique<Conexion>(persist.db_name, persist.pragmas, false);
+
+    const std::lock_guard<std::mutex> lock( persist.pool_mutex );
+    conexion = nueva.get();
+    persist.conexiones.push_back(std::move(nueva));
+}
+
+/** ***************************************************************************
+ * Fin del préstamo: la conexión vuelve al pool.
+ ** ***************************************************************************/
+PersistSQLite::Prestamo::~Prestamo()
+{
+    const std::lock_guard<std::mutex> lock( persist.pool_mutex );
+    persist.libres.push_back(conexion);
 }
 
 /** ***************************************************************************
- * Destructor. Finaliza los statements y cierra la conexión a BBDD.
+ * Destructor. Detiene el escritor del group commit, si lo hay, y cierra
+ * todas las conexiones del pool.
  ** ***************************************************************************/
-Persist::~Persist()
+PersistSQLite::~PersistSQLite()
 {
-    const std::lock_guard<std::mutex> lock( this->stmt_mutex );
+    // El escritor confirma lo que quede en la cola antes de terminar
+    {
+        const std::lock_guard<std::mutex> lock( this->cola_mutex );
+        terminar = true;
+    }
+    cola_cv.notify_one();
+    if (escritor.joinable())
+        escritor.join();
+
+    const std::lock_guard<std::mutex> lock( this->pool_mutex );
     std::cout << "Finalizando conexión a Base de Datos" << std::endl;
 
-    
+    libres.clear();
+    conexiones.clear();
+}
+
+/** ***************************************************************************
+ * Destructor de una conexión. Finaliza los statements y cierra la conexión a BBDD.
+ ** ***************************************************************************/
+PersistSQLite::Conexion::~Conexion()
+{
     if (auto exit = sqlite3_finalize ( this->insert_stmt ); exit)
         std::cerr << std::string("Error finalizando la consulta INSERT: [")
             .append(std::to_string(exit))
@@ -477,14 +2329,14 @@ Persist::~Persist()
 
     
 
-    if (auto exit = sqlite3_finalize ( this->select_id_stmt ); exit)
-        std::cerr << std::string("Error finalizando la consulta SELECT ID: [")
+    if (auto exit = sqlite3_finalize ( this->select_hash_stmt ); exit)
+        std::cerr << std::string("Error finalizando la consulta SELECT HASH: [")
             .append(std::to_string(exit))
             .append("]: ")
             .append(sqlite3_errmsg(db))
                   << std::endl;
 
-    this->select_id_stmt = NULL;
+    this->select_hash_stmt = NULL;
 
 
     if (auto exit = sqlite3_finalize ( this->select_json_stmt ); exit)
@@ -496,6 +2348,36 @@ Persist::~Persist()
 
     this->select_json_stmt = NULL;
 
+
+    if (auto exit = sqlite3_finalize ( this->select_clave_stmt ); exit)
+        std::cerr << std::string("Error finalizando la consulta SELECT CLAVE: [")
+            .append(std::to_string(exit))
+            .append("]: ")
+            .append(sqlite3_errmsg(db))
+                  << std::endl;
+
+    this->select_clave_stmt = NULL;
+
+
+    if (auto exit = sqlite3_finalize ( this->select_rango_stmt ); exit)
+        std::cerr << std::string("Error finalizando la consulta SELECT RANGO: [")
+            .append(std::to_string(exit))
+            .append("]: ")
+            .append(sqlite3_errmsg(db))
+                  << std::endl;
+
+    this->select_rango_stmt = NULL;
+
+
+    if (auto exit = sqlite3_finalize ( this->select_recientes_stmt ); exit)
+        std::cerr << std::string("Error finalizando la consulta SELECT RECIENTES: [")
+            .append(std::to_string(exit))
+            .append("]: ")
+            .append(sqlite3_errmsg(db))
+                  << std::endl;
+
+    this->select_recientes_stmt = NULL;
+
     sqlite3_close( this->db );
 
     this->db = NULL;
@@ -1,37 +1,175 @@
 #ifndef _RESTFUL_HPP_
 #define _RESTFUL_HPP_
 
+#include <chrono>    // std::chrono::microseconds
+#include <condition_variable> // std::condition_variable
+#include <deque>     // std::deque
+#include <functional> // std::function
+#include <initializer_list> // std::initializer_list
+#include <future>    // std::promise, std::future
 #include <memory>    // shared_ptr
+#include <map>       // std::multimap
 #include <mutex>     // mutex
+#include <string>    // std::string
+#include <thread>    // std::thread
+#include <unordered_map> // std::unordered_map
+#include <variant>   // std::variant
+#include <vector>    // std::vector
 #include <restbed>   // REST API
 #include <sqlite3.h> // SQLite3
 #include "json.hpp"  // soporte para JSON (nlohmann)
+#include "arbol.hpp" // árboles compilados y su caché
+#include "metricas.hpp" // métricas del servicio
+#include "pool.hpp"  // pool de hilos de cálculo
+#include "importar.hpp" // importación masiva de árboles
+#include "exportar.hpp" // exportación masiva de árboles
 using json=nlohmann::json;
 
 
 /* forward */
 class Control;
 
+long enteroDeEntorno(const char*, const char*); //< Entero no negativo de una variable de entorno, validado
+
 
 /**
  * Funcionalidad similar a la de un Service en MVCS.
  * Encapsula la lógica de persistencia (BBDD) y la hace
- * transparente para el modelo. En caso de tener varias
- * opciones de BBDD, se puede refactorizar esta clase para proveer
- * insert() y select() de forma transparente al backend.
+ * transparente para el modelo: es la interfaz común a los backends de
+ * almacenamiento, que se elige con RESTFUL_BACKEND (ver crear()):
+ *  - PersistSQLite: la BBDD SQLite (por omisión)
+ *  - PersistMemoria: un mapa en memoria, sin durabilidad (persistencia.hpp)
+ *  - PersistLog: un registro de solo agregado, mapeado en memoria (persistencia.hpp)
+ * Todos deduplican por el hash del JSON (ver hash128) y asignan ID enteros
+ * crecientes desde 1.
  */
 class Persist {
-private:
-  sqlite3      *db;               //< Acceso a BBDD
-  sqlite3_stmt *insert_stmt;      //< Consulta precompilada para insertar un JSON
-  sqlite3_stmt *select_id_stmt;   //< Consulta precompilada para obtener ID desde un JSON
-  sqlite3_stmt *select_json_stmt; //< Consulta precompilada para obtener JSON desde un ID
-  std::mutex    stmt_mutex;       //< El mutex protege las consultas precompiladas
 public:
-  Persist(); // Constructor, crea el archivo de BBDD si no existe
-  ~Persist();
-  int insert (const std::string);
+  virtual ~Persist() {}
+  virtual int insert (const std::string&) = 0;  //< Inserta un JSON (o lo encuentra) y devuelve su ID
+  virtual std::vector<int> insertLote (const std::vector<std::string>&); //< Inserta varios JSON, con una única confirmación
+  virtual void select (const std::string, const std::function<void(const char*, size_t)>&) = 0; //< JSON de un ID
+  virtual std::string clave (const std::string) = 0; //< Clave (hash) del JSON de un ID
+  virtual std::vector<int> recientes (size_t) = 0;   //< ID más recientes, del último hacia atrás
+  virtual void recorrer (int, int, const std::function<bool(int, const char*, size_t)>&) = 0; //< JSON de un rango de ID, en orden
+  virtual std::string archivo(void) const = 0;       //< Archivo de datos ("" si no hay)
   std::string select (const std::string);
+  static std::shared_ptr<Persist> crear(std::shared_ptr<Metricas> = nullptr);
+};
+
+
+/**
+ * Backend de persistencia en una BBDD SQLite.
+ *
+ * La BBDD funciona en modo WAL, con un pool de conexiones: cada hilo toma
+ * una conexión libre (con sus propias consultas precompiladas) mientras
+ * dura la operación, por lo que las lecturas corren en paralelo entre sí y
+ * con la escritura. Las escrituras se serializan entre ellas.
+ *
+ * Opcionalmente (group commit) las inserciones de varios hilos se encolan y
+ * un hilo escritor las confirma por lotes, en una transacción por lote.
+ */
+class PersistSQLite : public Persist {
+private:
+  /**
+   * Conexión a BBDD con sus consultas precompiladas. Solo la usa un hilo a la vez.
+   */
+  struct Conexion {
+    sqlite3      *db;               //< Acceso a BBDD
+    sqlite3_stmt *insert_stmt;      //< Consulta precompilada para insertar un JSON (si su hash es nuevo)
+    sqlite3_stmt *select_hash_stmt; //< Consulta precompilada para obtener ID y JSON desde un hash
+    sqlite3_stmt *select_json_stmt; //< Consulta precompilada para obtener JSON desde un ID
+    sqlite3_stmt *select_clave_stmt; //< Consulta precompilada para obtener el hash desde un ID
+    sqlite3_stmt *select_rango_stmt; //< Consulta precompilada para recorrer ID y JSON de un rango de ID
+    sqlite3_stmt *select_recientes_stmt; //< Consulta precompilada para obtener los ID más recientes
+    Conexion(const std::string&, const std::string&, bool);
+    ~Conexion();
+    void migrar(void);              //< Migración desde el esquema con JSON TEXT UNIQUE
+    int insertar(const std::string&, Metricas&);
+  };
+
+  /**
+   * Inserción encolada para el group commit, a la espera de su lote.
+   */
+  struct Pendiente {
+    std::string       json; //< JSON a insertar
+    std::promise<int> id;   //< Se resuelve tras el COMMIT del lote
+  };
+
+  /**
+   * Préstamo de una conexión del pool, que se devuelve al destruirse.
+   */
+  class Prestamo {
+    PersistSQLite &persist;
+    Conexion      *conexion;
+  public:
+    explicit Prestamo(PersistSQLite&);
+    ~Prestamo();
+    Conexion* operator->() const { return conexion; }
+  };
+
+  std::shared_ptr<Metricas> metricas;                 //< Esperas y tiempos de las consultas
+  std::string db_name;                                //< Archivo de BBDD
+  std::string pragmas;                                //< Ajustes aplicados a cada conexión nueva
+  std::vector< std::unique_ptr<Conexion> > conexiones; //< Todas las conexiones abiertas
+  std::vector<Conexion*> libres;                      //< Conexiones que ningún hilo está usando
+  std::mutex pool_mutex;                              //< Protege conexiones y libres
+  std::mutex escritura_mutex;                         //< Serializa las escrituras
+
+  std::chrono::microseconds grupo_ventana;            //< Ventana del group commit (0: desactivado)
+  size_t                    grupo_maximo;             //< Máximo de inserciones por lote
+  std::deque<Pendiente>     cola;                     //< Inserciones a la espera del escritor
+  std::mutex                cola_mutex;               //< Protege cola y terminar
+  std::condition_variable   cola_cv;                  //< Avisa al escritor de la cola o el cierre
+  bool                      terminar;                 //< Pide al escritor que vacíe la cola y termine
+  std::thread               escritor;                 //< Hilo que confirma los lotes
+  void escribirLotes(void);
+  void escribirLote(std::vector<Pendiente>&);
+  std::vector<int> transaccion(size_t, const std::function<const std::string&(size_t)>&);
+public:
+  explicit PersistSQLite(std::shared_ptr<Metricas> = nullptr); // Constructor, crea el archivo de BBDD si no existe
+  ~PersistSQLite();
+  using Persist::select;
+  int insert (const std::string&) override;
+  std::vector<int> insertLote (const std::vector<std::string>&) override;
+  std::future<int> insertAsync (std::string);
+  void select (const std::string, const std::function<void(const char*, size_t)>&) override;
+  std::string clave (const std::string) override;
+  std::vector<int> recientes (size_t) override;
+  void recorrer (int, int, const std::function<bool(int, const char*, size_t)>&) override;
+  std::string archivo(void) const override { return db_name; } //< Archivo de BBDD
+};
+
+
+/**
+ * Política de conexiones persistentes (HTTP keep-alive) de los web services.
+ * Decide, al responder cada solicitud, si la conexión queda abierta para la
+ * siguiente o se cierra: se cierra si el keep-alive está desactivado, si el
+ * cliente lo pide, si la conexión ya atendió el máximo de solicitudes, o si
+ * ya hay demasiadas conexiones persistentes abiertas. Las conexiones se
+ * siguen con weak_ptr, de modo que las que cierra el cliente o vence el
+ * tiempo de inactividad dejan de contarse solas.
+ */
+class Conexiones {
+private:
+  struct Conexion {
+    std::weak_ptr<const restbed::Session> session; //< Sesión de la conexión
+    int solicitudes;                                //< Solicitudes ya atendidas
+  };
+  std::chrono::milliseconds inactividad;     //< Tiempo máximo sin solicitudes; 0 desactiva el keep-alive
+  int                       maximo_solicitudes; //< Solicitudes por conexión
+  size_t                    maximo_conexiones;  //< Conexiones persistentes simultáneas
+  std::unordered_map<const restbed::Session*, Conexion> abiertas; //< Conexiones persistentes
+  std::mutex                conexiones_mutex;   //< Protege abiertas
+  bool activo(void) const { return inactividad.count()>0 && maximo_solicitudes>0 && maximo_conexiones>0; }
+public:
+  Conexiones();
+  void configurar(restbed::Settings&) const;
+  bool mantener(const std::shared_ptr<const restbed::Session>&, bool);
+  bool persistente(const std::shared_ptr<restbed::Session>&, std::multimap<std::string, std::string>&);
+  void responder(const std::shared_ptr<restbed::Session>&, int, const std::string&,
+                 std::multimap<std::string, std::string>);
+  size_t cantidad(void);
 };
 
 
@@ -41,10 +179,12 @@ public:
  */
 class Endpoint {
     std::shared_ptr< restbed::Service > service; //< Control de los web services
+    std::shared_ptr< Conexiones > conexiones;    //< Política de conexiones persistentes
 public:
   Endpoint ();
   ~Endpoint();
   int runWS(const std::shared_ptr<Control> control); //< Ejecución de los web services
+  std::shared_ptr< Conexiones > getConexiones(void) { return conexiones; }
 };
 
 
@@ -55,11 +195,37 @@ public:
 class Modelo {
 private:
   std::shared_ptr<Persist> persistService;  //< Acceso al servicio de persistencia en BBDD
+  std::shared_ptr<CacheArboles> cacheArboles; //< Árboles ya compilados, por ID
+  std::shared_ptr<Metricas> metricas;         //< Métricas del servicio
+  std::unordered_map< int, std::shared_future< std::shared_ptr<const ArbolCompilado> > > compilando; //< Árboles en compilación, por ID
+  std::mutex compilando_mutex;                //< Protege compilando
+  std::string instantaneas;                   //< Directorio de las instantáneas ("" si están desactivadas)
+  std::string archivoInstantanea(int) const;
+  void guardarInstantanea(int, const ArbolCompilado&, const std::string&);
+  std::shared_ptr<const ArbolCompilado> obtenerArbol(const json&, Tiempos*);
+  std::shared_ptr<const ArbolCompilado> compilarArbol(const json&, Tiempos*);
+  std::shared_ptr<const ArbolCompilado> arbolDeBusqueda(const json&, std::initializer_list<const char*>, Tiempos*);
+  int nodoDeBusqueda(const ArbolCompilado&, const json&, Tiempos*);
 public:
-  Modelo();
+  explicit Modelo(std::shared_ptr<Metricas> = nullptr);
   ~Modelo();
-  int createNewTree(const json);
-  std::shared_ptr<json> lowestCommonAncestor(const json);
+  int createNewTree(const json&);
+  int createNewTree(ArbolPlano&&, Tiempos* = nullptr);
+  std::vector<int> createNewTrees(const std::vector<std::string>&);
+  void exportTrees(int, int, const std::function<bool(int, const char*, size_t)>&);
+  int patchTree(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestor(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestor(const json&, const json&, const json&, Tiempos* = nullptr);
+  template<class Clave>
+  std::variant< Clave, std::shared_ptr<json> > lowestCommonAncestor(const json&, const Clave&, const Clave&,
+                                                                    Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestorBatch(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> nodeDepth(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> nodeDistance(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> kthAncestor(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> nodePath(const json&, Tiempos* = nullptr);
+  size_t precargar(size_t, PoolCalculo&);
+  void medidas(std::string&);
 };
 
 
@@ -71,14 +237,45 @@ public:
 class Control
   :public std::enable_shared_from_this<Control> {
 private:
+  std::shared_ptr<Metricas> metricas;    //< Métricas del servicio, compartidas por todas las capas
   std::shared_ptr<Endpoint> webServices; //< Acceso a la vista (Endpoint)
   std::shared_ptr<Modelo>   modeloArbol; //< Acceso al modelo
+  std::shared_ptr<PoolCalculo> poolCalculo; //< Hilos para el cálculo y la BBDD de las solicitudes
+  int                       reintento;     //< Segundos de Retry-After al rechazar por cola llena
+  bool                      server_timing; //< Si se envía la cabecera Server-Timing
+  std::chrono::milliseconds umbral_lento;  //< Solicitudes que se registran como lentas (0: ninguna)
+  size_t                    precarga;      //< Árboles a precargar antes de atender (0: ninguno)
+  size_t                    lote_importacion; //< Líneas por lote de la importación masiva
+  size_t                    maximo_arbol;  //< Bytes máximos del JSON de un árbol
 public:
   Control();
   ~Control();
   int run(void);
-  int newTreeInterface(const json);
-  std::shared_ptr<json> lowestCommonAncestorInterface(const json);
+  size_t warmUpInterface(void);
+  int newTreeInterface(const json&);
+  int newTreeInterface(ArbolPlano&&, Tiempos* = nullptr);
+  std::unique_ptr<Importador> importInterface(size_t);
+  std::unique_ptr<Exportador> exportInterface(Exportador::Formato, int, int);
+  int patchTreeInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestorInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestorInterface(const json&, const json&, const json&, Tiempos* = nullptr);
+  template<class Clave>
+  std::variant< Clave, std::shared_ptr<json> > lowestCommonAncestorInterface(const json&, const Clave&, const Clave&,
+                                                                             Tiempos* = nullptr);
+  std::shared_ptr<json> lowestCommonAncestorBatchInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> depthInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> distanceInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> kthAncestorInterface(const json&, Tiempos* = nullptr);
+  std::shared_ptr<json> pathInterface(const json&, Tiempos* = nullptr);
+  void replyInterface(const std::shared_ptr<restbed::Session>&, int, const std::string&,
+                      const std::multimap<std::string, std::string>&);
+  bool keepAliveInterface(const std::shared_ptr<restbed::Session>&, std::multimap<std::string, std::string>&);
+  std::string metricsInterface(void);
+  std::shared_ptr<Tiempos> timingInterface(Tiempos::reloj::time_point);
+  bool computeInterface(PoolCalculo::Tarea);
+  int getRetryAfter(void) const { return reintento; }
+  size_t getMaxTreeBytes(void) const { return maximo_arbol; }
+  std::shared_ptr<Metricas> getMetricas(void) { return metricas; }
 };
 
 
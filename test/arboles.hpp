@@ -0,0 +1,123 @@
+#ifndef _ARBOLES_HPP_
+#define _ARBOLES_HPP_
+
+#include <cstdint>   // int32_t
+#include <random>    // std::mt19937
+#include <string>    // std::string
+#include <utility>   // std::pair
+#include <vector>    // std::vector
+#include "../arbol.hpp" // ArbolPlano
+
+
+/*
+ * Generadores de árboles para pruebas, benchmarks y pruebas de carga.
+ * Arman directamente el árbol aplanado, sin el JSON completo, por lo que
+ * sirven también para árboles muy profundos (una cadena de 10^6 nodos) que
+ * nlohmann::json no puede destruir ni serializar sin agotar la pila.
+ * El texto JSON se obtiene con ArbolPlano::serializar().
+ */
+
+/**
+ * Forma del árbol.
+ */
+enum class Forma {
+  BALANCEADO, //< Árbol completo, los nodos numerados por niveles (el más ancho posible)
+  CADENA,     //< Árbol degenerado: cada nodo es hijo izquierdo del anterior
+  ALEATORIO   //< Cada nodo cuelga de un lugar libre elegido al azar
+};
+
+/**
+ * Tipo de dato del campo "node".
+ */
+enum class Carga {
+  ENTERO,     //< base+i
+  TEXTO,      //< "nodo-<base+i>"
+  OBJETO      //< {"id":base+i,"nombre":"nodo-<base+i>"}
+};
+
+/**
+ * Nombres de las formas y cargas, para los informes.
+ */
+inline const char* nombre(Forma f)
+{
+  return f==Forma::BALANCEADO ? "balanceado" : f==Forma::CADENA ? "cadena" : "aleatorio";
+}
+
+inline const char* nombre(Carga c)
+{
+  return c==Carga::ENTERO ? "entero" : c==Carga::TEXTO ? "texto" : "objeto";
+}
+
+/**
+ * Valor del campo "node" del nodo i.
+ * @param carga Tipo de dato
+ * @param i Número de nodo (ya sumada la base)
+ * @return Valor del nodo
+ */
+inline json valorNodo(Carga carga, int64_t i)
+{
+  switch (carga)
+  {
+  case Carga::ENTERO: return i;
+  case Carga::TEXTO:  return "nodo-"+std::to_string(i);
+  default:            return {{"id", i}, {"nombre", "nodo-"+std::to_string(i)}};
+  }
+}
+
+/**
+ * Árbol de n nodos con los valores base..base+n-1. Con la misma semilla, el
+ * árbol aleatorio es siempre el mismo; cambiando la base se obtienen árboles
+ * distintos de la misma forma.
+ * @param forma Forma del árbol
+ * @param carga Tipo de dato de los nodos
+ * @param n Cantidad de nodos (al menos 1)
+ * @param base Valor del primer nodo
+ * @param semilla Semilla para Forma::ALEATORIO
+ * @return Árbol aplanado, con la raíz en el nodo 0
+ */
+inline ArbolPlano generarArbol(Forma forma, Carga carga, int32_t n, int64_t base=0, unsigned semilla=42)
+{
+  ArbolPlano arbol;
+
+  arbol.nodos.reserve(n);
+  for (int32_t i = 0; i < n; i++)
+    arbol.nodos.push_back(valorNodo(carga, base+i));
+  arbol.izquierdo.assign(n, -1);
+  arbol.derecho.assign(n, -1);
+
+  switch (forma)
+  {
+  case Forma::BALANCEADO:
+    for (int32_t i = 0; i < n; i++) {
+      if (int64_t(2)*i+1 < n) arbol.izquierdo[i] = 2*i+1;
+      if (int64_t(2)*i+2 < n) arbol.derecho[i] = 2*i+2;
+    }
+    break;
+
+  case Forma::CADENA:
+    for (int32_t i = 0; i+1 < n; i++)
+      arbol.izquierdo[i] = i+1;
+    break;
+
+  case Forma::ALEATORIO: {
+    // Lugares libres (nodo, rama derecha): cada nodo nuevo ocupa uno al azar
+    std::mt19937 gen(semilla);
+    std::vector< std::pair<int32_t, bool> > libres = {{0, false}, {0, true}};
+    for (int32_t i = 1; i < n; i++) {
+      auto k = gen() % libres.size();
+      auto [p, derecho] = libres[k];
+      libres[k] = libres.back();
+      libres.pop_back();
+      (derecho ? arbol.derecho : arbol.izquierdo)[p] = i;
+      libres.push_back({i, false});
+      libres.push_back({i, true});
+    }
+    break;
+  }
+  }
+
+  return arbol;
+}
+
+
+#endif
@@ -0,0 +1,985 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <malloc.h>
+#include <new>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <sys/stat.h>
+#include "../json.hpp"
+#include "../restful.hpp"
+#include "../persistencia.hpp"
+#include "../lector.hpp"
+#include "arboles.hpp"
+
+// Memoria en uso y su pico, para medir la memoria de trabajo de una operación,
+// y cantidad de reservas, para medir las reservas por operación
+static std::atomic<long> enUso{0}, pico{0}, reservas{0};
+
+void* operator new(std::size_t n)
+{
+    void *p = std::malloc(n ? n : 1);
+    if (! p)
+        throw std::bad_alloc();
+    reservas++;
+    long actual = enUso += malloc_usable_size(p);
+    for (long anterior = pico; actual>anterior && ! pico.compare_exchange_weak(anterior, actual); )
+        ;
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    enUso -= malloc_usable_size(p);
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
+
+/*
+ * Benchmarks en proceso del modelo y de la persistencia.
+ *  1. Consultas de ancestro común sobre árboles compilados: una vez armado
+ *     el índice, el tiempo por consulta no depende del tamaño del árbol.
+ *  2. Inserciones en BBDD: esquema anterior (JSON TEXT UNIQUE) contra el
+ *     esquema actual (índice por hash), con el tamaño final del archivo.
+ *  3. Lecturas en BBDD según la cantidad de hilos, con el pool de conexiones
+ *     y con todas las lecturas serializadas por un único mutex.
+ *  4. Inserciones concurrentes con y sin group commit.
+ *  5. Ingesta de un árbol de ~1 MiB: DOM completo (json::parse y dump)
+ *     contra la lectura incremental, con el pico de memoria de cada una.
+ *  6. Árboles de 10^5 a 10^7 nodos: carga por partes, primera consulta
+ *     (lectura de la BBDD y compilación) y consultas con el árbol en caché.
+ *  7. Modelo y persistencia por forma de árbol (balanceado, cadena,
+ *     aleatorio; nodos enteros, de texto u objetos) y tamaño (10 a 10^6
+ *     nodos): createNewTree, Persist::insert, Persist::select y
+ *     lowestCommonAncestor, con ns/op, reservas/op y percentiles. Además de
+ *     la tabla, cada resultado se escribe como una línea JSON en
+ *     test/bench.jsonl.
+ *  8. Backends de persistencia (RESTFUL_BACKEND: sqlite, memoria, log):
+ *     inserciones nuevas y repetidas, lecturas con 1 y 4 hilos, tamaño del
+ *     archivo y tiempo de apertura con los árboles ya guardados.
+ *  9. Importación masiva en NDJSON (Control::importInterface) contra crear
+ *     los mismos árboles de a uno, como POST /crear-arbol.
+ * 10. Exportación masiva (Control::exportInterface) contra leer los mismos
+ *     árboles de a uno con Persist::select, con el pico de memoria, en
+ *     SQLite y en el registro.
+ * 11. Modificación de árboles grandes (Control::patchTreeInterface, un
+ *     subárbol pequeño colgado de un nodo al azar) contra volver a crear el
+ *     árbol modificado completo, como haría un cliente sin modificaciones.
+ * 12. Decodificación del parámetro q de /ancestro-comun: json::parse contra
+ *     ConsultaAncestro::decodificar, solo la decodificación y junto con la
+ *     consulta (Control::lowestCommonAncestorInterface), con nodos enteros
+ *     y de texto, en ns/op y reservas/op.
+ * 13. Árboles de enteros y de cadenas (ArbolCompilado::Tipo) contra el mismo
+ *     árbol con los valores en JSON: memoria, compilación, búsqueda y
+ *     ancestro común con valores JSON y con valores tipados, y la consulta
+ *     completa (Control::lowestCommonAncestorInterface) general y tipada.
+ *
+ * Sin argumentos se ejecutan todos; si no, solo los nombrados (ancestros,
+ * persist, select, group-commit, ingesta, grandes, modelo, backends,
+ * importacion, exportacion, modificacion, consulta, tipado).
+ */
+
+using reloj = std::chrono::steady_clock;
+
+static double milisegundos(reloj::time_point desde, reloj::time_point hasta)
+{
+    return std::chrono::duration<double, std::milli>(hasta-desde).count();
+}
+
+static long tamanioArchivo(const char *archivo)
+{
+    struct stat st;
+    return stat(archivo, &st) ? -1 : st.st_size;
+}
+
+/**
+ * Árbol balanceado con los nodos base..base+n-1 numerados por niveles.
+ */
+static json balanceado(int n, int base=0)
+{
+    std::function<json(int)> armar = [&] (int i) {
+        json o = {{"node", base+i}};
+        if (2*i+1 < n) o["left"] = armar(2*i+1);
+        if (2*i+2 < n) o["right"] = armar(2*i+2);
+        return o;
+    };
+    return armar(0);
+}
+
+static void benchAncestroComun(void)
+{
+    const int CONSULTAS = 1000000;
+    std::mt19937 gen(42);
+
+    std::printf("\n== Ancestro común sobre árbol compilado ==\n");
+    std::printf("%10s %14s %14s %12s\n", "nodos", "indexado (ms)", "memoria (KiB)", "ns/consulta");
+
+    for (int n = 10; n <= 1000000; n *= 10)
+    {
+        auto arbol_json = balanceado(n);
+
+        auto t0 = reloj::now();
+        ArbolCompilado arbol(arbol_json);
+        auto t1 = reloj::now();
+
+        std::vector< std::pair<int,int> > pares(CONSULTAS);
+        for (auto& p : pares)
+            p = {gen() % n, gen() % n};
+
+        long suma = 0;
+        auto t2 = reloj::now();
+        for (auto& p : pares)
+            suma += arbol.ancestroComun(p.first, p.second);
+        auto t3 = reloj::now();
+
+        std::printf("%10d %14.2f %14zu %12.1f%s\n", n, milisegundos(t0, t1),
+                    arbol.memoria()/1024,
+                    std::chrono::duration<double, std::nano>(t3-t2).count()/CONSULTAS,
+                    suma < 0 ? "?" : "");
+    }
+}
+
+/**
+ * Inserción con el esquema y las consultas anteriores a la deduplicación por
+ * hash: INSERT que falla por UNIQUE si el texto existe, y SELECT por texto.
+ */
+static int insertAnterior(sqlite3 *db, sqlite3_stmt *insert, sqlite3_stmt *select, const std::string& s)
+{
+    sqlite3_reset(insert);
+    sqlite3_bind_text(insert, 1, s.c_str(), s.length(), NULL);
+    sqlite3_step(insert);
+    sqlite3_reset(select);
+    sqlite3_bind_text(select, 1, s.c_str(), s.length(), NULL);
+    if (sqlite3_step(select) != SQLITE_ROW)
+        throw std::runtime_error(sqlite3_errmsg(db));
+    return sqlite3_column_int(select, 0);
+}
+
+static void benchPersist(void)
+{
+    const int ARBOLES = 2000;
+    const char *archivo = "test/bench.db";
+    std::vector<std::string> textos;
+
+    for (int i = 0; i < ARBOLES; i++)
+        textos.push_back(balanceado(200, i*200).dump());
+
+    std::printf("\n== Inserción de %d árboles de 200 nodos (%zu bytes c/u) ==\n", ARBOLES, textos[0].size());
+    std::printf("%-22s %16s %16s %14s\n", "esquema", "nuevos (ins/s)", "repetidos (ins/s)", "archivo (KiB)");
+
+    {
+        std::remove(archivo);
+        sqlite3 *db;
+        sqlite3_stmt *insert, *select;
+        sqlite3_open(archivo, &db);
+        sqlite3_exec(db, "CREATE TABLE ARBOLES (ID INTEGER PRIMARY KEY, JSON TEXT UNIQUE NOT NULL);", NULL, NULL, NULL);
+        sqlite3_prepare_v2(db, "INSERT INTO ARBOLES (JSON) VALUES (?);", -1, &insert, NULL);
+        sqlite3_prepare_v2(db, "SELECT ID FROM ARBOLES WHERE JSON = ?;", -1, &select, NULL);
+
+        auto t0 = reloj::now();
+        for (auto& s : textos)
+            insertAnterior(db, insert, select, s);
+        auto t1 = reloj::now();
+        for (auto& s : textos)
+            insertAnterior(db, insert, select, s);
+        auto t2 = reloj::now();
+
+        sqlite3_finalize(insert);
+        sqlite3_finalize(select);
+        sqlite3_close(db);
+
+        std::printf("%-22s %16.0f %16.0f %14ld\n", "JSON TEXT UNIQUE",
+                    ARBOLES/milisegundos(t0, t1)*1000, ARBOLES/milisegundos(t1, t2)*1000,
+                    tamanioArchivo(archivo)/1024);
+    }
+
+    {
+        std::remove(archivo);
+        setenv("RESTFUL_DB", archivo, 1);
+        auto t0 = reloj::now(), t1 = t0, t2 = t0;
+        {
+            PersistSQLite p;
+            t0 = reloj::now();
+            for (auto& s : textos)
+                p.insert(s);
+            t1 = reloj::now();
+            for (auto& s : textos)
+                p.insert(s);
+            t2 = reloj::now();
+        }
+
+        std::printf("%-22s %16.0f %16.0f %14ld\n", "HASH BLOB UNIQUE",
+                    ARBOLES/milisegundos(t0, t1)*1000, ARBOLES/milisegundos(t1, t2)*1000,
+                    tamanioArchivo(archivo)/1024);
+    }
+
+    std::remove(archivo);
+}
+
+static void benchSelect(void)
+{
+    const int ARBOLES = 1000, LECTURAS = 20000;
+    const char *archivo = "test/bench.db";
+
+    std::remove(archivo);
+    setenv("RESTFUL_DB", archivo, 1);
+    auto p = std::make_unique<PersistSQLite>();
+    std::vector<std::string> ids;
+
+    for (int i = 0; i < ARBOLES; i++)
+        ids.push_back(std::to_string(p->insert(balanceado(200, i*200).dump())));
+
+    std::printf("\n== Lecturas de árboles de 200 nodos (%d por hilo) ==\n", LECTURAS);
+    std::printf("%6s %20s %20s\n", "hilos", "pool (sel/s)", "mutex único (sel/s)");
+
+    for (int hilos = 1; hilos <= 8; hilos *= 2)
+    {
+        double resultados[2];
+
+        for (int serializado = 0; serializado < 2; serializado++)
+        {
+            std::mutex mutex_unico;
+            std::vector<std::thread> trabajadores;
+
+            auto t0 = reloj::now();
+            for (int h = 0; h < hilos; h++)
+                trabajadores.emplace_back([&, h] () {
+                    std::mt19937 gen(h);
+                    for (int i = 0; i < LECTURAS; i++) {
+                        auto& id = ids[gen() % ARBOLES];
+                        if (serializado) {
+                            const std::lock_guard<std::mutex> lock(mutex_unico);
+                            p->select(id);
+                        }
+                        else
+                            p->select(id);
+                    }
+                });
+            for (auto& t : trabajadores)
+                t.join();
+            auto t1 = reloj::now();
+
+            resultados[serializado] = hilos*LECTURAS/milisegundos(t0, t1)*1000;
+        }
+
+        std::printf("%6d %20.0f %20.0f\n", hilos, resultados[0], resultados[1]);
+    }
+
+    p.reset();
+    std::remove(archivo);
+}
+
+static void benchGroupCommit(void)
+{
+    const int HILOS = 8, POR_HILO = 250;
+    const char *archivo = "test/bench.db";
+    std::vector<std::string> textos;
+
+    for (int i = 0; i < HILOS*POR_HILO; i++)
+        textos.push_back(balanceado(200, i*200).dump());
+
+    std::printf("\n== Inserciones concurrentes (%d hilos x %d árboles) ==\n", HILOS, POR_HILO);
+    std::printf("%-28s %14s\n", "modo", "ins/s");
+
+    for (auto ventana : {"0", "100", "300", "1000", "5000"})
+    {
+        std::remove(archivo);
+        setenv("RESTFUL_DB", archivo, 1);
+        setenv("RESTFUL_DB_GROUP_COMMIT_US", ventana, 1);
+
+        double ms;
+        {
+            PersistSQLite p;
+            std::vector<std::thread> trabajadores;
+
+            auto t0 = reloj::now();
+            for (int h = 0; h < HILOS; h++)
+                trabajadores.emplace_back([&, h] () {
+                    for (int i = h*POR_HILO; i < (h+1)*POR_HILO; i++)
+                        p.insert(textos[i]);
+                });
+            for (auto& t : trabajadores)
+                t.join();
+            ms = milisegundos(t0, reloj::now());
+        }
+
+        auto modo = std::string(ventana)=="0" ? std::string("sin group commit") :
+            std::string("group commit, ventana ").append(ventana).append(" µs");
+        std::printf("%-28s %14.0f\n", modo.c_str(), HILOS*POR_HILO/ms*1000);
+    }
+
+    unsetenv("RESTFUL_DB_GROUP_COMMIT_US");
+    std::remove(archivo);
+}
+
+static void benchIngesta(void)
+{
+    const int REPETICIONES = 20, PARTE = 64*1024;
+    auto texto = balanceado(35000).dump();
+
+    std::printf("\n== Ingesta de un árbol de 35000 nodos (%zu bytes) ==\n", texto.size());
+    std::printf("%-24s %12s %22s\n", "método", "ms/árbol", "pico de memoria (xbody)");
+
+    for (int incremental = 0; incremental < 2; incremental++)
+    {
+        std::string guardado;
+        long base = enUso;
+        pico = base;
+
+        auto t0 = reloj::now();
+        for (int r = 0; r < REPETICIONES; r++) {
+            if (incremental) {
+                LectorArbol lector;
+                for (size_t i = 0; i < texto.size(); i += PARTE)
+                    lector.leer(texto.data()+i, std::min<size_t>(PARTE, texto.size()-i));
+                guardado = lector.terminar().serializar();
+            }
+            else {
+                // El camino anterior: copia del cuerpo, DOM completo y dump
+                auto copia = std::string(texto.data(), texto.size());
+                guardado = json::parse(copia).dump();
+            }
+        }
+        auto t1 = reloj::now();
+
+        std::printf("%-24s %12.2f %22.1f\n", incremental ? "incremental (por partes)" : "DOM (json::parse)",
+                    milisegundos(t0, t1)/REPETICIONES, double(pico-base)/texto.size());
+    }
+}
+
+/**
+ * Texto compacto de un árbol balanceado de n nodos, como el de
+ * balanceado(n).dump(), pero armado directamente, sin el DOM.
+ */
+static std::string textoBalanceado(int n)
+{
+    std::string texto;
+    std::function<void(int)> armar = [&] (int i) {
+        texto += '{';
+        if (2*i+1 < n) {
+            texto += "\"left\":";
+            armar(2*i+1);
+            texto += ',';
+        }
+        texto.append("\"node\":").append(std::to_string(i));
+        if (2*i+2 < n) {
+            texto += ",\"right\":";
+            armar(2*i+2);
+        }
+        texto += '}';
+    };
+    armar(0);
+    return texto;
+}
+
+static void benchArbolesGrandes(void)
+{
+    const size_t PARTE = 64*1024;
+    const char *archivo = "test/bench.db";
+
+    std::remove(archivo);
+    setenv("RESTFUL_DB", archivo, 1);
+    setenv("RESTFUL_CACHE_MB", "8192", 1);
+
+    std::printf("\n== Árboles grandes: carga por partes y consultas ==\n");
+    std::printf("%10s %12s %12s %16s %14s %18s %18s\n", "nodos", "texto (MiB)", "carga (ms)",
+                "1ra consulta (ms)", "µs/consulta", "pico carga (xbody)", "con instant. (ms)");
+
+    for (int n = 100000; n <= 10000000; n *= 10)
+    {
+        auto texto = textoBalanceado(n);
+        int id;
+
+        long base = enUso;
+        pico = base;
+        auto t0 = reloj::now();
+        {
+            const auto c = std::make_shared< Control >();
+            LectorArbol lector;
+            for (size_t i = 0; i < texto.size(); i += PARTE)
+                lector.leer(texto.data()+i, std::min(PARTE, texto.size()-i));
+            id = c->newTreeInterface(lector.terminar());
+        }
+        auto t1 = reloj::now();
+        double pico_carga = double(pico-base)/texto.size();
+
+        // Un Control nuevo no tiene el árbol en caché: la primera consulta lo
+        // lee de la BBDD y lo compila, las siguientes usan la caché.
+        const auto c = std::make_shared< Control >();
+        auto t2 = reloj::now();
+        c->lowestCommonAncestorInterface({{"id", id}, {"node_a", n-1}, {"node_b", n/2}});
+        auto t3 = reloj::now();
+
+        const int CONSULTAS = 100;
+        std::mt19937 gen(42);
+        auto t4 = reloj::now();
+        for (int i = 0; i < CONSULTAS; i++)
+            c->lowestCommonAncestorInterface({{"id", id}, {"node_a", int(gen() % n)}, {"node_b", int(gen() % n)}});
+        auto t5 = reloj::now();
+
+        // Primera consulta tras un reinicio con la instantánea ya guardada
+        setenv("RESTFUL_SNAPSHOT", "1", 1);
+        std::make_shared< Control >()->lowestCommonAncestorInterface({{"id", id}, {"node_a", n-1}, {"node_b", n/2}});
+        const auto r = std::make_shared< Control >();
+        auto t6 = reloj::now();
+        r->lowestCommonAncestorInterface({{"id", id}, {"node_a", n-1}, {"node_b", n/2}});
+        auto t7 = reloj::now();
+        unsetenv("RESTFUL_SNAPSHOT");
+
+        std::printf("%10d %12.1f %12.0f %16.0f %14.1f %18.1f %18.1f\n", n, texto.size()/1048576.0,
+                    milisegundos(t0, t1), milisegundos(t2, t3),
+                    std::chrono::duration<double, std::micro>(t5-t4).count()/CONSULTAS, pico_carga,
+                    milisegundos(t6, t7));
+    }
+
+    unsetenv("RESTFUL_CACHE_MB");
+    std::remove(archivo);
+    std::filesystem::remove_all(std::string(archivo)+".arboles");
+}
+
+/**
+ * Tiempos y reservas de memoria de cada repetición de una operación.
+ */
+struct Medicion {
+    std::vector<double> ns;  // duración de cada repetición
+    long reservas = 0;       // reservas de memoria en total
+
+    template<class Operacion> void medir(Operacion&& operacion)
+    {
+        long r0 = ::reservas;
+        auto t0 = reloj::now();
+        operacion();
+        auto t1 = reloj::now();
+        reservas += ::reservas-r0;
+        ns.push_back(std::chrono::duration<double, std::nano>(t1-t0).count());
+    }
+
+    double percentil(double p) const
+    {
+        auto orden = ns;
+        std::sort(orden.begin(), orden.end());
+        return orden[std::min(orden.size()-1, size_t(p*orden.size()))];
+    }
+};
+
+static void informar(std::ofstream& salida, const char *operacion, Forma forma, Carga carga, int n,
+                     const Medicion& m)
+{
+    double total = 0;
+    for (auto t : m.ns)
+        total += t;
+
+    json linea = {
+        {"bench", "modelo"}, {"op", operacion}, {"forma", nombre(forma)}, {"carga", nombre(carga)},
+        {"nodos", n}, {"ops", m.ns.size()}, {"ns_op", total/m.ns.size()},
+        {"reservas_op", double(m.reservas)/m.ns.size()},
+        {"p50_ns", m.percentil(0.5)}, {"p90_ns", m.percentil(0.9)},
+        {"p99_ns", m.percentil(0.99)}, {"max_ns", m.percentil(1)}
+    };
+    salida << linea.dump() << std::endl;
+
+    std::printf("%-11s %-7s %8d %-20s %7zu %13.0f %12.1f %13.0f %13.0f\n", nombre(forma), nombre(carga), n,
+                operacion, m.ns.size(), total/m.ns.size(), double(m.reservas)/m.ns.size(),
+                m.percentil(0.5), m.percentil(0.99));
+}
+
+static void benchModelo(void)
+{
+    const char *archivo = "test/bench.db";
+    const std::pair<Forma, Carga> casos[] = {
+        {Forma::BALANCEADO, Carga::ENTERO}, {Forma::CADENA, Carga::ENTERO},
+        {Forma::ALEATORIO, Carga::ENTERO}, {Forma::BALANCEADO, Carga::TEXTO},
+        {Forma::BALANCEADO, Carga::OBJETO}
+    };
+    std::ofstream salida("test/bench.jsonl");
+
+    // Se mide el código y no el fsync de cada inserción (en WAL, NORMAL no
+    // sincroniza en cada COMMIT); la caché retiene todos los árboles creados.
+    setenv("RESTFUL_DB", archivo, 1);
+    setenv("RESTFUL_DB_SYNCHRONOUS", "NORMAL", 1);
+    setenv("RESTFUL_CACHE_MB", "4096", 1);
+
+    std::printf("\n== Modelo y persistencia por forma y tamaño de árbol (también en test/bench.jsonl) ==\n");
+    std::printf("%-11s %-7s %8s %-20s %7s %13s %12s %13s %13s\n", "forma", "carga", "nodos", "operación",
+                "ops", "ns/op", "reservas/op", "p50 (ns)", "p99 (ns)");
+
+    for (auto [forma, carga] : casos)
+        for (int n = 10; n <= 1000000; n *= 10)
+        {
+            const int REPETICIONES = std::clamp(1000000/n, 5, 1000);
+            const int CONSULTAS = std::clamp(10000000/n, 100, 10000);
+
+            std::remove(archivo);
+            PersistSQLite p;
+            Modelo m;
+            std::vector<int> ids;
+
+            // Árboles nuevos (distinta base), armados fuera de la medición
+            Medicion crear, insertar, leer, consultar;
+            for (int r = 0; r < REPETICIONES; r++) {
+                auto plano = generarArbol(forma, carga, n, int64_t(r)*n);
+                crear.medir([&] () { ids.push_back(m.createNewTree(std::move(plano))); });
+            }
+            informar(salida, "createNewTree", forma, carga, n, crear);
+
+            std::vector<std::string> ids_persist;
+            for (int r = 0; r < REPETICIONES; r++) {
+                auto texto = generarArbol(forma, carga, n, int64_t(REPETICIONES+r)*n).serializar();
+                insertar.medir([&] () { ids_persist.push_back(std::to_string(p.insert(texto))); });
+            }
+            informar(salida, "Persist::insert", forma, carga, n, insertar);
+
+            size_t bytes = 0;
+            for (int r = 0; r < REPETICIONES; r++)
+                leer.medir([&] () { bytes += p.select(ids_persist[r]).size(); });
+            informar(salida, "Persist::select", forma, carga, n, leer);
+
+            // Consultas sobre el primer árbol, ya en caché
+            std::mt19937 gen(n);
+            std::vector<json> busquedas;
+            for (int i = 0; i < CONSULTAS; i++)
+                busquedas.push_back({{"id", ids[0]}, {"node_a", valorNodo(carga, gen() % n)},
+                                     {"node_b", valorNodo(carga, gen() % n)}});
+            for (auto& b : busquedas)
+                consultar.medir([&] () { m.lowestCommonAncestor(b); });
+            informar(salida, "lowestCommonAncestor", forma, carga, n, consultar);
+        }
+
+    unsetenv("RESTFUL_DB_SYNCHRONOUS");
+    unsetenv("RESTFUL_CACHE_MB");
+    std::remove(archivo);
+}
+
+static void benchBackends(void)
+{
+    const int ARBOLES = 2000, LECTURAS = 20000;
+    std::vector<std::string> textos;
+
+    for (int i = 0; i < ARBOLES; i++)
+        textos.push_back(balanceado(200, i*200).dump());
+
+    std::printf("\n== Backends de persistencia, %d árboles de 200 nodos (%zu bytes c/u) ==\n", ARBOLES, textos[0].size());
+    std::printf("%-9s %14s %16s %15s %15s %14s %12s\n", "backend", "nuevos (ins/s)", "repetidos (ins/s)",
+                "1 hilo (sel/s)", "4 hilos (sel/s)", "archivo (KiB)", "abrir (ms)");
+
+    for (auto backend : {"sqlite", "memoria", "log"})
+    {
+        auto archivo = std::string("test/bench.") + (std::strcmp(backend, "log") ? "db" : "log");
+        std::remove(archivo.c_str());
+        setenv("RESTFUL_DB", archivo.c_str(), 1);
+        setenv("RESTFUL_BACKEND", backend, 1);
+
+        double nuevos, repetidos, lecturas[2];
+        {
+            auto p = Persist::crear();
+
+            auto t0 = reloj::now();
+            for (auto& s : textos)
+                p->insert(s);
+            auto t1 = reloj::now();
+            for (auto& s : textos)
+                p->insert(s);
+            auto t2 = reloj::now();
+            nuevos = ARBOLES/milisegundos(t0, t1)*1000;
+            repetidos = ARBOLES/milisegundos(t1, t2)*1000;
+
+            for (int i = 0, hilos = 1; hilos <= 4; i++, hilos *= 4)
+            {
+                std::vector<std::thread> trabajadores;
+                auto t3 = reloj::now();
+                for (int h = 0; h < hilos; h++)
+                    trabajadores.emplace_back([&, h] () {
+                        std::mt19937 gen(h);
+                        for (int j = 0; j < LECTURAS; j++)
+                            p->select(std::to_string(1 + gen() % ARBOLES), [] (const char*, size_t) {});
+                    });
+                for (auto& t : trabajadores)
+                    t.join();
+                lecturas[i] = hilos*LECTURAS/milisegundos(t3, reloj::now())*1000;
+            }
+        }
+
+        // En memoria no hay nada que reabrir
+        long kib = 0;
+        double abrir = 0;
+        if (std::strcmp(backend, "memoria")) {
+            kib = tamanioArchivo(archivo.c_str())/1024;
+            auto t4 = reloj::now();
+            Persist::crear();
+            abrir = milisegundos(t4, reloj::now());
+        }
+
+        std::printf("%-9s %14.0f %16.0f %15.0f %15.0f %14ld %12.2f\n", backend, nuevos, repetidos,
+                    lecturas[0], lecturas[1], kib, abrir);
+        std::remove(archivo.c_str());
+    }
+
+    unsetenv("RESTFUL_BACKEND");
+}
+
+static void benchImportacion(void)
+{
+    const int ARBOLES = 20000, NODOS = 50;
+    const char *archivo = "test/bench.db";
+    std::string entrada;
+
+    for (int i = 0; i < ARBOLES; i++)
+        entrada.append(generarArbol(Forma::ALEATORIO, Carga::ENTERO, NODOS, int64_t(i)*NODOS).serializar()).push_back('\n');
+
+    std::printf("\n== Importación de %d árboles de %d nodos (%zu KiB en NDJSON) ==\n", ARBOLES, NODOS, entrada.size()/1024);
+    std::printf("%-26s %12s %14s\n", "modo", "total (ms)", "árboles/s");
+    setenv("RESTFUL_DB", archivo, 1);
+
+    double de_a_uno;
+    {
+        std::remove(archivo);
+        const auto c = std::make_shared< Control >();
+        auto t0 = reloj::now();
+        for (size_t i = 0, fin; i < entrada.size(); i = fin+1) {
+            fin = entrada.find('\n', i);
+            LectorArbol lector;
+            lector.leer(entrada.data()+i, fin-i);
+            c->newTreeInterface(lector.terminar());
+        }
+        de_a_uno = milisegundos(t0, reloj::now());
+        std::printf("%-26s %12.0f %14.0f\n", "de a uno (crear-arbol)", de_a_uno, ARBOLES/de_a_uno*1000);
+    }
+
+    for (auto lote : {"1000", "10000"})
+    {
+        std::remove(archivo);
+        setenv("RESTFUL_IMPORT_BATCH", lote, 1);
+        const auto c = std::make_shared< Control >();
+        auto importador = c->importInterface(1024*1024);
+        std::string salida;
+
+        auto t0 = reloj::now();
+        for (size_t i = 0; i < entrada.size(); i += 1024*1024) {
+            importador->leer(entrada.data()+i, std::min<size_t>(1024*1024, entrada.size()-i));
+            if (importador->lleno())
+                importador->procesar(salida);
+        }
+        importador->terminar(salida);
+        auto ms = milisegundos(t0, reloj::now());
+
+        auto modo = std::string("importación, lotes de ").append(lote);
+        std::printf("%-26s %12.0f %14.0f (x%.1f)\n", modo.c_str(), ms, ARBOLES/ms*1000, de_a_uno/ms);
+    }
+
+    unsetenv("RESTFUL_IMPORT_BATCH");
+    std::remove(archivo);
+}
+
+static void benchExportacion(void)
+{
+    const int ARBOLES = 20000, NODOS = 50;
+    std::vector<std::string> arboles;
+    for (int i = 0; i < ARBOLES; i++)
+        arboles.push_back(generarArbol(Forma::ALEATORIO, Carga::ENTERO, NODOS, int64_t(i)*NODOS).serializar());
+
+    std::printf("\n== Exportación de %d árboles de %d nodos ==\n", ARBOLES, NODOS);
+    std::printf("%-8s %-26s %12s %14s %12s %16s\n", "backend", "modo", "total (ms)", "árboles/s", "MiB/s", "pico (KiB)");
+
+    for (auto backend : {"sqlite", "log"})
+    {
+        auto archivo = std::string("test/bench.") + (std::strcmp(backend, "log") ? "db" : "log");
+        std::remove(archivo.c_str());
+        setenv("RESTFUL_DB", archivo.c_str(), 1);
+        setenv("RESTFUL_BACKEND", backend, 1);
+        auto persist = Persist::crear();
+        persist->insertLote(arboles);
+        const auto c = std::make_shared< Control >();
+
+        // El camino sin exportación: cada árbol se lee y se copia por separado
+        size_t bytes = 0;
+        long base = enUso;
+        pico = base;
+        auto t0 = reloj::now();
+        for (int id = 1; id <= ARBOLES; id++) {
+            auto texto = persist->select(std::to_string(id));
+            auto linea = std::string("{\"id\":").append(std::to_string(id)).append(",\"tree\":").append(texto).append("}\n");
+            bytes += linea.size();
+        }
+        auto de_a_uno = milisegundos(t0, reloj::now());
+        std::printf("%-8s %-26s %12.0f %14.0f %12.1f %16.1f\n", backend, "de a uno (select)", de_a_uno,
+                    ARBOLES/de_a_uno*1000, bytes/de_a_uno*1000/(1024*1024), double(pico-base)/1024);
+
+        for (auto formato : {Exportador::NDJSON, Exportador::BINARIO})
+        {
+            bytes = 0;
+            base = enUso;
+            pico = base;
+            t0 = reloj::now();
+            auto exportador = c->exportInterface(formato, 1, INT_MAX);
+            while (exportador->siguiente([&bytes] (const char*, size_t largo) { bytes += largo; }))
+                ;
+            auto ms = milisegundos(t0, reloj::now());
+            auto modo = std::string("exportación ").append(formato==Exportador::NDJSON ? "ndjson" : "binario");
+            std::printf("%-8s %-26s %12.0f %14.0f %12.1f %16.1f (x%.1f)\n", backend, modo.c_str(), ms,
+                        exportador->exportados()/ms*1000, bytes/ms*1000/(1024*1024), double(pico-base)/1024, de_a_uno/ms);
+        }
+
+        std::remove(archivo.c_str());
+    }
+
+    unsetenv("RESTFUL_BACKEND");
+}
+
+static void benchModificacion(void)
+{
+    const int CAMBIOS = 20, RAMA = 10;
+    const char *archivo = "test/bench.db";
+    std::mt19937 gen(11);
+
+    std::printf("\n== Modificación: %d subárboles de %d nodos colgados de nodos al azar ==\n", CAMBIOS, RAMA);
+    std::printf("%-10s %-24s %14s %14s\n", "nodos", "modo", "ms/árbol", "mejora");
+    setenv("RESTFUL_DB", archivo, 1);
+    // Con la caché por omisión, el árbol de 10^6 nodos no entra y se compilaría en cada modificación
+    setenv("RESTFUL_CACHE_MB", "2048", 1);
+
+    for (int n : {10000, 100000, 1000000})
+    {
+        std::vector<std::string> textos;
+        double modificar;
+        {
+            std::remove(archivo);
+            const auto c = std::make_shared< Control >();
+            auto id = c->newTreeInterface(generarArbol(Forma::ALEATORIO, Carga::ENTERO, n));
+            auto persist = Persist::crear();
+            std::vector<json> cambios;
+            for (int i = 0; i < CAMBIOS; i++) {
+                auto rama = json::parse(generarArbol(Forma::ALEATORIO, Carga::ENTERO, RAMA, n+int64_t(i)*RAMA).serializar());
+                cambios.push_back({{"id", id}, {"node", int(gen()%n)}, {gen()%2 ? "left" : "right", rama}});
+            }
+
+            auto t0 = reloj::now();
+            std::vector<int> ids;
+            for (auto& cambio : cambios)
+                ids.push_back(c->patchTreeInterface(cambio));
+            modificar = milisegundos(t0, reloj::now())/CAMBIOS;
+
+            for (auto i : ids)
+                textos.push_back(persist->select(std::to_string(i)));
+        }
+
+        // Lo mismo subiendo cada árbol modificado completo, en otra BBDD
+        std::remove(archivo);
+        const auto c = std::make_shared< Control >();
+        auto t0 = reloj::now();
+        for (auto& texto : textos) {
+            LectorArbol lector;
+            lector.leer(texto.data(), texto.size());
+            c->newTreeInterface(lector.terminar());
+        }
+        auto crear = milisegundos(t0, reloj::now())/CAMBIOS;
+
+        std::printf("%-10d %-24s %14.2f\n", n, "crear el árbol completo", crear);
+        std::printf("%-10d %-24s %14.2f %13.1fx\n", n, "modificar", modificar, crear/modificar);
+    }
+
+    unsetenv("RESTFUL_CACHE_MB");
+    std::remove(archivo);
+}
+
+static void benchConsulta(void)
+{
+    const int N = 100000, CONSULTAS = 1000000;
+    const char *archivo = "test/bench.db";
+    std::mt19937 gen(12);
+
+    std::printf("\n== Decodificación del parámetro q de /ancestro-comun (%d consultas) ==\n", CONSULTAS);
+    std::printf("%-8s %-34s %10s %13s %10s\n", "carga", "modo", "ns/op", "reservas/op", "mejora");
+    setenv("RESTFUL_DB", archivo, 1);
+
+    for (auto carga : {Carga::ENTERO, Carga::TEXTO})
+    {
+        std::remove(archivo);
+        const auto c = std::make_shared< Control >();
+        auto id = c->newTreeInterface(generarArbol(Forma::ALEATORIO, carga, N));
+        std::vector<std::string> consultas;
+        for (int i = 0; i < CONSULTAS; i++)
+            consultas.push_back(json({{"id", id}, {"node_a", valorNodo(carga, gen() % N)},
+                                      {"node_b", valorNodo(carga, gen() % N)}}).dump());
+
+        // Cada modo devuelve algo que depende del resultado, para que no se descarte
+        auto medir = [&] (const char *modo, const std::function<size_t(const std::string&)>& f, double base) {
+            size_t suma = 0;
+            long r0 = reservas;
+            auto t0 = reloj::now();
+            for (auto& q : consultas)
+                suma += f(q);
+            double ns = std::chrono::duration<double, std::nano>(reloj::now()-t0).count()/CONSULTAS;
+            double r = double(reservas-r0)/CONSULTAS;
+            if (base > 0)
+                std::printf("%-8s %-34s %10.1f %13.2f %9.1fx%s\n", nombre(carga), modo, ns, r, base/ns,
+                            suma ? "" : "?");
+            else
+                std::printf("%-8s %-34s %10.1f %13.2f%s\n", nombre(carga), modo, ns, r, suma ? "" : "?");
+            return ns;
+        };
+
+        auto parse = medir("json::parse", [] (const std::string& q) {
+                auto o = json::parse(q);
+                return o["id"].size() + o["node_a"].size() + o["node_b"].size();
+            }, 0);
+        medir("decodificar", [] (const std::string& q) {
+                ConsultaAncestro consulta;
+                consulta.decodificar(q);
+                return consulta.id.size() + consulta.node_a.size() + consulta.node_b.size();
+            }, parse);
+        auto completa = medir("json::parse + ancestro común", [&c] (const std::string& q) {
+                return c->lowestCommonAncestorInterface(json::parse(q))->size();
+            }, 0);
+        medir("decodificar + ancestro común", [&c] (const std::string& q) {
+                ConsultaAncestro consulta;
+                consulta.decodificar(q);
+                return c->lowestCommonAncestorInterface(consulta.id, consulta.node_a, consulta.node_b)->size();
+            }, completa);
+    }
+
+    std::remove(archivo);
+}
+
+/**
+ * El mismo árbol bajo una raíz con un objeto, para que sus valores queden
+ * en JSON (ArbolCompilado::GENERAL).
+ */
+static ArbolPlano conValoresJSON(const ArbolPlano& plano)
+{
+    ArbolPlano otro;
+    otro.nodos.push_back({{"raiz", true}});
+    otro.izquierdo.push_back(1);
+    otro.derecho.push_back(-1);
+    for (size_t i = 0; i < plano.nodos.size(); i++) {
+        otro.nodos.push_back(plano.nodos[i]);
+        otro.izquierdo.push_back(plano.izquierdo[i]<0 ? -1 : plano.izquierdo[i]+1);
+        otro.derecho.push_back(plano.derecho[i]<0 ? -1 : plano.derecho[i]+1);
+    }
+    return otro;
+}
+
+static void benchTipado(void)
+{
+    const int N = 1000000, CONSULTAS = 1000000;
+    const char *archivo = "test/bench.db";
+    std::mt19937 gen(13);
+
+    std::printf("\n== Árboles de enteros y de cadenas contra valores JSON (%d nodos, %d consultas) ==\n", N, CONSULTAS);
+    std::printf("%-8s %-34s %12s %12s %13s\n", "carga", "modo", "valor", "ns/op", "reservas/op");
+    setenv("RESTFUL_DB", archivo, 1);
+    setenv("RESTFUL_CACHE_MB", "4096", 1);
+
+    for (auto carga : {Carga::ENTERO, Carga::TEXTO})
+    {
+        auto plano = generarArbol(Forma::ALEATORIO, carga, N);
+        auto general = conValoresJSON(plano);
+
+        auto copia = plano;
+        auto t0 = reloj::now();
+        ArbolCompilado tipado(std::move(copia));
+        auto t1 = reloj::now();
+        ArbolCompilado generico(std::move(general));
+        auto t2 = reloj::now();
+
+        std::printf("%-8s %-34s %10.1f MiB\n", nombre(carga), "memoria, valores JSON", generico.memoria()/1048576.0);
+        std::printf("%-8s %-34s %10.1f MiB\n", nombre(carga), "memoria, tipado", tipado.memoria()/1048576.0);
+        std::printf("%-8s %-34s %10.1f ms\n", nombre(carga), "compilación, valores JSON", milisegundos(t1, t2));
+        std::printf("%-8s %-34s %10.1f ms\n", nombre(carga), "compilación, tipado", milisegundos(t0, t1));
+
+        std::vector< std::pair<json, json> > pares;
+        std::vector< std::pair<int64_t, int64_t> > enteros;
+        std::vector< std::pair<std::string, std::string> > cadenas;
+        for (int i = 0; i < CONSULTAS; i++) {
+            auto a = gen() % N, b = gen() % N;
+            pares.push_back({valorNodo(carga, a), valorNodo(carga, b)});
+            enteros.push_back({a, b});
+            cadenas.push_back({"nodo-"+std::to_string(a), "nodo-"+std::to_string(b)});
+        }
+
+        auto medir = [&] (const char *modo, const std::function<size_t(int)>& f) {
+            size_t suma = 0;
+            long r0 = reservas;
+            auto t0 = reloj::now();
+            for (int i = 0; i < CONSULTAS; i++)
+                suma += f(i);
+            double ns = std::chrono::duration<double, std::nano>(reloj::now()-t0).count()/CONSULTAS;
+            std::printf("%-8s %-34s %12s %12.1f %13.2f%s\n", nombre(carga), modo, "", ns,
+                        double(reservas-r0)/CONSULTAS, suma ? "" : "?");
+        };
+
+        medir("ancestro común, valores JSON", [&] (int i) {
+                auto lca = generico.ancestroComun(generico.buscar(pares[i].first), generico.buscar(pares[i].second));
+                return generico.nodo(lca).size();
+            });
+        medir("ancestro común, tipado con JSON", [&] (int i) {
+                auto lca = tipado.ancestroComun(tipado.buscar(pares[i].first), tipado.buscar(pares[i].second));
+                return tipado.nodo(lca).size();
+            });
+        if (carga == Carga::ENTERO)
+            medir("ancestro común, tipado", [&] (int i) {
+                    auto lca = tipado.ancestroComun(tipado.buscarEntero(enteros[i].first),
+                                                    tipado.buscarEntero(enteros[i].second));
+                    return size_t(tipado.entero(lca) >= 0);
+                });
+        else
+            medir("ancestro común, tipado", [&] (int i) {
+                    auto lca = tipado.ancestroComun(tipado.buscarCadena(cadenas[i].first),
+                                                    tipado.buscarCadena(cadenas[i].second));
+                    return tipado.cadena(lca).size();
+                });
+
+        // La consulta completa, con el árbol en la caché
+        std::remove(archivo);
+        const auto c = std::make_shared< Control >();
+        auto id = c->newTreeInterface(std::move(plano));
+        json id_json = id;
+        medir("Control, general", [&] (int i) {
+                return c->lowestCommonAncestorInterface(id_json, pares[i].first, pares[i].second)->size();
+            });
+        if (carga == Carga::ENTERO)
+            medir("Control, tipado", [&] (int i) {
+                    auto r = c->lowestCommonAncestorInterface(id_json, enteros[i].first, enteros[i].second);
+                    return size_t(std::get<int64_t>(r) >= 0);
+                });
+        else
+            medir("Control, tipado", [&] (int i) {
+                    auto r = c->lowestCommonAncestorInterface(id_json, cadenas[i].first, cadenas[i].second);
+                    return std::get<std::string>(r).size();
+                });
+    }
+
+    unsetenv("RESTFUL_CACHE_MB");
+    std::remove(archivo);
+}
+
+int main (const int argc, const char **argv)
+{
+    const std::pair< const char*, void(*)(void) > benchs[] = {
+        {"ancestros", benchAncestroComun},
+        {"persist", benchPersist},
+        {"select", benchSelect},
+        {"group-commit", benchGroupCommit},
+        {"ingesta", benchIngesta},
+        {"grandes", benchArbolesGrandes},
+        {"modelo", benchModelo},
+        {"backends", benchBackends},
+        {"importacion", benchImportacion},
+        {"exportacion", benchExportacion},
+        {"modificacion", benchModificacion},
+        {"consulta", benchConsulta},
+        {"tipado", benchTipado}
+    };
+
+    for (auto& b : benchs)
+        if (argc < 2 || std::find_if(argv+1, argv+argc, [&b] (const char *a) {
+                    return std::strcmp(a, b.first)==0; }) != argv+argc)
+            b.second();
+}
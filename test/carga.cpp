@@ -0,0 +1,425 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../json.hpp"
+#include "arboles.hpp"
+
+/*
+ * Generador de carga HTTP para una instancia local de restful.
+ *
+ * Abre N conexiones persistentes (un hilo por conexión) y envía una mezcla
+ * configurable de solicitudes a /crear-arbol (cada una con un árbol nuevo) y
+ * a /ancestro-comun (pares al azar sobre un árbol creado al inicio), a una
+ * tasa fija (carga abierta) o tan rápido como responda el servidor (carga
+ * cerrada). Con tasa fija, la latencia se mide desde el momento en que la
+ * solicitud debía enviarse, de modo que las demoras del servidor no se
+ * ocultan al atrasar el envío de las siguientes (coordinated omission).
+ *
+ * Informa, por servicio, la cantidad de solicitudes, errores, throughput y
+ * un histograma de latencias (p50, p90, p99, p99.9, máximo). Los árboles se
+ * arman con los mismos generadores que los benchmarks y las pruebas.
+ *
+ * uso: test/carga [-h host] [-p puerto] [-c conexiones] [-d segundos]
+ *                 [-r solicitudes/s] [-m % crear-arbol] [-n nodos]
+ *                 [-f balanceado|cadena|aleatorio] [-k entero|texto|objeto] [-j]
+ */
+
+using reloj = std::chrono::steady_clock;
+
+/**
+ * Opciones de la prueba, desde la línea de comandos.
+ */
+struct Opciones {
+    std::string host = "127.0.0.1"; // servidor
+    std::string puerto;             // puerto (RESTFUL_PORT u 80)
+    int    conexiones = 8;          // conexiones simultáneas, una por hilo
+    double segundos = 10;           // duración de la prueba
+    double tasa = 0;                // solicitudes/s en total (0: sin límite)
+    int    crear = 10;              // porcentaje de solicitudes a crear-arbol
+    int    nodos = 100;             // nodos de cada árbol
+    Forma  forma = Forma::BALANCEADO;
+    Carga  carga = Carga::ENTERO;
+    bool   json = false;            // informe en líneas JSON
+};
+
+/**
+ * Histograma de latencias con error relativo acotado, al estilo de
+ * HdrHistogram: cada potencia de 2 se divide en 64 cubetas lineales, así que
+ * cada valor se registra con un error menor al 1.6%, de 1 ns a horas, en
+ * memoria fija. Los histogramas de los hilos se suman al final.
+ */
+class Histograma {
+private:
+    static const int SUB = 64;    // cubetas por potencia de 2
+    static const int BITS_SUB = 6; // log2(SUB)
+    std::vector<uint64_t> cuentas;
+    uint64_t total;
+    uint64_t maximo;
+
+    static int indice(uint64_t v)
+    {
+        if (v < SUB)
+            return v;
+        int corrimiento = 63-__builtin_clzll(v)-BITS_SUB;
+        return (corrimiento+1)*SUB + int((v>>corrimiento)-SUB);
+    }
+
+    static uint64_t valor(int i) // mayor valor de la cubeta i
+    {
+        if (i < SUB)
+            return i;
+        int corrimiento = i/SUB-1;
+        return ((uint64_t(i%SUB+SUB)+1)<<corrimiento)-1;
+    }
+
+public:
+    Histograma() : cuentas((64-BITS_SUB+1)*SUB), total(0), maximo(0) {}
+
+    void registrar(uint64_t ns)
+    {
+        cuentas[indice(ns)]++;
+        total++;
+        maximo = std::max(maximo, ns);
+    }
+
+    void sumar(const Histograma& otro)
+    {
+        for (size_t i = 0; i < cuentas.size(); i++)
+            cuentas[i] += otro.cuentas[i];
+        total += otro.total;
+        maximo = std::max(maximo, otro.maximo);
+    }
+
+    uint64_t percentil(double p) const
+    {
+        uint64_t objetivo = std::max<uint64_t>(1, uint64_t(p/100*total+0.5)), acumulado = 0;
+        for (size_t i = 0; i < cuentas.size(); i++)
+            if ((acumulado += cuentas[i]) >= objetivo)
+                return std::min(valor(i), maximo);
+        return maximo;
+    }
+
+    uint64_t cantidad(void) const { return total; }
+    uint64_t maximoRegistrado(void) const { return maximo; }
+};
+
+/**
+ * Conexión HTTP/1.1 persistente, bloqueante.
+ */
+class Conexion {
+private:
+    const Opciones& opciones;
+    int fd;
+    std::string buffer; // bytes recibidos aún no consumidos
+
+    bool recibir(void)
+    {
+        char datos[16384];
+        auto n = ::recv(fd, datos, sizeof(datos), 0);
+        if (n <= 0)
+            return false;
+        buffer.append(datos, n);
+        return true;
+    }
+
+public:
+    explicit Conexion(const Opciones& o) : opciones(o), fd(-1) {}
+    ~Conexion() { cerrar(); }
+
+    void abrir(void)
+    {
+        cerrar();
+        addrinfo pista{}, *direcciones;
+        pista.ai_family = AF_UNSPEC;
+        pista.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(opciones.host.c_str(), opciones.puerto.c_str(), &pista, &direcciones))
+            throw std::runtime_error("No se pudo resolver " + opciones.host);
+
+        for (auto d = direcciones; d && fd < 0; d = d->ai_next) {
+            fd = ::socket(d->ai_family, d->ai_socktype, d->ai_protocol);
+            if (fd >= 0 && ::connect(fd, d->ai_addr, d->ai_addrlen)) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(direcciones);
+        if (fd < 0)
+            throw std::runtime_error("No se pudo conectar a " + opciones.host + ":" + opciones.puerto);
+
+        int uno = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &uno, sizeof(uno));
+        buffer.clear();
+    }
+
+    void cerrar(void)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+
+    bool abierta(void) const { return fd >= 0; }
+
+    /**
+     * Envía una solicitud y espera su respuesta.
+     * @param solicitud Solicitud HTTP completa
+     * @param cuerpo Cuerpo de la respuesta
+     * @return Código de estado, o 0 si la conexión falló
+     */
+    int solicitar(const std::string& solicitud, std::string& cuerpo)
+    {
+        for (size_t enviado = 0; enviado < solicitud.size(); ) {
+            auto n = ::send(fd, solicitud.data()+enviado, solicitud.size()-enviado, MSG_NOSIGNAL);
+            if (n <= 0)
+                return 0;
+            enviado += n;
+        }
+
+        size_t fin;
+        while ((fin = buffer.find("\r\n\r\n")) == std::string::npos)
+            if (! recibir())
+                return 0;
+
+        auto cabeceras = buffer.substr(0, fin+2);
+        for (auto& c : cabeceras)
+            c = tolower(c);
+        int estado = std::atoi(cabeceras.c_str()+cabeceras.find(' ')+1);
+
+        size_t largo = 0;
+        if (auto p = cabeceras.find("\r\ncontent-length:"); p != std::string::npos)
+            largo = std::strtoull(cabeceras.c_str()+p+17, nullptr, 10);
+        bool cerrar_pedido = cabeceras.find("\r\nconnection: close") != std::string::npos;
+
+        while (buffer.size() < fin+4+largo)
+            if (! recibir())
+                return 0;
+
+        cuerpo.assign(buffer, fin+4, largo);
+        buffer.erase(0, fin+4+largo);
+        if (cerrar_pedido)
+            cerrar();
+        return estado;
+    }
+};
+
+static std::string codificarURL(const std::string& s)
+{
+    static const char *hex = "0123456789ABCDEF";
+    std::string r;
+    for (unsigned char c : s)
+        if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~')
+            r += c;
+        else {
+            r += '%';
+            r += hex[c>>4];
+            r += hex[c&15];
+        }
+    return r;
+}
+
+static std::string post(const Opciones& o, const std::string& cuerpo)
+{
+    return "POST /crear-arbol HTTP/1.1\r\nHost: " + o.host + "\r\nContent-Type: application/json\r\n"
+        "Content-Length: " + std::to_string(cuerpo.size()) + "\r\n\r\n" + cuerpo;
+}
+
+static std::string get(const Opciones& o, const json& q)
+{
+    return "GET /ancestro-comun?q=" + codificarURL(q.dump()) + " HTTP/1.1\r\nHost: " + o.host +
+        "\r\nContent-Type: application/json\r\n\r\n";
+}
+
+/**
+ * Resultados de un hilo (y, sumados, de la prueba).
+ */
+struct Resultado {
+    Histograma latencia[2]; // ancestro-comun, crear-arbol
+    uint64_t   errores[2] = {0, 0};
+    uint64_t   reconexiones = 0;
+
+    void sumar(const Resultado& r)
+    {
+        for (int s = 0; s < 2; s++) {
+            latencia[s].sumar(r.latencia[s]);
+            errores[s] += r.errores[s];
+        }
+        reconexiones += r.reconexiones;
+    }
+};
+
+static void trabajador(const Opciones& o, int hilo, int id, std::atomic<int64_t>& siguiente_base,
+                       reloj::time_point inicio, reloj::time_point fin, Resultado& r)
+{
+    std::mt19937 gen(hilo);
+    Conexion conexion(o);
+    std::string cuerpo;
+
+    // Consultas armadas de antemano, para que el cliente gaste lo menos posible
+    std::vector<std::string> consultas;
+    for (int i = 0; i < 1024; i++)
+        consultas.push_back(get(o, {{"id", id},
+                                    {"node_a", valorNodo(o.carga, gen() % o.nodos)},
+                                    {"node_b", valorNodo(o.carga, gen() % o.nodos)}}));
+
+    // Con tasa fija, cada hilo envía a intervalos regulares, desfasado del resto
+    auto intervalo = std::chrono::duration_cast<reloj::duration>(
+        std::chrono::duration<double>(o.tasa > 0 ? o.conexiones/o.tasa : 0));
+    auto programado = inicio + intervalo*hilo/o.conexiones;
+
+    for (uint64_t k = 0; ; k++) {
+        bool crear = int(gen() % 100) < o.crear;
+        std::string solicitud = crear ?
+            post(o, generarArbol(o.forma, o.carga, o.nodos, siguiente_base += o.nodos, gen()).serializar()) :
+            consultas[k % consultas.size()];
+
+        auto desde = reloj::now();
+        if (o.tasa > 0) {
+            programado += intervalo;
+            if (programado >= fin || desde >= fin)
+                break;
+            std::this_thread::sleep_until(programado);
+            desde = programado;
+        }
+        else if (desde >= fin)
+            break;
+
+        if (! conexion.abierta()) {
+            if (k > 0)
+                r.reconexiones++;
+            conexion.abrir();
+        }
+
+        int estado = conexion.solicitar(solicitud, cuerpo);
+        if (estado == 0) {
+            conexion.cerrar();
+            conexion.abrir();
+            r.reconexiones++;
+            estado = conexion.solicitar(solicitud, cuerpo);
+        }
+        if (estado != 200)
+            r.errores[crear]++;
+
+        r.latencia[crear].registrar(std::chrono::duration_cast<std::chrono::nanoseconds>(reloj::now()-desde).count());
+    }
+}
+
+static void informar(const Opciones& o, const char *servicio, const Histograma& h, uint64_t errores, double segundos)
+{
+    auto us = [&h] (double p) { return h.percentil(p)/1000.0; };
+
+    if (o.json) {
+        json linea = {
+            {"servicio", servicio}, {"conexiones", o.conexiones}, {"tasa", o.tasa},
+            {"nodos", o.nodos}, {"forma", nombre(o.forma)}, {"carga", nombre(o.carga)},
+            {"solicitudes", h.cantidad()}, {"errores", errores}, {"sol_s", h.cantidad()/segundos},
+            {"p50_us", us(50)}, {"p90_us", us(90)}, {"p99_us", us(99)}, {"p999_us", us(99.9)},
+            {"max_us", h.maximoRegistrado()/1000.0}
+        };
+        std::printf("%s\n", linea.dump().c_str());
+        return;
+    }
+
+    std::printf("%-15s %11lu %8lu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", servicio,
+                (unsigned long)h.cantidad(), (unsigned long)errores, h.cantidad()/segundos,
+                us(50), us(90), us(99), us(99.9), h.maximoRegistrado()/1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    Opciones o;
+    if (auto puerto = getenv("RESTFUL_PORT"))
+        o.puerto = puerto;
+    else
+        o.puerto = "80";
+
+    for (int c; (c = getopt(argc, argv, "h:p:c:d:r:m:n:f:k:j")) != -1; )
+        switch (c) {
+        case 'h': o.host = optarg; break;
+        case 'p': o.puerto = optarg; break;
+        case 'c': o.conexiones = std::max(1, std::atoi(optarg)); break;
+        case 'd': o.segundos = std::atof(optarg); break;
+        case 'r': o.tasa = std::atof(optarg); break;
+        case 'm': o.crear = std::clamp(std::atoi(optarg), 0, 100); break;
+        case 'n': o.nodos = std::max(1, std::atoi(optarg)); break;
+        case 'f': o.forma = !std::strcmp(optarg, "cadena") ? Forma::CADENA :
+                      !std::strcmp(optarg, "aleatorio") ? Forma::ALEATORIO : Forma::BALANCEADO; break;
+        case 'k': o.carga = !std::strcmp(optarg, "texto") ? Carga::TEXTO :
+                      !std::strcmp(optarg, "objeto") ? Carga::OBJETO : Carga::ENTERO; break;
+        case 'j': o.json = true; break;
+        default:
+            std::fprintf(stderr, "uso: %s [-h host] [-p puerto] [-c conexiones] [-d segundos] [-r solicitudes/s]\n"
+                         "          [-m %% crear-arbol] [-n nodos] [-f balanceado|cadena|aleatorio]\n"
+                         "          [-k entero|texto|objeto] [-j]\n", argv[0]);
+            return 1;
+        }
+
+    try {
+        // Árbol sobre el que se consulta ancestro-comun
+        Conexion conexion(o);
+        std::string cuerpo;
+        conexion.abrir();
+        if (conexion.solicitar(post(o, generarArbol(o.forma, o.carga, o.nodos).serializar()), cuerpo) != 200)
+            throw std::runtime_error("No se pudo crear el árbol de consulta: " + cuerpo);
+        int id = json::parse(cuerpo)["id"];
+        conexion.cerrar();
+
+        if (! o.json)
+            std::printf("== %d conexiones, %.0f s, %s, %d%% crear-arbol, árboles %s/%s de %d nodos ==\n",
+                        o.conexiones, o.segundos,
+                        o.tasa > 0 ? (std::to_string(int(o.tasa)) + " sol/s").c_str() : "sin límite de tasa",
+                        o.crear, nombre(o.forma), nombre(o.carga), o.nodos);
+
+        std::vector<Resultado> resultados(o.conexiones);
+        std::vector<std::thread> hilos;
+        std::atomic<int64_t> siguiente_base{int64_t(o.nodos)};
+        auto inicio = reloj::now();
+        auto fin = inicio + std::chrono::duration_cast<reloj::duration>(std::chrono::duration<double>(o.segundos));
+
+        for (int h = 0; h < o.conexiones; h++)
+            hilos.emplace_back([&, h] () {
+                try {
+                    trabajador(o, h, id, siguiente_base, inicio, fin, resultados[h]);
+                }
+                catch (std::exception& e) {
+                    std::fprintf(stderr, "hilo %d: %s\n", h, e.what());
+                }
+            });
+        for (auto& t : hilos)
+            t.join();
+        double segundos = std::chrono::duration<double>(reloj::now()-inicio).count();
+
+        Resultado total;
+        for (auto& r : resultados)
+            total.sumar(r);
+        Histograma todas;
+        todas.sumar(total.latencia[0]);
+        todas.sumar(total.latencia[1]);
+
+        if (! o.json)
+            std::printf("%-15s %11s %8s %10s %10s %10s %10s %10s %10s\n", "servicio", "solicitudes", "errores",
+                        "sol/s", "p50 (µs)", "p90 (µs)", "p99 (µs)", "p99.9 (µs)", "máx (µs)");
+        informar(o, "crear-arbol", total.latencia[1], total.errores[1], segundos);
+        informar(o, "ancestro-comun", total.latencia[0], total.errores[0], segundos);
+        informar(o, "total", todas, total.errores[0]+total.errores[1], segundos);
+        if (! o.json)
+            std::printf("reconexiones: %lu\n", (unsigned long)total.reconexiones);
+    }
+    catch (std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+}
@@ -3,12 +3,50 @@
 #include "doctest.h"
 #include "../json.hpp"
 #include "../restful.hpp"
+#include "../persistencia.hpp"
+#include "../hash.hpp"
+#include "../lector.hpp"
+#include "arboles.hpp"
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <random>
+#include <set>
+#include <sstream>
+#include <new>
+#include <sys/resource.h>
+#include <thread>
+#include <tuple>
+
+// Contador de reservas de memoria de todo el proceso, para verificar que las
+// consultas no pidan memoria en proporción al tamaño del árbol. No se
+// permite a GCC expandirlos en línea, porque entonces advierte que free()
+// recibe punteros de new.
+static std::atomic<long> reservas{0};
+
+[[gnu::noinline]] void* operator new(std::size_t n)
+{
+    reservas++;
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { operator delete(p); }
 
 TEST_CASE ("Operaciones en BBDD mediante Persist")
 {
     setenv( "RESTFUL_DB", "test/test.db", 1 );
-    REQUIRE_NOTHROW ( Persist p );
-    Persist p;
+    REQUIRE_NOTHROW ( PersistSQLite p );
+    PersistSQLite p;
 
     SUBCASE ("El servicio de persistencia no verifica formato para insertar")
     {
@@ -32,6 +70,163 @@ TEST_CASE ("Operaciones en BBDD mediante Persist")
     }
 }
 
+TEST_CASE ("Deduplicación por hash en Persist")
+{
+    SUBCASE ("El hash de 128 bits es MurmurHash3 x64_128")
+    {
+        // Vectores de referencia de la implementación original
+        auto vacio = hash128( std::string("") );
+        auto hello = hash128( std::string("hello") );
+        CHECK_EQ( vacio.h1, 0ULL );
+        CHECK_EQ( vacio.h2, 0ULL );
+        CHECK_EQ( hello.h1, 0xcbd8a7b341bd9b02ULL );
+        CHECK_EQ( hello.h2, 0x5b1e906a48ae1d19ULL );
+    }
+
+    SUBCASE ("Una base de datos con el esquema anterior se migra conservando los ID")
+    {
+        const char *archivo = "test/test-migracion.db";
+        std::remove( archivo );
+
+        sqlite3 *db;
+        REQUIRE_EQ( sqlite3_open( archivo, &db ), SQLITE_OK );
+        REQUIRE_EQ( sqlite3_exec( db,
+                                  "CREATE TABLE ARBOLES (ID INTEGER PRIMARY KEY, JSON TEXT UNIQUE NOT NULL);"
+                                  "INSERT INTO ARBOLES (ID, JSON) VALUES (3, '{\"node\":1}'), (7, '{\"node\":2}');",
+                                  NULL, NULL, NULL ), SQLITE_OK );
+        sqlite3_close( db );
+
+        setenv( "RESTFUL_DB", archivo, 1 );
+        PersistSQLite p;
+
+        CHECK_EQ( p.select( "3" ), R"({"node":1})" );
+        CHECK_EQ( p.select( "7" ), R"({"node":2})" );
+        CHECK_EQ( p.insert( R"({"node":2})" ), 7 );
+        CHECK_GT( p.insert( R"({"node":3})" ), 7 );
+    }
+
+    SUBCASE ("Un recorrido cortado por el lector no deja abierta la transacción de lectura")
+    {
+        const char *archivo = "test/test-recorrido.db";
+        std::remove( archivo );
+        setenv( "RESTFUL_DB", archivo, 1 );
+        PersistSQLite p;
+        p.insert( R"({"node":1})" );
+        p.insert( R"({"node":2})" );
+
+        for (int i = 0; i < 3; i++) {
+            int vistos = 0;
+            p.recorrer( 1, 2, [&vistos] (int, const char*, size_t) { vistos++; return false; } );
+            CHECK_EQ( vistos, 1 );
+            CHECK( p.recientes( 1 ) == std::vector<int>{2} );
+        }
+
+        // Sin lectores abiertos, el checkpoint puede vaciar el WAL sin esperar
+        sqlite3 *db;
+        REQUIRE_EQ( sqlite3_open( archivo, &db ), SQLITE_OK );
+        CHECK_EQ( sqlite3_exec( db, "INSERT INTO ARBOLES (HASH, JSON) VALUES (x'00', '{}');", NULL, NULL, NULL ), SQLITE_OK );
+        CHECK_EQ( sqlite3_wal_checkpoint_v2( db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL ), SQLITE_OK );
+        sqlite3_close( db );
+        std::remove( archivo );
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+    }
+}
+
+TEST_CASE ("Persist con varios hilos y conexiones")
+{
+    setenv( "RESTFUL_DB", "test/test.db", 1 );
+
+    SUBCASE ("Lecturas y escrituras concurrentes devuelven los valores correctos")
+    {
+        PersistSQLite p;
+        const int HILOS = 4, POR_HILO = 50;
+        std::vector<int> ids( HILOS*POR_HILO );
+        std::vector<std::thread> hilos;
+        std::atomic<int> errores( 0 );
+
+        for (int h = 0; h < HILOS; h++)
+            hilos.emplace_back( [&, h] () {
+                try {
+                    for (int i = h*POR_HILO; i < (h+1)*POR_HILO; i++) {
+                        auto texto = "concurrente " + std::to_string( i );
+                        ids[i] = p.insert( texto );
+                        if (p.select( std::to_string( ids[i] ) ) != texto)
+                            errores++;
+                    }
+                }
+                catch (...) {
+                    errores++;
+                }
+            } );
+
+        for (auto& h : hilos)
+            h.join();
+
+        CHECK_EQ( errores.load(), 0 );
+        CHECK_EQ( std::set<int>( ids.begin(), ids.end() ).size(), ids.size() );
+    }
+
+    SUBCASE ("Con group commit las inserciones se confirman por lotes")
+    {
+        setenv( "RESTFUL_DB_GROUP_COMMIT_US", "20000", 1 );
+        setenv( "RESTFUL_DB_GROUP_COMMIT_MAX", "8", 1 );
+
+        {
+            PersistSQLite p;
+            std::vector< std::future<int> > futuros;
+
+            // El mismo JSON dos veces en un lote debe obtener el mismo ID
+            for (int i = 0; i < 20; i++)
+                futuros.push_back( p.insertAsync( "lote " + std::to_string( i % 10 ) ) );
+
+            std::vector<int> ids;
+            for (auto& f : futuros)
+                REQUIRE_NOTHROW( ids.push_back( f.get() ) );
+
+            for (int i = 0; i < 10; i++) {
+                CHECK_EQ( ids[i], ids[i+10] );
+                CHECK_EQ( p.select( std::to_string( ids[i] ) ), "lote " + std::to_string( i ) );
+            }
+
+            // insert() bloquea hasta que su lote se confirma
+            CHECK_EQ( p.insert( "lote 3" ), ids[3] );
+        }
+
+        unsetenv( "RESTFUL_DB_GROUP_COMMIT_US" );
+        unsetenv( "RESTFUL_DB_GROUP_COMMIT_MAX" );
+    }
+
+    SUBCASE ("Los ajustes de la BBDD se validan")
+    {
+        setenv( "RESTFUL_DB_SYNCHRONOUS", "; DROP TABLE ARBOLES", 1 );
+        CHECK_THROWS( PersistSQLite() );
+        unsetenv( "RESTFUL_DB_SYNCHRONOUS" );
+
+        setenv( "RESTFUL_DB_MMAP_SIZE", "mucho", 1 );
+        CHECK_THROWS( PersistSQLite() );
+        unsetenv( "RESTFUL_DB_MMAP_SIZE" );
+    }
+
+    SUBCASE ("Una conexión que no se puede configurar no deja la BBDD abierta")
+    {
+        auto descriptores = [] () {
+            return std::distance( std::filesystem::directory_iterator( "/proc/self/fd" ),
+                                  std::filesystem::directory_iterator() );
+        };
+        const std::string archivo = "test/test-danada.db";
+        std::ofstream( archivo, std::ios::binary ) << std::string( 4096, 'x' );
+        setenv( "RESTFUL_DB", archivo.c_str(), 1 );
+
+        auto antes = descriptores();
+        for (int i = 0; i < 10; i++)
+            CHECK_THROWS_AS( PersistSQLite(), std::runtime_error );
+        CHECK_EQ( descriptores(), antes );
+
+        std::remove( archivo.c_str() );
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+    }
+}
+
 TEST_CASE ("Insertar un árbol sin nodo raiz")
 {
     setenv( "RESTFUL_DB", "test/test.db", 1 );
@@ -60,6 +255,15 @@ TEST_CASE ("Consulta de ancestro común con ID erróneo")
     };
 
     REQUIRE_THROWS( c->lowestCommonAncestorInterface( e ) );
+
+    // Un ID fuera del rango de los ID asignados no se confunde con otro al
+    // truncarlo, aunque el otro esté en la caché
+    auto id = c->newTreeInterface( json::parse( R"({"node":1,"left":{"node":2},"right":{"node":3}})" ) );
+    CHECK_EQ( c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", 2}, {"node_b", 3}} )->dump(), "1" );
+    for (json otro : {json( (int64_t( 1 )<<32) + id ), json( (uint64_t( 1 )<<32) + uint64_t( id ) ),
+                      json( int64_t( id ) - (int64_t( 1 )<<32) ), json( 0 ), json( UINT64_MAX )})
+        CHECK_THROWS_AS( c->lowestCommonAncestorInterface( {{"id", otro}, {"node_a", 2}, {"node_b", 3}} ),
+                         std::logic_error );
 }
 
 TEST_CASE ("Uso normal, creación de árboles y consulta")
@@ -293,3 +497,1902 @@ TEST_CASE ("Insertar árboles de objetos es posible")
     CHECK_EQ( result->dump(), R"({"name":"John","surname":"Doe"})" );
 }
 
+
+TEST_CASE ("Caché de árboles compilados")
+{
+    nlohmann::json o = {
+        {"node",1},
+        {"left",{
+                {"node",2}
+            }
+        },
+        {"right",{
+                {"node",3}
+            }
+        }
+    };
+
+    auto arbol = std::make_shared<const ArbolCompilado>( o );
+    REQUIRE_EQ( arbol->tamanio(), 3u );
+
+    SUBCASE ("El árbol compilado resuelve el ancestro común por índice")
+    {
+        auto a = arbol->buscar( 2 );
+        auto b = arbol->buscar( 3 );
+        REQUIRE_GE( a, 0 );
+        REQUIRE_GE( b, 0 );
+        CHECK_EQ( arbol->nodo( arbol->ancestroComun( a, b ) ), 1 );
+        CHECK_EQ( arbol->buscar( 4 ), -1 );
+    }
+
+    SUBCASE ("La búsqueda por valor usa la igualdad de JSON y toma la última aparición")
+    {
+        // Preorden con la rama derecha primero: 0, 0.right, 0.left, 0.left.left
+        auto d = nlohmann::json::parse( R"({"node":{"a":1,"b":[1,2]},
+                                            "left":{"node":7,"left":{"node":1.0}},
+                                            "right":{"node":7.0}})" );
+        ArbolCompilado dup( d );
+
+        CHECK_EQ( dup.buscar( 7 ), 2 );
+        CHECK_EQ( dup.buscar( 7u ), 2 );
+        CHECK_EQ( dup.buscar( 1 ), 3 );
+        CHECK_EQ( dup.buscar( nlohmann::json::parse( R"({"b":[1.0,2],"a":1})" ) ), 0 );
+        CHECK_EQ( dup.buscar( nlohmann::json::parse( R"({"b":[2,1],"a":1})" ) ), -1 );
+        CHECK_EQ( dup.buscar( "7" ), -1 );
+        CHECK_EQ( dup.buscar( nullptr ), -1 );
+    }
+
+    SUBCASE ("El índice de valores coincide con una búsqueda lineal")
+    {
+        std::mt19937 gen( 5 );
+        for (int N : {1, 2, 17, 1000})
+            for (auto carga : {Carga::ENTERO, Carga::TEXTO, Carga::OBJETO}) {
+                // Valores repetidos: base 0 y N/3 nodos distintos como mucho
+                auto plano = generarArbol( Forma::ALEATORIO, carga, N, 0, N );
+                for (auto& v : plano.nodos)
+                    v = valorNodo( carga, gen() % (N/3+1) );
+                ArbolCompilado arbol( std::move( plano ) );
+
+                for (int v = 0; v <= N/3+1; v++) {
+                    auto valor = valorNodo( carga, v );
+                    int esperado = -1;
+                    for (int i = arbol.tamanio()-1; i >= 0 && esperado < 0; i--)
+                        if (arbol.nodo( i ) == valor)
+                            esperado = i;
+                    REQUIRE_EQ( arbol.buscar( valor ), esperado );
+                }
+            }
+    }
+
+    SUBCASE ("Un árbol mal formado no se compila")
+    {
+        nlohmann::json m = {
+            {"node",1},
+            {"left",{
+                    {"nodo",2}
+                }
+            }
+        };
+        CHECK_THROWS( ArbolCompilado{ m } );
+    }
+
+    SUBCASE ("La caché desaloja el árbol usado menos recientemente")
+    {
+        CacheArboles cache( 2*arbol->memoria() );
+
+        cache.guardar( 1, arbol );
+        cache.guardar( 2, arbol );
+        CHECK_EQ( cache.cantidad(), 2u );
+
+        // Usar el 1 hace que el 2 sea el menos reciente
+        CHECK( cache.obtener( 1 ) );
+        cache.guardar( 3, arbol );
+
+        CHECK_EQ( cache.cantidad(), 2u );
+        CHECK_LE( cache.memoria(), 2*arbol->memoria() );
+        CHECK( cache.obtener( 1 ) );
+        CHECK_FALSE( cache.obtener( 2 ) );
+        CHECK( cache.obtener( 3 ) );
+    }
+
+    SUBCASE ("Agregar no desaloja: solo guarda si hay lugar, como el menos reciente")
+    {
+        CacheArboles cache( 2*arbol->memoria() );
+
+        CHECK( cache.agregar( 1, arbol ) );
+        CHECK( cache.agregar( 2, arbol ) );
+        CHECK_FALSE( cache.agregar( 2, arbol ) );
+        CHECK_FALSE( cache.agregar( 3, arbol ) );
+        CHECK_EQ( cache.cantidad(), 2u );
+
+        // El 2 se agregó último, así que es el primero en desalojarse
+        cache.guardar( 3, arbol );
+        CHECK( cache.obtener( 1 ) );
+        CHECK_FALSE( cache.obtener( 2 ) );
+        CHECK( cache.obtener( 3 ) );
+    }
+
+    SUBCASE ("Con presupuesto 0 la caché no guarda nada")
+    {
+        CacheArboles cache( 0 );
+        cache.guardar( 1, arbol );
+        CHECK_EQ( cache.cantidad(), 0u );
+        CHECK_FALSE( cache.obtener( 1 ) );
+    }
+}
+
+TEST_CASE ("Índice de ancestros en tiempo constante")
+{
+    SUBCASE ("El RMQ coincide con una búsqueda lineal")
+    {
+        std::mt19937 gen( 1234 );
+        std::vector<int32_t> v( 300 );
+        for (auto& x : v)
+            x = gen() % 20;
+
+        IndiceRMQ rmq( v );
+
+        for (int l = 0; l < 300; l += 7)
+            for (int r = l; r < 300; r += 3) {
+                auto m = rmq.minimo( l, r );
+                REQUIRE_EQ( v[m], *std::min_element( v.begin()+l, v.begin()+r+1 ) );
+            }
+    }
+
+    SUBCASE ("El ancestro común coincide con el de subir por los padres")
+    {
+        // Árbol aleatorio: cada nodo nuevo cuelga de un nodo anterior con lugar libre
+        const int N = 2000;
+        std::mt19937 gen( 4321 );
+        std::vector<int> padre( N, -1 ), izq( N, -1 ), der( N, -1 );
+
+        for (int i = 1; i < N; i++)
+            while (true) {
+                int p = gen() % i;
+                auto& hijo = (gen() % 2) ? izq[p] : der[p];
+                if (hijo < 0) {
+                    hijo = i;
+                    padre[i] = p;
+                    break;
+                }
+            }
+
+        std::function<nlohmann::json(int)> armar = [&] (int i) {
+            nlohmann::json o = {{"node", i}};
+            if (izq[i] >= 0) o["left"] = armar( izq[i] );
+            if (der[i] >= 0) o["right"] = armar( der[i] );
+            return o;
+        };
+
+        auto ancestros = [&] (int i) {
+            std::vector<int> camino;
+            for (; i >= 0; i = padre[i])
+                camino.push_back( i );
+            return std::vector<int>( camino.rbegin(), camino.rend() );
+        };
+
+        ArbolCompilado arbol( armar( 0 ) );
+        REQUIRE_EQ( arbol.tamanio(), (size_t)N );
+
+        for (int k = 0; k < 5000; k++) {
+            int a = gen() % N, b = gen() % N;
+            auto ca = ancestros( a ), cb = ancestros( b );
+            size_t j = 0;
+            while (j+1 < ca.size() && j+1 < cb.size() && ca[j+1] == cb[j+1])
+                j++;
+
+            auto lca = arbol.ancestroComun( arbol.buscar( a ), arbol.buscar( b ) );
+            REQUIRE_EQ( arbol.nodo( lca ), ca[j] );
+        }
+    }
+
+    SUBCASE ("Con las formas y cargas de los generadores de árboles")
+    {
+        const int N = 500;
+        std::mt19937 gen( 99 );
+
+        for (auto forma : {Forma::BALANCEADO, Forma::CADENA, Forma::ALEATORIO})
+            for (auto carga : {Carga::ENTERO, Carga::TEXTO, Carga::OBJETO}) {
+                auto plano = generarArbol( forma, carga, N, 1000 );
+
+                std::vector<int> padre( N, -1 );
+                for (int i = 0; i < N; i++) {
+                    if (plano.izquierdo[i] >= 0) padre[plano.izquierdo[i]] = i;
+                    if (plano.derecho[i] >= 0) padre[plano.derecho[i]] = i;
+                }
+                auto profundidad = [&] (int i) {
+                    int d = 0;
+                    for (; padre[i] >= 0; i = padre[i])
+                        d++;
+                    return d;
+                };
+
+                // El texto generado es el mismo que el de nlohmann::json
+                auto texto = plano.serializar();
+                REQUIRE_EQ( nlohmann::json::parse( texto ).dump(), texto );
+
+                ArbolCompilado arbol( std::move( plano ) );
+                REQUIRE_EQ( arbol.tamanio(), (size_t)N );
+
+                for (int k = 0; k < 200; k++) {
+                    int a = gen() % N, b = gen() % N;
+                    auto lca = arbol.ancestroComun( arbol.buscar( valorNodo( carga, 1000+a ) ),
+                                                    arbol.buscar( valorNodo( carga, 1000+b ) ) );
+                    while (profundidad( a ) > profundidad( b )) a = padre[a];
+                    while (profundidad( b ) > profundidad( a )) b = padre[b];
+                    while (a != b) {
+                        a = padre[a];
+                        b = padre[b];
+                    }
+                    REQUIRE_EQ( arbol.nodo( lca ), valorNodo( carga, 1000+a ) );
+                }
+            }
+    }
+}
+
+TEST_CASE ("Profundidad, distancia, k-ésimo ancestro y camino")
+{
+    SUBCASE ("Coinciden con subir por los padres, también en árboles profundos")
+    {
+        std::mt19937 gen( 11 );
+        for (auto forma : {Forma::BALANCEADO, Forma::CADENA, Forma::ALEATORIO})
+            for (int N : {1, 2, 3, 100, 20000}) {
+                auto plano = generarArbol( forma, Carga::ENTERO, N );
+                std::vector<int> padre( N, -1 );
+                for (int i = 0; i < N; i++) {
+                    if (plano.izquierdo[i] >= 0) padre[plano.izquierdo[i]] = i;
+                    if (plano.derecho[i] >= 0) padre[plano.derecho[i]] = i;
+                }
+                auto subir = [&] (int i) {
+                    std::vector<int> camino;
+                    for (; i >= 0; i = padre[i])
+                        camino.push_back( i );
+                    return camino;
+                };
+
+                ArbolCompilado arbol( std::move( plano ) );
+
+                for (int q = 0; q < 300; q++) {
+                    int a = gen() % N, b = gen() % N;
+                    auto ca = subir( a ), cb = subir( b );
+                    int ia = arbol.buscar( a ), ib = arbol.buscar( b );
+
+                    REQUIRE_EQ( arbol.nivel( ia ), (int)ca.size()-1 );
+                    for (int k : {0, 1, 2, int( gen() % ca.size() ), (int)ca.size()-1})
+                        if (k < (int)ca.size())
+                            REQUIRE_EQ( arbol.nodo( arbol.ancestro( ia, k ) ), ca[k] );
+                    REQUIRE_EQ( arbol.ancestro( ia, ca.size() ), -1 );
+
+                    // Camino: a ... lca ... b
+                    while (ca.size() > 1 && cb.size() > 1 && ca[ca.size()-2] == cb[cb.size()-2]) {
+                        ca.pop_back();
+                        cb.pop_back();
+                    }
+                    std::vector<int> esperado( ca.begin(), ca.end() );
+                    esperado.insert( esperado.end(), cb.rbegin()+1, cb.rend() );
+
+                    auto camino = arbol.camino( ia, ib );
+                    REQUIRE_EQ( camino.size(), esperado.size() );
+                    for (size_t i = 0; i < camino.size(); i++)
+                        REQUIRE_EQ( arbol.nodo( camino[i] ), esperado[i] );
+                    REQUIRE_EQ( arbol.distancia( ia, ib ), (int)esperado.size()-1 );
+                }
+            }
+    }
+
+    SUBCASE ("Consultas a través del controlador")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        setenv( "RESTFUL_PORT_NO", "37337", 1 );
+        const auto c = std::make_shared< Control >();
+
+        // r -> a -> b (izquierda), r -> c (derecha)
+        int id = c->newTreeInterface( nlohmann::json::parse(
+            R"({"node":"r","left":{"node":"a","left":{"node":"b"}},"right":{"node":"c"}})" ) );
+
+        std::shared_ptr<nlohmann::json> result;
+        result = c->depthInterface( {{"id", id}, {"node", "b"}} );
+        CHECK_EQ( *result, 2 );
+        result = c->depthInterface( {{"id", id}, {"node", "r"}} );
+        CHECK_EQ( *result, 0 );
+        result = c->distanceInterface( {{"id", id}, {"node_a", "b"}, {"node_b", "c"}} );
+        CHECK_EQ( *result, 3 );
+        result = c->kthAncestorInterface( {{"id", id}, {"node", "b"}, {"k", 0}} );
+        CHECK_EQ( *result, "b" );
+        result = c->kthAncestorInterface( {{"id", id}, {"node", "b"}, {"k", 2}} );
+        CHECK_EQ( *result, "r" );
+        result = c->pathInterface( {{"id", id}, {"node_a", "b"}, {"node_b", "c"}} );
+        CHECK_EQ( *result, nlohmann::json::array( {"b", "a", "r", "c"} ) );
+        result = c->pathInterface( {{"id", id}, {"node_a", "a"}, {"node_b", "a"}} );
+        CHECK_EQ( *result, nlohmann::json::array( {"a"} ) );
+
+        CHECK_THROWS_AS( c->kthAncestorInterface( {{"id", id}, {"node", "b"}, {"k", 3}} ), std::logic_error );
+        CHECK_THROWS_AS( c->kthAncestorInterface( {{"id", id}, {"node", "b"}, {"k", -1}} ), std::logic_error );
+        CHECK_THROWS_AS( c->kthAncestorInterface( {{"id", id}, {"node", "b"}, {"k", "1"}} ), std::logic_error );
+        CHECK_THROWS_AS( c->kthAncestorInterface( {{"id", id}, {"node", "b"}} ), std::logic_error );
+        CHECK_THROWS_AS( c->depthInterface( {{"id", id}, {"node", "x"}} ), std::logic_error );
+        CHECK_THROWS_AS( c->distanceInterface( {{"id", id}, {"node_a", "b"}} ), std::logic_error );
+        CHECK_THROWS_AS( c->pathInterface( {{"node_a", "b"}, {"node_b", "c"}} ), std::logic_error );
+    }
+}
+
+TEST_CASE ("Consulta de ancestros comunes en lote")
+{
+    setenv( "RESTFUL_DB", "test/test.db", 1 );
+    setenv( "RESTFUL_PORT_NO", "37337", 1 );
+    const auto c = std::make_shared< Control >();
+
+    nlohmann::json o = {
+        {"node",1},
+        {"left",{
+                {"node",2},
+                {"left",{
+                        {"node",3}
+                    }
+                }
+            }
+        },
+        {"right",{
+                {"node",4}
+            }
+        }
+    };
+
+    int id = 0;
+    std::shared_ptr<nlohmann::json> result;
+    REQUIRE_NOTHROW( id = c->newTreeInterface( o ) );
+
+    SUBCASE ("Cada par tiene su resultado, en el mismo orden, con errores por par")
+    {
+        nlohmann::json q = {
+            {"id",    id},
+            {"pairs", {
+                    {{"node_a", 3}, {"node_b", 4}},
+                    {{"node_a", 3}, {"node_b", 2}},
+                    {{"node_a", 3}, {"node_b", 99}},
+                    {{"node_a", 4}},
+                    {{"node_a", 4}, {"node_b", 4}}
+                }
+            }
+        };
+
+        REQUIRE_NOTHROW( result = c->lowestCommonAncestorBatchInterface( q ) );
+        REQUIRE_EQ( result->size(), 5u );
+        CHECK_EQ( (*result)[0]["node"], 1 );
+        CHECK_EQ( (*result)[1]["node"], 2 );
+        CHECK( (*result)[2].contains( "error" ) );
+        CHECK( (*result)[3].contains( "error" ) );
+        CHECK_EQ( (*result)[4]["node"], 4 );
+    }
+
+    SUBCASE ("Sin pares o con ID erróneo falla la solicitud completa")
+    {
+        CHECK_THROWS( c->lowestCommonAncestorBatchInterface( {{"id", id}} ) );
+        CHECK_THROWS( c->lowestCommonAncestorBatchInterface( {{"id", 1000}, {"pairs", nlohmann::json::array()}} ) );
+    }
+}
+
+TEST_CASE ("Consultas sin reservas de memoria proporcionales al árbol")
+{
+    setenv( "RESTFUL_DB", "test/test.db", 1 );
+    setenv( "RESTFUL_PORT_NO", "37337", 1 );
+    const auto c = std::make_shared< Control >();
+    const int CONSULTAS = 100;
+
+    // Árboles balanceados de distinto tamaño, con nodos 0..n-1
+    std::function<nlohmann::json(int, int)> armar = [&] (int i, int n) {
+        nlohmann::json o = {{"node", i}};
+        if (2*i+1 < n) o["left"] = armar( 2*i+1, n );
+        if (2*i+2 < n) o["right"] = armar( 2*i+2, n );
+        return o;
+    };
+
+    std::vector<long> porConsulta;
+
+    for (int n : {15, 1023, 16383})
+    {
+        int id = 0;
+        REQUIRE_NOTHROW( id = c->newTreeInterface( armar( 0, n ) ) );
+
+        std::mt19937 gen( n );
+        std::vector<nlohmann::json> consultas;
+        for (int k = 0; k < CONSULTAS; k++)
+            consultas.push_back( {{"id", id}, {"node_a", (int)(gen() % n)}, {"node_b", (int)(gen() % n)}} );
+
+        // La primera consulta compila el árbol y lo deja en la caché
+        REQUIRE_NOTHROW( c->lowestCommonAncestorInterface( consultas[0] ) );
+
+        long antes = reservas;
+        for (auto& q : consultas)
+            c->lowestCommonAncestorInterface( q );
+        porConsulta.push_back( (reservas-antes)/CONSULTAS );
+    }
+
+    // Solo se reserva el resultado, sea cual sea el tamaño del árbol
+    CHECK_EQ( porConsulta[0], porConsulta[1] );
+    CHECK_EQ( porConsulta[0], porConsulta[2] );
+    CHECK_LE( porConsulta[0], 2 );
+
+    SUBCASE ("Compilar un árbol reutiliza la memoria de trabajo del hilo")
+    {
+        auto arbol = armar( 0, 4095 );
+        ArbolCompilado primero( arbol );
+        auto capacidad = Arena::delHilo().capacidad();
+        CHECK_GT( capacidad, 0u );
+
+        ArbolCompilado segundo( arbol );
+        CHECK_EQ( Arena::delHilo().capacidad(), capacidad );
+    }
+}
+
+TEST_CASE ("Política de conexiones persistentes")
+{
+    setenv( "RESTFUL_KEEP_ALIVE_TIMEOUT_MS", "1000", 1 );
+    setenv( "RESTFUL_KEEP_ALIVE_MAX_REQUESTS", "3", 1 );
+    setenv( "RESTFUL_MAX_CONNECTIONS", "2", 1 );
+
+    SUBCASE ("Cada conexión atiende hasta el máximo de solicitudes")
+    {
+        Conexiones conexiones;
+        auto s = std::make_shared< restbed::Session >( "s" );
+
+        CHECK( conexiones.mantener( s, false ) );
+        CHECK( conexiones.mantener( s, false ) );
+        CHECK_FALSE( conexiones.mantener( s, false ) );
+        CHECK_EQ( conexiones.cantidad(), 0u );
+    }
+
+    SUBCASE ("Si el cliente pide cerrar, la conexión se cierra")
+    {
+        Conexiones conexiones;
+        auto s = std::make_shared< restbed::Session >( "s" );
+
+        CHECK( conexiones.mantener( s, false ) );
+        CHECK_FALSE( conexiones.mantener( s, true ) );
+        CHECK_EQ( conexiones.cantidad(), 0u );
+    }
+
+    SUBCASE ("Se respeta el máximo de conexiones simultáneas")
+    {
+        Conexiones conexiones;
+        auto s1 = std::make_shared< restbed::Session >( "s1" );
+        auto s2 = std::make_shared< restbed::Session >( "s2" );
+        auto s3 = std::make_shared< restbed::Session >( "s3" );
+
+        CHECK( conexiones.mantener( s1, false ) );
+        CHECK( conexiones.mantener( s2, false ) );
+        CHECK_FALSE( conexiones.mantener( s3, false ) );
+        CHECK_EQ( conexiones.cantidad(), 2u );
+
+        // Una conexión cerrada por el cliente libera su lugar
+        s1.reset();
+        CHECK( conexiones.mantener( s3, false ) );
+        CHECK_EQ( conexiones.cantidad(), 2u );
+    }
+
+    SUBCASE ("Con tiempo de inactividad 0 no hay conexiones persistentes")
+    {
+        setenv( "RESTFUL_KEEP_ALIVE_TIMEOUT_MS", "0", 1 );
+        Conexiones conexiones;
+        auto s = std::make_shared< restbed::Session >( "s" );
+
+        CHECK_FALSE( conexiones.mantener( s, false ) );
+    }
+
+    SUBCASE ("Los valores inválidos se rechazan")
+    {
+        setenv( "RESTFUL_MAX_CONNECTIONS", "-1", 1 );
+        CHECK_THROWS( Conexiones{} );
+        setenv( "RESTFUL_MAX_CONNECTIONS", "muchas", 1 );
+        CHECK_THROWS( Conexiones{} );
+    }
+
+    unsetenv( "RESTFUL_KEEP_ALIVE_TIMEOUT_MS" );
+    unsetenv( "RESTFUL_KEEP_ALIVE_MAX_REQUESTS" );
+    unsetenv( "RESTFUL_MAX_CONNECTIONS" );
+}
+
+TEST_CASE ("Lectura incremental de árboles")
+{
+    // Lee el texto en partes del largo indicado
+    auto leer = [] (const std::string& texto, size_t parte) {
+        LectorArbol lector;
+        for (size_t i = 0; i < texto.size(); i += parte)
+            lector.leer( texto.data()+i, std::min( parte, texto.size()-i ) );
+        return lector.terminar();
+    };
+
+    SUBCASE ("El texto canónico y el árbol compilado coinciden con los de nlohmann::json")
+    {
+        std::vector<std::string> textos = {
+            R"({"node":1})",
+            R"( { "node" : 1 , "left" : {"node":2, "left":{"node":3}}, "right":{"node":4} } )",
+            R"({"right":{"node":"d","left":{"node":"e"}},"node":"a","left":{"node":"b\"}{\\","right":{"node":"cé"}}})",
+            R"({"node":{"name":"John","surname":"Doe"},"left":{"node":[1,{"a":"]"}],"right":{"node":null}}})",
+            R"({"node":-1.5e2,"left":{"node":true},"right":{"node":18446744073709551615,"left":{"node":0.1}}})",
+            R"({"zeta":1,"node":1,"alfa":{"x":[1,2]},"left":{"m":"medio","node":2},"right":{"node":3,"right":{"node":4}}})",
+            R"({"node":7,"left":{"node":8}})"
+        };
+
+        for (auto& texto : textos)
+            for (size_t parte : {1, 3, 7, 1000}) {
+                auto plano = leer( texto, parte );
+                auto o = nlohmann::json::parse( texto );
+                REQUIRE_EQ( plano.serializar(), o.dump() );
+
+                ArbolCompilado desdeJson( o ), desdePlano( std::move( plano ) );
+                REQUIRE_EQ( desdePlano.tamanio(), desdeJson.tamanio() );
+                for (size_t i = 0; i < desdeJson.tamanio(); i++) {
+                    CHECK_EQ( desdePlano.nodo( i ), desdeJson.nodo( i ) );
+                    CHECK_EQ( desdePlano.ancestroComun( 0, i ), desdeJson.ancestroComun( 0, i ) );
+                    CHECK_EQ( desdePlano.ancestroComun( i, desdeJson.tamanio()-1 ),
+                              desdeJson.ancestroComun( i, desdeJson.tamanio()-1 ) );
+                }
+            }
+    }
+
+    SUBCASE ("Los árboles mal formados se rechazan")
+    {
+        std::vector<std::string> textos = {
+            "",
+            R"([1,2])",
+            R"({"left":{"node":1}})",
+            R"({"node":1,"left":{"nodo":2}})",
+            R"({"node":1,"left":2})",
+            R"({"node":1,"left":null})",
+            R"({"node":1,"node":2})",
+            R"({"node":1,"x":1,"x":2})",
+            R"({"node":1,})",
+            R"({"node":1 "left":{"node":2}})",
+            R"({"node":tru})",
+            R"({"node":{"a":}})",
+            R"({"node":1}{"node":2})",
+            R"({"node":1,"left":{"node":2})"
+        };
+
+        for (auto& texto : textos)
+            CHECK_THROWS_AS( leer( texto, 5 ), std::logic_error );
+    }
+
+    SUBCASE ("Un árbol leído por partes se guarda igual que desde nlohmann::json")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        const auto c = std::make_shared< Control >();
+        std::string texto = R"({"node":10,"right":{"node":12},"left":{"node":11,"left":{"node":13}}})";
+
+        int id1 = 0, id2 = 0;
+        REQUIRE_NOTHROW( id1 = c->newTreeInterface( leer( texto, 4 ) ) );
+        REQUIRE_NOTHROW( id2 = c->newTreeInterface( nlohmann::json::parse( texto ) ) );
+        CHECK_EQ( id1, id2 );
+
+        auto result = c->lowestCommonAncestorInterface( {{"id", id1}, {"node_a", 13}, {"node_b", 12}} );
+        CHECK_EQ( *result, 10 );
+    }
+
+    SUBCASE ("El tamaño máximo de los árboles se valida")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        CHECK_EQ( std::make_shared< Control >()->getMaxTreeBytes(), 256u*1024*1024 );
+
+        setenv( "RESTFUL_MAX_TREE_MB", "3", 1 );
+        CHECK_EQ( std::make_shared< Control >()->getMaxTreeBytes(), 3u*1024*1024 );
+        for (auto valor : {"-1", "256MB", "0x10", "", "99999999999999999999"}) {
+            setenv( "RESTFUL_MAX_TREE_MB", valor, 1 );
+            CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        }
+        unsetenv( "RESTFUL_MAX_TREE_MB" );
+    }
+}
+
+TEST_CASE ("Cuerpos chunked")
+{
+    // Decodifica el cuerpo en partes del largo indicado
+    auto decodificar = [] (const std::string& cuerpo, size_t parte, size_t maximo) {
+        DecodificadorChunked decodificador( maximo );
+        std::string datos;
+        for (size_t i = 0; i < cuerpo.size(); i += parte)
+            decodificador.leer( cuerpo.data()+i, std::min( parte, cuerpo.size()-i ),
+                                [&datos] (const char *d, size_t n) { datos.append( d, n ); } );
+        if (! decodificador.terminado())
+            throw std::logic_error( "incompleto" );
+        return datos;
+    };
+
+    SUBCASE ("Los datos se reconstruyen con cualquier partición, extensiones y trailers")
+    {
+        std::string cuerpo = "5\r\n{\"nod\r\n"
+                             "A;ext=1\r\ne\":1,\"left\r\n"
+                             "8 \r\n\":{\"node\r\n"
+                             "5\r\n\":2}}\r\n"
+                             "0\r\nX-Trailer: si\r\n\r\n";
+        for (size_t parte : {1, 2, 5, 1000})
+            CHECK_EQ( decodificar( cuerpo, parte, 1024 ), R"({"node":1,"left":{"node":2}})" );
+    }
+
+    SUBCASE ("Pidiendo lo que indica siguiente() nunca se lee más allá del final")
+    {
+        std::string cuerpo = "3\r\nabc\r\n10\r\n0123456789abcdef\r\n0\r\n\r\n";
+        std::string resto = "GET / HTTP/1.1\r\n";
+        auto entrada = cuerpo+resto;
+
+        DecodificadorChunked decodificador( 1024 );
+        std::string datos;
+        size_t i = 0;
+        while (! decodificador.terminado()) {
+            size_t n = decodificador.siguiente();
+            if (n == 0)
+                n = entrada.find( "\r\n", i )+2-i;
+            else
+                n = std::min<size_t>( n, 4 );
+            decodificador.leer( entrada.data()+i, n, [&datos] (const char *d, size_t n) { datos.append( d, n ); } );
+            i += n;
+        }
+        CHECK_EQ( datos, "abc0123456789abcdef" );
+        CHECK_EQ( decodificador.bytes(), 19u );
+        CHECK_EQ( entrada.substr( i ), resto );
+    }
+
+    SUBCASE ("Se rechazan los cuerpos que superan el máximo y los mal formados")
+    {
+        CHECK_THROWS_AS( decodificar( "8\r\n01234567\r\n0\r\n\r\n", 3, 7 ), std::length_error );
+        CHECK_THROWS_AS( decodificar( "4\r\n0123\r\n4\r\n4567\r\n0\r\n\r\n", 3, 7 ), std::length_error );
+        CHECK_THROWS_AS( decodificar( "ffffffffffffffff\r\n", 3, 7 ), std::length_error );
+        CHECK_NOTHROW( decodificar( "7\r\n0123456\r\n0\r\n\r\n", 3, 7 ) );
+
+        for (std::string cuerpo : {"x\r\n", "4x\r\n0123\r\n0\r\n\r\n", "4\r\n0123XY0\r\n\r\n",
+                                   "0\r\n\r\n0", "4\r\n01"})
+            CHECK_THROWS_AS( decodificar( cuerpo, 2, 1024 ), std::logic_error );
+    }
+
+    SUBCASE ("Un árbol guardado se compila desde el texto almacenado")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        std::string texto = R"({"node":"r","left":{"node":"a","right":{"node":"b"}},"right":{"node":"c"}})";
+
+        int id = 0;
+        REQUIRE_NOTHROW( id = std::make_shared< Control >()->newTreeInterface( nlohmann::json::parse( texto ) ) );
+
+        // Otro Control no tiene el árbol en caché: lo lee y compila de la BBDD
+        const auto c = std::make_shared< Control >();
+        auto result = c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "b"}, {"node_b", "c"}} );
+        CHECK_EQ( *result, "r" );
+        result = c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "b"}, {"node_b", "a"}} );
+        CHECK_EQ( *result, "a" );
+    }
+}
+
+TEST_CASE ("Métricas")
+{
+    auto cuenta = [] (const std::string& texto, const std::string& serie) {
+        auto i = texto.find( "\n"+serie+" " );
+        REQUIRE_NE( i, std::string::npos );
+        return std::stoull( texto.substr( i+serie.size()+2 ) );
+    };
+
+    SUBCASE ("Las solicitudes se cuentan por ruta y estado, y los histogramas acumulan")
+    {
+        Metricas m;
+        m.solicitud( Metricas::ANCESTRO_COMUN, 200, std::chrono::microseconds( 50 ) );
+        m.solicitud( Metricas::ANCESTRO_COMUN, 200, std::chrono::milliseconds( 3 ) );
+        m.solicitud( Metricas::ANCESTRO_COMUN, 400, std::chrono::seconds( 20 ) );
+        m.solicitud( Metricas::CREAR_ARBOL, 418, std::chrono::milliseconds( 1 ) );
+        m.arbol( 5 );
+
+        auto texto = m.exportar();
+        CHECK_EQ( cuenta( texto, "restful_http_requests_total{route=\"/ancestro-comun\",status=\"200\"}" ), 2u );
+        CHECK_EQ( cuenta( texto, "restful_http_requests_total{route=\"/ancestro-comun\",status=\"400\"}" ), 1u );
+        CHECK_EQ( cuenta( texto, "restful_http_requests_total{route=\"/crear-arbol\",status=\"otro\"}" ), 1u );
+        CHECK_EQ( texto.find( "route=\"/ancestro-comun-lote\",status" ), std::string::npos );
+
+        auto serie = std::string( "restful_http_request_duration_seconds_bucket{route=\"/ancestro-comun\"," );
+        CHECK_EQ( cuenta( texto, serie+"le=\"0.0001\"}" ), 1u );
+        CHECK_EQ( cuenta( texto, serie+"le=\"0.005\"}" ), 2u );
+        CHECK_EQ( cuenta( texto, serie+"le=\"10\"}" ), 2u );
+        CHECK_EQ( cuenta( texto, serie+"le=\"+Inf\"}" ), 3u );
+        CHECK_EQ( cuenta( texto, "restful_http_request_duration_seconds_count{route=\"/ancestro-comun\"}" ), 3u );
+        CHECK_EQ( cuenta( texto, "restful_tree_nodes_bucket{le=\"1\"}" ), 0u );
+        CHECK_EQ( cuenta( texto, "restful_tree_nodes_bucket{le=\"10\"}" ), 1u );
+    }
+
+    SUBCASE ("Los totales son exactos con varios hilos registrando a la vez")
+    {
+        Metricas m;
+        std::vector< std::thread > hilos;
+        for (int h = 0; h < 20; h++)
+            hilos.emplace_back( [&m] () {
+                for (int i = 0; i < 5000; i++) {
+                    m.solicitud( Metricas::ANCESTRO_COMUN_LOTE, 200, std::chrono::microseconds( i ) );
+                    m.cache( i%2 );
+                }
+            } );
+        for (auto& h : hilos)
+            h.join();
+
+        auto texto = m.exportar();
+        CHECK_EQ( cuenta( texto, "restful_http_requests_total{route=\"/ancestro-comun-lote\",status=\"200\"}" ), 100000u );
+        CHECK_EQ( cuenta( texto, "restful_http_request_duration_seconds_count{route=\"/ancestro-comun-lote\"}" ), 100000u );
+        CHECK_EQ( cuenta( texto, "restful_tree_cache_requests_total{result=\"hit\"}" ), 50000u );
+        CHECK_EQ( cuenta( texto, "restful_tree_cache_requests_total{result=\"miss\"}" ), 50000u );
+    }
+
+    SUBCASE ("El controlador registra la persistencia y la caché de árboles")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        setenv( "RESTFUL_PORT_NO", "37337", 1 );
+        const auto c = std::make_shared< Control >();
+
+        // Como en /crear-arbol, el árbol llega por LectorArbol
+        std::string texto = R"({"node":"m1","left":{"node":"m2"},"right":{"node":"m3"}})";
+        LectorArbol lector;
+        lector.leer( texto.data(), texto.size() );
+        int id = c->newTreeInterface( lector.terminar() );
+        c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "m2"}, {"node_b", "m3"}} );
+        c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "m2"}, {"node_b", "m2"}} );
+
+        texto = c->metricsInterface();
+        CHECK_EQ( cuenta( texto, "restful_tree_cache_requests_total{result=\"hit\"}" ), 2u );
+        CHECK_EQ( cuenta( texto, "restful_tree_nodes_count" ), 1u );
+        CHECK_GE( cuenta( texto, "restful_db_step_seconds_count{statement=\"insert\"}" ), 1u );
+        CHECK_GE( cuenta( texto, "restful_db_wait_seconds_count{lock=\"escritura\"}" ), 1u );
+        CHECK_EQ( cuenta( texto, "restful_tree_cache_trees" ), 1u );
+        CHECK_NE( texto.find( "\nrestful_keepalive_connections 0\n" ), std::string::npos );
+    }
+}
+
+TEST_CASE ("Tiempos por fase")
+{
+    setenv( "RESTFUL_DB", "test/test.db", 1 );
+    setenv( "RESTFUL_PORT_NO", "37337", 1 );
+
+    SUBCASE ("Las fases con el mismo nombre se suman y se informan en orden")
+    {
+        Tiempos t( Tiempos::reloj::now(), true, std::chrono::nanoseconds( 0 ) );
+        t.sumar( "db", std::chrono::microseconds( 1500 ) );
+        t.sumar( "lca", std::chrono::microseconds( 20 ) );
+        t.sumar( "db", std::chrono::microseconds( 500 ) );
+        {
+            Tiempos::Fase fase( nullptr, "nada" );
+        }
+        CHECK_EQ( t.servidor( std::chrono::milliseconds( 3 ) ), "db;dur=2, lca;dur=0.02, total;dur=3" );
+
+        std::multimap< std::string, std::string > cabeceras;
+        t.terminar( Metricas::ANCESTRO_COMUN, 200, cabeceras );
+        REQUIRE_EQ( cabeceras.count( "Server-Timing" ), 1u );
+        CHECK_EQ( cabeceras.find( "Server-Timing" )->second.rfind( "db;dur=2, lca;dur=0.02, total;dur=", 0 ), 0u );
+    }
+
+    SUBCASE ("Desactivados, el controlador no mide")
+    {
+        unsetenv( "RESTFUL_SERVER_TIMING" );
+        unsetenv( "RESTFUL_SLOW_MS" );
+        CHECK_EQ( std::make_shared< Control >()->timingInterface( Tiempos::reloj::now() ), nullptr );
+
+        setenv( "RESTFUL_SERVER_TIMING", "2", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        setenv( "RESTFUL_SERVER_TIMING", "0", 1 );
+        setenv( "RESTFUL_SLOW_MS", "lento", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_SERVER_TIMING" );
+        unsetenv( "RESTFUL_SLOW_MS" );
+    }
+
+    SUBCASE ("El modelo informa sus fases y las solicitudes lentas se registran con el árbol")
+    {
+        setenv( "RESTFUL_SLOW_MS", "1", 1 );
+        const auto c = std::make_shared< Control >();
+        unsetenv( "RESTFUL_SLOW_MS" );
+
+        int id = c->newTreeInterface( generarArbol( Forma::BALANCEADO, Carga::TEXTO, 1000, 7000 ) );
+        // Otro Control, para compilar el árbol desde la BBDD
+        setenv( "RESTFUL_SERVER_TIMING", "1", 1 );
+        const auto frio = std::make_shared< Control >();
+        unsetenv( "RESTFUL_SERVER_TIMING" );
+
+        auto tiempos = frio->timingInterface( Tiempos::reloj::now() );
+        REQUIRE( tiempos );
+        frio->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "nodo-7998"}, {"node_b", "nodo-7999"}}, tiempos.get() );
+        auto texto = tiempos->servidor( std::chrono::nanoseconds( 0 ) );
+        for (auto fase : {"cache;", "db;", "compilar;", "buscar;", "lca;"})
+            CHECK_NE( texto.find( fase ), std::string::npos );
+
+        // Una solicitud que supera el umbral va a la salida de errores
+        tiempos = c->timingInterface( Tiempos::reloj::now()-std::chrono::milliseconds( 5 ) );
+        REQUIRE( tiempos );
+        c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", "nodo-7001"}, {"node_b", "nodo-7002"}}, tiempos.get() );
+
+        std::ostringstream registro;
+        auto anterior = std::cerr.rdbuf( registro.rdbuf() );
+        std::multimap< std::string, std::string > cabeceras;
+        tiempos->terminar( Metricas::ANCESTRO_COMUN, 200, cabeceras );
+        std::cerr.rdbuf( anterior );
+
+        CHECK_EQ( cabeceras.count( "Server-Timing" ), 0u );
+        CHECK_EQ( registro.str().rfind( "Solicitud lenta: /ancestro-comun 200 árbol "+std::to_string( id )+" (1000 nodos) [", 0 ), 0u );
+    }
+}
+
+TEST_CASE ("Instantáneas de árboles compilados")
+{
+    const std::string archivo = "test/instantanea.arbol";
+    const std::string fuente = hash128( std::string( "fuente" ) ).bytes();
+
+    auto leer = [] (const std::string& nombre) {
+        std::ifstream f( nombre, std::ios::binary );
+        return std::string( std::istreambuf_iterator<char>( f ), std::istreambuf_iterator<char>() );
+    };
+    auto escribir = [] (const std::string& nombre, const std::string& datos) {
+        std::ofstream( nombre, std::ios::binary ) << datos;
+    };
+
+    SUBCASE ("El árbol mapeado responde igual que el compilado, en todas las formas y cargas")
+    {
+        std::mt19937 gen( 77 );
+        for (auto forma : {Forma::BALANCEADO, Forma::CADENA, Forma::ALEATORIO})
+            for (auto carga : {Carga::ENTERO, Carga::TEXTO, Carga::OBJETO})
+                for (int n : {1, 2, 33, 5000})
+                {
+                    ArbolCompilado compilado( generarArbol( forma, carga, n ) );
+                    compilado.guardar( archivo, fuente );
+                    auto mapeado = ArbolCompilado::abrir( archivo, fuente );
+                    REQUIRE( mapeado );
+                    REQUIRE_EQ( mapeado->tamanio(), compilado.tamanio() );
+
+                    for (int i = 0; i < n; i++) {
+                        REQUIRE_EQ( mapeado->nodo( i ), compilado.nodo( i ) );
+                        REQUIRE_EQ( mapeado->nivel( i ), compilado.nivel( i ) );
+                        REQUIRE_EQ( mapeado->buscar( valorNodo( carga, i ) ), compilado.buscar( valorNodo( carga, i ) ) );
+                    }
+                    CHECK_EQ( mapeado->buscar( valorNodo( carga, n ) ), -1 );
+
+                    for (int j = 0; j < 200; j++) {
+                        int a = gen() % n, b = gen() % n, k = gen() % (n+1);
+                        REQUIRE_EQ( mapeado->ancestroComun( a, b ), compilado.ancestroComun( a, b ) );
+                        REQUIRE_EQ( mapeado->distancia( a, b ), compilado.distancia( a, b ) );
+                        REQUIRE_EQ( mapeado->ancestro( a, k ), compilado.ancestro( a, k ) );
+                        REQUIRE_EQ( mapeado->camino( a, b ), compilado.camino( a, b ) );
+                    }
+
+                    // Guardar el árbol mapeado produce el mismo archivo
+                    auto original = leer( archivo );
+                    mapeado->guardar( archivo + "2", fuente );
+                    CHECK_EQ( leer( archivo + "2" ), original );
+                }
+        std::remove( (archivo + "2").c_str() );
+    }
+
+    SUBCASE ("Las instantáneas que no corresponden o están dañadas se descartan")
+    {
+        ArbolCompilado compilado( generarArbol( Forma::ALEATORIO, Carga::TEXTO, 1000 ) );
+        compilado.guardar( archivo, fuente );
+        auto original = leer( archivo );
+        REQUIRE( ArbolCompilado::abrir( archivo, fuente ) );
+
+        CHECK_FALSE( ArbolCompilado::abrir( archivo, hash128( std::string( "otra" ) ).bytes() ) );
+        CHECK_FALSE( ArbolCompilado::abrir( archivo, "" ) );
+        CHECK_FALSE( ArbolCompilado::abrir( "test/no-existe.arbol", fuente ) );
+
+        // Truncado
+        escribir( archivo, original.substr( 0, original.size()/2 ) );
+        CHECK_FALSE( ArbolCompilado::abrir( archivo, fuente ) );
+
+        // Un byte cambiado en los índices o en el texto
+        for (size_t i : {original.size()/3, original.rfind( "nodo-" )}) {
+            auto danado = original;
+            danado[i] ^= 1;
+            escribir( archivo, danado );
+            CHECK_FALSE( ArbolCompilado::abrir( archivo, fuente ) );
+        }
+
+        // Otra versión del formato
+        auto version = original;
+        version[8] ^= 1;
+        escribir( archivo, version );
+        CHECK_FALSE( ArbolCompilado::abrir( archivo, fuente ) );
+
+        // Bloques del RMQ o ranuras que no corresponden a los nodos (no son
+        // parte de la suma de verificación, o solo mueven las secciones)
+        for (size_t campo : {56, 64})
+            for (uint64_t valor : {uint64_t(0), uint64_t(3), uint64_t(1)<<62}) {
+                auto cabecera = original;
+                memcpy( &cabecera[campo], &valor, sizeof(valor) );
+                escribir( archivo, cabecera );
+                CHECK_FALSE( ArbolCompilado::abrir( archivo, fuente ) );
+            }
+
+        escribir( archivo, original );
+        CHECK( ArbolCompilado::abrir( archivo, fuente ) );
+    }
+
+    SUBCASE ("Con RESTFUL_SNAPSHOT las consultas tras un reinicio no interpretan el JSON")
+    {
+        auto cuenta = [] (const std::string& texto, const std::string& serie) {
+            auto i = texto.find( "\n"+serie+" " );
+            REQUIRE_NE( i, std::string::npos );
+            return std::stoull( texto.substr( i+serie.size()+2 ) );
+        };
+
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        setenv( "RESTFUL_SNAPSHOT", "1", 1 );
+
+        int id, otro;
+        {
+            const auto c = std::make_shared< Control >();
+            id = c->newTreeInterface( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 3000, 424242 ) );
+            otro = c->newTreeInterface( generarArbol( Forma::CADENA, Carga::ENTERO, 10, 434343 ) );
+        }
+        REQUIRE_FALSE( leer( "test/test.db.arboles/" + std::to_string( id ) + ".arbol" ).empty() );
+
+        {
+            const auto c = std::make_shared< Control >();
+            auto result = c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", 424242+2999}, {"node_b", 424242+2998}} );
+            CHECK( result->is_number_integer() );
+            result = c->depthInterface( {{"id", id}, {"node", 424242}} );
+            CHECK_EQ( *result, 0 );
+            auto texto = c->metricsInterface();
+            CHECK_EQ( cuenta( texto, "restful_json_parse_seconds_count{source=\"guardado\"}" ), 0u );
+            CHECK_EQ( cuenta( texto, "restful_tree_cache_requests_total{result=\"miss\"}" ), 1u );
+        }
+
+        // Una instantánea de otro árbol se descarta y se reemplaza
+        auto propia = "test/test.db.arboles/" + std::to_string( id ) + ".arbol";
+        escribir( propia, leer( "test/test.db.arboles/" + std::to_string( otro ) + ".arbol" ) );
+        {
+            const auto c = std::make_shared< Control >();
+            auto result = c->depthInterface( {{"id", id}, {"node", 424242}} );
+            CHECK_EQ( *result, 0 );
+            CHECK_EQ( cuenta( c->metricsInterface(), "restful_json_parse_seconds_count{source=\"guardado\"}" ), 1u );
+        }
+        CHECK_NE( leer( propia ), leer( "test/test.db.arboles/" + std::to_string( otro ) + ".arbol" ) );
+
+        setenv( "RESTFUL_SNAPSHOT", "2", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_SNAPSHOT" );
+    }
+
+    std::remove( archivo.c_str() );
+}
+
+TEST_CASE ("Precarga de árboles")
+{
+    setenv( "RESTFUL_DB", "test/test.db", 1 );
+
+    // Tres árboles nuevos, guardados sin pasar por la caché
+    std::vector<int> ids;
+    {
+        const auto c = std::make_shared< Control >();
+        auto marca = std::to_string( std::chrono::steady_clock::now().time_since_epoch().count() );
+        for (int i = 0; i < 3; i++)
+            ids.push_back( c->newTreeInterface( {{"node", marca}, {"left", {{"node", i}}}} ) );
+        REQUIRE_LT( ids[0], ids[1] );
+        REQUIRE_LT( ids[1], ids[2] );
+    }
+
+    SUBCASE ("Sin RESTFUL_WARMUP_TREES no se precarga nada")
+    {
+        const auto c = std::make_shared< Control >();
+        CHECK_EQ( c->warmUpInterface(), 0u );
+        CHECK_NE( c->metricsInterface().find( "\nrestful_tree_cache_trees 0\n" ), std::string::npos );
+    }
+
+    SUBCASE ("Se precargan los árboles más recientes y las consultas los encuentran en la caché")
+    {
+        setenv( "RESTFUL_WARMUP_TREES", "2", 1 );
+        const auto c = std::make_shared< Control >();
+        unsetenv( "RESTFUL_WARMUP_TREES" );
+
+        CHECK_EQ( c->warmUpInterface(), 2u );
+        c->lowestCommonAncestorInterface( {{"id", ids[2]}, {"node_a", 2}, {"node_b", 2}} );
+        c->lowestCommonAncestorInterface( {{"id", ids[1]}, {"node_a", 1}, {"node_b", 1}} );
+        c->lowestCommonAncestorInterface( {{"id", ids[0]}, {"node_a", 0}, {"node_b", 0}} );
+
+        auto texto = c->metricsInterface();
+        CHECK_NE( texto.find( "\nrestful_tree_cache_requests_total{result=\"hit\"} 2\n" ), std::string::npos );
+        CHECK_NE( texto.find( "\nrestful_tree_cache_requests_total{result=\"miss\"} 1\n" ), std::string::npos );
+    }
+
+    SUBCASE ("Con la caché desactivada no se precarga; el límite puede superar la cantidad de árboles")
+    {
+        setenv( "RESTFUL_WARMUP_TREES", "1000000", 1 );
+        setenv( "RESTFUL_COMPUTE_THREADS", "4", 1 );
+        setenv( "RESTFUL_CACHE_MB", "0", 1 );
+        auto c = std::make_shared< Control >();
+        CHECK_EQ( c->warmUpInterface(), 0u );
+        unsetenv( "RESTFUL_CACHE_MB" );
+
+        c = std::make_shared< Control >();
+        unsetenv( "RESTFUL_WARMUP_TREES" );
+        unsetenv( "RESTFUL_COMPUTE_THREADS" );
+        auto cargados = c->warmUpInterface();
+        CHECK_GE( cargados, 3u );
+        CHECK_NE( c->metricsInterface().find( "\nrestful_tree_cache_trees " + std::to_string( cargados ) + "\n" ),
+                  std::string::npos );
+    }
+
+    SUBCASE ("Un valor inválido en RESTFUL_WARMUP_TREES no se acepta")
+    {
+        setenv( "RESTFUL_WARMUP_TREES", "todos", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_WARMUP_TREES" );
+    }
+}
+
+TEST_CASE ("Pool de cálculo")
+{
+    SUBCASE ("Se ejecutan todas las tareas, también las enviadas desde varios hilos")
+    {
+        std::atomic<int> hechas{0};
+        {
+            PoolCalculo pool( 3, 100000 );
+            std::vector< std::thread > hilos;
+            for (int h = 0; h < 4; h++)
+                hilos.emplace_back( [&] () {
+                    for (int i = 0; i < 5000; i++)
+                        REQUIRE( pool.enviar( [&hechas] () { hechas++; } ) );
+                } );
+            for (auto& h : hilos)
+                h.join();
+            // El destructor espera las tareas pendientes
+        }
+        CHECK_EQ( hechas.load(), 20000 );
+    }
+
+    SUBCASE ("Con la cola llena se rechazan las tareas, y la espera se mide")
+    {
+        auto metricas = std::make_shared< Metricas >();
+        std::promise<void> liberar;
+        std::shared_future<void> liberado = liberar.get_future().share();
+        std::promise<void> ocupado;
+        std::atomic<int> hechas{0};
+
+        {
+            PoolCalculo pool( 1, 2, metricas );
+            REQUIRE( pool.enviar( [&] () { ocupado.set_value(); liberado.wait(); hechas++; } ) );
+            ocupado.get_future().wait();
+
+            // El único hilo está ocupado: caben dos tareas en la cola
+            CHECK( pool.enviar( [&hechas] () { hechas++; } ) );
+            CHECK( pool.enviar( [&hechas] () { throw std::runtime_error( "falla" ); } ) );
+            CHECK_EQ( pool.cantidad(), 2u );
+            CHECK_FALSE( pool.enviar( [&hechas] () { hechas++; } ) );
+
+            liberar.set_value();
+        }
+        CHECK_EQ( hechas.load(), 2 );
+
+        auto texto = metricas->exportar();
+        CHECK_NE( texto.find( "\nrestful_compute_queue_wait_seconds_count 3\n" ), std::string::npos );
+    }
+
+    SUBCASE ("Un reparto desde las tareas del pool termina aunque los ayudantes no lleguen a ejecutarse")
+    {
+        std::vector< std::vector<int> > partes( 2, std::vector<int>( 1000, 0 ) );
+        std::promise<void> terminadas[2];
+        {
+            // Los dos hilos quedan repartiendo: los ayudantes esperan en la cola o no entran
+            PoolCalculo pool( 2, 2 );
+            for (int t = 0; t < 2; t++)
+                REQUIRE( pool.enviar( [&, t] () {
+                    pool.repartir( partes[t].size(), [&, t] (size_t i) { partes[t][i]++; } );
+                    terminadas[t].set_value();
+                } ) );
+            for (auto& t : terminadas)
+                t.get_future().wait();
+        }
+        for (auto& p : partes)
+            CHECK_EQ( std::count( p.begin(), p.end(), 1 ), 1000 );
+    }
+
+    SUBCASE ("Sin hilos, las tareas se ejecutan al enviarlas")
+    {
+        PoolCalculo pool( 0, 0 );
+        auto hilo = std::this_thread::get_id();
+        std::thread::id ejecutada;
+        CHECK( pool.enviar( [&ejecutada] () { ejecutada = std::this_thread::get_id(); } ) );
+        CHECK_EQ( ejecutada, hilo );
+    }
+
+    SUBCASE ("La configuración del pool se valida")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        setenv( "RESTFUL_COMPUTE_THREADS", "muchos", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_COMPUTE_THREADS" );
+        setenv( "RESTFUL_COMPUTE_QUEUE", "-1", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_COMPUTE_QUEUE" );
+    }
+}
+
+TEST_CASE ("Backends de persistencia")
+{
+    const std::string archivo = "test/test.log";
+    std::remove( archivo.c_str() );
+    setenv( "RESTFUL_DB", archivo.c_str(), 1 );
+
+    auto leer = [] (const std::string& nombre) {
+        std::ifstream f( nombre, std::ios::binary );
+        return std::string( std::istreambuf_iterator<char>( f ), std::istreambuf_iterator<char>() );
+    };
+    auto escribir = [] (const std::string& nombre, const std::string& datos) {
+        std::ofstream( nombre, std::ios::binary ) << datos;
+    };
+
+    auto comunes = [] (Persist& p) {
+        auto id1 = p.insert( "Testing" );
+        auto id2 = p.insert( R"({"node":1})" );
+        CHECK_EQ( id1, 1 );
+        CHECK_EQ( id2, 2 );
+        CHECK_EQ( p.insert( "Testing" ), id1 );
+        CHECK_EQ( p.select( "1" ), "Testing" );
+        CHECK_EQ( p.select( "2" ), R"({"node":1})" );
+        CHECK_EQ( p.clave( "2" ), hash128( std::string(R"({"node":1})") ).bytes() );
+        CHECK( p.recientes( 5 ) == std::vector<int>{2, 1} );
+        CHECK( p.recientes( 1 ) == std::vector<int>{2} );
+        std::vector<int> recorridos;
+        p.recorrer( 0, 5, [&recorridos] (int id, const char*, size_t) { recorridos.push_back( id ); return true; } );
+        CHECK( recorridos == std::vector<int>{1, 2} );
+        std::string texto;
+        p.recorrer( 2, 2, [&texto] (int, const char *t, size_t n) { texto.assign( t, n ); return true; } );
+        CHECK_EQ( texto, R"({"node":1})" );
+        recorridos.clear();
+        p.recorrer( 1, 5, [&recorridos] (int id, const char*, size_t) { recorridos.push_back( id ); return false; } );
+        CHECK( recorridos == std::vector<int>{1} );
+        CHECK_THROWS_AS( p.select( "3" ), std::runtime_error );
+        CHECK_THROWS_AS( p.select( "0" ), std::runtime_error );
+        CHECK_THROWS_AS( p.select( "1x" ), std::runtime_error );
+        CHECK_THROWS_AS( p.clave( "-1" ), std::runtime_error );
+    };
+
+    SUBCASE ("En memoria")
+    {
+        PersistMemoria p;
+        comunes( p );
+        CHECK_EQ( p.archivo(), "" );
+    }
+
+    SUBCASE ("En un registro, que se conserva al reabrirlo")
+    {
+        {
+            PersistLog p;
+            comunes( p );
+            CHECK_EQ( p.archivo(), archivo );
+        }
+        PersistLog p;
+        CHECK_EQ( p.select( "2" ), R"({"node":1})" );
+        CHECK_EQ( p.insert( "Testing" ), 1 );
+        CHECK_EQ( p.insert( "Otro" ), 3 );
+    }
+
+    SUBCASE ("Con varios hilos el registro crece y se mapea de nuevo sin perder lecturas")
+    {
+        setenv( "RESTFUL_DB_SYNCHRONOUS", "OFF", 1 );
+        PersistLog p;
+        const int HILOS = 4, POR_HILO = 200;
+        const std::string relleno( 4000, 'x' );   // > 1 MiB en total, más que el primer mapeo
+        std::atomic<int> errores(0);
+        std::vector<std::thread> hilos;
+
+        for (int h = 0; h < HILOS; h++)
+            hilos.emplace_back( [&, h] () {
+                for (int i = 0; i < POR_HILO; i++) {
+                    auto json = std::to_string( h ) + ":" + std::to_string( i ) + relleno;
+                    auto id = p.insert( json );
+                    if (p.select( std::to_string( id ) ) != json)
+                        errores++;
+                }
+            } );
+        for (auto& t: hilos)
+            t.join();
+
+        CHECK_EQ( errores.load(), 0 );
+        CHECK( p.recientes( 1 ) == std::vector<int>{HILOS*POR_HILO} );
+        unsetenv( "RESTFUL_DB_SYNCHRONOUS" );
+    }
+
+    SUBCASE ("Un registro incompleto al final se descarta al abrir")
+    {
+        {
+            PersistLog p;
+            comunes( p );
+        }
+        auto completo = leer( archivo );
+        escribir( archivo, completo.substr( 0, completo.size()-10 ) );
+        {
+            PersistLog p;
+            CHECK( p.recientes( 5 ) == std::vector<int>{1} );
+            CHECK_THROWS_AS( p.select( "2" ), std::runtime_error );
+            CHECK_EQ( p.insert( R"({"node":1})" ), 2 );
+        }
+        CHECK_EQ( leer( archivo ), completo );
+    }
+
+    SUBCASE ("Un registro dañado solo se descarta si es el último")
+    {
+        {
+            PersistLog p;
+            comunes( p );
+        }
+        auto completo = leer( archivo );
+
+        // El último registro tiene su largo, pero sus datos no llegaron a escribirse
+        auto ultimo = completo;
+        auto pos = ultimo.rfind( R"({"node":1})" );
+        std::fill( ultimo.begin() + pos, ultimo.end(), '\0' );
+        escribir( archivo, ultimo );
+        {
+            PersistLog p;
+            CHECK( p.recientes( 5 ) == std::vector<int>{1} );
+        }
+        CHECK_EQ( leer( archivo ), completo.substr( 0, completo.rfind( "Testing" ) + 8 ) );
+
+        // Un byte dañado en un registro con otros después: no se abre ni se trunca
+        auto danado = completo;
+        danado[danado.find( "Testing" )] = 't';
+        escribir( archivo, danado );
+        CHECK_THROWS_AS( PersistLog(), std::runtime_error );
+        CHECK_EQ( leer( archivo ), danado );
+
+        // Un largo dañado que excede el archivo tampoco se toma por una escritura interrumpida
+        danado = completo;
+        auto cabecera = danado.find( "Testing" ) - 32;
+        const uint32_t largo = 0x7fffffff;
+        danado.replace( cabecera, sizeof(largo), reinterpret_cast<const char*>( &largo ), sizeof(largo) );
+        escribir( archivo, danado );
+        CHECK_THROWS_AS( PersistLog(), std::runtime_error );
+        CHECK_EQ( leer( archivo ), danado );
+    }
+
+    SUBCASE ("Una escritura fallida no deja restos en el archivo")
+    {
+        {
+            PersistLog p;
+            comunes( p );
+        }
+        auto completo = leer( archivo );
+        {
+            PersistLog p;
+
+            // El archivo no puede crecer más de 1000 bytes: el segundo registro queda a medias
+            struct rlimit antes, limite;
+            getrlimit( RLIMIT_FSIZE, &antes );
+            limite = antes;
+            limite.rlim_cur = completo.size() + 1000;
+            auto senial = signal( SIGXFSZ, SIG_IGN );
+            setrlimit( RLIMIT_FSIZE, &limite );
+            CHECK_THROWS_AS( p.insertLote( {std::string( 600, 'a' ), std::string( 600, 'b' )} ), std::runtime_error );
+            setrlimit( RLIMIT_FSIZE, &antes );
+            signal( SIGXFSZ, senial );
+
+            CHECK_EQ( leer( archivo ), completo );
+            CHECK_EQ( p.insert( "c" ), 3 );
+        }
+        PersistLog p;
+        CHECK( p.recientes( 5 ) == std::vector<int>{3, 2, 1} );
+        CHECK_EQ( p.select( "3" ), "c" );
+    }
+
+    SUBCASE ("Un archivo que no es un registro no se abre")
+    {
+        escribir( archivo, "SQLite format 3" );
+        CHECK_THROWS_AS( PersistLog(), std::runtime_error );
+    }
+
+    SUBCASE ("El backend se elige con RESTFUL_BACKEND")
+    {
+        setenv( "RESTFUL_BACKEND", "memoria", 1 );
+        {
+            const auto c = std::make_shared< Control >();
+            auto id = c->newTreeInterface( json::parse( R"({"node":1,"left":{"node":2},"right":{"node":3}})" ) );
+            auto result = c->lowestCommonAncestorInterface( {{"id", id}, {"node_a", 2}, {"node_b", 3}} );
+            CHECK_EQ( *result, 1 );
+        }
+        CHECK_NE( dynamic_cast<PersistMemoria*>( Persist::crear().get() ), nullptr );
+
+        setenv( "RESTFUL_BACKEND", "log", 1 );
+        CHECK_NE( dynamic_cast<PersistLog*>( Persist::crear().get() ), nullptr );
+
+        setenv( "RESTFUL_BACKEND", "memoria", 1 );
+        setenv( "RESTFUL_SNAPSHOT", "1", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_SNAPSHOT" );
+
+        setenv( "RESTFUL_BACKEND", "postgres", 1 );
+        CHECK_THROWS_AS( Persist::crear(), std::runtime_error );
+        unsetenv( "RESTFUL_BACKEND" );
+    }
+
+    std::remove( archivo.c_str() );
+}
+
+TEST_CASE ("Importación masiva de árboles")
+{
+    SUBCASE ("Un resultado por línea, en orden, con líneas partidas entre lecturas y árboles repetidos")
+    {
+        std::vector< std::vector<std::string> > lotes;
+        Importador importador( [&lotes] (const std::vector<std::string>& textos) {
+                lotes.push_back( textos );
+                std::vector<int> ids;
+                for (auto& t : textos)
+                    ids.push_back( 100 + (int)t.size() );
+                return ids;
+            }, nullptr, std::make_shared<PoolCalculo>( 3, 100 ), 64, 4 );
+
+        std::string entrada = "{\"node\":1}\r\n{ \"node\" : 1 }\nnope\n\n"
+                              "{\"node\":1,\"left\":{\"node\":2}}\n{\"node\":\"" + std::string( 100, 'x' ) + "\"}\n{\"node\":3}";
+        std::string salida;
+        for (char c : entrada) {
+            importador.leer( &c, 1 );
+            if (importador.lleno())
+                importador.procesar( salida );
+        }
+        importador.terminar( salida );
+
+        std::vector<std::string> resultados;
+        std::istringstream lineas( salida );
+        for (std::string l; std::getline( lineas, l ); )
+            resultados.push_back( l );
+
+        REQUIRE_EQ( resultados.size(), 7u );
+        CHECK_EQ( resultados[0], R"({"id":110})" );
+        CHECK_EQ( resultados[1], R"({"id":110})" );
+        CHECK_NE( resultados[2].find( "\"error\"" ), std::string::npos );
+        CHECK_NE( resultados[3].find( "\"error\"" ), std::string::npos );
+        CHECK_EQ( resultados[4], R"({"id":128})" );
+        CHECK_NE( resultados[5].find( "MiB por árbol" ), std::string::npos );
+        CHECK_EQ( resultados[6], R"({"id":110})" );
+
+        // El primer lote tiene el mismo árbol dos veces: se guarda una
+        REQUIRE_EQ( lotes.size(), 2u );
+        CHECK_EQ( lotes[0].size(), 1u );
+        CHECK_EQ( importador.procesadas(), 7u );
+        CHECK_EQ( importador.fallidas(), 3u );
+        CHECK_EQ( importador.guardados(), 3u );
+    }
+
+    SUBCASE ("Los ID son los mismos que al crear los árboles de a uno")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        setenv( "RESTFUL_IMPORT_BATCH", "16", 1 );
+        const auto c = std::make_shared< Control >();
+
+        std::vector<std::string> arboles;
+        for (int i = 0; i < 50; i++)
+            arboles.push_back( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 20, 515151 + 100*i ).serializar() );
+
+        auto importador = c->importInterface( 1024*1024 );
+        std::string entrada, salida;
+        for (auto& a : arboles)
+            entrada += a + "\n";
+        importador->leer( entrada.data(), entrada.size() / 2 );
+        while (importador->lleno())
+            importador->procesar( salida );
+        importador->leer( entrada.data() + entrada.size() / 2, entrada.size() - entrada.size() / 2 );
+        importador->terminar( salida );
+
+        std::istringstream lineas( salida );
+        int i = 0;
+        for (std::string l; std::getline( lineas, l ); i++) {
+            auto id = json::parse( l ).at( "id" ).get<int>();
+            CHECK_EQ( id, c->newTreeInterface( json::parse( arboles[i] ) ) );
+        }
+        CHECK_EQ( i, 50 );
+
+        auto id = json::parse( salida.substr( 0, salida.find( '\n' ) ) )["id"];
+        auto result = c->depthInterface( {{"id", id}, {"node", 515151}} );
+        CHECK_EQ( *result, 0 );
+
+        setenv( "RESTFUL_IMPORT_BATCH", "0", 1 );
+        CHECK_THROWS_AS( std::make_shared< Control >(), std::runtime_error );
+        unsetenv( "RESTFUL_IMPORT_BATCH" );
+    }
+
+    SUBCASE ("El registro guarda un lote con repetidos, y el lote se conserva al reabrirlo")
+    {
+        const std::string archivo = "test/test.log";
+        std::remove( archivo.c_str() );
+        setenv( "RESTFUL_DB", archivo.c_str(), 1 );
+        {
+            PersistLog p;
+            CHECK_EQ( p.insert( "a" ), 1 );
+            CHECK( p.insertLote( {"b", "a", "c", "b"} ) == std::vector<int>{2, 1, 3, 2} );
+        }
+        PersistLog p;
+        CHECK_EQ( p.select( "3" ), "c" );
+        CHECK( p.insertLote( {"d", "c"} ) == std::vector<int>{4, 3} );
+        std::remove( archivo.c_str() );
+    }
+}
+
+TEST_CASE ("Exportación masiva de árboles")
+{
+    SUBCASE ("Por tramos de árboles completos, y los rangos concatenados son la exportación completa")
+    {
+        std::vector<std::string> arboles = { "a", "bb", "ccc", "dddd", "eeeee" };
+        int recorridos = 0;
+        auto recorrer = [&arboles, &recorridos] (int desde, int hasta, const std::function<bool(int, const char*, size_t)>& lector) {
+            recorridos++;
+            for (int id = desde; id <= hasta && id <= (int)arboles.size(); id++)
+                if (! lector( id, arboles[id-1].data(), arboles[id-1].size() ))
+                    return;
+        };
+        auto exportar = [&recorrer] (Exportador::Formato formato, int desde, int hasta, size_t tramo) {
+            Exportador e( recorrer, formato, desde, hasta );
+            std::string salida;
+            auto escribir = [&salida] (const char *datos, size_t largo) { salida.append( datos, largo ); };
+            while (e.siguiente( escribir, tramo ))
+                ;
+            CHECK( e.terminado() );
+            CHECK_EQ( e.bytes(), salida.size() );
+            return salida;
+        };
+
+        auto completa = exportar( Exportador::NDJSON, 1, INT_MAX, 1024 );
+        CHECK_EQ( completa, "{\"id\":1,\"tree\":a}\n{\"id\":2,\"tree\":bb}\n{\"id\":3,\"tree\":ccc}\n"
+                            "{\"id\":4,\"tree\":dddd}\n{\"id\":5,\"tree\":eeeee}\n" );
+        CHECK_EQ( recorridos, 1 );
+
+        // Con un byte por tramo, un árbol por tramo (y uno vacío al final del rango)
+        recorridos = 0;
+        CHECK_EQ( exportar( Exportador::NDJSON, 1, INT_MAX, 1 ), completa );
+        CHECK_EQ( recorridos, 6 );
+
+        CHECK_EQ( exportar( Exportador::NDJSON, 1, 2, 1 ) + exportar( Exportador::NDJSON, 3, 4, 7 )
+                  + exportar( Exportador::NDJSON, 5, 99, 1 ), completa );
+        CHECK_EQ( exportar( Exportador::NDJSON, 6, INT_MAX, 1 ), "" );
+        CHECK_EQ( exportar( Exportador::NDJSON, 3, 2, 1 ), "" );
+
+        auto binaria = exportar( Exportador::BINARIO, 2, 3, 1 );
+        CHECK_EQ( binaria, std::string( "\x02\0\0\0\0\0\0\0\x02\0\0\0\0\0\0\0" "bb"
+                                        "\x03\0\0\0\0\0\0\0\x03\0\0\0\0\0\0\0" "ccc", 2*16 + 5 ) );
+
+        // Reanudación desde el último ID exportado
+        Exportador e( recorrer, Exportador::NDJSON );
+        std::string salida;
+        auto escribir = [&salida] (const char *datos, size_t largo) { salida.append( datos, largo ); };
+        CHECK( e.siguiente( escribir, 30 ) );
+        CHECK_EQ( e.ultimo(), 2 );
+        CHECK_EQ( e.exportados(), 2u );
+        CHECK_EQ( salida + exportar( Exportador::NDJSON, e.ultimo() + 1, INT_MAX, 1 ), completa );
+
+        CHECK_EQ( Exportador::formatoDe( "" ), Exportador::NDJSON );
+        CHECK_EQ( Exportador::formatoDe( "binario" ), Exportador::BINARIO );
+        CHECK_THROWS_AS( Exportador::formatoDe( "xml" ), std::logic_error );
+    }
+
+    SUBCASE ("Se exportan los árboles guardados en la BBDD, en orden de ID")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        const auto c = std::make_shared< Control >();
+        auto id = c->newTreeInterface( json::parse( R"({"node":7,"left":{"node":8}})" ) );
+
+        auto exportar = [&c] (int desde, int hasta) {
+            auto e = c->exportInterface( Exportador::NDJSON, desde, hasta );
+            std::string salida;
+            while (e->siguiente( [&salida] (const char *datos, size_t largo) { salida.append( datos, largo ); }, 4096 ))
+                ;
+            return salida;
+        };
+        auto completa = exportar( 1, INT_MAX );
+
+        auto persist = std::make_shared< PersistSQLite >();
+        std::istringstream lineas( completa );
+        int anterior = 0, cantidad = 0;
+        for (std::string l; std::getline( lineas, l ); cantidad++) {
+            REQUIRE_EQ( l.rfind( "{\"id\":", 0 ), 0u );
+            auto inicio = l.find( ",\"tree\":" );
+            auto i = std::stoi( l.substr( 6, inicio - 6 ) );
+            CHECK_GT( i, anterior );
+            CHECK_EQ( l.substr( inicio + 8, l.size() - inicio - 9 ), persist->select( std::to_string( i ) ) );
+            anterior = i;
+        }
+        CHECK_EQ( anterior, id );
+        CHECK_EQ( cantidad, (int)persist->recientes( SIZE_MAX ).size() );
+        CHECK_EQ( exportar( 1, id / 2 ) + exportar( id / 2 + 1, INT_MAX ), completa );
+
+        auto linea = exportar( id, id );
+        CHECK_EQ( json::parse( linea ), json::parse( "{\"id\":" + std::to_string( id ) + R"(,"tree":{"node":7,"left":{"node":8}}})" ) );
+    }
+}
+
+TEST_CASE ("Modificación de árboles")
+{
+    SUBCASE ("Injertar da el mismo árbol que compilar el árbol modificado")
+    {
+        const std::string archivo = "test/injertar.arbol";
+        const std::string fuente = hash128( std::string( "injertar" ) ).bytes();
+        std::mt19937 gen( 91 );
+
+        // Nodo con el valor x y, si no es la raíz, su padre y la rama en la que cuelga
+        auto ubicar = [] (json& arbol, int x) {
+            std::vector< std::tuple<json*, json*, bool> > pila = {{&arbol, nullptr, false}};
+            while (! pila.empty()) {
+                auto [o, p, d] = pila.back();
+                pila.pop_back();
+                if ((*o)["node"] == x)
+                    return std::make_tuple( o, p, d );
+                if (o->contains( "left" ))
+                    pila.push_back( {&(*o)["left"], o, false} );
+                if (o->contains( "right" ))
+                    pila.push_back( {&(*o)["right"], o, true} );
+            }
+            return std::make_tuple( (json*)nullptr, (json*)nullptr, false );
+        };
+
+        for (auto forma : {Forma::BALANCEADO, Forma::CADENA, Forma::ALEATORIO})
+            for (int n : {1, 2, 33, 500})
+                for (bool mapeado : {false, true})
+                {
+                    const auto original = json::parse( generarArbol( forma, Carga::ENTERO, n ).serializar() );
+                    std::shared_ptr<const ArbolCompilado> base = std::make_shared<const ArbolCompilado>( original );
+                    if (mapeado) {
+                        base->guardar( archivo, fuente );
+                        base = ArbolCompilado::abrir( archivo, fuente );
+                        REQUIRE( base );
+                    }
+
+                    for (int it = 0; it < 20; it++)
+                    {
+                        json arbol = original;
+                        bool quitar = n>1 && gen()%3 == 0;
+                        int x = quitar ? 1 + gen()%(n-1) : gen()%n;
+                        auto [o, p, d] = ubicar( arbol, x );
+                        REQUIRE( o );
+
+                        int32_t padre, hijo, hermano;
+                        bool derecho;
+                        std::unique_ptr<ArbolCompilado> rama;
+                        if (quitar) {
+                            padre = base->buscar( (*p)["node"] );
+                            derecho = d;
+                            hijo = base->buscar( x );
+                            p->erase( derecho ? "right" : "left" );
+                            o = p;
+                        }
+                        else {
+                            padre = base->buscar( x );
+                            derecho = gen()%2;
+                            hijo = o->contains( derecho ? "right" : "left" ) ? base->buscar( (*o)[derecho ? "right" : "left"]["node"] ) : -1;
+                            // Con base 0 la rama repite valores del árbol
+                            auto plano = generarArbol( Forma::ALEATORIO, Carga::ENTERO, 1 + gen()%40, gen()%2 ? 0 : 10000, gen() );
+                            (*o)[derecho ? "right" : "left"] = json::parse( plano.serializar() );
+                            rama = std::make_unique<ArbolCompilado>( std::move( plano ) );
+                        }
+                        hermano = o->contains( derecho ? "left" : "right" ) ? base->buscar( (*o)[derecho ? "left" : "right"]["node"] ) : -1;
+
+                        ArbolCompilado esperado( arbol );
+                        auto injertado = ArbolCompilado::injertar( *base, padre, derecho, hijo, hermano, rama.get() );
+                        const int m = esperado.tamanio();
+                        REQUIRE_EQ( injertado->tamanio(), esperado.tamanio() );
+
+                        for (int i = 0; i < m; i++) {
+                            REQUIRE_EQ( injertado->nodo( i ), esperado.nodo( i ) );
+                            REQUIRE_EQ( injertado->nivel( i ), esperado.nivel( i ) );
+                            REQUIRE_EQ( injertado->ancestro( i, 1 ), esperado.ancestro( i, 1 ) );
+                            REQUIRE_EQ( injertado->buscar( esperado.nodo( i ) ), esperado.buscar( esperado.nodo( i ) ) );
+                        }
+                        CHECK_EQ( injertado->buscar( 20000 ), -1 );
+
+                        for (int j = 0; j < 100; j++) {
+                            int a = gen() % m, b = gen() % m, k = gen() % (m+1);
+                            REQUIRE_EQ( injertado->ancestroComun( a, b ), esperado.ancestroComun( a, b ) );
+                            REQUIRE_EQ( injertado->distancia( a, b ), esperado.distancia( a, b ) );
+                            REQUIRE_EQ( injertado->ancestro( a, k ), esperado.ancestro( a, k ) );
+                        }
+
+                        // Las versiones injertadas se guardan como instantáneas igual que las compiladas
+                        injertado->guardar( archivo + "2", fuente );
+                        auto abierto = ArbolCompilado::abrir( archivo + "2", fuente );
+                        REQUIRE( abierto );
+                        CHECK_EQ( abierto->ancestroComun( 0, m-1 ), esperado.ancestroComun( 0, m-1 ) );
+                    }
+                }
+        std::remove( archivo.c_str() );
+        std::remove( (archivo + "2").c_str() );
+    }
+
+    SUBCASE ("Cada modificación es un árbol nuevo y el original no cambia")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        const auto c = std::make_shared< Control >();
+        auto persist = std::make_shared< PersistSQLite >();
+        auto id = c->newTreeInterface( json::parse( R"({"node":1,"left":{"node":2},"right":{"node":3}})" ) );
+
+        auto cambio = json::parse( R"({"node":2,"right":{"node":4,"left":{"node":5}}})" );
+        cambio["id"] = id;
+        auto id2 = c->patchTreeInterface( cambio );
+        CHECK_NE( id2, id );
+        CHECK_EQ( persist->select( std::to_string( id2 ) ),
+                  R"({"left":{"node":2,"right":{"left":{"node":5},"node":4}},"node":1,"right":{"node":3}})" );
+        CHECK_EQ( c->patchTreeInterface( cambio ), id2 );
+
+        CHECK_EQ( c->lowestCommonAncestorInterface( {{"id", id2}, {"node_a", 5}, {"node_b", 3}} )->dump(), "1" );
+        CHECK_EQ( c->depthInterface( {{"id", id2}, {"node", 5}} )->dump(), "3" );
+        CHECK_THROWS_AS( c->depthInterface( {{"id", id}, {"node", 5}} ), std::logic_error );
+
+        // Una rama ocupada se reemplaza
+        auto id3 = c->patchTreeInterface( {{"id", id2}, {"node", 1}, {"left", {{"node", 9}}}} );
+        CHECK_EQ( persist->select( std::to_string( id3 ) ), R"({"left":{"node":9},"node":1,"right":{"node":3}})" );
+
+        // Quitar lo agregado vuelve al árbol original
+        CHECK_EQ( c->patchTreeInterface( {{"id", id2}, {"node", 4}, {"remove", true}} ), id );
+        CHECK_EQ( c->pathInterface( {{"id", id}, {"node_a", 2}, {"node_b", 3}} )->dump(), "[2,1,3]" );
+        auto id4 = c->patchTreeInterface( {{"id", id}, {"node", 2}, {"remove", true}} );
+        CHECK_EQ( persist->select( std::to_string( id4 ) ), R"({"node":1,"right":{"node":3}})" );
+
+        // Las ramas nuevas quedan en orden entre los otros campos, que no se confunden con ramas
+        auto id5 = c->newTreeInterface( json::parse( R"({"a":[1,"}"],"node":1,"z":{"left":{"node":0}}})" ) );
+        auto id6 = c->patchTreeInterface( {{"id", id5}, {"node", 1}, {"left", {{"node", 2}, {"b", "\\"}}}} );
+        CHECK_EQ( persist->select( std::to_string( id6 ) ),
+                  R"({"a":[1,"}"],"left":{"b":"\\","node":2},"node":1,"z":{"left":{"node":0}}})" );
+        auto id7 = c->patchTreeInterface( {{"id", id6}, {"node", 1}, {"right", {{"node", 3}}}} );
+        CHECK_EQ( persist->select( std::to_string( id7 ) ),
+                  R"({"a":[1,"}"],"left":{"b":"\\","node":2},"node":1,"right":{"node":3},"z":{"left":{"node":0}}})" );
+        CHECK_EQ( c->depthInterface( {{"id", id7}, {"node", 3}} )->dump(), "1" );
+        CHECK_THROWS_AS( c->depthInterface( {{"id", id7}, {"node", 0}} ), std::logic_error );
+
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 1}, {"remove", true}} ), std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 7}, {"remove", true}} ), std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 2}, {"remove", false}} ), std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 2}} ), std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 2}, {"remove", true}, {"left", {{"node", 9}}}} ),
+                         std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"id", id}, {"node", 2}, {"left", {{"nodo", 9}}}} ), std::logic_error );
+        CHECK_THROWS_AS( c->patchTreeInterface( {{"node", 2}, {"remove", true}} ), std::logic_error );
+    }
+}
+
+TEST_CASE ("Decodificación de consultas de ancestro común")
+{
+    SUBCASE ("Las consultas simples dan los mismos valores, y del mismo tipo, que el parser general")
+    {
+        const char *consultas[] = {
+            R"({"id":1,"node_a":2,"node_b":3})",
+            R"({"node_b":3,"id":12,"node_a":-2})",
+            " { \"id\" : 7 ,\n\t\"node_a\" : \"x\" , \"node_b\" : \"\" }\r\n",
+            R"({"id":"5","node_a":"hola mundo","node_b":0})",
+            R"({"id":1,"node_a":18446744073709551615,"node_b":-9223372036854775808})",
+            R"({"id":1,"node_a":-0,"node_b":"{,}:"})"
+        };
+        for (auto q : consultas) {
+            auto esperado = json::parse( q );
+            ConsultaAncestro consulta;
+            REQUIRE( consulta.decodificar( q ) );
+            CHECK_EQ( consulta.id, esperado["id"] );
+            CHECK_EQ( consulta.node_a, esperado["node_a"] );
+            CHECK_EQ( consulta.node_b, esperado["node_b"] );
+            CHECK_EQ( int( consulta.id.type() ), int( esperado["id"].type() ) );
+            CHECK_EQ( int( consulta.node_a.type() ), int( esperado["node_a"].type() ) );
+            CHECK_EQ( int( consulta.node_b.type() ), int( esperado["node_b"].type() ) );
+        }
+    }
+
+    SUBCASE ("Cualquier otra forma se deja al parser general")
+    {
+        const char *consultas[] = {
+            "",
+            "[]",
+            R"({"id":1,"node_a":2})",
+            R"({"id":1,"node_a":2,"node_b":3,"node_c":4})",
+            R"({"id":1,"node_a":2,"node_a":3})",
+            R"({"id":1,"node_a":2.5,"node_b":3})",
+            R"({"id":1,"node_a":2e3,"node_b":3})",
+            R"({"id":1,"node_a":02,"node_b":3})",
+            R"({"id":1,"node_a":18446744073709551616,"node_b":3})",
+            R"({"id":1,"node_a":-9223372036854775809,"node_b":3})",
+            R"({"id":1,"node_a":"a\nb","node_b":3})",
+            R"({"id":1,"node_a":"a\"b","node_b":3})",
+            R"({"id":1,"node_a":"ñ","node_b":3})",
+            R"({"id":1,"node_a":{"x":1},"node_b":3})",
+            R"({"id":1,"node_a":[1],"node_b":3})",
+            R"({"id":1,"node_a":true,"node_b":null})",
+            R"({"id":1,"node_a":2,"node_b":3}x)",
+            R"({"id":1,"node_a":2,"node_b":3,})",
+            R"({"id":1 "node_a":2,"node_b":3})",
+            R"({"id":1,"node_a":2,"node_b":3)",
+            R"({"id":1,"node_a":"2,"node_b":3})",
+            R"({"id":1,"node_a":2,"node_b":-})"
+        };
+        for (auto q : consultas) {
+            ConsultaAncestro consulta;
+            CHECK_FALSE( consulta.decodificar( q ) );
+        }
+    }
+
+    SUBCASE ("La consulta decodificada da el mismo ancestro que la interpretada")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        const auto c = std::make_shared< Control >();
+        std::mt19937 gen( 24 );
+        for (auto carga : {Carga::ENTERO, Carga::TEXTO})
+        {
+            auto plano = generarArbol( Forma::ALEATORIO, carga, 200 );
+            auto nodos = plano.nodos;
+            auto id = c->newTreeInterface( std::move( plano ) );
+            for (int i = 0; i < 200; i++) {
+                json q = {{"id", id}, {"node_a", nodos[gen() % nodos.size()]}, {"node_b", nodos[gen() % nodos.size()]}};
+                auto texto = q.dump();
+                ConsultaAncestro consulta;
+                REQUIRE( consulta.decodificar( texto ) );
+                auto decodificada = c->lowestCommonAncestorInterface( consulta.id, consulta.node_a, consulta.node_b );
+                auto interpretada = c->lowestCommonAncestorInterface( json::parse( texto ) );
+                CHECK_EQ( *decodificada, *interpretada );
+            }
+            ConsultaAncestro consulta;
+            REQUIRE( consulta.decodificar( json( {{"id", id}, {"node_a", nodos[0]}, {"node_b", "no existe"}} ).dump() ) );
+            CHECK_THROWS_AS( c->lowestCommonAncestorInterface( consulta.id, consulta.node_a, consulta.node_b ),
+                             std::logic_error );
+        }
+    }
+}
+
+TEST_CASE ("Árboles de enteros y de cadenas")
+{
+    // El mismo árbol bajo una raíz con un objeto, que lo deja en el tipo
+    // GENERAL: los nodos del original quedan con un índice más
+    auto general = [] (const ArbolPlano& plano) {
+        ArbolPlano otro;
+        otro.nodos.push_back( {{"sentinela", true}} );
+        otro.izquierdo.push_back( 1 );
+        otro.derecho.push_back( -1 );
+        for (size_t i = 0; i < plano.nodos.size(); i++) {
+            otro.nodos.push_back( plano.nodos[i] );
+            otro.izquierdo.push_back( plano.izquierdo[i]<0 ? -1 : plano.izquierdo[i]+1 );
+            otro.derecho.push_back( plano.derecho[i]<0 ? -1 : plano.derecho[i]+1 );
+        }
+        return otro;
+    };
+
+    SUBCASE ("El tipo de los valores se elige al compilar")
+    {
+        CHECK_EQ( ArbolCompilado( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 50 ) ).tipoValores(),
+                  ArbolCompilado::ENTEROS );
+        CHECK_EQ( ArbolCompilado( generarArbol( Forma::ALEATORIO, Carga::TEXTO, 50 ) ).tipoValores(),
+                  ArbolCompilado::CADENAS );
+        CHECK_EQ( ArbolCompilado( generarArbol( Forma::ALEATORIO, Carga::OBJETO, 50 ) ).tipoValores(),
+                  ArbolCompilado::GENERAL );
+        CHECK_EQ( ArbolCompilado( json::parse( R"({"node":-1,"left":{"node":9223372036854775807}})" ) ).tipoValores(),
+                  ArbolCompilado::ENTEROS );
+        CHECK_EQ( ArbolCompilado( json::parse( R"({"node":1,"left":{"node":9223372036854775808}})" ) ).tipoValores(),
+                  ArbolCompilado::GENERAL );
+        CHECK_EQ( ArbolCompilado( json::parse( R"({"node":1,"left":{"node":2.0}})" ) ).tipoValores(),
+                  ArbolCompilado::GENERAL );
+        CHECK_EQ( ArbolCompilado( json::parse( R"({"node":1,"left":{"node":"2"}})" ) ).tipoValores(),
+                  ArbolCompilado::GENERAL );
+        CHECK_EQ( ArbolCompilado( json::parse( R"({"node":"","left":{"node":"ñ\u0000"}})" ) ).tipoValores(),
+                  ArbolCompilado::CADENAS );
+    }
+
+    SUBCASE ("Los árboles de enteros y de cadenas responden igual que el tipo general")
+    {
+        std::mt19937 gen( 25 );
+        for (auto forma : {Forma::BALANCEADO, Forma::CADENA, Forma::ALEATORIO})
+            for (auto carga : {Carga::ENTERO, Carga::TEXTO})
+                for (int n : {1, 2, 33, 3000})
+                {
+                    // Valores repetidos, y negativos en los enteros
+                    auto plano = generarArbol( forma, carga, n );
+                    for (auto& v : plano.nodos)
+                        v = valorNodo( carga, int64_t(gen() % (n/2+1)) - n/4 );
+                    ArbolCompilado generico( general( plano ) );
+                    ArbolCompilado tipado( std::move( plano ) );
+                    REQUIRE_EQ( generico.tipoValores(), ArbolCompilado::GENERAL );
+                    REQUIRE_NE( tipado.tipoValores(), ArbolCompilado::GENERAL );
+
+                    // Los valores del árbol y otros del mismo tipo o de otro, incluidos
+                    // los que nlohmann::json compara entre tipos numéricos distintos
+                    std::vector<json> consultas;
+                    for (int64_t v = -n/4-1; v <= n/4+1; v++) {
+                        consultas.push_back( valorNodo( carga, v ) );
+                        consultas.push_back( double( v ) );
+                        consultas.push_back( double( v ) + 0.5 );
+                        consultas.push_back( std::to_string( v ) );
+                        if (v >= 0)
+                            consultas.push_back( uint64_t( v ) );
+                        else
+                            consultas.push_back( uint64_t( -v ) );
+                    }
+                    for (json v : {json( UINT64_MAX ), json( INT64_MIN ), json( uint64_t( INT64_MAX )+1 ), json( -0.0 ),
+                                   json( nullptr ), json( true ), json( "" ), json::array(), json::object()})
+                        consultas.push_back( v );
+
+                    std::vector<int> encontrados;
+                    for (auto& q : consultas) {
+                        int t = tipado.buscar( q ), g = generico.buscar( q );
+                        REQUIRE_EQ( t<0 ? -1 : t+1, g );
+                        if (q.is_number_integer() && (! q.is_number_unsigned() || q.get<uint64_t>() <= INT64_MAX))
+                            REQUIRE_EQ( tipado.buscarEntero( q.get<int64_t>() ), t );
+                        if (q.is_string())
+                            REQUIRE_EQ( tipado.buscarCadena( q.get_ref<const std::string&>() ), t );
+                        if (t >= 0) {
+                            REQUIRE_EQ( tipado.nodo( t ), generico.nodo( g ) );
+                            encontrados.push_back( t );
+                        }
+                    }
+                    REQUIRE_FALSE( encontrados.empty() );
+
+                    for (int j = 0; j < 300; j++) {
+                        int a = encontrados[gen() % encontrados.size()], b = encontrados[gen() % encontrados.size()];
+                        auto lca = tipado.ancestroComun( a, b );
+                        REQUIRE_EQ( generico.ancestroComun( a+1, b+1 ), lca+1 );
+                        REQUIRE_EQ( tipado.nodo( lca ), generico.nodo( lca+1 ) );
+                        if (tipado.tipoValores() == ArbolCompilado::ENTEROS)
+                            REQUIRE_EQ( json( tipado.entero( lca ) ), generico.nodo( lca+1 ) );
+                        else
+                            REQUIRE_EQ( json( std::string( tipado.cadena( lca ) ) ), generico.nodo( lca+1 ) );
+                    }
+                }
+    }
+
+    SUBCASE ("Las versiones injertadas y las instantáneas conservan el tipo")
+    {
+        const std::string archivo = "test/tipado.arbol";
+        const std::string fuente = hash128( std::string( "tipado" ) ).bytes();
+
+        ArbolCompilado enteros( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 100 ) );
+        ArbolCompilado otros( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 10, 1000 ) );
+        ArbolCompilado cadenas( generarArbol( Forma::ALEATORIO, Carga::TEXTO, 10, 2000 ) );
+        ArbolCompilado objetos( generarArbol( Forma::ALEATORIO, Carga::OBJETO, 10, 3000 ) );
+
+        auto v = ArbolCompilado::injertar( enteros, 5, true, -1, -1, &otros );
+        CHECK_EQ( v->tipoValores(), ArbolCompilado::ENTEROS );
+        CHECK_EQ( v->buscarEntero( 1005 ), v->buscar( 1005 ) );
+        CHECK_GE( v->buscarEntero( 1005 ), 0 );
+        CHECK_EQ( ArbolCompilado::injertar( enteros, 5, true, -1, -1, &cadenas )->tipoValores(),
+                  ArbolCompilado::GENERAL );
+
+        // Quitar los únicos nodos de otro tipo deja el tipo especializado
+        auto mixto = ArbolCompilado::injertar( cadenas, 0, true, -1, -1, &objetos );
+        REQUIRE_EQ( mixto->tipoValores(), ArbolCompilado::GENERAL );
+        int raiz = mixto->buscar( {{"id", 3000}, {"nombre", "nodo-3000"}} );
+        REQUIRE_GE( raiz, 0 );
+        auto sin = ArbolCompilado::injertar( *mixto, 0, true, raiz, -1, nullptr );
+        CHECK_EQ( sin->tipoValores(), ArbolCompilado::CADENAS );
+
+        for (auto arbol : {&enteros, &cadenas}) {
+            arbol->guardar( archivo, fuente );
+            auto mapeado = ArbolCompilado::abrir( archivo, fuente );
+            REQUIRE( mapeado );
+            CHECK_EQ( mapeado->tipoValores(), arbol->tipoValores() );
+            for (int i = 0; i < int( arbol->tamanio() ); i++)
+                REQUIRE_EQ( mapeado->buscar( arbol->nodo( i ) ), arbol->buscar( arbol->nodo( i ) ) );
+        }
+        std::remove( archivo.c_str() );
+    }
+
+    SUBCASE ("La consulta con valores tipados da la misma respuesta que la general")
+    {
+        setenv( "RESTFUL_DB", "test/test.db", 1 );
+        const auto c = std::make_shared< Control >();
+        auto ide = c->newTreeInterface( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 300, -150 ) );
+        auto idc = c->newTreeInterface( generarArbol( Forma::ALEATORIO, Carga::TEXTO, 300 ) );
+        auto idg = c->newTreeInterface( general( generarArbol( Forma::ALEATORIO, Carga::ENTERO, 300, 5000 ) ) );
+        std::mt19937 gen( 26 );
+
+        for (int j = 0; j < 200; j++) {
+            int64_t a = int64_t(gen() % 300) - 150, b = int64_t(gen() % 300) - 150;
+            auto r = c->lowestCommonAncestorInterface( ide, a, b );
+            REQUIRE( std::holds_alternative<int64_t>( r ) );
+            auto esperado = c->lowestCommonAncestorInterface( {{"id", ide}, {"node_a", a}, {"node_b", b}} );
+            CHECK_EQ( json( std::get<int64_t>( r ) ), *esperado );
+
+            std::string sa = "nodo-" + std::to_string( gen() % 300 ), sb = "nodo-" + std::to_string( gen() % 300 );
+            auto s = c->lowestCommonAncestorInterface( idc, sa, sb );
+            REQUIRE( std::holds_alternative<std::string>( s ) );
+            esperado = c->lowestCommonAncestorInterface( {{"id", idc}, {"node_a", sa}, {"node_b", sb}} );
+            CHECK_EQ( json( std::get<std::string>( s ) ), *esperado );
+
+            // En un árbol de otro tipo la respuesta es JSON
+            a += 5150;
+            b += 5150;
+            auto g = c->lowestCommonAncestorInterface( idg, a, b );
+            REQUIRE( std::holds_alternative< std::shared_ptr<json> >( g ) );
+            esperado = c->lowestCommonAncestorInterface( {{"id", idg}, {"node_a", a}, {"node_b", b}} );
+            CHECK_EQ( *std::get< std::shared_ptr<json> >( g ), *esperado );
+        }
+
+        CHECK_THROWS_AS( c->lowestCommonAncestorInterface( ide, int64_t( 0 ), int64_t( 150 ) ), std::logic_error );
+        CHECK_THROWS_AS( c->lowestCommonAncestorInterface( ide, std::string( "0" ), std::string( "1" ) ),
+                         std::logic_error );
+        CHECK_THROWS_AS( c->lowestCommonAncestorInterface( idc, int64_t( 0 ), int64_t( 1 ) ), std::logic_error );
+    }
+}